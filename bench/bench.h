@@ -0,0 +1,55 @@
+/*
+ * bench.h - Shared helpers for the benchmarks under bench/.
+ *
+ * Every benchmark prints one result per line on stdout:
+ *
+ *     <name> <value> <unit>
+ *
+ * plus '#' comment lines.  Values are times, so lower is better.  bench.sh
+ * stores the lines and compares them with the checked-in bench/baseline.txt
+ * (see bench/CMakeLists.txt).
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Timed passes per case; the fastest one is reported, which filters out noise */
+#define BENCH_REPEATS 5
+
+/* One timed pass over a case; returns nanoseconds per operation */
+typedef double (*bench_pass_fn)(void *arg);
+
+static inline uint64_t bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline void bench_result(const char *name, double value, const char *unit)
+{
+    printf("%s %.1f %s\n", name, value, unit);
+    fflush(stdout);
+}
+
+/* Run pass BENCH_REPEATS times after one warm-up and report the best time */
+static inline void bench_best(const char *name, bench_pass_fn pass, void *arg)
+{
+    double best = 0;
+    int i;
+
+    pass(arg);
+    for (i = 0; i < BENCH_REPEATS; i++) {
+        double ns = pass(arg);
+        if (i == 0 || ns < best)
+            best = ns;
+    }
+    bench_result(name, best, "ns");
+}
+
+#endif /* BENCH_H */
@@ -0,0 +1,95 @@
+#!/bin/sh
+# Run the benchmarks under bench/ and check them against the stored baseline
+#
+# Usage:
+#   bench.sh run <results> <program> [args...]
+#       Run one benchmark, show its output and store it in <results>
+#   bench.sh compare <baseline> <tolerance> <results>...
+#       Compare every result with its baseline value; fail when any is more
+#       than <tolerance> percent slower.  Results without a baseline value
+#       are reported as new and do not fail.
+#   bench.sh baseline <baseline> <results>...
+#       Write <results> to <baseline>, replacing it but keeping the
+#       tolerances it sets
+#
+# Result files hold "<name> <value> <unit>" lines, where lower values are
+# better, and '#' comment lines (see bench.h).  Baseline lines may add a
+# fourth field, a tolerance in percent for that result alone, for results
+# that are noisier than the rest (end-to-end runs).
+
+set -e
+
+usage() {
+    echo "Usage: $0 run <results> <program> [args...]" >&2
+    echo "       $0 compare <baseline> <tolerance> <results>..." >&2
+    echo "       $0 baseline <baseline> <results>..." >&2
+    exit 1
+}
+
+[ $# -ge 3 ] || usage
+command=$1
+shift
+
+case "$command" in
+run)
+    results=$1
+    shift
+    mkdir -p "$(dirname "$results")"
+    "$@" > "$results.tmp" || { rm -f "$results.tmp"; echo "$1 failed" >&2; exit 1; }
+    mv "$results.tmp" "$results"
+    cat "$results"
+    ;;
+compare)
+    baseline=$1
+    tolerance=$2
+    shift 2
+    if [ ! -f "$baseline" ]; then
+        echo "No baseline $baseline; create it with the bench-baseline target" >&2
+        exit 1
+    fi
+    # The baseline is read first, then every results file
+    awk -v tolerance="$tolerance" '
+        /^#/ || NF < 2 { next }
+        FILENAME == ARGV[1] { base[$1] = $2; if (NF >= 4) limit[$1] = $4; next }
+        {
+            if (!($1 in base)) {
+                printf "%-28s %12s %12.1f %8s  new\n", $1, "-", $2, "-"
+                next
+            }
+            change = base[$1] > 0 ? ($2 - base[$1]) * 100 / base[$1] : 0
+            status = "ok"
+            if (change > (($1 in limit) ? limit[$1] : tolerance)) {
+                status = "REGRESSION"
+                failed++
+            }
+            printf "%-28s %12.1f %12.1f %+7.1f%%  %s\n", $1, base[$1], $2, change, status
+        }
+        END {
+            if (failed) {
+                printf "%d benchmark(s) slower than the baseline allows\n", failed
+                exit 1
+            }
+        }' "$baseline" "$@"
+    ;;
+baseline)
+    baseline=$1
+    shift
+    {
+        echo "# Benchmark baseline: <name> <value> <unit> [tolerance %], lower is better"
+        echo "# Recorded $(date -u +%Y-%m-%d) on $(uname -m), $(getconf _NPROCESSORS_ONLN) CPU(s)"
+        echo "# Regenerate with: cmake --build <build> --target bench-baseline"
+        # Per-result tolerances of the old baseline carry over
+        old=$baseline
+        [ -f "$old" ] || old=/dev/null
+        awk '
+            /^#/ || NF < 2 { next }
+            FILENAME == ARGV[1] { if (NF >= 4) limit[$1] = $4; next }
+            { print $1, $2, $3 (($1 in limit) ? " " limit[$1] : "") }' "$old" "$@"
+    } > "$baseline.tmp"
+    mv "$baseline.tmp" "$baseline"
+    echo "Wrote $baseline"
+    ;;
+*)
+    usage
+    ;;
+esac
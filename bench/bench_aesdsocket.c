@@ -0,0 +1,210 @@
+/*
+ * bench_aesdsocket.c - Microbenchmarks of aesdsocket internals.
+ *
+ * Usage: bench_aesdsocket packet
+ *        bench_aesdsocket read [dir]
+ *
+ * The server keeps its helpers static, so this file includes aesdsocket.c
+ * itself (with its main renamed) and calls them directly; no I/O on sockets
+ * or the data file is involved.
+ *
+ * packet - connection_handler's packet assembly: a byte stream is handed
+ *   over in RECV_BUFFER_SIZE chunks, split at newlines and appended with
+ *   packet_buffer_append exactly as the receive loop does, and each complete
+ *   packet is dropped (packet_buffer_trim) instead of processed.  Results
+ *   are ns per packet:
+ *     packet_assembly.small   64-byte packets, several per chunk
+ *     packet_assembly.medium  4 KiB packets spanning chunks
+ *     packet_assembly.large   1 MiB packets, growing and trimming the buffer
+ *
+ * read - read_entire_file on a page-cached regular file in dir (default
+ *   $TMPDIR or /tmp), from open fd to freed buffer.  Results are ns per call:
+ *     read_entire_file.4k, .64k, .1m, .16m
+ */
+
+#define main aesdsocket_main
+#include "aesdsocket.c"
+#undef main
+
+#include "bench.h"
+
+#define PACKET_STREAM_SIZE (8 * 1024 * 1024)
+
+struct packet_case {
+    const char *stream;
+    size_t stream_size;
+    size_t packets;
+};
+
+struct read_case {
+    int fd;
+    size_t size;
+    unsigned int calls;
+};
+
+static volatile size_t bench_sink;
+
+static double packet_pass(void *arg)
+{
+    struct packet_case *pc = arg;
+    struct connection_ctx conn;
+    char *packet_buffer;
+    size_t buffer_capacity = RECV_BUFFER_SIZE;
+    size_t packet_size = 0, done = 0, offset;
+    uint64_t start;
+
+    memset(&conn, 0, sizeof(conn));
+    strcpy(conn.client_ip, "bench");
+    mem_account_register(&conn.mem, conn.client_ip);
+    packet_buffer = packet_buffer_get(&conn);
+    if (!packet_buffer) {
+        fprintf(stderr, "packet_buffer_get failed\n");
+        exit(1);
+    }
+
+    start = bench_now_ns();
+    for (offset = 0; offset < pc->stream_size; offset += RECV_BUFFER_SIZE) {
+        const char *current_pos = pc->stream + offset;
+        size_t remaining = pc->stream_size - offset;
+
+        if (remaining > RECV_BUFFER_SIZE)
+            remaining = RECV_BUFFER_SIZE;
+        while (remaining > 0) {
+            const char *newline_pos = memchr(current_pos, '\n', remaining);
+            size_t chunk_size = newline_pos
+                ? (size_t)(newline_pos - current_pos) + 1
+                : remaining;
+
+            if (packet_buffer_append(&conn, &packet_buffer, &buffer_capacity,
+                                     &packet_size, current_pos, chunk_size) == -1) {
+                fprintf(stderr, "packet_buffer_append failed\n");
+                exit(1);
+            }
+            current_pos += chunk_size;
+            remaining   -= chunk_size;
+            if (newline_pos) {
+                done += (unsigned char)packet_buffer[packet_size / 2];
+                packet_size = 0;
+                packet_buffer_trim(&conn, &packet_buffer, &buffer_capacity);
+            }
+        }
+    }
+    start = bench_now_ns() - start;
+
+    bench_sink = done;
+    packet_buffer_put(&conn, packet_buffer, buffer_capacity);
+    mem_account_unregister(&conn.mem);
+    return (double)start / pc->packets;
+}
+
+/* A stream of PACKET_STREAM_SIZE bytes of packet_size-byte packets */
+static void packet_case_run(const char *name, size_t packet_size)
+{
+    struct packet_case pc;
+    char *stream = malloc(PACKET_STREAM_SIZE);
+    size_t i;
+
+    if (!stream) {
+        perror("malloc");
+        exit(1);
+    }
+    for (i = 0; i < PACKET_STREAM_SIZE; i++)
+        stream[i] = (i % packet_size == packet_size - 1) ? '\n' : 'a' + i % 26;
+    pc.stream = stream;
+    pc.stream_size = PACKET_STREAM_SIZE;
+    pc.packets = PACKET_STREAM_SIZE / packet_size;
+    bench_best(name, packet_pass, &pc);
+    free(stream);
+}
+
+static double read_pass(void *arg)
+{
+    struct read_case *rc = arg;
+    struct mem_account acct;
+    uint64_t start;
+    unsigned int i;
+
+    mem_account_register(&acct, "bench");
+    start = bench_now_ns();
+    for (i = 0; i < rc->calls; i++) {
+        size_t size = 0;
+        char *buffer;
+
+        if (lseek(rc->fd, 0, SEEK_SET) == -1 ||
+            !(buffer = read_entire_file(rc->fd, &size, &acct)) || size != rc->size) {
+            fprintf(stderr, "read_entire_file failed\n");
+            exit(1);
+        }
+        bench_sink = (unsigned char)buffer[size - 1];
+        free(buffer);
+        mem_uncharge(&acct, size);
+    }
+    start = bench_now_ns() - start;
+    mem_account_unregister(&acct);
+    return (double)start / rc->calls;
+}
+
+static int read_case_run(const char *name, const char *dir, size_t size)
+{
+    struct read_case rc;
+    char path[PATH_MAX];
+    char *data = malloc(size);
+    size_t i;
+
+    if (!data) {
+        perror("malloc");
+        return -1;
+    }
+    snprintf(path, sizeof(path), "%s/bench_read.XXXXXX", dir);
+    rc.fd = mkstemp(path);
+    if (rc.fd == -1) {
+        perror(path);
+        free(data);
+        return -1;
+    }
+    unlink(path);
+    for (i = 0; i < size; i++)
+        data[i] = (i % 64 == 63) ? '\n' : 'a' + i % 26;
+    if (write(rc.fd, data, size) != (ssize_t)size) {
+        perror("write");
+        close(rc.fd);
+        free(data);
+        return -1;
+    }
+    free(data);
+
+    rc.size = size;
+    rc.calls = (64 * 1024 * 1024) / size;  /* 64 MiB read per pass */
+    if (rc.calls > 4096)
+        rc.calls = 4096;
+    bench_best(name, read_pass, &rc);
+    close(rc.fd);
+    return 0;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc == 2 && strcmp(argv[1], "packet") == 0) {
+        printf("# packet assembly: %d MiB stream in %d-byte receives\n",
+               PACKET_STREAM_SIZE / (1024 * 1024), RECV_BUFFER_SIZE);
+        packet_case_run("packet_assembly.small", 64);
+        packet_case_run("packet_assembly.medium", 4 * 1024);
+        packet_case_run("packet_assembly.large", 1024 * 1024);
+        return 0;
+    }
+    if ((argc == 2 || argc == 3) && strcmp(argv[1], "read") == 0) {
+        const char *dir = argc == 3 ? argv[2] : getenv("TMPDIR");
+
+        if (!dir || !*dir)
+            dir = "/tmp";
+        printf("# read_entire_file: regular files in %s\n", dir);
+        if (read_case_run("read_entire_file.4k", dir, 4 * 1024) == -1 ||
+            read_case_run("read_entire_file.64k", dir, 64 * 1024) == -1 ||
+            read_case_run("read_entire_file.1m", dir, 1024 * 1024) == -1 ||
+            read_case_run("read_entire_file.16m", dir, 16 * 1024 * 1024) == -1)
+            return 1;
+        return 0;
+    }
+    fprintf(stderr, "Usage: %s packet\n       %s read [dir]\n", argv[0], argv[0]);
+    return 1;
+}
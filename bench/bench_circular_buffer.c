@@ -0,0 +1,127 @@
+/*
+ * bench_circular_buffer.c - Microbenchmark of the aesd-char-driver circular
+ * buffer, built for user space from the same source as the driver.
+ *
+ * Usage: bench_circular_buffer
+ *
+ * Results (ns per call, see bench.h):
+ *   circular_buffer.find       find_entry_offset_for_fpos at random offsets
+ *                              of a full buffer (entries of 1..256 bytes)
+ *   circular_buffer.find_last  the same for offsets in the newest entry,
+ *                              the longest walk
+ *   circular_buffer.find_past  offsets beyond the stored data (NULL result)
+ *   circular_buffer.add        add_entry to a full buffer (overwrite)
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "aesd-circular-buffer.h"
+#include "bench.h"
+
+#define CB_ITERATIONS (1u << 21)
+#define CB_OFFSETS 4096  /* power of two */
+#define CB_MAX_ENTRY 256
+
+struct cb_case {
+    struct aesd_circular_buffer buffer;
+    size_t offsets[CB_OFFSETS];
+};
+
+static char cb_data[CB_MAX_ENTRY];
+static volatile size_t cb_sink;
+
+/* Small LCG so every run benchmarks the same buffer contents and offsets */
+static uint32_t cb_rand(uint32_t *state)
+{
+    *state = *state * 1103515245u + 12345u;
+    return *state >> 8;
+}
+
+/* Fill c->buffer past capacity so it is full and wrapped; return the total size */
+static size_t cb_fill(struct cb_case *c, uint32_t *seed, size_t *newest_start)
+{
+    size_t total = 0;
+    uint8_t index;
+    struct aesd_buffer_entry *entry;
+    int i;
+
+    aesd_circular_buffer_init(&c->buffer);
+    for (i = 0; i < AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED + 3; i++) {
+        struct aesd_buffer_entry add = { cb_data, 1 + cb_rand(seed) % CB_MAX_ENTRY };
+        aesd_circular_buffer_add_entry(&c->buffer, &add);
+    }
+    AESD_CIRCULAR_BUFFER_FOREACH(entry, &c->buffer, index) {
+        total += entry->size;
+    }
+    *newest_start = total - c->buffer.entry[(c->buffer.in_offs +
+                    AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - 1) %
+                    AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED].size;
+    return total;
+}
+
+static double cb_find_pass(void *arg)
+{
+    struct cb_case *c = arg;
+    size_t sink = 0, byte;
+    uint64_t start = bench_now_ns();
+    unsigned int i;
+
+    for (i = 0; i < CB_ITERATIONS; i++) {
+        struct aesd_buffer_entry *entry = aesd_circular_buffer_find_entry_offset_for_fpos(
+            &c->buffer, c->offsets[i & (CB_OFFSETS - 1)], &byte);
+        sink += byte + (entry != NULL);
+    }
+    cb_sink = sink;
+    return (double)(bench_now_ns() - start) / CB_ITERATIONS;
+}
+
+static double cb_add_pass(void *arg)
+{
+    struct cb_case *c = arg;
+    struct aesd_buffer_entry add = { cb_data, 0 };
+    uint64_t start = bench_now_ns();
+    unsigned int i;
+
+    for (i = 0; i < CB_ITERATIONS; i++) {
+        add.size = 1 + (i & (CB_MAX_ENTRY - 1));
+        aesd_circular_buffer_add_entry(&c->buffer, &add);
+    }
+    cb_sink = c->buffer.in_offs;
+    return (double)(bench_now_ns() - start) / CB_ITERATIONS;
+}
+
+int main(void)
+{
+    struct cb_case *c = malloc(sizeof(*c));
+    uint32_t seed = 1;
+    size_t total, newest;
+    int i;
+
+    if (!c) {
+        perror("malloc");
+        return 1;
+    }
+    memset(cb_data, 'x', sizeof(cb_data));
+
+    total = cb_fill(c, &seed, &newest);
+    printf("# circular buffer: %d entries, %zu bytes\n",
+           AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED, total);
+
+    for (i = 0; i < CB_OFFSETS; i++)
+        c->offsets[i] = cb_rand(&seed) % total;
+    bench_best("circular_buffer.find", cb_find_pass, c);
+
+    for (i = 0; i < CB_OFFSETS; i++)
+        c->offsets[i] = newest + cb_rand(&seed) % (total - newest);
+    bench_best("circular_buffer.find_last", cb_find_pass, c);
+
+    for (i = 0; i < CB_OFFSETS; i++)
+        c->offsets[i] = total + cb_rand(&seed) % CB_MAX_ENTRY;
+    bench_best("circular_buffer.find_past", cb_find_pass, c);
+
+    bench_best("circular_buffer.add", cb_add_pass, c);
+
+    free(c);
+    return 0;
+}
@@ -0,0 +1,242 @@
+/*
+ * bench_loopback.c - End-to-end latency of aesdsocket over loopback.
+ *
+ * Usage: bench_loopback [-n packets] [-c connections] server
+ *
+ * Starts server (an aesdsocket built with USE_AESD_CHAR_DEVICE=0) on a free
+ * port with a fresh data file in a temporary directory, then:
+ *   loopback.connect  -c connections (default 200), each connecting, sending
+ *                     one packet and reading the whole readback: median ns
+ *   loopback.packet   -n packets (default 1000) on one connection, each sent
+ *                     after the previous readback is complete: median ns
+ * Every packet is PACKET_LEN bytes, so the readback of the k-th packet is
+ * k * PACKET_LEN bytes long and the client knows when it has all of it.
+ * The server is stopped with SIGTERM, which also removes its data file.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "bench.h"
+
+#define PACKET_LEN 16
+#define START_TIMEOUT_MS 5000
+
+static const char packet[PACKET_LEN + 1] = "bench loopback.\n";
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+/* A loopback port that is free right now, or 0 */
+static unsigned int free_port(void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    unsigned int port = 0;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd == -1)
+        return 0;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0 &&
+        getsockname(fd, (struct sockaddr *)&addr, &len) == 0)
+        port = ntohs(addr.sin_port);
+    close(fd);
+    return port;
+}
+
+static int connect_to(unsigned int port)
+{
+    struct sockaddr_in addr;
+    int one = 1;
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (fd == -1)
+        return -1;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fd;
+}
+
+/* Send one packet and read its readback of expect bytes */
+static int round_trip(int fd, size_t expect)
+{
+    char buf[64 * 1024];
+    size_t got = 0;
+
+    if (send(fd, packet, PACKET_LEN, 0) != PACKET_LEN)
+        return -1;
+    while (got < expect) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) {
+            if (n == -1 && errno == EINTR)
+                continue;
+            return -1;
+        }
+        got += (size_t)n;
+    }
+    return got == expect ? 0 : -1;
+}
+
+static void report_median(const char *name, uint64_t *samples, size_t count)
+{
+    qsort(samples, count, sizeof(*samples), cmp_u64);
+    bench_result(name, (double)samples[count / 2], "ns");
+}
+
+static int run(unsigned int port, size_t connections, size_t packets)
+{
+    uint64_t *samples = malloc(sizeof(*samples) * (connections > packets ? connections : packets));
+    size_t written = 0, i;
+    int fd;
+
+    if (!samples) {
+        perror("malloc");
+        return -1;
+    }
+
+    for (i = 0; i < connections; i++) {
+        uint64_t start = bench_now_ns();
+
+        fd = connect_to(port);
+        if (fd == -1 || round_trip(fd, written + PACKET_LEN) == -1) {
+            fprintf(stderr, "connection %zu failed: %s\n", i, strerror(errno));
+            goto fail;
+        }
+        samples[i] = bench_now_ns() - start;
+        written += PACKET_LEN;
+        close(fd);
+    }
+    report_median("loopback.connect", samples, connections);
+
+    fd = connect_to(port);
+    if (fd == -1)
+        goto fail;
+    for (i = 0; i < packets; i++) {
+        uint64_t start = bench_now_ns();
+
+        if (round_trip(fd, written + PACKET_LEN) == -1) {
+            fprintf(stderr, "packet %zu failed: %s\n", i, strerror(errno));
+            close(fd);
+            goto fail;
+        }
+        samples[i] = bench_now_ns() - start;
+        written += PACKET_LEN;
+    }
+    close(fd);
+    report_median("loopback.packet", samples, packets);
+    free(samples);
+    return 0;
+
+fail:
+    free(samples);
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-n packets] [-c connections] server\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+    char dir[] = "/tmp/bench_loopback.XXXXXX";
+    char data_file[PATH_MAX], port_arg[16];
+    size_t packets = 1000, connections = 200;
+    unsigned int port;
+    int opt, status, waited, rc = 1;
+    bool exited = false;
+    pid_t pid;
+    int fd = -1;
+
+    while ((opt = getopt(argc, argv, "n:c:")) != -1) {
+        switch (opt) {
+        case 'n':
+            packets = strtoul(optarg, NULL, 10);
+            break;
+        case 'c':
+            connections = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    if (optind != argc - 1 || packets == 0 || connections == 0) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    port = free_port();
+    if (port == 0 || !mkdtemp(dir)) {
+        perror("bench_loopback setup");
+        return 1;
+    }
+    snprintf(data_file, sizeof(data_file), "%s/aesdsocketdata", dir);
+    snprintf(port_arg, sizeof(port_arg), "%u", port);
+
+    pid = fork();
+    if (pid == -1) {
+        perror("fork");
+        rmdir(dir);
+        return 1;
+    }
+    if (pid == 0) {
+        execl(argv[optind], argv[optind], "-p", port_arg, "-o", data_file, (char *)NULL);
+        perror(argv[optind]);
+        _exit(127);
+    }
+
+    /* Wait for the server to listen */
+    for (waited = 0; waited < START_TIMEOUT_MS; waited += 10) {
+        fd = connect_to(port);
+        if (fd != -1)
+            break;
+        if (waitpid(pid, &status, WNOHANG) == pid) {
+            exited = true;
+            break;
+        }
+        usleep(10 * 1000);
+    }
+    if (fd == -1) {
+        fprintf(stderr, "%s did not start listening on port %u\n", argv[optind], port);
+    } else {
+        close(fd);
+        printf("# loopback: %s on port %u, %d-byte packets\n", argv[optind], port, PACKET_LEN);
+        rc = run(port, connections, packets) == 0 ? 0 : 1;
+    }
+
+    if (!exited) {
+        kill(pid, SIGTERM);
+        waitpid(pid, &status, 0);
+    }
+    unlink(data_file);
+    rmdir(dir);
+    return rc;
+}
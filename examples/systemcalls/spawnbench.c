@@ -0,0 +1,181 @@
+/**
+* spawnbench - Process spawn latency against parent RSS.
+*
+* Grows the parent's resident set in steps (heap pages that are written, so
+* they are really mapped) and at every step times, for the same program:
+*   fork  - fork() + execv() + waitpid(), the way do_exec() used to do it
+*   spawn - do_exec(), which uses posix_spawn()
+* fork() has to copy the page tables of the whole parent, so its latency rises
+* with RSS; posix_spawn() borrows the parent's address space and should not.
+*
+* Usage: spawnbench [-n runs] [-m mib,mib,...] [-p program]
+*   -n runs     spawns per method and step (default 200)
+*   -m list     parent RSS steps in MiB (default 0,64,256,1024)
+*   -p program  absolute path of the program to run (default /bin/true)
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "systemcalls.h"
+
+#define MAX_STEPS 16
+#define MIB (1024UL * 1024UL)
+
+static int64_t now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static bool fork_exec_wait(const char *program)
+{
+	char *const argv[] = {(char *)program, NULL};
+	int status;
+	pid_t pid = fork();
+	if(pid < 0)
+	{
+		return false;
+	}
+	if(pid == 0)
+	{
+		execv(program, argv);
+		_exit(127);
+	}
+	while(waitpid(pid, &status, 0) < 0)
+	{
+		if(errno != EINTR)
+		{
+			return false;
+		}
+	}
+	return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool spawn_exec_wait(const char *program)
+{
+	return do_exec(1, program);
+}
+
+static int cmp_i64(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *)a;
+	int64_t y = *(const int64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/**
+* Time @param runs spawns of @param program with @param method and print the
+* median, 99th percentile and mean in microseconds.
+* @return false if any spawn failed.
+*/
+static bool measure(const char *name, bool (*method)(const char *), const char *program,
+		int runs, size_t rss_mib)
+{
+	int64_t *samples = malloc(sizeof(*samples) * runs);
+	int64_t total = 0;
+	int i;
+
+	if(samples == NULL)
+	{
+		perror("malloc");
+		return false;
+	}
+	for(i = 0; i < runs; i++)
+	{
+		int64_t start = now_ns();
+		if(!method(program))
+		{
+			fprintf(stderr, "%s of %s failed\n", name, program);
+			free(samples);
+			return false;
+		}
+		samples[i] = now_ns() - start;
+		total += samples[i];
+	}
+	qsort(samples, runs, sizeof(*samples), cmp_i64);
+	printf("%8zu  %-6s %10.1f %10.1f %10.1f\n", rss_mib, name,
+			samples[runs / 2] / 1000.0,
+			samples[(runs * 99) / 100] / 1000.0,
+			(double)total / runs / 1000.0);
+	free(samples);
+	return true;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr, "Usage: %s [-n runs] [-m mib,mib,...] [-p program]\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	size_t steps[MAX_STEPS] = {0, 64, 256, 1024};
+	int nsteps = 4;
+	int runs = 200;
+	const char *program = "/bin/true";
+	char *ballast = NULL;
+	size_t ballast_mib = 0;
+	int opt, i;
+
+	while((opt = getopt(argc, argv, "n:m:p:")) != -1)
+	{
+		switch(opt)
+		{
+		case 'n':
+			runs = atoi(optarg);
+			break;
+		case 'm':
+		{
+			char *tok = strtok(optarg, ",");
+			nsteps = 0;
+			while(tok != NULL && nsteps < MAX_STEPS)
+			{
+				steps[nsteps++] = strtoul(tok, NULL, 10);
+				tok = strtok(NULL, ",");
+			}
+			break;
+		}
+		case 'p':
+			program = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+	if(runs <= 0 || nsteps == 0 || program[0] != '/')
+	{
+		usage(argv[0]);
+		return 1;
+	}
+
+	printf("%8s  %-6s %10s %10s %10s\n", "rss_mib", "method", "p50_us", "p99_us", "mean_us");
+	for(i = 0; i < nsteps; i++)
+	{
+		if(steps[i] > ballast_mib)
+		{ // Grow and touch every page so it is resident in the parent
+			char *grown = realloc(ballast, steps[i] * MIB);
+			if(grown == NULL)
+			{
+				fprintf(stderr, "Cannot grow parent to %zu MiB\n", steps[i]);
+				break;
+			}
+			memset(grown + ballast_mib * MIB, 0x5a, (steps[i] - ballast_mib) * MIB);
+			ballast = grown;
+			ballast_mib = steps[i];
+		}
+		if(!measure("fork", fork_exec_wait, program, runs, ballast_mib) ||
+		   !measure("spawn", spawn_exec_wait, program, runs, ballast_mib))
+		{
+			free(ballast);
+			return 1;
+		}
+	}
+	free(ballast);
+	return 0;
+}
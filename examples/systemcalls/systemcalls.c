@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "systemcalls.h"
 
 #include <fcntl.h>
@@ -5,6 +6,17 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <stdlib.h>
+#include <string.h>
+#include <spawn.h>
+#include <time.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+
+extern char **environ;
+
+static bool needs_shell(const char *cmd);
+static bool spawn_simple_command(const char *cmd);
 
 /**
  * @param cmd the command to execute with system()
@@ -12,9 +24,20 @@
  *   successfully using the system() call, false if an error occurred,
  *   either in invocation of the system() call, or if a non-zero return
  *   value was returned by the command issued in @param cmd.
+ *
+ * system() starts /bin/sh -c, which then starts the command: two processes
+ * per call.  A simple command (words separated by blanks, no quoting,
+ * expansion, redirection, pipes or builtins) means the same without a shell,
+ * so it is split here and spawned directly through $PATH instead.  Anything
+ * else still goes to the shell.
 */
 bool do_system(const char *cmd)
 {
+	if(cmd != NULL && !needs_shell(cmd))
+	{
+		return spawn_simple_command(cmd);
+	}
+
 	int retval = 0;
 	retval = system(cmd);
 	
@@ -26,6 +49,83 @@ bool do_system(const char *cmd)
     return true;
 }
 
+/**
+* Start command[0] with arguments command.  When @param out_fd or @param err_fd
+* is not -1 it becomes the child's standard output or standard error.
+* @return true with the child's pid in @param pid, false if it could not be
+*   started (including a failed exec).
+*/
+static bool spawn_child(char *const command[], int out_fd, int err_fd, pid_t *pid)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawn_file_actions_t *actions_ptr = NULL;
+	int ret;
+
+	if(out_fd >= 0 || err_fd >= 0)
+	{ // Same as dup2(fd, 1) + close(fd) in a forked child
+		if(posix_spawn_file_actions_init(&actions) != 0)
+		{
+			return false;
+		}
+		actions_ptr = &actions;
+		if((out_fd >= 0 && posix_spawn_file_actions_adddup2(actions_ptr, out_fd, STDOUT_FILENO) != 0) ||
+		   (err_fd >= 0 && posix_spawn_file_actions_adddup2(actions_ptr, err_fd, STDERR_FILENO) != 0) ||
+		   (out_fd > STDERR_FILENO && posix_spawn_file_actions_addclose(actions_ptr, out_fd) != 0) ||
+		   (err_fd > STDERR_FILENO && err_fd != out_fd && posix_spawn_file_actions_addclose(actions_ptr, err_fd) != 0))
+		{
+			posix_spawn_file_actions_destroy(actions_ptr);
+			return false;
+		}
+	}
+
+	ret = posix_spawn(pid, command[0], actions_ptr, NULL, command, environ);
+	if(actions_ptr != NULL)
+	{
+		posix_spawn_file_actions_destroy(actions_ptr);
+	}
+	if(ret != 0)
+	{ // Spawn or exec failed; posix_spawn returns the error instead of setting errno
+		fprintf(stderr, "posix_spawn %s: %s\n", command[0], strerror(ret));
+		return false;
+	}
+	return true;
+}
+
+/**
+* Reap @param pid.
+* @return its wait status, or -1 if waiting failed.
+*/
+static int wait_child(pid_t pid)
+{
+	int status;
+
+	while(waitpid(pid, &status, 0) < 0)
+	{
+		if(errno != EINTR)
+		{
+			return -1; // Waiting failed for some reason
+		}
+	}
+	return status;
+}
+
+// If the command ran, it reports success with exit status 0
+static bool status_success(int status)
+{
+	return status != -1 && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static bool spawn_and_wait(char *const command[], int out_fd)
+{
+	pid_t pid;
+
+	if(!spawn_child(command, out_fd, -1, &pid))
+	{
+		return false;
+	}
+	return status_success(wait_child(pid));
+}
+
 /**
 * @param count -The numbers of variables passed to the function. The variables are command to execute.
 *   followed by arguments to pass to the command
@@ -38,8 +138,15 @@ bool do_system(const char *cmd)
 *   using the execv() call, false if an error occurred, either in invocation of the
 *   fork, waitpid, or execv() command, or if a non-zero return value was returned
 *   by the command issued in @param arguments with the specified arguments.
+*
+* The child is started with posix_spawn() rather than fork() + execv().  fork()
+* copies the parent's page tables (and marks every page copy-on-write) only
+* for the child to discard them in execv(), so its cost grows with the
+* parent's RSS.  glibc implements posix_spawn() with clone(CLONE_VM |
+* CLONE_VFORK): the child borrows the parent's memory until it execs, and the
+* cost stays flat.  An execv() failure in the child is reported back as
+* posix_spawn()'s return value.  spawnbench.c measures the difference.
 */
-
 bool do_exec(int count, ...)
 {
     va_list args;
@@ -51,39 +158,9 @@ bool do_exec(int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
-
-	// Following code block written with guidance from ChatGPT: https://chatgpt.com/share/69712993-15bc-8007-b18c-9d87b47cb5be
-	pid_t pid = fork();
-	if(pid < 0) // fork() failed
-	{
-		perror("Fork");
-		return false;
-	}
-	
-	if(pid == 0) // child process task
-	{
-		execv(command[0], command);
-		perror("execv");
-		_exit(127); // return code 127 if execv() fails
-	}
-	
-	// Remaining parent process task
-	int status;
-	if(waitpid(pid, &status, 0) < 0)
-	{
-		return false; // Waiting failed for some reason
-	}
-	
-	// If execv succeeded, the child would exit with 0
-    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) 
-    { // Command run successfully
-		va_end(args);
-        return true;
-    }
-
-	// Otherwise, command failed
     va_end(args);
-    return false;
+
+	return spawn_and_wait(command, -1);
 }
 
 /**
@@ -102,54 +179,490 @@ bool do_exec_redirect(const char *outputfile, int count, ...)
         command[i] = va_arg(args, char *);
     }
     command[count] = NULL;
+    va_end(args);
 
-/*
- * TODO
- *   Call execv, but first using https://stackoverflow.com/a/13784315/1446624 as a refernce,
- *   redirect standard out to a file specified by outputfile.
- *   The rest of the behaviour is same as do_exec()
- *
-*/
-	// Following code block written with reference from: https://stackoverflow.com/a/13784315/1446624
-	int fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT, 0644);
+	// Redirection as in https://stackoverflow.com/a/13784315/1446624, done by posix_spawn file actions
+	int fd = open(outputfile, O_WRONLY|O_TRUNC|O_CREAT|O_CLOEXEC, 0644);
 	if(fd < 0)
 	{ // Opening file failed
 		perror("File open");
 		return false;
 	}
 
-	// Following code block written with guidance from ChatGPT: https://chatgpt.com/share/69712993-15bc-8007-b18c-9d87b47cb5be
-	pid_t pid = fork();
-	if(pid < 0) // fork() failed
+	bool result = spawn_and_wait(command, fd);
+	close(fd);
+	return result;
+}
+
+static int64_t monotonic_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+// glibc only wraps pidfd_open() from 2.36 on, the system call exists since Linux 5.3
+static int open_pidfd(pid_t pid)
+{
+#ifdef SYS_pidfd_open
+	return syscall(SYS_pidfd_open, pid, 0);
+#else
+	(void)pid;
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
+struct batch_child {
+	pid_t pid;          // 0 when not running
+	int pidfd;          // -1 when not watched through epoll
+	int64_t start_ns;
+};
+
+static void batch_reap(int epfd, struct exec_job *job, struct batch_child *child)
+{
+	job->status = wait_child(child->pid);
+	job->success = status_success(job->status);
+	job->elapsed_ns = monotonic_ns() - child->start_ns;
+	if(child->pidfd >= 0)
+	{ // A child spawned just now may still hold the pidfd until its exec closes
+	  // it, so close() alone would leave the stale entry in the epoll set
+		epoll_ctl(epfd, EPOLL_CTL_DEL, child->pidfd, NULL);
+		close(child->pidfd);
+		child->pidfd = -1;
+	}
+	child->pid = 0;
+}
+
+/**
+* Run every command in @param jobs, at most @param max_parallel at a time (0
+* means one per online CPU), and fill in the status and timing of each.
+* A free slot is refilled as soon as any running command exits: every child
+* is watched through a pidfd in one epoll set instead of waiting for the
+* children in order.  On kernels without pidfd_open() the children are
+* reaped in the order they were started.
+* @return true if every command was started and exited with status 0.
+*/
+bool do_exec_batch(struct exec_job *jobs, size_t count, unsigned int max_parallel)
+{
+	struct batch_child *children;
+	struct epoll_event events[16];
+	size_t next = 0, oldest = 0, running = 0, watched = 0, i;
+	bool all_ok = true;
+	int epfd;
+
+	if(max_parallel == 0)
+	{
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		max_parallel = cpus > 0 ? (unsigned int)cpus : 1;
+	}
+	for(i = 0; i < count; i++)
+	{
+		jobs[i].started = false;
+		jobs[i].status = -1;
+		jobs[i].success = false;
+		jobs[i].elapsed_ns = 0;
+	}
+	children = calloc(count ? count : 1, sizeof(*children));
+	if(children == NULL)
 	{
-		perror("Fork");
 		return false;
 	}
-	
-	if(pid == 0) // child process task
+	epfd = epoll_create1(EPOLL_CLOEXEC);
+
+	while(next < count || running > 0)
 	{
-		if (dup2(fd, 1) < 0) { perror("dup2"); abort(); } // duplicate fd to replace stdout
-		close(fd); // Child does not need this file any more
-		execv(command[0], command);
-		perror("execv");
-		_exit(127); // return code 127 if execv() fails
+		while(running < max_parallel && next < count)
+		{ // Fill the free slots
+			struct batch_child *child = &children[next];
+
+			child->pidfd = -1;
+			child->start_ns = monotonic_ns();
+			if(spawn_child(jobs[next].argv, -1, -1, &child->pid))
+			{
+				jobs[next].started = true;
+				running++;
+				child->pidfd = epfd >= 0 ? open_pidfd(child->pid) : -1;
+				if(child->pidfd >= 0)
+				{
+					struct epoll_event ev = { .events = EPOLLIN, .data.u64 = next };
+					if(epoll_ctl(epfd, EPOLL_CTL_ADD, child->pidfd, &ev) == 0)
+					{
+						watched++;
+					}
+					else
+					{
+						close(child->pidfd);
+						child->pidfd = -1;
+					}
+				}
+			}
+			else
+			{
+				child->pid = 0;
+				all_ok = false;
+			}
+			next++;
+		}
+		if(running == 0)
+		{
+			break;
+		}
+
+		if(watched == running)
+		{ // A pidfd becomes readable when its process exits
+			int n = epoll_wait(epfd, events, sizeof(events) / sizeof(events[0]), -1);
+			int e;
+			if(n < 0 && errno != EINTR)
+			{ // Cannot wait on the set any more; fall back to waitpid
+				close(epfd);
+				epfd = -1;
+				for(i = oldest; i < next; i++)
+				{
+					if(children[i].pidfd >= 0)
+					{
+						close(children[i].pidfd);
+						children[i].pidfd = -1;
+					}
+				}
+				watched = 0;
+			}
+			for(e = 0; e < n; e++)
+			{
+				size_t idx = events[e].data.u64;
+				batch_reap(epfd, &jobs[idx], &children[idx]);
+				running--;
+				watched--;
+			}
+		}
+		else
+		{ // Some child is not watched; block on the oldest one that is not
+			i = oldest;
+			while(children[i].pid == 0 || children[i].pidfd >= 0)
+			{
+				i++;
+			}
+			batch_reap(epfd, &jobs[i], &children[i]);
+			running--;
+		}
+		while(oldest < next && children[oldest].pid == 0)
+		{
+			oldest++;
+		}
 	}
-	
-	// Remaining parent process task
-	int status;
-	if(waitpid(pid, &status, 0) < 0)
+
+	for(i = 0; i < count; i++)
 	{
-		return false; // Waiting failed for some reason
+		all_ok = all_ok && jobs[i].success;
+	}
+	if(epfd >= 0)
+	{
+		close(epfd);
+	}
+	free(children);
+	return all_ok;
+}
+
+#define CAPTURE_INITIAL 256
+#define CAPTURE_SPLICE_CHUNK 65536
+
+// One output stream of the command being captured
+struct capture_stream {
+	int pipe_fd;        // read end of the child's pipe, -1 at EOF
+	int sink_fd;        // -1 to collect into buf
+	bool use_splice;    // cleared when the sink does not support splice()
+	char **buf;
+	size_t *len;
+	size_t cap;
+};
+
+static bool write_all(int fd, const char *data, size_t len)
+{
+	while(len > 0)
+	{
+		ssize_t n = write(fd, data, len);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			return false;
+		}
+		data += n;
+		len -= n;
+	}
+	return true;
+}
+
+/**
+* Move what is available in @param st's pipe to its buffer or sink.
+* @return the number of bytes moved, 0 at EOF, -1 on error.
+*/
+static ssize_t capture_drain(struct capture_stream *st)
+{
+	char chunk[4096];
+	ssize_t n;
+
+	if(st->sink_fd < 0)
+	{ // Collect, keeping the buffer NUL terminated
+		if(*st->len + 1 == st->cap)
+		{
+			char *grown = realloc(*st->buf, st->cap * 2);
+			if(grown == NULL)
+			{
+				return -1;
+			}
+			*st->buf = grown;
+			st->cap *= 2;
+		}
+		do
+		{
+			n = read(st->pipe_fd, *st->buf + *st->len, st->cap - *st->len - 1);
+		} while(n < 0 && errno == EINTR);
+		if(n > 0)
+		{
+			*st->len += n;
+			(*st->buf)[*st->len] = '\0';
+		}
+		return n;
+	}
+
+	if(st->use_splice)
+	{ // Pipe to file or socket inside the kernel, without copying through this process
+		do
+		{
+			n = splice(st->pipe_fd, NULL, st->sink_fd, NULL, CAPTURE_SPLICE_CHUNK, SPLICE_F_MOVE);
+		} while(n < 0 && errno == EINTR);
+		if(n >= 0 || errno != EINVAL)
+		{
+			return n;
+		}
+		// EINVAL: the sink cannot be spliced to (a terminal, or opened with O_APPEND)
+		st->use_splice = false;
 	}
-	
-	// If execv succeeded, the child would exit with 0
-    if (WIFEXITED(status) && WEXITSTATUS(status) == 0) 
-    { // Command run successfully
-		va_end(args);
-        return true;
-    }
 
-	// Otherwise, command failed
+	do
+	{
+		n = read(st->pipe_fd, chunk, sizeof(chunk));
+	} while(n < 0 && errno == EINTR);
+	if(n > 0 && !write_all(st->sink_fd, chunk, n))
+	{
+		return -1;
+	}
+	return n;
+}
+
+/**
+* @param capture - out_fd and err_fd select where the output goes, see
+*   struct exec_capture.  The other fields are filled in; release them with
+*   exec_capture_free() whatever the result.
+* All other parameters, see do_exec above
+* @return true if the command ran and exited with status 0, and all of its
+*   output was collected or sent.
+*
+* The command writes to pipes, and both are drained in one poll() loop so a
+* child that fills one pipe while this process waits on the other cannot
+* deadlock.  Output sent to a file or socket is moved with splice().
+*/
+bool do_exec_capture(struct exec_capture *capture, int count, ...)
+{
+    va_list args;
+    va_start(args, count);
+    char * command[count+1];
+    int i;
+    for(i=0; i<count; i++)
+    {
+        command[i] = va_arg(args, char *);
+    }
+    command[count] = NULL;
     va_end(args);
-    return false;
+
+	struct capture_stream streams[2] = {
+		{ .pipe_fd = -1, .sink_fd = capture->out_fd, .buf = &capture->out, .len = &capture->out_len },
+		{ .pipe_fd = -1, .sink_fd = capture->err_fd, .buf = &capture->err, .len = &capture->err_len },
+	};
+	int write_ends[2] = { -1, -1 };
+	bool ok = true;
+	pid_t pid;
+
+	capture->out = capture->err = NULL;
+	capture->out_len = capture->err_len = 0;
+	capture->status = -1;
+
+	for(i = 0; i < 2; i++)
+	{
+		int fds[2];
+		struct capture_stream *st = &streams[i];
+
+		if(st->sink_fd < 0)
+		{
+			st->cap = CAPTURE_INITIAL;
+			*st->buf = calloc(1, st->cap);
+			ok = ok && *st->buf != NULL;
+		}
+		st->use_splice = true;
+		if(ok && pipe2(fds, O_CLOEXEC) == 0)
+		{
+			st->pipe_fd = fds[0];
+			write_ends[i] = fds[1];
+		}
+		else
+		{
+			ok = false;
+		}
+	}
+
+	ok = ok && spawn_child(command, write_ends[0], write_ends[1], &pid);
+	for(i = 0; i < 2; i++)
+	{ // Only the child writes, so EOF arrives when it is done
+		if(write_ends[i] >= 0)
+		{
+			close(write_ends[i]);
+		}
+	}
+	if(!ok)
+	{
+		for(i = 0; i < 2; i++)
+		{
+			if(streams[i].pipe_fd >= 0)
+			{
+				close(streams[i].pipe_fd);
+			}
+		}
+		return false;
+	}
+
+	while(streams[0].pipe_fd >= 0 || streams[1].pipe_fd >= 0)
+	{
+		struct pollfd pfds[2];
+		struct capture_stream *polled[2];
+		int nfds = 0, n;
+
+		for(i = 0; i < 2; i++)
+		{
+			if(streams[i].pipe_fd >= 0)
+			{
+				pfds[nfds].fd = streams[i].pipe_fd;
+				pfds[nfds].events = POLLIN;
+				polled[nfds++] = &streams[i];
+			}
+		}
+		if(poll(pfds, nfds, -1) < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			break;
+		}
+		for(n = 0; n < nfds; n++)
+		{
+			if(pfds[n].revents == 0)
+			{
+				continue;
+			}
+			ssize_t moved = capture_drain(polled[n]);
+			if(moved <= 0)
+			{ // EOF; on error stop reading, the child then gets EPIPE
+				ok = ok && moved == 0;
+				close(polled[n]->pipe_fd);
+				polled[n]->pipe_fd = -1;
+			}
+		}
+	}
+	for(i = 0; i < 2; i++)
+	{ // Only left open when poll() failed
+		if(streams[i].pipe_fd >= 0)
+		{
+			close(streams[i].pipe_fd);
+			ok = false;
+		}
+	}
+
+	capture->status = wait_child(pid);
+	return ok && status_success(capture->status);
+}
+
+void exec_capture_free(struct exec_capture *capture)
+{
+	free(capture->out);
+	free(capture->err);
+	capture->out = capture->err = NULL;
+	capture->out_len = capture->err_len = 0;
+}
+
+// Longer commands go to the shell rather than being copied onto the stack
+#define SIMPLE_COMMAND_MAX 4096
+
+// Words the shell must run itself, or that change what the following words mean
+static const char *const shell_words[] = {
+	"cd", "exit", "export", "unset", "set", "readonly", "local", ".", "source",
+	"exec", "eval", "alias", "unalias", "ulimit", "umask", "wait", "read",
+	"shift", "trap", "return", "break", "continue", "command", "type", "hash",
+	"times", "getopts", "jobs", "fg", "bg",
+	"if", "then", "else", "elif", "fi", "case", "esac", "for", "while",
+	"until", "do", "done", "function", "time", NULL
+};
+
+/**
+* @return true unless @param cmd is a simple command: blank separated words
+*   without any character the shell would interpret, that does not start
+*   with an assignment, a builtin or a keyword, and not longer than
+*   SIMPLE_COMMAND_MAX.
+*/
+static bool needs_shell(const char *cmd)
+{
+	const char *word = cmd + strspn(cmd, " \t");
+	size_t len = strcspn(word, " \t");
+	int i;
+
+	if(*word == '\0' || strlen(cmd) >= SIMPLE_COMMAND_MAX ||
+	   strpbrk(cmd, "|&;<>()$`\\\"'*?[]{}#~!\n") != NULL)
+	{
+		return true;
+	}
+	if(memchr(word, '=', len) != NULL)
+	{ // VAR=value command
+		return true;
+	}
+	for(i = 0; shell_words[i] != NULL; i++)
+	{
+		if(strlen(shell_words[i]) == len && strncmp(word, shell_words[i], len) == 0)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+* Split the simple command @param cmd into words and run it, looking the
+* first word up in $PATH the way the shell would.
+* @return true if the command ran and exited with status 0.
+*/
+static bool spawn_simple_command(const char *cmd)
+{
+	size_t size = strlen(cmd) + 1;
+	char copy[size];
+	char *words[size / 2 + 1];
+	char *save = NULL;
+	size_t count = 0;
+	pid_t pid;
+	int ret;
+
+	memcpy(copy, cmd, size);
+	for(char *word = strtok_r(copy, " \t", &save); word != NULL; word = strtok_r(NULL, " \t", &save))
+	{
+		words[count++] = word;
+	}
+	words[count] = NULL;
+
+	ret = posix_spawnp(&pid, words[0], NULL, NULL, words, environ);
+	if(ret != 0)
+	{ // The shell would have reported "not found" and exited with 127
+		fprintf(stderr, "posix_spawnp %s: %s\n", words[0], strerror(ret));
+		return false;
+	}
+	return status_success(wait_child(pid));
 }
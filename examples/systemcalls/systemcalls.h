@@ -1,9 +1,41 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 
 bool do_system(const char *command);
 
 bool do_exec(int count, ...);
 
 bool do_exec_redirect(const char *outputfile, int count, ...);
+
+/**
+* One command of a do_exec_batch() call.
+*/
+struct exec_job {
+    char *const *argv;      // in: NULL terminated, argv[0] is the full path of the command
+    bool started;           // out: the command was spawned
+    int status;             // out: wait status as returned by waitpid(), -1 if never reaped
+    bool success;           // out: started and exited with status 0
+    int64_t elapsed_ns;     // out: time from spawn to exit
+};
+
+bool do_exec_batch(struct exec_job *jobs, size_t count, unsigned int max_parallel);
+
+/**
+* Where do_exec_capture() sends the output of the command, and what it collected.
+*/
+struct exec_capture {
+    int out_fd;             // in: -1 to collect stdout in out, else the file or socket to send it to
+    int err_fd;             // in: -1 to collect stderr in err, else the file or socket to send it to
+    char *out;              // out: collected stdout, NUL terminated, NULL when sent to out_fd
+    size_t out_len;
+    char *err;              // out: collected stderr, NUL terminated, NULL when sent to err_fd
+    size_t err_len;
+    int status;             // out: wait status as returned by waitpid(), -1 if never reaped
+};
+
+bool do_exec_capture(struct exec_capture *capture, int count, ...);
+
+void exec_capture_free(struct exec_capture *capture);
@@ -0,0 +1,585 @@
+/*
+ * lockbench.c - Contention benchmark for the thread_data workload.
+ *
+ * Each of -t threads runs the threading.c workload in a loop for -d seconds:
+ * wait wait_to_obtain_ms, obtain the lock, hold it for wait_to_release_ms,
+ * release it.  The millisecond waits default to 0, which is pure contention;
+ * -n and -c add that many iterations of busy work outside and inside the
+ * critical section, which is how short holds such as aesdsocket's cache
+ * lookups look.  The same run is repeated for every lock in -l:
+ *
+ *   pthread   default pthread_mutex_t (futex, sleeps at once when contended)
+ *   adaptive  PTHREAD_MUTEX_ADAPTIVE_NP (spins briefly before sleeping)
+ *   spin      pthread_spinlock_t
+ *   ticket    FIFO ticket spinlock
+ *   mcs       MCS queue lock: FIFO, each waiter spins on its own cache line
+ *   futex     three-state futex mutex (Drepper, "Futexes Are Tricky")
+ *
+ * and reported as:
+ *
+ *   acq/s     lock acquisitions per second, all threads
+ *   fairness  Jain's index over the per-thread acquisition counts: 1.0 when
+ *             every thread got the same share, 1/threads when one got all
+ *   handoff   time from a release to the acquisition by a thread that was
+ *             already waiting for it (p50 / p99 / max, microseconds)
+ *
+ * Reading the results: the spinning locks win on short holds with no more
+ * threads than CPUs and collapse when a holder is preempted or sleeps
+ * (-r 1), which is why aesdsocket's file_mutex, held across file I/O, stays
+ * a pthread mutex.  FIFO locks (ticket, mcs) trade throughput for fairness.
+ * The driver runs in the kernel and uses struct mutex, whose optimistic
+ * spinning resembles "adaptive" here.
+ *
+ * Usage: lockbench [-t threads] [-d secs] [-o ms] [-r ms] [-n iters] [-c iters]
+ *                  [-l lock[,lock...]]
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#include "threading.h"
+
+#define CACHE_LINE 64
+#define MAX_THREADS 256
+#define MAX_SAMPLES (64 * 1024)   /* handoff samples kept per thread */
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* ------------------------------------------------------------------ */
+/* Locks                                                               */
+/* ------------------------------------------------------------------ */
+
+struct mcs_node {
+    struct mcs_node *next;
+    int locked;
+} __attribute__((aligned(CACHE_LINE)));
+
+struct bench_lock {
+    pthread_mutex_t mutex;                                  /* pthread, adaptive */
+    pthread_spinlock_t spin;
+    unsigned int ticket_next __attribute__((aligned(CACHE_LINE)));
+    unsigned int ticket_serving __attribute__((aligned(CACHE_LINE)));
+    struct mcs_node *mcs_tail __attribute__((aligned(CACHE_LINE)));
+    int futex_word __attribute__((aligned(CACHE_LINE)));   /* 0 free, 1 locked, 2 contended */
+};
+
+struct lock_ops {
+    const char *name;
+    void (*init)(struct bench_lock *l);
+    void (*acquire)(struct bench_lock *l, struct mcs_node *node);
+    void (*release)(struct bench_lock *l, struct mcs_node *node);
+    void (*destroy)(struct bench_lock *l);
+};
+
+static void noop_destroy(struct bench_lock *l)
+{
+    (void)l;
+}
+
+static void pthread_init(struct bench_lock *l)
+{
+    pthread_mutex_init(&l->mutex, NULL);
+}
+
+static void adaptive_init(struct bench_lock *l)
+{
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_ADAPTIVE_NP);
+    pthread_mutex_init(&l->mutex, &attr);
+    pthread_mutexattr_destroy(&attr);
+}
+
+static void mutex_acquire(struct bench_lock *l, struct mcs_node *node)
+{
+    (void)node;
+    pthread_mutex_lock(&l->mutex);
+}
+
+static void mutex_release(struct bench_lock *l, struct mcs_node *node)
+{
+    (void)node;
+    pthread_mutex_unlock(&l->mutex);
+}
+
+static void mutex_destroy(struct bench_lock *l)
+{
+    pthread_mutex_destroy(&l->mutex);
+}
+
+static void spin_init(struct bench_lock *l)
+{
+    pthread_spin_init(&l->spin, PTHREAD_PROCESS_PRIVATE);
+}
+
+static void spin_acquire(struct bench_lock *l, struct mcs_node *node)
+{
+    (void)node;
+    pthread_spin_lock(&l->spin);
+}
+
+static void spin_release(struct bench_lock *l, struct mcs_node *node)
+{
+    (void)node;
+    pthread_spin_unlock(&l->spin);
+}
+
+static void spin_destroy(struct bench_lock *l)
+{
+    pthread_spin_destroy(&l->spin);
+}
+
+static void ticket_init(struct bench_lock *l)
+{
+    l->ticket_next = 0;
+    l->ticket_serving = 0;
+}
+
+static void ticket_acquire(struct bench_lock *l, struct mcs_node *node)
+{
+    unsigned int mine = __atomic_fetch_add(&l->ticket_next, 1, __ATOMIC_RELAXED);
+
+    (void)node;
+    while (__atomic_load_n(&l->ticket_serving, __ATOMIC_ACQUIRE) != mine)
+        cpu_relax();
+}
+
+static void ticket_release(struct bench_lock *l, struct mcs_node *node)
+{
+    (void)node;
+    /* Only the holder writes ticket_serving */
+    __atomic_store_n(&l->ticket_serving, l->ticket_serving + 1, __ATOMIC_RELEASE);
+}
+
+static void mcs_init(struct bench_lock *l)
+{
+    l->mcs_tail = NULL;
+}
+
+static void mcs_acquire(struct bench_lock *l, struct mcs_node *node)
+{
+    struct mcs_node *pred;
+
+    node->next = NULL;
+    node->locked = 1;
+    pred = __atomic_exchange_n(&l->mcs_tail, node, __ATOMIC_ACQ_REL);
+    if (pred == NULL)
+        return;
+    __atomic_store_n(&pred->next, node, __ATOMIC_RELEASE);
+    while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE))
+        cpu_relax();
+}
+
+static void mcs_release(struct bench_lock *l, struct mcs_node *node)
+{
+    struct mcs_node *next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+
+    if (next == NULL) {
+        struct mcs_node *expected = node;
+        if (__atomic_compare_exchange_n(&l->mcs_tail, &expected, NULL, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            return;
+        /* A successor swapped the tail but has not linked itself yet */
+        while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+            cpu_relax();
+    }
+    __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+}
+
+static long futex(int *uaddr, int op, int val)
+{
+    return syscall(SYS_futex, uaddr, op, val, NULL, NULL, 0);
+}
+
+static void futex_init(struct bench_lock *l)
+{
+    l->futex_word = 0;
+}
+
+static void futex_acquire(struct bench_lock *l, struct mcs_node *node)
+{
+    int c = 0;
+
+    (void)node;
+    if (__atomic_compare_exchange_n(&l->futex_word, &c, 1, false,
+                                    __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+    if (c != 2)
+        c = __atomic_exchange_n(&l->futex_word, 2, __ATOMIC_ACQUIRE);
+    while (c != 0) {
+        futex(&l->futex_word, FUTEX_WAIT_PRIVATE, 2);
+        c = __atomic_exchange_n(&l->futex_word, 2, __ATOMIC_ACQUIRE);
+    }
+}
+
+static void futex_release(struct bench_lock *l, struct mcs_node *node)
+{
+    (void)node;
+    if (__atomic_fetch_sub(&l->futex_word, 1, __ATOMIC_RELEASE) != 1) {
+        __atomic_store_n(&l->futex_word, 0, __ATOMIC_RELEASE);
+        futex(&l->futex_word, FUTEX_WAKE_PRIVATE, 1);
+    }
+}
+
+static const struct lock_ops locks[] = {
+    { "pthread",  pthread_init,  mutex_acquire,  mutex_release,  mutex_destroy },
+    { "adaptive", adaptive_init, mutex_acquire,  mutex_release,  mutex_destroy },
+    { "spin",     spin_init,     spin_acquire,   spin_release,   spin_destroy },
+    { "ticket",   ticket_init,   ticket_acquire, ticket_release, noop_destroy },
+    { "mcs",      mcs_init,      mcs_acquire,    mcs_release,    noop_destroy },
+    { "futex",    futex_init,    futex_acquire,  futex_release,  noop_destroy },
+};
+#define LOCK_COUNT (sizeof(locks) / sizeof(locks[0]))
+
+/* ------------------------------------------------------------------ */
+/* Workload                                                            */
+/* ------------------------------------------------------------------ */
+
+struct bench_config {
+    unsigned int threads;
+    double seconds;
+    int wait_to_obtain_ms;
+    int wait_to_release_ms;
+    unsigned long outside_iters;
+    unsigned long inside_iters;
+};
+
+/* State shared by the threads of one run; written only with the lock held */
+struct bench_shared {
+    struct bench_lock lock;
+    uint64_t last_release_ns;
+    int last_holder;                 /* thread index, -1 before the first release */
+    unsigned long counter;           /* the critical section's work */
+};
+
+/* Holds the threads until all of them exist, so they start contending together */
+struct start_gate {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool open;
+};
+
+struct bench_thread {
+    struct thread_data data;         /* the workload; thread_complete_success on exit */
+    int index;
+    const struct lock_ops *ops;
+    struct bench_shared *shared;
+    const struct bench_config *config;
+    struct start_gate *gate;
+    const int *stop;
+    struct mcs_node node;
+    unsigned long acquisitions;
+    uint32_t *samples;               /* handoff latencies, ns (capped) */
+    unsigned int sample_count;
+};
+
+static void busy_work(unsigned long iters)
+{
+    volatile unsigned long sink = 0;
+    unsigned long i;
+
+    for (i = 0; i < iters; i++)
+        sink += i;
+}
+
+static void *bench_thread_func(void *arg)
+{
+    struct bench_thread *t = arg;
+    struct bench_shared *shared = t->shared;
+
+    t->data.thread_complete_success = false;
+    pthread_mutex_lock(&t->gate->mutex);
+    while (!t->gate->open)
+        pthread_cond_wait(&t->gate->cond, &t->gate->mutex);
+    pthread_mutex_unlock(&t->gate->mutex);
+
+    while (!__atomic_load_n(t->stop, __ATOMIC_RELAXED)) {
+        uint64_t requested, acquired;
+
+        if (t->data.wait_to_obtain_ms > 0)
+            usleep((useconds_t)t->data.wait_to_obtain_ms * 1000);
+        busy_work(t->config->outside_iters);
+
+        requested = now_ns();
+        t->ops->acquire(&shared->lock, &t->node);
+        acquired = now_ns();
+
+        /* A handoff: someone else released while this thread was waiting */
+        if (shared->last_holder >= 0 && shared->last_holder != t->index &&
+            shared->last_release_ns >= requested && t->sample_count < MAX_SAMPLES) {
+            uint64_t latency = acquired - shared->last_release_ns;
+            t->samples[t->sample_count++] = latency > UINT32_MAX ? UINT32_MAX
+                                                                 : (uint32_t)latency;
+        }
+
+        shared->counter++;
+        busy_work(t->config->inside_iters);
+        if (t->data.wait_to_release_ms > 0)
+            usleep((useconds_t)t->data.wait_to_release_ms * 1000);
+
+        shared->last_holder = t->index;
+        shared->last_release_ns = now_ns();
+        t->ops->release(&shared->lock, &t->node);
+        t->acquisitions++;
+    }
+
+    t->data.thread_complete_success = true;
+    return t;
+}
+
+static int compare_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static double percentile_us(const uint32_t *sorted, size_t n, double p)
+{
+    if (n == 0)
+        return 0.0;
+    return sorted[(size_t)(p * (double)(n - 1))] / 1000.0;
+}
+
+/*
+ * run_lock - One timed run of the workload against ops.  Returns 0 and
+ * prints one result line, or -1 if the threads could not be started.
+ */
+static int run_lock(const struct lock_ops *ops, const struct bench_config *config)
+{
+    struct bench_shared *shared;
+    struct bench_thread *threads;
+    pthread_t *ids;
+    struct start_gate gate = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, false };
+    struct timespec pause;
+    int stop = 0;
+    unsigned int i, started = 0;
+    uint64_t begin, elapsed;
+    double sum = 0.0, sum_sq = 0.0, fairness;
+    unsigned long total = 0;
+    size_t sample_total = 0, k = 0;
+    uint32_t *all;
+    bool success = true;
+    int ret = 0;
+
+    shared = aligned_alloc(CACHE_LINE, (sizeof(*shared) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+    threads = aligned_alloc(CACHE_LINE, sizeof(*threads) * config->threads);
+    ids = calloc(config->threads, sizeof(*ids));
+    if (!shared || !threads || !ids) {
+        fprintf(stderr, "lockbench: out of memory\n");
+        free(shared);
+        free(threads);
+        free(ids);
+        return -1;
+    }
+    memset(shared, 0, sizeof(*shared));
+    memset(threads, 0, sizeof(*threads) * config->threads);
+    shared->last_holder = -1;
+    ops->init(&shared->lock);
+
+    for (i = 0; i < config->threads; i++) {
+        struct bench_thread *t = &threads[i];
+
+        t->data.mutex = NULL;  /* the lock under test is in shared->lock */
+        t->data.wait_to_obtain_ms = config->wait_to_obtain_ms;
+        t->data.wait_to_release_ms = config->wait_to_release_ms;
+        t->index = (int)i;
+        t->ops = ops;
+        t->shared = shared;
+        t->config = config;
+        t->gate = &gate;
+        t->stop = &stop;
+        t->samples = malloc(sizeof(uint32_t) * MAX_SAMPLES);
+        if (!t->samples || pthread_create(&ids[i], NULL, bench_thread_func, t) != 0) {
+            fprintf(stderr, "lockbench: could not start thread %u\n", i);
+            free(t->samples);
+            t->samples = NULL;
+            ret = -1;
+            break;
+        }
+        started++;
+    }
+
+    /* On failure the threads that did start leave at once */
+    if (ret == -1)
+        __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&gate.mutex);
+    gate.open = true;
+    pthread_cond_broadcast(&gate.cond);
+    pthread_mutex_unlock(&gate.mutex);
+
+    if (ret == 0) {
+        begin = now_ns();
+        pause.tv_sec = (time_t)config->seconds;
+        pause.tv_nsec = (long)((config->seconds - (double)pause.tv_sec) * 1e9);
+        while (nanosleep(&pause, &pause) == -1 && errno == EINTR)
+            ;
+        __atomic_store_n(&stop, 1, __ATOMIC_RELAXED);
+    }
+
+    for (i = 0; i < started; i++) {
+        pthread_join(ids[i], NULL);
+        total += threads[i].acquisitions;
+        sample_total += threads[i].sample_count;
+        sum += (double)threads[i].acquisitions;
+        sum_sq += (double)threads[i].acquisitions * (double)threads[i].acquisitions;
+        success = success && threads[i].data.thread_complete_success;
+    }
+
+    if (ret == 0) {
+        elapsed = now_ns() - begin;
+        fairness = sum_sq > 0.0 ? sum * sum / ((double)config->threads * sum_sq) : 0.0;
+
+        all = malloc(sizeof(uint32_t) * (sample_total ? sample_total : 1));
+        if (all) {
+            for (i = 0; i < config->threads; i++) {
+                memcpy(all + k, threads[i].samples, sizeof(uint32_t) * threads[i].sample_count);
+                k += threads[i].sample_count;
+            }
+            qsort(all, sample_total, sizeof(uint32_t), compare_u32);
+        }
+        printf("%-9s %12.0f %9.3f %10.2f %10.2f %10.2f %9zu%s\n", ops->name,
+               (double)total * 1e9 / (double)elapsed, fairness,
+               all ? percentile_us(all, sample_total, 0.50) : 0.0,
+               all ? percentile_us(all, sample_total, 0.99) : 0.0,
+               all ? percentile_us(all, sample_total, 1.0) : 0.0,
+               sample_total, success ? "" : "  (thread failed)");
+        free(all);
+    }
+
+    for (i = 0; i < config->threads; i++)
+        free(threads[i].samples);
+    pthread_cond_destroy(&gate.cond);
+    pthread_mutex_destroy(&gate.mutex);
+    ops->destroy(&shared->lock);
+    free(ids);
+    free(threads);
+    free(shared);
+    return ret;
+}
+
+static void usage(const char *prog)
+{
+    unsigned int i;
+
+    fprintf(stderr, "Usage: %s [-t threads] [-d secs] [-o ms] [-r ms] [-n iters] [-c iters]\n"
+                    "          [-l lock[,lock...]]\n", prog);
+    fprintf(stderr, "  -t threads  Contending threads (default: online CPUs, max %d)\n",
+            MAX_THREADS);
+    fprintf(stderr, "  -d secs     Duration of each run (default 1)\n");
+    fprintf(stderr, "  -o ms       wait_to_obtain_ms before each acquisition (default 0)\n");
+    fprintf(stderr, "  -r ms       wait_to_release_ms while holding (default 0)\n");
+    fprintf(stderr, "  -n iters    Busy work outside the lock (default 100)\n");
+    fprintf(stderr, "  -c iters    Busy work inside the lock (default 100)\n");
+    fprintf(stderr, "  -l locks    Comma-separated subset of:");
+    for (i = 0; i < LOCK_COUNT; i++)
+        fprintf(stderr, " %s", locks[i].name);
+    fprintf(stderr, "\n");
+}
+
+static bool lock_selected(const char *list, const char *name)
+{
+    size_t len = strlen(name);
+    const char *p = list;
+
+    if (list == NULL)
+        return true;
+    while ((p = strstr(p, name)) != NULL) {
+        if ((p == list || p[-1] == ',') && (p[len] == ',' || p[len] == '\0'))
+            return true;
+        p += len;
+    }
+    return false;
+}
+
+static int parse_count(const char *s, unsigned long *out)
+{
+    char *end;
+
+    errno = 0;
+    *out = strtoul(s, &end, 10);
+    return (errno == 0 && end != s && *end == '\0' && s[0] != '-') ? 0 : -1;
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_config config;
+    const char *selection = NULL;
+    unsigned long value;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned int i;
+    int argi, failed = 0;
+
+    config.threads = cpus > 0 ? (unsigned int)(cpus < MAX_THREADS ? cpus : MAX_THREADS) : 4;
+    config.seconds = 1.0;
+    config.wait_to_obtain_ms = 0;
+    config.wait_to_release_ms = 0;
+    config.outside_iters = 100;
+    config.inside_iters = 100;
+
+    for (argi = 1; argi < argc; argi++) {
+        const char *arg = argv[argi];
+        const char *val = argi + 1 < argc ? argv[argi + 1] : NULL;
+
+        if (val && strcmp(arg, "-t") == 0 && parse_count(val, &value) == 0 &&
+            value >= 1 && value <= MAX_THREADS) {
+            config.threads = (unsigned int)value;
+        } else if (val && strcmp(arg, "-d") == 0 && (config.seconds = atof(val)) > 0.0) {
+        } else if (val && strcmp(arg, "-o") == 0 && parse_count(val, &value) == 0 &&
+                   value <= 1000000) {
+            config.wait_to_obtain_ms = (int)value;
+        } else if (val && strcmp(arg, "-r") == 0 && parse_count(val, &value) == 0 &&
+                   value <= 1000000) {
+            config.wait_to_release_ms = (int)value;
+        } else if (val && strcmp(arg, "-n") == 0 && parse_count(val, &config.outside_iters) == 0) {
+        } else if (val && strcmp(arg, "-c") == 0 && parse_count(val, &config.inside_iters) == 0) {
+        } else if (val && strcmp(arg, "-l") == 0) {
+            selection = val;
+        } else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+        argi++;
+    }
+
+    printf("threads %u, %.1f s per lock, obtain after %d ms, hold %d ms, "
+           "work %lu outside / %lu inside\n",
+           config.threads, config.seconds, config.wait_to_obtain_ms,
+           config.wait_to_release_ms, config.outside_iters, config.inside_iters);
+    printf("%-9s %12s %9s %10s %10s %10s %9s\n", "lock", "acq/s", "fairness",
+           "p50 us", "p99 us", "max us", "handoffs");
+
+    for (i = 0; i < LOCK_COUNT; i++) {
+        if (lock_selected(selection, locks[i].name) && run_lock(&locks[i], &config) == -1)
+            failed = 1;
+    }
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -1,7 +1,13 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE  // pthread_mutex_clocklock
+#endif
 #include "threading.h"
 #include <unistd.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
 // Code updated with assistance from DeepSeek: https://chat.deepseek.com/share/v7krojhn6u2k69cx2r
 
 // Optional: use these functions to add debug or error prints to your application
@@ -9,43 +15,138 @@
 //#define DEBUG_LOG(msg,...) printf("threading: " msg "\n" , ##__VA_ARGS__)
 #define ERROR_LOG(msg,...) printf("threading ERROR: " msg "\n" , ##__VA_ARGS__)
 
-void* threadfunc(void* thread_param)
+/*
+ * pthread_mutex_clocklock (glibc 2.30) takes a CLOCK_MONOTONIC deadline.
+ * Older C libraries only have pthread_mutex_timedlock, whose deadline is
+ * CLOCK_REALTIME; the monotonic deadline is converted for it.
+ */
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30))
+#define HAVE_MUTEX_CLOCKLOCK 1
+#else
+#define HAVE_MUTEX_CLOCKLOCK 0
+#endif
+
+static void timespec_add_ms(struct timespec *ts, int ms)
 {
-	struct thread_data* thread_func_args = (struct thread_data*) thread_param;
-    
-    // Set initial success flag to false
-    thread_func_args->thread_complete_success = false;
-    
-    // 1. Wait before obtaining mutex
-    DEBUG_LOG("Thread waiting %d ms before obtaining mutex", thread_func_args->wait_to_obtain_ms);
-    usleep(thread_func_args->wait_to_obtain_ms * 1000);
-    
+    ts->tv_sec  += ms / 1000;
+    ts->tv_nsec += (long)(ms % 1000) * 1000000L;
+    if (ts->tv_nsec >= 1000000000L) {
+        ts->tv_sec++;
+        ts->tv_nsec -= 1000000000L;
+    }
+}
+
+static int64_t timespec_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+    return (int64_t)(a->tv_sec - b->tv_sec) * 1000000000 + (a->tv_nsec - b->tv_nsec);
+}
+
+/**
+* Sleep until the CLOCK_MONOTONIC time @param deadline.  Unlike a relative
+* usleep, time lost before the call or to a signal does not push the wake-up
+* later.
+*/
+static void sleep_until(const struct timespec *deadline)
+{
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, deadline, NULL) == EINTR)
+        ;
+}
+
+static int lock_until(pthread_mutex_t *mutex, const struct timespec *deadline)
+{
+#if HAVE_MUTEX_CLOCKLOCK
+    return pthread_mutex_clocklock(mutex, CLOCK_MONOTONIC, deadline);
+#else
+    struct timespec now, realtime;
+    int64_t remaining_ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    remaining_ns = timespec_diff_ns(deadline, &now);
+    if (remaining_ns < 0)
+        remaining_ns = 0;
+    realtime.tv_sec  += (time_t)(remaining_ns / 1000000000);
+    realtime.tv_nsec += (long)(remaining_ns % 1000000000);
+    if (realtime.tv_nsec >= 1000000000L) {
+        realtime.tv_sec++;
+        realtime.tv_nsec -= 1000000000L;
+    }
+    return pthread_mutex_timedlock(mutex, &realtime);
+#endif
+}
+
+/**
+* Steps 2-4 of threadfunc: obtain the mutex, hold it, release it, and set
+* thread_complete_success and the measured times.  Shared with the
+* scheduler's worker threads.
+*/
+static void obtain_hold_release(struct thread_data* thread_func_args)
+{
+    struct timespec obtain_deadline = thread_func_args->requested_at;
+    struct timespec acquired, release_deadline, released;
+    int lock_result;
+
+    timespec_add_ms(&obtain_deadline, thread_func_args->wait_to_obtain_ms);
+
     // 2. Obtain the mutex
     DEBUG_LOG("Thread attempting to obtain mutex");
-    int lock_result = pthread_mutex_lock(thread_func_args->mutex);
+    if (thread_func_args->lock_timeout_ms > 0) {
+        struct timespec lock_deadline = obtain_deadline;
+        timespec_add_ms(&lock_deadline, thread_func_args->lock_timeout_ms);
+        lock_result = lock_until(thread_func_args->mutex, &lock_deadline);
+    } else {
+        lock_result = pthread_mutex_lock(thread_func_args->mutex);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &acquired);
+    thread_func_args->acquire_latency_ns = timespec_diff_ns(&acquired, &obtain_deadline);
+    if (lock_result == ETIMEDOUT) {
+        // The caller asked for a timeout, so this is an expected outcome, not an error
+        DEBUG_LOG("Gave up obtaining mutex after %d ms", thread_func_args->lock_timeout_ms);
+        thread_func_args->thread_complete_success = false;
+        return;
+    }
     if (lock_result != 0) {
         ERROR_LOG("Failed to obtain mutex: %d", lock_result);
         thread_func_args->thread_complete_success = false;
-        return thread_param;
+        return;
     }
     
-    // 3. Wait while holding mutex
+    // 3. Wait while holding mutex, until a deadline counted from the actual acquisition
     DEBUG_LOG("Thread holding mutex for %d ms", thread_func_args->wait_to_release_ms);
-    usleep(thread_func_args->wait_to_release_ms * 1000);
+    release_deadline = acquired;
+    timespec_add_ms(&release_deadline, thread_func_args->wait_to_release_ms);
+    sleep_until(&release_deadline);
     
     // 4. Release the mutex
     DEBUG_LOG("Thread releasing mutex");
+    clock_gettime(CLOCK_MONOTONIC, &released);
+    thread_func_args->hold_time_ns = timespec_diff_ns(&released, &acquired);
     int unlock_result = pthread_mutex_unlock(thread_func_args->mutex);
     if (unlock_result != 0) {
         ERROR_LOG("Failed to release mutex: %d", unlock_result);
         thread_func_args->thread_complete_success = false;
-        return thread_param;
+        return;
     }
     
     // Set success flag to true
     thread_func_args->thread_complete_success = true;
     DEBUG_LOG("Thread completed successfully");
+}
+
+void* threadfunc(void* thread_param)
+{
+	struct thread_data* thread_func_args = (struct thread_data*) thread_param;
+    
+    // Set initial success flag to false
+    thread_func_args->thread_complete_success = false;
+    
+    // 1. Wait before obtaining mutex, until requested_at + wait_to_obtain_ms
+    DEBUG_LOG("Thread waiting %d ms before obtaining mutex", thread_func_args->wait_to_obtain_ms);
+    struct timespec obtain_deadline = thread_func_args->requested_at;
+    timespec_add_ms(&obtain_deadline, thread_func_args->wait_to_obtain_ms);
+    sleep_until(&obtain_deadline);
     
+    obtain_hold_release(thread_func_args);
     return thread_param;
 }
 
@@ -65,9 +166,18 @@ void* threadfunc(void* thread_param)
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms)
+{
+    return start_thread_obtaining_mutex_timeout(thread, mutex, wait_to_obtain_ms,
+                                                wait_to_release_ms, 0);
+}
+
+bool start_thread_obtaining_mutex_timeout(pthread_t *thread, pthread_mutex_t *mutex,
+                                          int wait_to_obtain_ms, int wait_to_release_ms,
+                                          int lock_timeout_ms)
 {
     // Validate input parameters
-    if (thread == NULL || mutex == NULL || wait_to_obtain_ms < 0 || wait_to_release_ms < 0) {
+    if (thread == NULL || mutex == NULL || wait_to_obtain_ms < 0 || wait_to_release_ms < 0 ||
+        lock_timeout_ms < 0) {
         ERROR_LOG("Invalid input parameters");
         return false;
     }
@@ -83,7 +193,12 @@ bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int
     thread_data_ptr->mutex = mutex;
     thread_data_ptr->wait_to_obtain_ms = wait_to_obtain_ms;
     thread_data_ptr->wait_to_release_ms = wait_to_release_ms;
+    thread_data_ptr->lock_timeout_ms = lock_timeout_ms;
+    thread_data_ptr->acquire_latency_ns = 0;
+    thread_data_ptr->hold_time_ns = 0;
     thread_data_ptr->thread_complete_success = false;  // Initially false
+    // Deadlines count from now, so thread start-up delay is not added to the wait
+    clock_gettime(CLOCK_MONOTONIC, &thread_data_ptr->requested_at);
     
     // Create the thread
     int create_result = pthread_create(thread, NULL, threadfunc, (void*)thread_data_ptr);
@@ -97,3 +212,384 @@ bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int
     return true;
 }
 
+
+/*
+ * Hierarchical timer wheel for mutex_scheduler.
+ *
+ * Time is counted in 1 ms ticks since the scheduler was created.  Level l has
+ * WHEEL_SIZE slots of 64^l ticks each; a task goes into the lowest level
+ * whose span covers its remaining delay, in the slot selected by the bits of
+ * its expiry tick at that level.  Whenever the level 0 index wraps, the next
+ * slot of level 1 is cascaded (its tasks are re-inserted, now into level 0),
+ * and so on up the levels, so every task is touched at most once per level.
+ * Delays beyond the top level's span park in its last slot and are
+ * re-inserted until they come within range.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SIZE (1 << WHEEL_BITS)
+#define WHEEL_MASK (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4                 /* 64^4 ms: about 4.6 hours */
+#define WHEEL_SPAN ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+struct mutex_task {
+    struct mutex_scheduler *sched;
+    struct thread_data *data;
+    uint64_t expires;                  /* tick */
+    bool done;
+    struct mutex_task *next;           /* wheel slot or ready queue */
+    struct mutex_task *all_prev;       /* tasks not yet joined */
+    struct mutex_task *all_next;
+};
+
+struct mutex_scheduler {
+    pthread_mutex_t lock;              /* protects everything below */
+    pthread_cond_t timer_cond;         /* wakes the timer thread (CLOCK_MONOTONIC) */
+    pthread_cond_t work_cond;          /* wakes the workers */
+    pthread_cond_t done_cond;          /* signals mutex_task_join */
+    struct timespec epoch;
+    uint64_t current;                  /* next tick to process */
+    struct mutex_task *wheel[WHEEL_LEVELS][WHEEL_SIZE];
+    unsigned long timers;              /* tasks in the wheel */
+    struct mutex_task *ready_head;
+    struct mutex_task *ready_tail;
+    struct mutex_task *all;
+    unsigned long pending;             /* submitted, not yet done */
+    bool stopping;
+    pthread_t timer_thread;
+    pthread_t *workers;
+    unsigned int worker_count;
+};
+
+static uint64_t scheduler_now(const struct mutex_scheduler *sched)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)(ts.tv_sec - sched->epoch.tv_sec) * 1000000000u +
+            (uint64_t)ts.tv_nsec - (uint64_t)sched->epoch.tv_nsec) / 1000000u;
+}
+
+static void ready_push(struct mutex_scheduler *sched, struct mutex_task *task)
+{
+    task->next = NULL;
+    if (sched->ready_tail)
+        sched->ready_tail->next = task;
+    else
+        sched->ready_head = task;
+    sched->ready_tail = task;
+}
+
+/* Called with sched->lock held */
+static void wheel_insert(struct mutex_scheduler *sched, struct mutex_task *task)
+{
+    uint64_t delta, slot_tick;
+    unsigned int level;
+
+    if (task->expires < sched->current) {
+        ready_push(sched, task);
+        return;
+    }
+    delta = task->expires - sched->current;
+    slot_tick = task->expires;
+    if (delta >= WHEEL_SPAN) {
+        delta = WHEEL_SPAN - 1;
+        slot_tick = sched->current + delta;
+    }
+    for (level = 0; level < WHEEL_LEVELS - 1; level++) {
+        if (delta < ((uint64_t)1 << (WHEEL_BITS * (level + 1))))
+            break;
+    }
+
+    struct mutex_task **slot =
+        &sched->wheel[level][(slot_tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    task->next = *slot;
+    *slot = task;
+    sched->timers++;
+}
+
+/* Process tick sched->current: cascade, then move expired tasks to the ready queue */
+static void wheel_tick(struct mutex_scheduler *sched)
+{
+    uint64_t tick = sched->current;
+    unsigned int level;
+    struct mutex_task *task, *next;
+
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+        if ((tick >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK)
+            break;
+        struct mutex_task **slot =
+            &sched->wheel[level][(tick >> (WHEEL_BITS * level)) & WHEEL_MASK];
+        task = *slot;
+        *slot = NULL;
+        for (; task; task = next) {
+            next = task->next;
+            sched->timers--;
+            wheel_insert(sched, task);
+        }
+    }
+
+    task = sched->wheel[0][tick & WHEEL_MASK];
+    sched->wheel[0][tick & WHEEL_MASK] = NULL;
+    for (; task; task = next) {
+        next = task->next;
+        sched->timers--;
+        ready_push(sched, task);
+    }
+    sched->current++;
+}
+
+/*
+ * The next tick worth waking up for: the first occupied level 0 slot before
+ * the index wraps, or the wrap itself, where a cascade may bring new tasks.
+ * When current is itself a wrap, its cascade has not run yet: the slots it
+ * will cascade (the ones wheel_tick visits) must be checked first.
+ */
+static uint64_t wheel_next_tick(const struct mutex_scheduler *sched)
+{
+    uint64_t tick = sched->current;
+    unsigned int level;
+
+    for (level = 1; level < WHEEL_LEVELS; level++) {
+        if ((tick >> (WHEEL_BITS * (level - 1))) & WHEEL_MASK)
+            break;
+        if (sched->wheel[level][(tick >> (WHEEL_BITS * level)) & WHEEL_MASK])
+            return tick;
+    }
+
+    do {
+        if (sched->wheel[0][tick & WHEEL_MASK])
+            return tick;
+        tick++;
+    } while (tick & WHEEL_MASK);
+    return tick;
+}
+
+static void* scheduler_timer_thread(void* arg)
+{
+    struct mutex_scheduler *sched = arg;
+
+    pthread_mutex_lock(&sched->lock);
+    while (!sched->stopping) {
+        uint64_t now = scheduler_now(sched);
+        bool queued = false;
+
+        if (sched->timers == 0) {
+            /* Nothing to cascade: skip the idle ticks instead of walking them */
+            if (sched->current <= now)
+                sched->current = now + 1;
+        }
+        while (sched->current <= now) {
+            wheel_tick(sched);
+            queued = true;
+        }
+        if (queued && sched->ready_head)
+            pthread_cond_broadcast(&sched->work_cond);
+
+        if (sched->timers == 0) {
+            pthread_cond_wait(&sched->timer_cond, &sched->lock);
+        } else {
+            uint64_t wake = wheel_next_tick(sched);
+            struct timespec deadline = sched->epoch;
+
+            deadline.tv_sec  += (time_t)(wake / 1000);
+            deadline.tv_nsec += (long)(wake % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&sched->timer_cond, &sched->lock, &deadline);
+        }
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return NULL;
+}
+
+static void* scheduler_worker_thread(void* arg)
+{
+    struct mutex_scheduler *sched = arg;
+
+    pthread_mutex_lock(&sched->lock);
+    for (;;) {
+        struct mutex_task *task;
+
+        while (!sched->ready_head && !sched->stopping)
+            pthread_cond_wait(&sched->work_cond, &sched->lock);
+        task = sched->ready_head;
+        if (!task)
+            break;
+        sched->ready_head = task->next;
+        if (!sched->ready_head)
+            sched->ready_tail = NULL;
+        pthread_mutex_unlock(&sched->lock);
+
+        obtain_hold_release(task->data);
+
+        pthread_mutex_lock(&sched->lock);
+        task->done = true;
+        sched->pending--;
+        pthread_cond_broadcast(&sched->done_cond);
+    }
+    pthread_mutex_unlock(&sched->lock);
+    return NULL;
+}
+
+/* Stop and join the threads started so far, then free the scheduler */
+static void scheduler_free(struct mutex_scheduler *sched, bool timer_started)
+{
+    unsigned int i;
+
+    pthread_mutex_lock(&sched->lock);
+    sched->stopping = true;
+    pthread_cond_broadcast(&sched->work_cond);
+    pthread_cond_signal(&sched->timer_cond);
+    pthread_mutex_unlock(&sched->lock);
+
+    if (timer_started)
+        pthread_join(sched->timer_thread, NULL);
+    for (i = 0; i < sched->worker_count; i++)
+        pthread_join(sched->workers[i], NULL);
+
+    while (sched->all) {
+        struct mutex_task *task = sched->all;
+        sched->all = task->all_next;
+        free(task->data);
+        free(task);
+    }
+    pthread_cond_destroy(&sched->done_cond);
+    pthread_cond_destroy(&sched->work_cond);
+    pthread_cond_destroy(&sched->timer_cond);
+    pthread_mutex_destroy(&sched->lock);
+    free(sched->workers);
+    free(sched);
+}
+
+struct mutex_scheduler *mutex_scheduler_create(unsigned int workers)
+{
+    struct mutex_scheduler *sched;
+    pthread_condattr_t attr;
+    unsigned int i;
+    int result;
+
+    if (workers == 0) {
+        ERROR_LOG("Invalid input parameters");
+        return NULL;
+    }
+    sched = calloc(1, sizeof(*sched));
+    if (sched == NULL || (sched->workers = calloc(workers, sizeof(pthread_t))) == NULL) {
+        ERROR_LOG("Failed to allocate memory for scheduler");
+        free(sched);
+        return NULL;
+    }
+
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sched->timer_cond, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&sched->work_cond, NULL);
+    pthread_cond_init(&sched->done_cond, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &sched->epoch);
+
+    result = pthread_create(&sched->timer_thread, NULL, scheduler_timer_thread, sched);
+    if (result != 0) {
+        ERROR_LOG("Failed to create timer thread: %d", result);
+        scheduler_free(sched, false);
+        return NULL;
+    }
+    for (i = 0; i < workers; i++) {
+        result = pthread_create(&sched->workers[i], NULL, scheduler_worker_thread, sched);
+        if (result != 0) {
+            ERROR_LOG("Failed to create worker thread: %d", result);
+            scheduler_free(sched, true);
+            return NULL;
+        }
+        sched->worker_count++;
+    }
+    return sched;
+}
+
+bool mutex_scheduler_submit(struct mutex_scheduler *sched, struct mutex_task **task,
+                            pthread_mutex_t *mutex, int wait_to_obtain_ms,
+                            int wait_to_release_ms, int lock_timeout_ms)
+{
+    struct mutex_task *new_task;
+    uint64_t now;
+
+    if (sched == NULL || task == NULL || mutex == NULL || wait_to_obtain_ms < 0 ||
+        wait_to_release_ms < 0 || lock_timeout_ms < 0) {
+        ERROR_LOG("Invalid input parameters");
+        return false;
+    }
+
+    new_task = calloc(1, sizeof(*new_task));
+    if (new_task == NULL || (new_task->data = malloc(sizeof(struct thread_data))) == NULL) {
+        ERROR_LOG("Failed to allocate memory for thread_data");
+        free(new_task);
+        return false;
+    }
+    new_task->data->mutex = mutex;
+    new_task->data->wait_to_obtain_ms = wait_to_obtain_ms;
+    new_task->data->wait_to_release_ms = wait_to_release_ms;
+    new_task->data->lock_timeout_ms = lock_timeout_ms;
+    new_task->data->acquire_latency_ns = 0;
+    new_task->data->hold_time_ns = 0;
+    new_task->data->thread_complete_success = false;
+
+    new_task->sched = sched;
+    clock_gettime(CLOCK_MONOTONIC, &new_task->data->requested_at);
+    pthread_mutex_lock(&sched->lock);
+    now = scheduler_now(sched);
+    /* An empty wheel may be far behind: start it at now, not where it stopped */
+    if (sched->timers == 0 && sched->current < now)
+        sched->current = now;
+    /* Round up to a whole tick so the task never runs before its deadline */
+    new_task->expires = ((uint64_t)timespec_diff_ns(&new_task->data->requested_at, &sched->epoch) +
+                         (uint64_t)wait_to_obtain_ms * 1000000u + 999999u) / 1000000u;
+    wheel_insert(sched, new_task);
+    if (sched->ready_head == new_task)
+        pthread_cond_signal(&sched->work_cond);
+    else
+        pthread_cond_signal(&sched->timer_cond);
+    new_task->all_next = sched->all;
+    if (sched->all)
+        sched->all->all_prev = new_task;
+    sched->all = new_task;
+    sched->pending++;
+    pthread_mutex_unlock(&sched->lock);
+
+    *task = new_task;
+    DEBUG_LOG("Task scheduled in %d ms", wait_to_obtain_ms);
+    return true;
+}
+
+struct thread_data *mutex_task_join(struct mutex_task *task)
+{
+    struct thread_data *data;
+    struct mutex_scheduler *sched = task->sched;
+
+    pthread_mutex_lock(&sched->lock);
+    while (!task->done)
+        pthread_cond_wait(&sched->done_cond, &sched->lock);
+    if (task->all_prev)
+        task->all_prev->all_next = task->all_next;
+    else
+        sched->all = task->all_next;
+    if (task->all_next)
+        task->all_next->all_prev = task->all_prev;
+    pthread_mutex_unlock(&sched->lock);
+
+    data = task->data;
+    free(task);
+    return data;
+}
+
+void mutex_scheduler_destroy(struct mutex_scheduler *sched)
+{
+    if (sched == NULL)
+        return;
+    pthread_mutex_lock(&sched->lock);
+    while (sched->pending > 0)
+        pthread_cond_wait(&sched->done_cond, &sched->lock);
+    pthread_mutex_unlock(&sched->lock);
+    scheduler_free(sched, true);
+}
@@ -1,4 +1,6 @@
 #include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
 #include <pthread.h>
 // Code updated with assistance from DeepSeek: https://chat.deepseek.com/share/v7krojhn6u2k69cx2r
 
@@ -12,6 +14,18 @@ struct thread_data{
     pthread_mutex_t *mutex;           // Mutex to obtain and release
     int wait_to_obtain_ms;            // Time to wait before obtaining mutex
     int wait_to_release_ms;           // Time to wait while holding mutex
+    int lock_timeout_ms;              // Give up if not obtained this long after the
+                                      // obtain deadline; 0 waits indefinitely
+    struct timespec requested_at;     // CLOCK_MONOTONIC when started; the waits are
+                                      // absolute deadlines counted from here
+
+    /**
+     * Measured results, in nanoseconds: how late the mutex was obtained
+     * relative to requested_at + wait_to_obtain_ms (sleep overshoot,
+     * scheduling delay and contention together), and how long it was held.
+     */
+    int64_t acquire_latency_ns;
+    int64_t hold_time_ns;
 
     /**
      * Set to true if the thread completed with success, false
@@ -36,3 +50,62 @@ struct thread_data{
 * @return true if the thread could be started, false if a failure occurred.
 */
 bool start_thread_obtaining_mutex(pthread_t *thread, pthread_mutex_t *mutex,int wait_to_obtain_ms, int wait_to_release_ms);
+
+/**
+* As start_thread_obtaining_mutex, but the thread gives up (thread_complete_success false)
+* if it cannot obtain the mutex within @param lock_timeout_ms of its obtain deadline.
+* A @param lock_timeout_ms of 0 waits indefinitely.
+*/
+bool start_thread_obtaining_mutex_timeout(pthread_t *thread, pthread_mutex_t *mutex,
+                                          int wait_to_obtain_ms, int wait_to_release_ms,
+                                          int lock_timeout_ms);
+
+/**
+ * Scheduler for the same delayed mutex tasks without a thread per task.
+ *
+ * Pending tasks wait in a hierarchical timer wheel (1 ms ticks, levels of 64
+ * slots each) serviced by one timer thread; when a task's wait_to_obtain_ms
+ * expires it is queued to a fixed pool of worker threads, one of which
+ * obtains the mutex, holds it for wait_to_release_ms and releases it.
+ * Scheduling a task and expiring it are O(1) whatever the number of pending
+ * tasks, and the scheduler never uses more than workers + 1 threads.
+ *
+ * Because a pthread mutex must be released by the thread that locked it, the
+ * hold runs on a worker: at most @param workers tasks hold (or wait for) a
+ * mutex at the same time, and the others wait in the queue until one is free.
+ */
+struct mutex_scheduler;
+struct mutex_task;
+
+/**
+* Create a scheduler with @param workers worker threads (at least 1).
+* @return the scheduler, or NULL if it could not be created.
+*/
+struct mutex_scheduler *mutex_scheduler_create(unsigned int workers);
+
+/**
+* Schedule a task which, like the thread of start_thread_obtaining_mutex, waits
+* @param wait_to_obtain_ms milliseconds, then obtains @param mutex, holds it for
+* @param wait_to_release_ms milliseconds and releases it.  Does not block.
+* As with start_thread_obtaining_mutex_timeout, the task gives up if it cannot obtain the
+* mutex within @param lock_timeout_ms of its obtain deadline; 0 waits indefinitely.
+* On success @param task is filled with a handle to pass to mutex_task_join.
+* @return true if the task was scheduled, false if a failure occurred.
+*/
+bool mutex_scheduler_submit(struct mutex_scheduler *sched, struct mutex_task **task,
+                            pthread_mutex_t *mutex, int wait_to_obtain_ms,
+                            int wait_to_release_ms, int lock_timeout_ms);
+
+/**
+* Wait for @param task to complete and release its handle.
+* @return the task's dynamically allocated thread_data, as a joined thread of
+* start_thread_obtaining_mutex would return it; the caller frees it.
+*/
+struct thread_data *mutex_task_join(struct mutex_task *task);
+
+/**
+* Wait for every scheduled task to complete, then stop and free the scheduler.
+* Handles not yet joined must not be joined afterwards; their thread_data
+* is freed with them.
+*/
+void mutex_scheduler_destroy(struct mutex_scheduler *sched);
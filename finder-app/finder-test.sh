@@ -53,10 +53,11 @@ fi
 #make clean
 #make
 
+# One writer process for all files: it reads path and string line pairs from stdin
 for i in $( seq 1 $NUMFILES)
 do
-	writer "$WRITEDIR/${username}$i.txt" "$WRITESTR"
-done
+	printf '%s\n%s\n' "$WRITEDIR/${username}$i.txt" "$WRITESTR"
+done | writer -
 
 OUTPUTSTRING=$(finder.sh "$WRITEDIR" "$WRITESTR")
 
@@ -0,0 +1,567 @@
+// File: finder.c
+// Author: Jordan Kooyman
+// Date Modified: 2026-10-18
+// Description: Native replacement for the find | wc -l and grep -R | wc -l pipelines in finder.sh
+//              Walks filesdir once with a pool of worker threads, counting regular files and the
+//              lines that contain searchstr in the same pass, and prints finder.sh's output line
+//              With -i, keeps a persistent index so that repeated queries only read changed files,
+//              and with -w watches the tree to keep that index fresh (see finderindex.c)
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <getopt.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "finderindex.h"
+
+#define EXIT_ERROR (1)
+#define MAX_WORKERS 16
+#define DIRENT_BUF_SIZE 32768
+#define FILE_BATCH 64           // files handed to a worker per work item
+
+/*
+ * Counting rules, so the output is the same as finder.sh's pipelines:
+ *   find "$filesdir" -type f   counts regular files, never following symbolic links
+ *   grep -R "$searchstr"       follows symbolic links to files and directories, skips a
+ *                              link back to a directory it is already inside, and reports
+ *                              a binary file (one holding a NUL byte) as a single message
+ *                              on stderr, not as lines
+ * Every entry therefore carries whether it was reached without following a link.  Devices
+ * and FIFOs are skipped (grep would block reading a FIFO).
+ */
+
+/* Directory on the path from filesdir, to recognise a link back into it */
+struct dir_node {
+    dev_t dev;
+    ino_t ino;
+    struct dir_node *parent;
+    struct dir_node *all_next;      // every node, to free them at exit
+};
+
+/* Open directory shared by the file batches read from it */
+struct dir_handle {
+    int fd;
+    char *path;
+    int refs;                       // protected by queue_mutex
+};
+
+struct file_entry {
+    char *name;
+    bool counted;                   // reached without following a link
+};
+
+struct work {
+    struct work *next;
+    /* Directory to list */
+    char *path;
+    bool counted;
+    struct dir_node *parent;
+    /* or, when dir is set, files to search */
+    struct dir_handle *dir;
+    struct file_entry files[FILE_BATCH];
+    int nfiles;
+};
+
+struct totals {
+    unsigned long files;
+    unsigned long lines;
+};
+
+static pthread_mutex_t queue_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_cond = PTHREAD_COND_INITIALIZER;
+static struct work *queue_head;
+static struct work *queue_tail;
+static unsigned long queue_pending;     // queued or being processed
+static struct dir_node *all_nodes;
+
+static const char *needle;
+static size_t needle_len;
+static struct finder_index *findex;     // with -i
+
+static void enqueue(struct work *w)
+{
+    pthread_mutex_lock(&queue_mutex);
+    w->next = NULL;
+    if (queue_tail)
+        queue_tail->next = w;
+    else
+        queue_head = w;
+    queue_tail = w;
+    queue_pending++;
+    pthread_cond_signal(&queue_cond);
+    pthread_mutex_unlock(&queue_mutex);
+}
+
+static void dir_handle_put(struct dir_handle *dir)
+{
+    bool last;
+
+    pthread_mutex_lock(&queue_mutex);
+    last = --dir->refs == 0;
+    pthread_mutex_unlock(&queue_mutex);
+    if (last) {
+        close(dir->fd);
+        free(dir->path);
+        free(dir);
+    }
+}
+
+/* Return the first occurrence of needle in s[0..n), or NULL */
+static const char *scan(const char *s, size_t n)
+{
+    size_t i = 0, limit;
+
+    if (n < needle_len)
+        return NULL;
+    limit = n - needle_len + 1;     // possible start positions
+
+#ifdef __SSE2__
+    /*
+     * Compare 16 start positions at once on the first and the last byte of
+     * the needle; only positions where both match are checked in full.
+     */
+    const __m128i first = _mm_set1_epi8(needle[0]);
+    const __m128i last = _mm_set1_epi8(needle[needle_len - 1]);
+    for (; i + 16 <= limit; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + i + needle_len - 1));
+        unsigned int mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+                                                            _mm_cmpeq_epi8(b, last)));
+        while (mask) {
+            size_t pos = i + __builtin_ctz(mask);
+            if (memcmp(s + pos, needle, needle_len) == 0)
+                return s + pos;
+            mask &= mask - 1;
+        }
+    }
+#endif
+
+    /* Tail, or the whole buffer elsewhere: libc's memchr is vectorised too */
+    while (i < limit) {
+        const char *hit = memchr(s + i, needle[0], limit - i);
+        if (hit == NULL)
+            return NULL;
+        if (memcmp(hit, needle, needle_len) == 0)
+            return hit;
+        i = hit - s + 1;
+    }
+    return NULL;
+}
+
+/* Count the lines of buf that contain needle; 0 for binary content */
+static unsigned long count_lines(const char *buf, size_t len)
+{
+    const char *end = buf + len;
+    const char *pos = buf;
+    const char *hit;
+    unsigned long lines = 0;
+
+    if (memchr(buf, '\0', len) != NULL)
+        return 0;
+    while ((hit = scan(pos, end - pos)) != NULL) {
+        lines++;
+        pos = memchr(hit, '\n', end - hit);
+        if (pos == NULL)
+            break;
+        pos++;
+    }
+    return lines;
+}
+
+static unsigned long search_file(struct dir_handle *dir, const char *name, bool counted)
+{
+    struct stat st;
+    unsigned long lines = 0;
+    char *path = NULL;
+    void *map;
+    int fd;
+
+    if (findex != NULL) {
+        // A file the index has a count for is not even opened
+        if (fstatat(dir->fd, name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+            return 0;
+        if (asprintf(&path, "%s/%s", dir->path, name) < 0)
+            return 0;
+        if (finder_index_lookup(findex, path, &st, counted, &lines)) {
+            free(path);
+            return lines;
+        }
+    }
+
+    fd = openat(dir->fd, name, O_RDONLY | O_CLOEXEC | O_NOCTTY | O_NONBLOCK);
+    if (fd < 0) {
+        fprintf(stderr, "finder: %s: %s\n", name, strerror(errno));
+        free(path);
+        return 0;
+    }
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+        if (st.st_size > 0) {
+            map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                madvise(map, st.st_size, MADV_SEQUENTIAL);
+                lines = count_lines(map, st.st_size);
+                munmap(map, st.st_size);
+            }
+        }
+        if (path != NULL)
+            finder_index_store(findex, path, &st, counted, lines);
+    }
+    close(fd);
+    free(path);
+    return lines;
+}
+
+static void add_file(struct work **batch, struct dir_handle *dir, const char *name, bool counted)
+{
+    struct work *b = *batch;
+
+    if (b == NULL) {
+        b = calloc(1, sizeof(*b));
+        if (b == NULL)
+            return;
+        pthread_mutex_lock(&queue_mutex);
+        dir->refs++;
+        pthread_mutex_unlock(&queue_mutex);
+        b->dir = dir;
+        *batch = b;
+    }
+    b->files[b->nfiles].name = strdup(name);
+    b->files[b->nfiles].counted = counted;
+    if (b->files[b->nfiles].name != NULL)
+        b->nfiles++;
+    if (b->nfiles == FILE_BATCH) {
+        enqueue(b);
+        *batch = NULL;
+    }
+}
+
+static void add_dir(const char *parent_path, const char *name, bool counted, struct dir_node *parent)
+{
+    struct work *w = calloc(1, sizeof(*w));
+
+    if (w == NULL)
+        return;
+    if (asprintf(&w->path, "%s/%s", parent_path, name) < 0) {
+        free(w);
+        return;
+    }
+    w->counted = counted;
+    w->parent = parent;
+    enqueue(w);
+}
+
+/* List a directory with getdents64, queueing subdirectories and batches of files */
+static void list_dir(struct work *w, struct totals *totals)
+{
+    char buf[DIRENT_BUF_SIZE];
+    struct dir_handle *dir;
+    struct dir_node *node, *n;
+    struct work *batch = NULL;
+    struct stat st;
+    long nread;
+    int fd;
+
+    fd = open(w->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "finder: %s: %s\n", w->path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    for (n = w->parent; n != NULL; n = n->parent) {
+        if (n->dev == st.st_dev && n->ino == st.st_ino) {
+            fprintf(stderr, "finder: %s: warning: recursive directory loop\n", w->path);
+            close(fd);
+            return;
+        }
+    }
+
+    node = malloc(sizeof(*node));
+    dir = malloc(sizeof(*dir));
+    if (node == NULL || dir == NULL) {
+        free(node);
+        free(dir);
+        close(fd);
+        return;
+    }
+    node->dev = st.st_dev;
+    node->ino = st.st_ino;
+    node->parent = w->parent;
+    pthread_mutex_lock(&queue_mutex);
+    node->all_next = all_nodes;
+    all_nodes = node;
+    pthread_mutex_unlock(&queue_mutex);
+    dir->fd = fd;
+    dir->path = w->path;        // the batches need it for the index
+    w->path = NULL;
+    dir->refs = 1;
+    if (findex != NULL)
+        finder_index_dir(findex, dir->path, w->counted);
+
+    while ((nread = syscall(SYS_getdents64, fd, buf, sizeof(buf))) > 0) {
+        long off = 0;
+        while (off < nread) {
+            struct dirent64 *d = (struct dirent64 *)(buf + off);
+            unsigned char type = d->d_type;
+            bool counted = w->counted;
+
+            off += d->d_reclen;
+            if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+                continue;
+
+            if (type == DT_UNKNOWN) {
+                if (fstatat(fd, d->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0)
+                    continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG :
+                       S_ISLNK(st.st_mode) ? DT_LNK : DT_UNKNOWN;
+            }
+            if (type == DT_LNK) {
+                // grep -R follows it, find -type f does not count what is behind it
+                if (fstatat(fd, d->d_name, &st, 0) != 0)
+                    continue;
+                type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG : DT_UNKNOWN;
+                counted = false;
+            }
+
+            if (type == DT_DIR) {
+                add_dir(dir->path, d->d_name, counted, node);
+            } else if (type == DT_REG) {
+                if (counted)
+                    totals->files++;
+                add_file(&batch, dir, d->d_name, counted);
+            }
+        }
+    }
+    if (nread < 0)
+        fprintf(stderr, "finder: %s: %s\n", dir->path, strerror(errno));
+    if (batch != NULL)
+        enqueue(batch);
+    dir_handle_put(dir);
+}
+
+static void *worker(void *arg)
+{
+    struct totals *totals = arg;
+    struct work *w;
+    int i;
+
+    for (;;) {
+        pthread_mutex_lock(&queue_mutex);
+        while (queue_head == NULL && queue_pending > 0)
+            pthread_cond_wait(&queue_cond, &queue_mutex);
+        w = queue_head;
+        if (w == NULL) {
+            // Nothing queued and nothing in progress that could queue more
+            pthread_mutex_unlock(&queue_mutex);
+            return NULL;
+        }
+        queue_head = w->next;
+        if (queue_head == NULL)
+            queue_tail = NULL;
+        pthread_mutex_unlock(&queue_mutex);
+
+        if (w->dir != NULL) {
+            for (i = 0; i < w->nfiles; i++) {
+                totals->lines += search_file(w->dir, w->files[i].name, w->files[i].counted);
+                free(w->files[i].name);
+            }
+            dir_handle_put(w->dir);
+        } else {
+            list_dir(w, totals);
+            free(w->path);
+        }
+        free(w);
+
+        pthread_mutex_lock(&queue_mutex);
+        if (--queue_pending == 0)
+            pthread_cond_broadcast(&queue_cond);
+        pthread_mutex_unlock(&queue_mutex);
+    }
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "Usage: finder [-j workers] [-i index] <filesdir> <searchstr>\n");
+    fprintf(stderr, "       finder -i index -w <filesdir>\n");
+}
+
+static struct work *new_dir_work(const char *path, bool counted, struct dir_node *parent)
+{
+    struct work *w = calloc(1, sizeof(*w));
+
+    if (w == NULL || (w->path = strdup(path)) == NULL) {
+        free(w);
+        return NULL;
+    }
+    w->counted = counted;
+    w->parent = parent;
+    return w;
+}
+
+/* The directories from root down to, not including, path, for the loop check */
+static struct dir_node *ancestors(const char *root, const char *path)
+{
+    struct dir_node *chain = NULL, *node;
+    size_t len = strlen(root);
+    char prefix[strlen(path) + 1];
+    struct stat st;
+
+    memcpy(prefix, path, sizeof(prefix));
+    while (len < sizeof(prefix) - 1) {
+        prefix[len] = '\0';
+        if (stat(prefix, &st) != 0 || (node = malloc(sizeof(*node))) == NULL)
+            break;
+        node->dev = st.st_dev;
+        node->ino = st.st_ino;
+        node->parent = chain;
+        node->all_next = all_nodes;
+        all_nodes = node;
+        chain = node;
+        prefix[len] = '/';
+        while (len < sizeof(prefix) - 1 && prefix[++len] != '/')
+            ;
+    }
+    return chain;
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t threads[MAX_WORKERS];
+    struct totals totals[MAX_WORKERS];
+    struct totals sum = {0, 0};
+    struct work *root;
+    struct stat st;
+    long workers = sysconf(_SC_NPROCESSORS_ONLN);
+    const char *index_path = NULL;
+    char *filesdir;
+    bool watch = false;
+    bool root_counted;
+    bool incremental = false;
+    char **dirty = NULL;
+    size_t ndirty = 0, d;
+    int started = 0, i, opt;
+
+    while ((opt = getopt(argc, argv, "+j:i:w")) != -1) {
+        switch (opt) {
+        case 'j':
+            workers = atol(optarg);
+            break;
+        case 'i':
+            index_path = optarg;
+            break;
+        case 'w':
+            watch = true;
+            break;
+        default:
+            usage();
+            return EXIT_ERROR;
+        }
+    }
+    if (argc - optind != (watch ? 1 : 2) || (watch && index_path == NULL)) {
+        usage();
+        return EXIT_ERROR;
+    }
+    if (workers < 1)
+        workers = 1;
+    if (workers > MAX_WORKERS)
+        workers = MAX_WORKERS;
+
+    filesdir = argv[optind];
+    if (stat(filesdir, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        printf("Invalid filesdir '%s'\n", filesdir);
+        return EXIT_ERROR;
+    }
+    // find does not descend into filesdir itself when it is a link
+    root_counted = lstat(filesdir, &st) == 0 && !S_ISLNK(st.st_mode);
+    if (index_path != NULL) {
+        // The index names files by their path, so the same tree must always be spelled alike
+        filesdir = realpath(filesdir, NULL);
+        if (filesdir == NULL) {
+            perror("finder");
+            return EXIT_ERROR;
+        }
+    }
+    if (watch)
+        return finder_index_watch(index_path, filesdir) == 0 ? EXIT_SUCCESS : EXIT_ERROR;
+
+    needle = argv[optind + 1];
+    needle_len = strlen(needle);
+    if (needle_len == 0 || strchr(needle, '\n') != NULL) {
+        // grep reads these as patterns matching every line, or several patterns
+        fprintf(stderr, "finder: searchstr must be a single non-empty line\n");
+        return EXIT_ERROR;
+    }
+
+    if (index_path != NULL) {
+        findex = finder_index_open(index_path, filesdir, needle);
+        if (findex == NULL)
+            return EXIT_ERROR;
+        incremental = finder_index_plan(findex, &dirty, &ndirty);
+    }
+
+    if (incremental) {
+        // Everything else in the index is current: walk only where the watcher saw changes
+        for (d = 0; d < ndirty; d++) {
+            bool counted = false;
+            if (stat(dirty[d], &st) != 0 || !S_ISDIR(st.st_mode))
+                continue;       // gone; what the index had below it is dropped
+            finder_index_dir_counted(findex, dirty[d], &counted);
+            root = new_dir_work(dirty[d], counted, ancestors(filesdir, dirty[d]));
+            if (root != NULL)
+                enqueue(root);
+        }
+    } else {
+        root = new_dir_work(filesdir, root_counted, NULL);
+        if (root == NULL) {
+            perror("finder");
+            return EXIT_ERROR;
+        }
+        enqueue(root);
+    }
+
+    memset(totals, 0, sizeof(totals));
+    for (i = 0; i < workers; i++) {
+        if (pthread_create(&threads[i], NULL, worker, &totals[i]) != 0)
+            break;
+        started++;
+    }
+    if (started == 0)
+        worker(&totals[0]);
+    for (i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    if (findex != NULL) {
+        // The walk covered only part of the tree, or files it did not read
+        finder_index_totals(findex, &sum.files, &sum.lines);
+        if (finder_index_close(findex) != 0)
+            fprintf(stderr, "finder: index not saved, the next query walks everything\n");
+    } else {
+        for (i = 0; i < MAX_WORKERS; i++) {
+            sum.files += totals[i].files;
+            sum.lines += totals[i].lines;
+        }
+    }
+    while (all_nodes != NULL) {
+        struct dir_node *next = all_nodes->all_next;
+        free(all_nodes);
+        all_nodes = next;
+    }
+    if (index_path != NULL)
+        free(filesdir);
+
+    printf("The number of files are %lu and the number of matching lines are %lu\n",
+           sum.files, sum.lines);
+    return EXIT_SUCCESS;
+}
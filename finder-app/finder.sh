@@ -15,6 +15,25 @@ if [ ! -d "$filesdir" ]; then
     exit 1
 fi
 
+# A plain string is searched by the native finder, which counts files and
+# matching lines in one pass over the tree.  grep patterns, and systems
+# without finder installed, use find and grep.
+# With FINDER_INDEX set (to a path outside filesdir), finder keeps an index
+# there and only reads the files that changed since the last query; run
+# "finder -i $FINDER_INDEX -w filesdir &" to have it watch for changes, so
+# that unchanged directories are not even listed.  While a query waits for
+# the watcher it keeps a .finder-sync.<pid> file in filesdir, which a find
+# or grep run over filesdir at the same moment counts.
+case "$searchstr" in
+    ''|*[][.*^$\\]*)
+        ;;
+    *)
+        if command -v finder >/dev/null 2>&1; then
+            exec finder ${FINDER_INDEX:+-i "$FINDER_INDEX"} "$filesdir" "$searchstr"
+        fi
+        ;;
+esac
+
 filecount=$(find "$filesdir" -type f | wc -l)
 
 searchcount=$(grep -R "$searchstr" "$filesdir" | wc -l)
@@ -0,0 +1,980 @@
+// File: finderindex.c
+// Author: Jordan Kooyman
+// Date Modified: 2026-10-18
+// Description: Persistent index and inotify watcher for finder (see finderindex.h)
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/inotify.h>
+
+#include "finderindex.h"
+
+/*
+ * Files kept next to the index (index_path plus a suffix):
+ *   .lock    flock()ed by a query for as long as it uses the index
+ *   .watch   pid of the watcher, written once its watches are in place
+ *   .dirty   the watcher's journal: one directory per line in which something
+ *            changed since a query last took the journal, and "%sync <name>"
+ *            once the watcher has seen the sync cookie <name> created
+ *
+ * The index itself is text, one record per line, with '%', ' ', '\t' and '\n'
+ * in names escaped as %xx:
+ *   finder-index 1
+ *   root <filesdir>
+ *   watcher <pid the index was last brought up to date under, or 0>
+ *   strings <n>
+ *   <string>                                  n lines
+ *   d <counted> <path>                        a directory
+ *   f <counted> <dev> <ino> <size> <mtime_ns> <path> <lines>...
+ *                                             a file and its matching lines for each
+ *                                             string, -1 when not searched yet
+ *
+ * A query trusts what the index says about a directory only while the watcher
+ * it was saved under is still running, and then walks just the journalled
+ * directories.  Otherwise it walks the whole tree, but still reads only the
+ * files whose size, mtime or inode changed.
+ *
+ * inotify events reach the watcher some time after the change, so before
+ * taking the journal a query creates a cookie file (SYNC_PREFIX<pid>) in the
+ * root and waits for the watcher to journal it: every change made before the
+ * query started is journalled by then.  If that takes longer than
+ * INDEX_SYNC_TIMEOUT_MS the query walks the whole tree.  The watcher ignores
+ * the cookie otherwise, so it does not make the root dirty.  A query killed
+ * before it unlinks its cookie leaves it behind; the next query removes it.
+ */
+
+#define INDEX_MAGIC "finder-index 1"
+#define INDEX_MAX_STRINGS 32
+#define INDEX_INITIAL_BUCKETS 1024
+#define SYNC_PREFIX ".finder-sync."
+#define SYNC_LINE "%sync "              // '%' is always escaped in paths
+#define INDEX_SYNC_TIMEOUT_MS 1000
+#define INDEX_SYNC_POLL_US 1000
+
+struct entry {
+    char *path;
+    bool is_dir;
+    bool counted;               // reached without following a link
+    bool seen;                  // by this query's walk, or outside what it walks
+    dev_t dev;
+    ino_t ino;
+    off_t size;
+    int64_t mtime_ns;
+    long *counts;               // files: per string, -1 when unknown
+    struct entry *next;         // hash chain
+};
+
+struct finder_index {
+    char *path;
+    char *root;
+    int lock_fd;
+    pthread_mutex_t mutex;      // entries, during the walk
+    char *strings[INDEX_MAX_STRINGS];
+    int nstrings;
+    int id;                     // of this query's needle
+    struct entry **buckets;
+    size_t nbuckets;
+    size_t nentries;
+    pid_t watcher;
+    char **dirty;
+    size_t ndirty;
+};
+
+static char *suffixed(const char *path, const char *suffix)
+{
+    char *s;
+
+    if (asprintf(&s, "%s%s", path, suffix) < 0)
+        return NULL;
+    return s;
+}
+
+static void write_escaped(FILE *f, const char *s)
+{
+    for (; *s; s++) {
+        if (*s == '%' || *s == ' ' || *s == '\t' || *s == '\n')
+            fprintf(f, "%%%02X", (unsigned char)*s);
+        else
+            fputc(*s, f);
+    }
+}
+
+/* Unescape s in place */
+static char *unescape(char *s)
+{
+    char *in = s, *out = s;
+
+    while (*in) {
+        unsigned int c;
+        if (in[0] == '%' && sscanf(in + 1, "%2x", &c) == 1) {
+            *out++ = (char)c;
+            in += 3;
+        } else {
+            *out++ = *in++;
+        }
+    }
+    *out = '\0';
+    return s;
+}
+
+static size_t hash(const char *s)
+{
+    size_t h = 1469598103934665603ULL;  // FNV-1a
+
+    while (*s)
+        h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+    return h;
+}
+
+static struct entry *find(struct finder_index *idx, const char *path)
+{
+    struct entry *e;
+
+    for (e = idx->buckets[hash(path) & (idx->nbuckets - 1)]; e != NULL; e = e->next)
+        if (strcmp(e->path, path) == 0)
+            return e;
+    return NULL;
+}
+
+static void rehash(struct finder_index *idx)
+{
+    size_t nbuckets = idx->nbuckets * 2, i;
+    struct entry **buckets = calloc(nbuckets, sizeof(*buckets));
+
+    if (buckets == NULL)
+        return;                 // chains just get longer
+    for (i = 0; i < idx->nbuckets; i++) {
+        struct entry *e = idx->buckets[i];
+        while (e != NULL) {
+            struct entry *next = e->next;
+            struct entry **b = &buckets[hash(e->path) & (nbuckets - 1)];
+            e->next = *b;
+            *b = e;
+            e = next;
+        }
+    }
+    free(idx->buckets);
+    idx->buckets = buckets;
+    idx->nbuckets = nbuckets;
+}
+
+static struct entry *insert(struct finder_index *idx, const char *path, bool is_dir)
+{
+    struct entry *e = calloc(1, sizeof(*e));
+    struct entry **b;
+    int i;
+
+    if (e == NULL || (e->path = strdup(path)) == NULL) {
+        free(e);
+        return NULL;
+    }
+    e->is_dir = is_dir;
+    if (!is_dir) {
+        e->counts = malloc(sizeof(*e->counts) * INDEX_MAX_STRINGS);
+        if (e->counts == NULL) {
+            free(e->path);
+            free(e);
+            return NULL;
+        }
+        for (i = 0; i < INDEX_MAX_STRINGS; i++)
+            e->counts[i] = -1;
+    }
+    if (idx->nentries >= idx->nbuckets)
+        rehash(idx);
+    b = &idx->buckets[hash(path) & (idx->nbuckets - 1)];
+    e->next = *b;
+    *b = e;
+    idx->nentries++;
+    return e;
+}
+
+static void free_entry(struct entry *e)
+{
+    free(e->path);
+    free(e->counts);
+    free(e);
+}
+
+static bool under(const char *path, const char *dir)
+{
+    size_t len = strlen(dir);
+
+    return strncmp(path, dir, len) == 0 && (path[len] == '\0' || path[len] == '/');
+}
+
+static void load(struct finder_index *idx)
+{
+    FILE *f = fopen(idx->path, "r");
+    char *line = NULL;
+    size_t size = 0;
+    ssize_t len;
+    int strings = -1;
+
+    if (f == NULL)
+        return;
+    if (getline(&line, &size, f) <= 0 || strncmp(line, INDEX_MAGIC "\n", sizeof(INDEX_MAGIC)) != 0)
+        goto done;
+    while ((len = getline(&line, &size, f)) > 0) {
+        char *save = NULL, *kind, *tok;
+        if (line[len - 1] == '\n')
+            line[len - 1] = '\0';
+
+        if (strings > 0) {
+            if ((idx->strings[idx->nstrings] = strdup(unescape(line))) != NULL)
+                idx->nstrings++;
+            strings--;
+            continue;
+        }
+        kind = strtok_r(line, " ", &save);
+        tok = strtok_r(NULL, " ", &save);
+        if (kind == NULL || tok == NULL)
+            continue;
+        if (strcmp(kind, "root") == 0) {
+            if (strcmp(unescape(tok), idx->root) != 0)
+                goto done;      // an index for another tree
+        } else if (strcmp(kind, "watcher") == 0) {
+            idx->watcher = atol(tok);
+        } else if (strcmp(kind, "strings") == 0) {
+            strings = atoi(tok);
+            if (strings < 0 || strings > INDEX_MAX_STRINGS)
+                goto done;
+        } else if (strcmp(kind, "d") == 0) {
+            bool counted = atoi(tok);
+            struct entry *e;
+            if ((tok = strtok_r(NULL, " ", &save)) != NULL && (e = insert(idx, unescape(tok), true)) != NULL)
+                e->counted = counted;
+        } else if (strcmp(kind, "f") == 0) {
+            char *fields[6];    // counted dev ino size mtime_ns path
+            struct entry *e;
+            int i;
+            fields[0] = tok;
+            for (i = 1; i < 6; i++)
+                if ((fields[i] = strtok_r(NULL, " ", &save)) == NULL)
+                    break;
+            if (i < 6 || (e = insert(idx, unescape(fields[5]), false)) == NULL)
+                continue;
+            e->counted = atoi(fields[0]);
+            e->dev = strtoull(fields[1], NULL, 10);
+            e->ino = strtoull(fields[2], NULL, 10);
+            e->size = strtoll(fields[3], NULL, 10);
+            e->mtime_ns = strtoll(fields[4], NULL, 10);
+            for (i = 0; i < idx->nstrings && (tok = strtok_r(NULL, " ", &save)) != NULL; i++)
+                e->counts[i] = atol(tok);
+        }
+    }
+done:
+    free(line);
+    fclose(f);
+}
+
+/* Make needle a string of the index, dropping the oldest when it is full */
+static int add_string(struct finder_index *idx, const char *needle)
+{
+    size_t i;
+    int id;
+
+    for (id = 0; id < idx->nstrings; id++)
+        if (strcmp(idx->strings[id], needle) == 0)
+            return id;
+    if (idx->nstrings == INDEX_MAX_STRINGS) {
+        free(idx->strings[0]);
+        memmove(idx->strings, idx->strings + 1, sizeof(idx->strings[0]) * (INDEX_MAX_STRINGS - 1));
+        for (i = 0; i < idx->nbuckets; i++) {
+            struct entry *e;
+            for (e = idx->buckets[i]; e != NULL; e = e->next) {
+                if (e->is_dir)
+                    continue;
+                memmove(e->counts, e->counts + 1, sizeof(*e->counts) * (INDEX_MAX_STRINGS - 1));
+                e->counts[INDEX_MAX_STRINGS - 1] = -1;
+            }
+        }
+        idx->nstrings--;
+    }
+    idx->strings[idx->nstrings] = strdup(needle);
+    if (idx->strings[idx->nstrings] == NULL)
+        return -1;
+    return idx->nstrings++;
+}
+
+struct finder_index *finder_index_open(const char *index_path, const char *root, const char *needle)
+{
+    struct finder_index *idx = calloc(1, sizeof(*idx));
+    char *lock_path = suffixed(index_path, ".lock");
+
+    if (idx == NULL || lock_path == NULL)
+        goto fail;
+    idx->lock_fd = -1;
+    idx->path = strdup(index_path);
+    idx->root = strdup(root);
+    idx->nbuckets = INDEX_INITIAL_BUCKETS;
+    idx->buckets = calloc(idx->nbuckets, sizeof(*idx->buckets));
+    if (idx->path == NULL || idx->root == NULL || idx->buckets == NULL)
+        goto fail;
+    pthread_mutex_init(&idx->mutex, NULL);
+
+    // Queries on the same index take turns
+    idx->lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (idx->lock_fd < 0 || flock(idx->lock_fd, LOCK_EX) != 0) {
+        fprintf(stderr, "finder: %s: %s\n", lock_path, strerror(errno));
+        goto fail;
+    }
+    free(lock_path);
+
+    load(idx);
+    idx->id = add_string(idx, needle);
+    if (idx->id < 0) {
+        finder_index_close(idx);
+        return NULL;
+    }
+    return idx;
+
+fail:
+    if (idx != NULL) {
+        if (idx->lock_fd >= 0)
+            close(idx->lock_fd);
+        free(idx->path);
+        free(idx->root);
+        free(idx->buckets);
+        free(idx);
+    }
+    free(lock_path);
+    return NULL;
+}
+
+static pid_t live_watcher(const char *index_path)
+{
+    char *watch_path = suffixed(index_path, ".watch");
+    FILE *f = watch_path ? fopen(watch_path, "r") : NULL;
+    long pid = 0;
+
+    free(watch_path);
+    if (f == NULL)
+        return 0;
+    if (fscanf(f, "%ld", &pid) != 1 || pid <= 0 || (kill(pid, 0) != 0 && errno != EPERM))
+        pid = 0;
+    fclose(f);
+    return pid;
+}
+
+/*
+ * Take the watcher's journal: rename it away, then wait out a write in progress.
+ * Returns true if it holds the sync line for cookie.
+ */
+static bool take_journal(struct finder_index *idx, const char *cookie)
+{
+    char *journal = suffixed(idx->path, ".dirty");
+    char *taken = suffixed(idx->path, ".dirty.taken");
+    char *line = NULL;
+    size_t size = 0;
+    bool synced = false;
+    ssize_t len;
+    FILE *f;
+
+    if (journal == NULL || taken == NULL || rename(journal, taken) != 0)
+        goto done;
+    f = fopen(taken, "r");
+    unlink(taken);
+    if (f == NULL)
+        goto done;
+    flock(fileno(f), LOCK_SH);
+    while ((len = getline(&line, &size, f)) > 0) {
+        char **grown;
+        if (line[len - 1] == '\n')
+            line[len - 1] = '\0';
+        if (strncmp(line, SYNC_LINE, strlen(SYNC_LINE)) == 0) {
+            if (strcmp(line + strlen(SYNC_LINE), cookie) == 0)
+                synced = true;
+            continue;
+        }
+        grown = realloc(idx->dirty, sizeof(*grown) * (idx->ndirty + 1));
+        if (grown == NULL)
+            break;
+        idx->dirty = grown;
+        if ((idx->dirty[idx->ndirty] = strdup(unescape(line))) != NULL)
+            idx->ndirty++;
+    }
+    fclose(f);
+done:
+    free(line);
+    free(journal);
+    free(taken);
+    return synced;
+}
+
+/*
+ * Take the journal once the watcher has caught up with every change made so
+ * far (see the sync cookie above).  Returns false if it did not in time.
+ */
+static bool sync_journal(struct finder_index *idx)
+{
+    char *cookie = NULL, *cookie_path = NULL;
+    bool synced = false;
+    int waited, fd;
+
+    if (asprintf(&cookie, SYNC_PREFIX "%ld", (long)getpid()) < 0) {
+        cookie = NULL;
+        goto done;
+    }
+    if (asprintf(&cookie_path, "%s/%s", idx->root, cookie) < 0) {
+        cookie_path = NULL;
+        goto done;
+    }
+    fd = open(cookie_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        goto done;              // e.g. a read-only tree: no barrier, walk everything
+    close(fd);
+    for (waited = 0; !synced; waited++) {
+        synced = take_journal(idx, cookie);
+        if (synced || waited * INDEX_SYNC_POLL_US >= INDEX_SYNC_TIMEOUT_MS * 1000)
+            break;
+        usleep(INDEX_SYNC_POLL_US);
+    }
+    unlink(cookie_path);
+done:
+    free(cookie);
+    free(cookie_path);
+    return synced;
+}
+
+/*
+ * Remove the sync cookies of queries that died before unlinking theirs, so
+ * they do not stay in the tree and in every later file count.
+ */
+static void remove_stale_cookies(struct finder_index *idx)
+{
+    DIR *dir = opendir(idx->root);
+    struct dirent *de;
+
+    if (dir == NULL)
+        return;
+    while ((de = readdir(dir)) != NULL) {
+        char *end, *cookie_path;
+        long pid;
+
+        if (strncmp(de->d_name, SYNC_PREFIX, strlen(SYNC_PREFIX)) != 0)
+            continue;
+        errno = 0;
+        pid = strtol(de->d_name + strlen(SYNC_PREFIX), &end, 10);
+        if (errno != 0 || *end != '\0' || pid <= 0 || pid == (long)getpid() ||
+            kill(pid, 0) == 0 || errno != ESRCH)
+            continue;
+        if (asprintf(&cookie_path, "%s/%s", idx->root, de->d_name) >= 0) {
+            unlink(cookie_path);
+            free(cookie_path);
+        }
+    }
+    closedir(dir);
+}
+
+static int compare_paths(const void *a, const void *b)
+{
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static void mark_all(struct finder_index *idx, bool seen)
+{
+    size_t i;
+    struct entry *e;
+
+    for (i = 0; i < idx->nbuckets; i++)
+        for (e = idx->buckets[i]; e != NULL; e = e->next)
+            e->seen = seen;
+}
+
+bool finder_index_plan(struct finder_index *idx, char ***dirty, size_t *ndirty)
+{
+    pid_t watcher = live_watcher(idx->path);
+    bool incremental = watcher != 0 && watcher == idx->watcher;
+    size_t i, j, kept;
+    struct entry *e;
+
+    remove_stale_cookies(idx);
+    for (i = 0; incremental && i < idx->nbuckets; i++)
+        for (e = idx->buckets[i]; e != NULL; e = e->next)
+            if (!e->is_dir && e->counts[idx->id] < 0)
+                incremental = false;   // a string the index does not know every count for
+
+    if (incremental && !sync_journal(idx)) {
+        // The watcher is behind or stuck: what it journalled so far is not enough
+        for (i = 0; i < idx->ndirty; i++)
+            free(idx->dirty[i]);
+        idx->ndirty = 0;
+        incremental = false;
+    }
+
+    if (!incremental) {
+        // Changes from now on are journalled again, and the walk sees everything before
+        char *journal = suffixed(idx->path, ".dirty");
+        if (journal != NULL)
+            unlink(journal);
+        free(journal);
+        idx->watcher = watcher;
+        mark_all(idx, false);
+        return false;
+    }
+
+    // Keep the outermost of nested directories; they sort right after it
+    qsort(idx->dirty, idx->ndirty, sizeof(*idx->dirty), compare_paths);
+    for (i = 0, kept = 0; i < idx->ndirty; i++) {
+        if (kept > 0 && under(idx->dirty[i], idx->dirty[kept - 1])) {
+            free(idx->dirty[i]);
+            continue;
+        }
+        e = find(idx, idx->dirty[i]);
+        if (strcmp(idx->dirty[i], idx->root) == 0 || e == NULL || !e->is_dir) {
+            // The root, or a directory the index never saw: walk everything
+            for (j = i; j < idx->ndirty; j++)
+                free(idx->dirty[j]);
+            idx->ndirty = kept;
+            mark_all(idx, false);
+            return false;
+        }
+        idx->dirty[kept++] = idx->dirty[i];
+    }
+    idx->ndirty = kept;
+
+    for (i = 0; i < idx->nbuckets; i++) {
+        for (e = idx->buckets[i]; e != NULL; e = e->next) {
+            e->seen = true;
+            for (j = 0; j < idx->ndirty && e->seen; j++)
+                if (under(e->path, idx->dirty[j]))
+                    e->seen = false;
+        }
+    }
+    *dirty = idx->dirty;
+    *ndirty = idx->ndirty;
+    return true;
+}
+
+bool finder_index_dir_counted(struct finder_index *idx, const char *path, bool *counted)
+{
+    struct entry *e = find(idx, path);
+
+    if (e == NULL || !e->is_dir)
+        return false;
+    *counted = e->counted;
+    return true;
+}
+
+void finder_index_dir(struct finder_index *idx, const char *path, bool counted)
+{
+    struct entry *e;
+
+    pthread_mutex_lock(&idx->mutex);
+    e = find(idx, path);
+    if (e == NULL || !e->is_dir) {
+        if (e != NULL)
+            e->seen = false;    // was a file; dropped at the end
+        e = insert(idx, path, true);
+    }
+    if (e != NULL) {
+        e->counted = counted;
+        e->seen = true;
+    }
+    pthread_mutex_unlock(&idx->mutex);
+}
+
+static int64_t mtime_ns(const struct stat *st)
+{
+    return (int64_t)st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
+}
+
+static bool unchanged(const struct entry *e, const struct stat *st)
+{
+    return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size &&
+           e->mtime_ns == mtime_ns(st);
+}
+
+bool finder_index_lookup(struct finder_index *idx, const char *path, const struct stat *st,
+                         bool counted, unsigned long *lines)
+{
+    struct entry *e;
+    bool hit = false;
+
+    pthread_mutex_lock(&idx->mutex);
+    e = find(idx, path);
+    if (e != NULL && !e->is_dir && unchanged(e, st) && e->counts[idx->id] >= 0) {
+        *lines = e->counts[idx->id];
+        e->counted = counted;
+        e->seen = true;
+        hit = true;
+    }
+    pthread_mutex_unlock(&idx->mutex);
+    return hit;
+}
+
+void finder_index_store(struct finder_index *idx, const char *path, const struct stat *st,
+                        bool counted, unsigned long lines)
+{
+    struct entry *e;
+    int i;
+
+    pthread_mutex_lock(&idx->mutex);
+    e = find(idx, path);
+    if (e != NULL && e->is_dir) {
+        e->seen = false;        // was a directory; dropped at the end
+        e = NULL;
+    }
+    if (e == NULL)
+        e = insert(idx, path, false);
+    if (e != NULL) {
+        if (!unchanged(e, st)) {
+            // New content: what was counted for the other strings no longer holds
+            for (i = 0; i < INDEX_MAX_STRINGS; i++)
+                e->counts[i] = -1;
+            e->dev = st->st_dev;
+            e->ino = st->st_ino;
+            e->size = st->st_size;
+            e->mtime_ns = mtime_ns(st);
+        }
+        e->counts[idx->id] = lines;
+        e->counted = counted;
+        e->seen = true;
+    }
+    pthread_mutex_unlock(&idx->mutex);
+}
+
+void finder_index_totals(struct finder_index *idx, unsigned long *files, unsigned long *lines)
+{
+    size_t i;
+
+    *files = *lines = 0;
+    for (i = 0; i < idx->nbuckets; i++) {
+        struct entry **link = &idx->buckets[i];
+        while (*link != NULL) {
+            struct entry *e = *link;
+            if (!e->seen) {
+                *link = e->next;
+                free_entry(e);
+                idx->nentries--;
+                continue;
+            }
+            if (!e->is_dir) {
+                if (e->counted)
+                    (*files)++;
+                if (e->counts[idx->id] > 0)
+                    *lines += e->counts[idx->id];
+            }
+            link = &e->next;
+        }
+    }
+}
+
+static int save(struct finder_index *idx)
+{
+    char *tmp = suffixed(idx->path, ".tmp");
+    FILE *f = tmp ? fopen(tmp, "w") : NULL;
+    size_t i;
+    int s;
+
+    if (f == NULL) {
+        fprintf(stderr, "finder: %s: %s\n", tmp ? tmp : idx->path, strerror(errno));
+        unlink(idx->path);
+        free(tmp);
+        return -1;
+    }
+    fprintf(f, "%s\nroot ", INDEX_MAGIC);
+    write_escaped(f, idx->root);
+    fprintf(f, "\nwatcher %ld\nstrings %d\n", (long)idx->watcher, idx->nstrings);
+    for (s = 0; s < idx->nstrings; s++) {
+        write_escaped(f, idx->strings[s]);
+        fputc('\n', f);
+    }
+    for (i = 0; i < idx->nbuckets; i++) {
+        struct entry *e;
+        for (e = idx->buckets[i]; e != NULL; e = e->next) {
+            if (e->is_dir) {
+                fprintf(f, "d %d ", e->counted);
+                write_escaped(f, e->path);
+            } else {
+                fprintf(f, "f %d %llu %llu %lld %lld ", e->counted, (unsigned long long)e->dev,
+                        (unsigned long long)e->ino, (long long)e->size, (long long)e->mtime_ns);
+                write_escaped(f, e->path);
+                for (s = 0; s < idx->nstrings; s++)
+                    fprintf(f, " %ld", e->counts[s]);
+            }
+            fputc('\n', f);
+        }
+    }
+    // Readers see the old index or the new one, never half of it
+    if (fclose(f) != 0 || rename(tmp, idx->path) != 0) {
+        fprintf(stderr, "finder: %s: %s\n", idx->path, strerror(errno));
+        unlink(tmp);
+        unlink(idx->path);      // the journal is already taken: the old index is stale
+        free(tmp);
+        return -1;
+    }
+    free(tmp);
+    return 0;
+}
+
+int finder_index_close(struct finder_index *idx)
+{
+    int ret = save(idx);
+    size_t i;
+    int s;
+
+    for (i = 0; i < idx->nbuckets; i++) {
+        while (idx->buckets[i] != NULL) {
+            struct entry *next = idx->buckets[i]->next;
+            free_entry(idx->buckets[i]);
+            idx->buckets[i] = next;
+        }
+    }
+    for (i = 0; i < idx->ndirty; i++)
+        free(idx->dirty[i]);
+    for (s = 0; s < idx->nstrings; s++)
+        free(idx->strings[s]);
+    free(idx->dirty);
+    free(idx->buckets);
+    free(idx->path);
+    free(idx->root);
+    pthread_mutex_destroy(&idx->mutex);
+    close(idx->lock_fd);    // releases the lock
+    free(idx);
+    return ret;
+}
+
+/*
+ * Watcher
+ */
+
+struct watch {
+    char **paths;               // every path the walk reaches this directory by
+    size_t npaths;
+};
+
+struct watcher {
+    int fd;
+    struct watch *watches;      // indexed by watch descriptor
+    int nwatches;
+    char **dirty;               // directories changed in the current batch
+    size_t ndirty;
+    size_t dirty_size;
+    char *cookie;               // sync cookie created in the current batch
+};
+
+struct ancestor {
+    dev_t dev;
+    ino_t ino;
+    const struct ancestor *parent;
+};
+
+static void add_watch_path(struct watcher *w, int wd, const char *path)
+{
+    struct watch *watch;
+    char **grown;
+
+    if (wd >= w->nwatches) {
+        struct watch *more = realloc(w->watches, sizeof(*more) * (wd + 1));
+        if (more == NULL)
+            return;
+        memset(more + w->nwatches, 0, sizeof(*more) * (wd + 1 - w->nwatches));
+        w->watches = more;
+        w->nwatches = wd + 1;
+    }
+    watch = &w->watches[wd];
+    grown = realloc(watch->paths, sizeof(*grown) * (watch->npaths + 1));
+    if (grown == NULL)
+        return;
+    watch->paths = grown;
+    if ((watch->paths[watch->npaths] = strdup(path)) != NULL)
+        watch->npaths++;
+}
+
+/* Watch path and every directory below it, following links as the walk does */
+static void watch_tree(struct watcher *w, const char *path, const struct ancestor *parent)
+{
+    const uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB |
+                          IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF;
+    const struct ancestor *a;
+    struct ancestor self;
+    struct dirent *d;
+    struct stat st;
+    DIR *dir;
+    int wd;
+
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode))
+        return;
+    for (a = parent; a != NULL; a = a->parent)
+        if (a->dev == st.st_dev && a->ino == st.st_ino)
+            return;             // a link back into the tree
+    wd = inotify_add_watch(w->fd, path, mask);
+    if (wd < 0) {
+        fprintf(stderr, "finder: watch %s: %s\n", path, strerror(errno));
+        return;
+    }
+    add_watch_path(w, wd, path);
+
+    self.dev = st.st_dev;
+    self.ino = st.st_ino;
+    self.parent = parent;
+    dir = opendir(path);
+    if (dir == NULL)
+        return;
+    while ((d = readdir(dir)) != NULL) {
+        char *child;
+        if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+            continue;
+        if (d->d_type != DT_DIR && d->d_type != DT_LNK && d->d_type != DT_UNKNOWN)
+            continue;
+        if (asprintf(&child, "%s/%s", path, d->d_name) < 0)
+            continue;
+        watch_tree(w, child, &self);
+        free(child);
+    }
+    closedir(dir);
+}
+
+static void mark_dirty(struct watcher *w, const char *path)
+{
+    size_t i;
+
+    for (i = 0; i < w->ndirty; i++)
+        if (strcmp(w->dirty[i], path) == 0)
+            return;
+    if (w->ndirty == w->dirty_size) {
+        size_t size = w->dirty_size ? w->dirty_size * 2 : 16;
+        char **grown = realloc(w->dirty, sizeof(*grown) * size);
+        if (grown == NULL)
+            return;
+        w->dirty = grown;
+        w->dirty_size = size;
+    }
+    if ((w->dirty[w->ndirty] = strdup(path)) != NULL)
+        w->ndirty++;
+}
+
+/*
+ * Append the batch to the journal.  A query may rename the journal away at any
+ * time, so the file is locked and then checked to still be the journal.
+ */
+static void flush_dirty(struct watcher *w, const char *journal)
+{
+    struct stat by_fd, by_name;
+    size_t i;
+    FILE *f;
+    int fd;
+
+    if (w->ndirty == 0 && w->cookie == NULL)
+        return;
+    for (;;) {
+        fd = open(journal, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "finder: %s: %s\n", journal, strerror(errno));
+            break;
+        }
+        flock(fd, LOCK_EX);
+        if (fstat(fd, &by_fd) == 0 && stat(journal, &by_name) == 0 &&
+            by_fd.st_dev == by_name.st_dev && by_fd.st_ino == by_name.st_ino)
+            break;
+        close(fd);
+    }
+    f = fd >= 0 ? fdopen(fd, "a") : NULL;
+    for (i = 0; i < w->ndirty; i++) {
+        if (f != NULL) {
+            write_escaped(f, w->dirty[i]);
+            fputc('\n', f);
+        }
+        free(w->dirty[i]);
+    }
+    w->ndirty = 0;
+    // After the directories: everything before the cookie is in the journal
+    if (w->cookie != NULL) {
+        if (f != NULL)
+            fprintf(f, "%s%s\n", SYNC_LINE, w->cookie);
+        free(w->cookie);
+        w->cookie = NULL;
+    }
+    if (f != NULL)
+        fclose(f);      // flushes, then drops the lock
+    else if (fd >= 0)
+        close(fd);
+}
+
+int finder_index_watch(const char *index_path, const char *root)
+{
+    char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+    char *journal = suffixed(index_path, ".dirty");
+    char *watch_path = suffixed(index_path, ".watch");
+    char *watch_tmp = suffixed(index_path, ".watch.tmp");
+    struct watcher w = { .fd = -1 };
+    FILE *f;
+    ssize_t len;
+
+    if (journal == NULL || watch_path == NULL || watch_tmp == NULL)
+        return -1;
+    w.fd = inotify_init1(IN_CLOEXEC);
+    if (w.fd < 0) {
+        fprintf(stderr, "finder: inotify: %s\n", strerror(errno));
+        return -1;
+    }
+    watch_tree(&w, root, NULL);
+
+    // Announce the watcher only now that every directory is watched
+    f = fopen(watch_tmp, "w");
+    if (f == NULL || fprintf(f, "%ld\n", (long)getpid()) < 0 || fclose(f) != 0 ||
+        rename(watch_tmp, watch_path) != 0) {
+        fprintf(stderr, "finder: %s: %s\n", watch_path, strerror(errno));
+        return -1;
+    }
+
+    while ((len = read(w.fd, buf, sizeof(buf))) != 0) {
+        char *p;
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "finder: inotify read: %s\n", strerror(errno));
+            return -1;
+        }
+        for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ((struct inotify_event *)p)->len) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            struct watch *watch;
+            size_t i;
+
+            if (ev->mask & IN_Q_OVERFLOW) {
+                mark_dirty(&w, root);   // events were lost: the next query walks everything
+                continue;
+            }
+            if (ev->wd < 0 || ev->wd >= w.nwatches)
+                continue;
+            if (ev->len > 0 && strncmp(ev->name, SYNC_PREFIX, strlen(SYNC_PREFIX)) == 0) {
+                // A query's sync cookie: not a change to the tree
+                if ((ev->mask & IN_CREATE) && w.cookie == NULL)
+                    w.cookie = strdup(ev->name);
+                continue;
+            }
+            watch = &w.watches[ev->wd];
+            for (i = 0; i < watch->npaths; i++) {
+                mark_dirty(&w, watch->paths[i]);
+                if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO)) && ev->len > 0) {
+                    char *child;
+                    if (asprintf(&child, "%s/%s", watch->paths[i], ev->name) >= 0) {
+                        watch_tree(&w, child, NULL);
+                        free(child);
+                    }
+                }
+            }
+            if (ev->mask & IN_IGNORED) {
+                // The directory is gone; its parent's entry says so
+                for (i = 0; i < watch->npaths; i++)
+                    free(watch->paths[i]);
+                free(watch->paths);
+                watch->paths = NULL;
+                watch->npaths = 0;
+            }
+        }
+        flush_dirty(&w, journal);
+    }
+    return -1;
+}
@@ -0,0 +1,63 @@
+// File: finderindex.h
+// Author: Jordan Kooyman
+// Date Modified: 2026-10-18
+// Description: Persistent index for finder: the files and directories under filesdir, the
+//              stat data each file had when it was last read, and how many of its lines
+//              contained each string searched for so far
+
+#ifndef FINDER_INDEX_H
+#define FINDER_INDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+struct finder_index;
+
+/*
+ * Lock and load the index at index_path for filesdir root (an index for another
+ * root, or none, starts empty) and register needle as one of its strings.
+ * Returns NULL on error, after a message on stderr.
+ */
+struct finder_index *finder_index_open(const char *index_path, const char *root, const char *needle);
+
+/*
+ * Decide what the walk has to cover.  Returns false when the whole tree must be
+ * walked.  Returns true when a watcher has journalled every change since the
+ * index was last saved (the query waits briefly for it to catch up): only the directories in *dirty (ndirty of them, possibly
+ * none) must be walked, everything else in the index is current.  *dirty is
+ * owned by the index.  Either way the entries that the walk covers are marked
+ * unseen, and the ones it does not see are dropped by finder_index_totals.
+ */
+bool finder_index_plan(struct finder_index *idx, char ***dirty, size_t *ndirty);
+
+/* Whether directory path was reached without following a link, if it is indexed */
+bool finder_index_dir_counted(struct finder_index *idx, const char *path, bool *counted);
+
+/* The walk reached directory path */
+void finder_index_dir(struct finder_index *idx, const char *path, bool counted);
+
+/*
+ * The walk reached file path with stat data st.  Returns true with its line count
+ * in *lines if the file is unchanged since it was last read for this needle.
+ */
+bool finder_index_lookup(struct finder_index *idx, const char *path, const struct stat *st,
+                         bool counted, unsigned long *lines);
+
+/* The walk read file path with stat data st and found lines matching lines */
+void finder_index_store(struct finder_index *idx, const char *path, const struct stat *st,
+                        bool counted, unsigned long lines);
+
+/* Drop what the walk did not see and count files and matching lines from the index */
+void finder_index_totals(struct finder_index *idx, unsigned long *files, unsigned long *lines);
+
+/* Save the index, unlock and free it.  Returns 0, or -1 if it could not be saved. */
+int finder_index_close(struct finder_index *idx);
+
+/*
+ * Watch root with inotify until killed, journalling every directory in which
+ * something changes for the queries that use index_path.  Returns only on error.
+ */
+int finder_index_watch(const char *index_path, const char *root);
+
+#endif /* FINDER_INDEX_H */
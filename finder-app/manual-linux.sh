@@ -144,7 +144,7 @@ cd "$OUTDIR/rootfs/dev"
 sudo mknod -m 666 null c 1 3
 sudo mknod -m 666 console c 5 1
 
-# Clean and build the writer utility for aarch64 (modified to be statically linked)
+# Clean and build the writer and finder utilities for aarch64 (modified to be statically linked)
 echo "Builder writer for target platform"
 cd ${FINDER_APP_DIR}
 make clean
@@ -156,6 +156,7 @@ echo "Copy finder-app assignment components to rootfs/home"
 cd "$OUTDIR/rootfs"
 mkdir -p home/conf
 cp ${FINDER_APP_DIR}/writer home/
+cp ${FINDER_APP_DIR}/finder home/
 cp ${FINDER_APP_DIR}/finder.sh home/
 cp ${FINDER_APP_DIR}/finder-test.sh home/
 cp ${FINDER_APP_DIR}/autorun-qemu.sh home/
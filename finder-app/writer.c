@@ -2,30 +2,357 @@
 // Author: Jordan Kooyman
 // Date Modified: 2026-01-19
 // Description: Simple CLI utility which will create a file at a given path and store the given string in that file
+//              With "-" as the only argument, reads a manifest from stdin instead and creates every file it lists
+//              -a replaces files atomically, -s makes them durable (fdatasync, batched in -)
 // Basic Code outline generated using ChatGPT: https://chatgpt.com/share/696e63d0-4afc-8007-833e-dc309149e77a
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
 #include <syslog.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
 
 #define EXIT_ERROR (1)
 
+#define SYNC_BATCH 64                // files written before one round of fdatasync
+
+/*
+ * Output modes:
+ *
+ * Default: each file is opened with O_TRUNC and written in place.
+ *
+ * Atomic (-a): the content is written to an unnamed O_TMPFILE in the target's
+ * directory and only then given its name with linkat(), or, when the target
+ * already exists, linked under a temporary name and renamed over it.  A
+ * reader opening the path sees the old file or the new one, never a
+ * truncated or partly written one.  File systems without O_TMPFILE get a
+ * named temporary file (".<name>.<pid>.<n>") and the rename.
+ *
+ * Durable (-s): file data is fdatasync()ed before the file is published, and
+ * the directory is fsync()ed after, so a published name survives a crash with
+ * its content.  Files are held in groups of up to SYNC_BATCH in the same
+ * directory, and each group is synced together, published together and
+ * followed by one directory fsync, rather than paying one journal commit
+ * after each file.
+ */
+struct pending {
+    int fd;
+    char *name;                 // final name in the directory
+    char *tmp_name;             // named temporary file, or NULL for O_TMPFILE
+    bool failed;
+};
+
+struct writer {
+    bool atomic;
+    bool sync;
+    char *dir_name;             // directory dir_fd refers to
+    int dir_fd;
+    struct pending group[SYNC_BATCH];
+    int ngroup;
+    unsigned long tmp_counter;
+};
+
+/* Open an unpublished file in the current directory; *tmp_name is set if it has a name */
+static int open_temp(struct writer *wr, const char *name, char **tmp_name)
+{
+    int fd;
+
+    *tmp_name = NULL;
+    fd = openat(wr->dir_fd, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+    if (fd >= 0)
+        return fd;
+    if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)
+        return -1;
+
+    // No O_TMPFILE on this file system
+    do {
+        free(*tmp_name);
+        if (asprintf(tmp_name, ".%s.%ld.%lu", name, (long)getpid(), wr->tmp_counter++) < 0) {
+            *tmp_name = NULL;
+            return -1;
+        }
+        fd = openat(wr->dir_fd, *tmp_name, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    } while (fd < 0 && errno == EEXIST);
+    if (fd < 0) {
+        free(*tmp_name);
+        *tmp_name = NULL;
+    }
+    return fd;
+}
+
+/* Give an O_TMPFILE a name in dir_fd; fails with EEXIST if the name is taken */
+static int link_tmpfile(int fd, int dir_fd, const char *name)
+{
+    char proc_path[64];
+
+    // By descriptor through /proc, as AT_EMPTY_PATH needs CAP_DAC_READ_SEARCH
+    snprintf(proc_path, sizeof(proc_path), "/proc/self/fd/%d", fd);
+    if (linkat(AT_FDCWD, proc_path, dir_fd, name, AT_SYMLINK_FOLLOW) == 0)
+        return 0;
+    if (errno != ENOENT)
+        return -1;
+    // No /proc mounted (a minimal rootfs); works when running as root
+    return linkat(fd, "", dir_fd, name, AT_EMPTY_PATH);
+}
+
+/* Give a written temporary file its final name */
+static int publish(struct writer *wr, struct pending *p)
+{
+    char *link_name = NULL;
+    int ret = -1;
+
+    if (p->tmp_name != NULL)
+        return renameat(wr->dir_fd, p->tmp_name, wr->dir_fd, p->name);
+
+    if (link_tmpfile(p->fd, wr->dir_fd, p->name) == 0)
+        return 0;
+    if (errno != EEXIST)
+        return -1;
+
+    // linkat() does not replace: link under a unique name, then rename over the target
+    do {
+        free(link_name);
+        if (asprintf(&link_name, ".%s.%ld.%lu", p->name, (long)getpid(), wr->tmp_counter++) < 0)
+            return -1;
+        ret = link_tmpfile(p->fd, wr->dir_fd, link_name);
+    } while (ret != 0 && errno == EEXIST);
+    if (ret == 0) {
+        ret = renameat(wr->dir_fd, link_name, wr->dir_fd, p->name);
+        if (ret != 0)
+            unlinkat(wr->dir_fd, link_name, 0);
+    }
+    free(link_name);
+    return ret;
+}
+
+/* Sync, publish and close the held group; returns how many of its files failed */
+static unsigned long writer_flush(struct writer *wr)
+{
+    unsigned long failed = 0;
+    int i;
+
+    // All of the group's data first, so no name is published ahead of its content
+    for (i = 0; i < wr->ngroup; i++)
+        wr->group[i].failed = wr->sync && fdatasync(wr->group[i].fd) != 0;
+
+    for (i = 0; i < wr->ngroup; i++) {
+        struct pending *p = &wr->group[i];
+
+        if (!p->failed && wr->atomic && publish(wr, p) != 0)
+            p->failed = true;
+        if (p->failed) {
+            fprintf(stderr, "Error writing %s: %s\n", p->name, strerror(errno));
+            syslog(LOG_ERR, "Error occured when writing file: %s", p->name);
+            if (p->tmp_name != NULL)
+                unlinkat(wr->dir_fd, p->tmp_name, 0);
+            failed++;
+        }
+        close(p->fd);
+        free(p->name);
+        free(p->tmp_name);
+    }
+    // The new names themselves are durable only once the directory is
+    if (wr->sync && wr->ngroup > 0 && fsync(wr->dir_fd) != 0) {
+        fprintf(stderr, "Error syncing directory %s: %s\n", wr->dir_name, strerror(errno));
+        syslog(LOG_ERR, "Error occured when syncing directory: %s", wr->dir_name);
+        // Now every file of the group has failed; count each one once
+        failed = wr->ngroup;
+    }
+    wr->ngroup = 0;
+    return failed;
+}
+
+/*
+ * Write content (already ending in its newline) to path, relative to a cached
+ * descriptor for its directory.  Returns the number of files that failed: the
+ * group held for -s is flushed when the directory changes.
+ */
+static unsigned long writer_file(struct writer *wr, char *path, const char *content, size_t len)
+{
+    unsigned long failed = 0;
+    struct pending *p;
+    char *tmp_name = NULL;
+    int fd;
+
+    /* Split into directory and file name, reusing the open directory */
+    char *slash = strrchr(path, '/');
+    const char *base = slash ? slash + 1 : path;
+    const char *dir = ".";
+    if (slash == path)
+        dir = "/";
+    else if (slash)
+        dir = path;
+    if (slash && slash != path)
+        *slash = '\0';
+    if (wr->dir_name == NULL || strcmp(wr->dir_name, dir) != 0) {
+        failed += writer_flush(wr);
+        if (wr->dir_fd >= 0)
+            close(wr->dir_fd);
+        free(wr->dir_name);
+        wr->dir_name = strdup(dir);
+        wr->dir_fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (wr->dir_fd < 0) {
+            fprintf(stderr, "Error opening directory %s: %s\n", dir, strerror(errno));
+            syslog(LOG_ERR, "Error occured when opening directory: %s", dir);
+        }
+    }
+    if (slash && slash != path)
+        *slash = '/';
+    if (wr->dir_fd < 0)
+        return failed + 1;
+
+    if (wr->atomic)
+        fd = open_temp(wr, base, &tmp_name);
+    else
+        fd = openat(wr->dir_fd, base, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error opening output file %s: %s\n", path, strerror(errno));
+        syslog(LOG_ERR, "Error occured when opening file: %s", path);
+        return failed + 1;
+    }
+    if (write(fd, content, len) != (ssize_t)len) {
+        fprintf(stderr, "Error writing %s\n", path);
+        syslog(LOG_ERR, "Error occured when writing file: %s", path);
+        if (tmp_name != NULL)
+            unlinkat(wr->dir_fd, tmp_name, 0);
+        free(tmp_name);
+        close(fd);
+        return failed + 1;
+    }
+
+    p = &wr->group[wr->ngroup++];
+    p->fd = fd;
+    p->name = strdup(base);
+    p->tmp_name = tmp_name;
+    if (p->name == NULL) {
+        // Nothing to publish it under
+        if (tmp_name != NULL)
+            unlinkat(wr->dir_fd, tmp_name, 0);
+        free(tmp_name);
+        close(fd);
+        wr->ngroup--;
+        return failed + 1;
+    }
+    if (!wr->sync || wr->ngroup == SYNC_BATCH)
+        failed += writer_flush(wr);
+    return failed;
+}
+
+static unsigned long writer_close(struct writer *wr)
+{
+    unsigned long failed = writer_flush(wr);
+
+    if (wr->dir_fd >= 0)
+        close(wr->dir_fd);
+    free(wr->dir_name);
+    return failed;
+}
+
+/*
+ * Batch mode: stdin holds pairs of lines, a path and then the string to write
+ * to it, e.g.
+ *     /tmp/aeld-data/user1.txt
+ *     AELD_IS_FUN
+ * Each file gets the string and a newline, as in single file mode.
+ *
+ * Everything happens in this one process.  Files are opened with openat()
+ * relative to a descriptor for their directory, which is kept open while
+ * consecutive paths share it, so the directory path is looked up once
+ * instead of once per file.  The line read for the string already ends in
+ * the newline, so each file takes a single unbuffered write().
+ */
+static int write_manifest(struct writer *wr)
+{
+    char *path = NULL, *content = NULL;
+    size_t path_size = 0, content_size = 0;
+    ssize_t path_len, content_len;
+    unsigned long files = 0, failed = 0;
+
+    while ((path_len = getline(&path, &path_size, stdin)) > 0) {
+        if (path[path_len - 1] == '\n')
+            path[--path_len] = '\0';
+        content_len = getline(&content, &content_size, stdin);
+        if (content_len < 0) {
+            fprintf(stderr, "Manifest ends without a string for '%s'\n", path);
+            syslog(LOG_ERR, "Manifest ends without a string for %s", path);
+            failed++;
+            break;
+        }
+        if (content[content_len - 1] != '\n') {
+            // Last line of the input without its newline; getline leaves room for one more byte
+            content[content_len++] = '\n';
+        }
+        failed += writer_file(wr, path, content, content_len);
+        files++;
+    }
+    failed += writer_close(wr);
+    free(path);
+    free(content);
+
+    syslog(LOG_DEBUG, "Wrote %lu files from manifest, %lu failed", files - failed, failed);
+    return failed ? EXIT_ERROR : EXIT_SUCCESS;
+}
+
 int main(int argc, char *argv[])
 {
 	openlog("writer", 0, LOG_USER);
 	
     FILE *writefile = NULL;
     char* writestr;
+    struct writer wr = { .dir_fd = -1 };
+    const char *prog = argv[0];
+
+    /* Options */
+    while (argc > 1 && (strcmp(argv[1], "-a") == 0 || strcmp(argv[1], "-s") == 0)) {
+        if (argv[1][1] == 'a')
+            wr.atomic = true;
+        else
+            wr.sync = true;
+        argv++;
+        argc--;
+    }
+
+    /* Batch mode */
+    if (argc == 2 && strcmp(argv[1], "-") == 0) {
+        int ret = write_manifest(&wr);
+        closelog();
+        return ret;
+    }
 
     /* Validate arguments */
     if (argc != 3) {
 		// Write error message to stderr stream
-        fprintf(stderr, "Usage: %s <writefile> <writestr>\n", argv[0]);
+        fprintf(stderr, "Usage: %s [-a] [-s] <writefile> <writestr>\n", prog);
+        fprintf(stderr, "       %s [-a] [-s] - < manifest (lines: writefile, writestr, ...)\n", prog);
+        fprintf(stderr, "  -a  replace files atomically\n  -s  sync files to disk before exiting\n");
         syslog(LOG_ERR, "Invalid number of arguments: expected 2 but got %d", (argc - 1));
         closelog();
         return EXIT_ERROR;
     }
 
+    if (wr.atomic || wr.sync) {
+        size_t len = strlen(argv[2]);
+        char *content = malloc(len + 1);
+        unsigned long failed;
+
+        if (content == NULL) {
+            closelog();
+            return EXIT_ERROR;
+        }
+        syslog(LOG_DEBUG, "Writing '%s' to '%s'", argv[2], argv[1]);
+        memcpy(content, argv[2], len);
+        content[len] = '\n';
+        failed = writer_file(&wr, argv[1], content, len + 1);
+        failed += writer_close(&wr);
+        free(content);
+        closelog();
+        return failed ? EXIT_ERROR : EXIT_SUCCESS;
+    }
+
 
     /* Open output file */
     writefile = fopen(argv[1], "w");
@@ -0,0 +1,678 @@
+/*
+ * aesdreplay.c - Replay an aesdsocket traffic capture against a server and
+ * report latency and throughput.
+ *
+ * Usage: aesdreplay [-h host] [-p port] [-s speed] capture-file
+ *
+ * The capture is written by "aesdsocket -c file" (format in capture.h).  Each
+ * recorded connection is replayed on its own connection and thread: it
+ * connects, sends every recorded chunk with the recorded boundaries, and
+ * closes, at the recorded offsets from the start of the capture divided by
+ * the speed factor.
+ *
+ *   -s 1     recorded pace (default)
+ *   -s N     N times faster (N may be fractional, e.g. 0.5 for half speed)
+ *   -s max   no pacing: each chunk is sent as soon as the responses to the
+ *            connection's previous packets have arrived (closed loop)
+ *
+ * Latency is time to first byte: from the send of the chunk that completed
+ * a packet to the first byte of its response.  Responses are told apart with
+ * the response sizes in the capture, so replay against a server that starts
+ * from the same backend content as the captured one (e.g. an empty data
+ * file).  Concurrent connections can still interleave differently than they
+ * did when captured, which changes the size of full readbacks: a response
+ * that goes quiet for REPLAY_QUIET_NS before reaching its recorded size is
+ * counted as short and the next bytes go to the next packet; bytes beyond
+ * the recorded size are counted as unexpected.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "capture.h"
+
+#define REPLAY_START_DELAY_NS 20000000ull  /* lead time before the first event */
+#define REPLAY_RESPONSE_TIMEOUT_NS 2000000000ull
+#define REPLAY_QUIET_NS 100000000ull  /* a started response idle this long has ended */
+#define REPLAY_RECV_SIZE (64 * 1024)
+#define REPLAY_THREAD_STACK (256 * 1024)
+
+struct replay_event {
+    uint64_t time_ns;
+    uint8_t type;
+    uint32_t length;
+    const unsigned char *payload;  /* DATA only, points into the mapped capture */
+};
+
+struct pending_response {
+    uint64_t sent_ns;
+    size_t remaining;
+    bool seen_first;
+};
+
+struct replay_conn {
+    uint32_t id;
+    struct replay_event *events;
+    size_t event_count;
+    size_t event_cap;
+    size_t response_count;  /* RESPONSE events with a non-zero size */
+    pthread_t thread;
+    bool started;
+    int done;               /* __atomic; set when the thread may be joined */
+
+    /* Runtime, owned by the connection thread */
+    int fd;
+    struct pending_response *pending;  /* FIFO of response_count slots */
+    size_t pending_head;
+    size_t pending_tail;
+    uint64_t last_send_ns;
+    uint64_t last_recv_ns;
+
+    /* Results */
+    uint64_t *latencies_ns;
+    size_t latency_count;
+    uint64_t bytes_sent;
+    uint64_t bytes_received;
+    uint64_t unexpected_bytes;
+    uint64_t responses;
+    uint64_t short_responses;
+    uint64_t incomplete;
+    bool failed;
+};
+
+static const char *target_host = "127.0.0.1";
+static const char *target_port = "9000";
+static double speed = 1.0;               /* 0 = max */
+static uint64_t replay_base_ns;          /* monotonic time of capture offset first_ns */
+static uint64_t capture_first_ns;
+static struct addrinfo *target_addr;
+
+static uint32_t get_be32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p)
+{
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* scheduled_ns - When an event recorded at time_ns is due in this replay */
+static uint64_t scheduled_ns(uint64_t time_ns)
+{
+    if (speed == 0)
+        return 0;
+    return replay_base_ns + (uint64_t)((double)(time_ns - capture_first_ns) / speed);
+}
+
+static void sleep_until(uint64_t when_ns)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = (time_t)(when_ns / 1000000000u);
+    ts.tv_nsec = (long)(when_ns % 1000000000u);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+/* ------------------------------------------------------------------ */
+/* Capture loading                                                     */
+/* ------------------------------------------------------------------ */
+
+static struct replay_conn **conn_by_id;  /* indexed by capture connection id */
+static size_t conn_by_id_cap;
+static struct replay_conn **conns;       /* in order of first appearance */
+static size_t conn_count;
+
+static struct replay_conn *conn_for_id(uint32_t id)
+{
+    struct replay_conn *rc;
+
+    if (id >= conn_by_id_cap) {
+        size_t cap = conn_by_id_cap ? conn_by_id_cap : 64;
+        struct replay_conn **grown;
+
+        while (cap <= id)
+            cap *= 2;
+        grown = realloc(conn_by_id, cap * sizeof(*grown));
+        if (!grown)
+            return NULL;
+        memset(grown + conn_by_id_cap, 0, (cap - conn_by_id_cap) * sizeof(*grown));
+        conn_by_id = grown;
+        conn_by_id_cap = cap;
+    }
+    if (conn_by_id[id])
+        return conn_by_id[id];
+
+    rc = calloc(1, sizeof(*rc));
+    if (!rc)
+        return NULL;
+    rc->id = id;
+    rc->fd = -1;
+    if (conn_count % 64 == 0) {
+        struct replay_conn **grown = realloc(conns, (conn_count + 64) * sizeof(*grown));
+        if (!grown) {
+            free(rc);
+            return NULL;
+        }
+        conns = grown;
+    }
+    conns[conn_count++] = rc;
+    conn_by_id[id] = rc;
+    return rc;
+}
+
+static int add_event(struct replay_conn *rc, const struct replay_event *ev)
+{
+    if (rc->event_count == rc->event_cap) {
+        size_t cap = rc->event_cap ? rc->event_cap * 2 : 16;
+        struct replay_event *grown = realloc(rc->events, cap * sizeof(*grown));
+        if (!grown)
+            return -1;
+        rc->events = grown;
+        rc->event_cap = cap;
+    }
+    rc->events[rc->event_count++] = *ev;
+    if (ev->type == CAPTURE_REC_RESPONSE && ev->length > 0)
+        rc->response_count++;
+    return 0;
+}
+
+/*
+ * load_capture - Map the capture and split it into per-connection event
+ * lists.  A truncated final record (capture cut short) is ignored.
+ */
+static int load_capture(const char *path)
+{
+    const unsigned char *map, *p, *end;
+    struct stat st;
+    int fd;
+    bool first = true;
+
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1 || fstat(fd, &st) == -1) {
+        fprintf(stderr, "aesdreplay: %s: %s\n", path, strerror(errno));
+        if (fd != -1)
+            close(fd);
+        return -1;
+    }
+    if ((size_t)st.st_size < CAPTURE_FILE_HDR_SIZE) {
+        fprintf(stderr, "aesdreplay: %s: not a capture file\n", path);
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "aesdreplay: mmap %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    if (memcmp(map, CAPTURE_MAGIC, 8) != 0 || get_be32(map + 8) != CAPTURE_VERSION) {
+        fprintf(stderr, "aesdreplay: %s: not a version %d capture file\n",
+                path, CAPTURE_VERSION);
+        return -1;
+    }
+
+    p = map + CAPTURE_FILE_HDR_SIZE;
+    end = map + st.st_size;
+    while ((size_t)(end - p) >= CAPTURE_REC_HDR_SIZE) {
+        struct replay_event ev;
+        struct replay_conn *rc;
+        uint32_t conn_id;
+        size_t payload;
+
+        ev.time_ns = get_be64(p);
+        conn_id    = get_be32(p + 8);
+        ev.type    = p[12];
+        ev.length  = get_be32(p + 16);
+        payload    = ev.type == CAPTURE_REC_DATA ? ev.length : 0;
+        if ((size_t)(end - p) - CAPTURE_REC_HDR_SIZE < payload) {
+            fprintf(stderr, "aesdreplay: ignoring truncated last record\n");
+            break;
+        }
+        ev.payload = payload ? p + CAPTURE_REC_HDR_SIZE : NULL;
+        p += CAPTURE_REC_HDR_SIZE + payload;
+
+        if (ev.type < CAPTURE_REC_OPEN || ev.type > CAPTURE_REC_CLOSE) {
+            fprintf(stderr, "aesdreplay: unknown record type %u\n", ev.type);
+            return -1;
+        }
+        if (first) {
+            capture_first_ns = ev.time_ns;
+            first = false;
+        }
+        rc = conn_for_id(conn_id);
+        if (!rc || add_event(rc, &ev) == -1) {
+            fprintf(stderr, "aesdreplay: out of memory\n");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* ------------------------------------------------------------------ */
+/* Connection threads                                                  */
+/* ------------------------------------------------------------------ */
+
+static bool pending_empty(const struct replay_conn *rc)
+{
+    return rc->pending_head == rc->pending_tail;
+}
+
+static void record_latency(struct replay_conn *rc, uint64_t ns)
+{
+    rc->latencies_ns[rc->latency_count++] = ns;
+}
+
+/*
+ * account_received - Attribute n bytes that arrived at now_ns to the oldest
+ * outstanding responses.
+ */
+static void account_received(struct replay_conn *rc, size_t n, uint64_t now_ns)
+{
+    rc->bytes_received += n;
+    rc->last_recv_ns = now_ns;
+    while (n > 0) {
+        struct pending_response *pr;
+        size_t take;
+
+        if (pending_empty(rc)) {
+            rc->unexpected_bytes += n;
+            return;
+        }
+        pr = &rc->pending[rc->pending_head];
+        if (!pr->seen_first) {
+            record_latency(rc, now_ns - pr->sent_ns);
+            pr->seen_first = true;
+        }
+        take = n < pr->remaining ? n : pr->remaining;
+        pr->remaining -= take;
+        n -= take;
+        if (pr->remaining == 0) {
+            rc->pending_head++;
+            rc->responses++;
+        }
+    }
+}
+
+/*
+ * pump - Read responses until deadline_ns, or until nothing is outstanding
+ * when until_idle is set.  Returns -1 when the server closed or failed the
+ * connection.
+ */
+static int pump(struct replay_conn *rc, uint64_t deadline_ns, bool until_idle)
+{
+    char buf[REPLAY_RECV_SIZE];
+
+    for (;;) {
+        struct pollfd pfd = { rc->fd, POLLIN, 0 };
+        struct timespec ts;
+        uint64_t now = monotonic_ns();
+        uint64_t wake = deadline_ns;
+        ssize_t n;
+
+        if (!pending_empty(rc) && rc->pending[rc->pending_head].seen_first) {
+            uint64_t quiet_end = rc->last_recv_ns + REPLAY_QUIET_NS;
+            if (now >= quiet_end) {
+                rc->pending_head++;  /* shorter than recorded */
+                rc->short_responses++;
+                continue;
+            }
+            if (quiet_end < wake)
+                wake = quiet_end;
+        }
+        if (until_idle && pending_empty(rc))
+            return 0;
+        if (now >= deadline_ns)
+            return 0;
+        ts.tv_sec  = (time_t)((wake - now) / 1000000000u);
+        ts.tv_nsec = (long)((wake - now) % 1000000000u);
+        if (ppoll(&pfd, 1, &ts, NULL) <= 0)
+            continue;
+
+        n = recv(rc->fd, buf, sizeof(buf), 0);
+        if (n > 0) {
+            account_received(rc, (size_t)n, monotonic_ns());
+        } else if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            return -1;
+        }
+    }
+}
+
+/*
+ * send_chunk - Send one recorded chunk on the non-blocking socket, reading
+ * responses while the send buffer is full so neither side can stall the
+ * other.
+ */
+static int send_chunk(struct replay_conn *rc, const unsigned char *data, size_t len)
+{
+    char buf[REPLAY_RECV_SIZE];
+    size_t sent = 0;
+
+    while (sent < len) {
+        ssize_t n = send(rc->fd, data + sent, len - sent, MSG_NOSIGNAL);
+        if (n > 0) {
+            sent += (size_t)n;
+            continue;
+        }
+        if (n == -1 && errno != EAGAIN && errno != EINTR)
+            return -1;
+
+        struct pollfd pfd = { rc->fd, POLLIN | POLLOUT, 0 };
+        if (poll(&pfd, 1, -1) > 0 && (pfd.revents & POLLIN)) {
+            n = recv(rc->fd, buf, sizeof(buf), 0);
+            if (n > 0)
+                account_received(rc, (size_t)n, monotonic_ns());
+            else if (n == 0 || (errno != EAGAIN && errno != EINTR))
+                return -1;
+        }
+    }
+    rc->bytes_sent += len;
+    rc->last_send_ns = monotonic_ns();
+    return 0;
+}
+
+static int replay_connect(struct replay_conn *rc)
+{
+    int one = 1;
+
+    rc->fd = socket(target_addr->ai_family, SOCK_STREAM | SOCK_CLOEXEC,
+                    target_addr->ai_protocol);
+    if (rc->fd == -1)
+        return -1;
+    if (connect(rc->fd, target_addr->ai_addr, target_addr->ai_addrlen) == -1)
+        return -1;
+    setsockopt(rc->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return fcntl(rc->fd, F_SETFL, fcntl(rc->fd, F_GETFL) | O_NONBLOCK);
+}
+
+/* wait_responses - Drain outstanding responses, giving up after the timeout */
+static int wait_responses(struct replay_conn *rc)
+{
+    return pump(rc, monotonic_ns() + REPLAY_RESPONSE_TIMEOUT_NS, true);
+}
+
+static void *conn_thread(void *arg)
+{
+    struct replay_conn *rc = arg;
+    size_t i;
+
+    rc->pending = calloc(rc->response_count + 1, sizeof(*rc->pending));
+    rc->latencies_ns = malloc((rc->response_count + 1) * sizeof(*rc->latencies_ns));
+    if (!rc->pending || !rc->latencies_ns) {
+        rc->failed = true;
+        goto out;
+    }
+
+    for (i = 0; i < rc->event_count && !rc->failed; i++) {
+        const struct replay_event *ev = &rc->events[i];
+
+        switch (ev->type) {
+        case CAPTURE_REC_OPEN:
+            if (rc->fd == -1 && replay_connect(rc) == -1) {
+                fprintf(stderr, "aesdreplay: connection %u: connect: %s\n",
+                        rc->id, strerror(errno));
+                rc->failed = true;
+            }
+            break;
+        case CAPTURE_REC_DATA:
+            if (rc->fd == -1)
+                break;  /* capture started while this connection was open */
+            if ((speed == 0 ? wait_responses(rc)
+                            : pump(rc, scheduled_ns(ev->time_ns), false)) == -1 ||
+                send_chunk(rc, ev->payload, ev->length) == -1) {
+                fprintf(stderr, "aesdreplay: connection %u: closed by server\n", rc->id);
+                rc->failed = true;
+            }
+            break;
+        case CAPTURE_REC_RESPONSE:
+            if (rc->fd == -1)
+                break;
+            if (ev->length == 0) {
+                rc->responses++;
+                break;
+            }
+            rc->pending[rc->pending_tail].sent_ns = rc->last_send_ns;
+            rc->pending[rc->pending_tail].remaining = ev->length;
+            rc->pending[rc->pending_tail].seen_first = false;
+            rc->pending_tail++;
+            break;
+        case CAPTURE_REC_CLOSE:
+            if (rc->fd != -1 && speed != 0)
+                pump(rc, scheduled_ns(ev->time_ns), false);
+            break;
+        }
+    }
+
+    if (rc->fd != -1) {
+        if (!rc->failed)
+            wait_responses(rc);
+        close(rc->fd);
+    }
+    rc->incomplete = rc->pending_tail - rc->pending_head;
+out:
+    __atomic_store_n(&rc->done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/* ------------------------------------------------------------------ */
+/* Report                                                              */
+/* ------------------------------------------------------------------ */
+
+static int compare_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const uint64_t *sorted, size_t n, double pct)
+{
+    size_t idx;
+
+    if (n == 0)
+        return 0;
+    idx = (size_t)(pct / 100.0 * (double)(n - 1) + 0.5);
+    return (double)sorted[idx] / 1000.0;
+}
+
+/*
+ * report - Print the summary.  Elapsed time runs from start_ns to the last
+ * byte sent or received, so waiting out responses that never came does not
+ * dilute the throughput figures.
+ */
+static void report(uint64_t start_ns)
+{
+    uint64_t last_ns = start_ns;
+    double elapsed_s;
+    uint64_t sent = 0, received = 0, unexpected = 0, responses = 0, incomplete = 0;
+    uint64_t short_responses = 0;
+    uint64_t *all;
+    size_t total = 0, n = 0, failed = 0, i;
+    double sum_us = 0;
+
+    for (i = 0; i < conn_count; i++)
+        total += conns[i]->latency_count;
+    all = malloc((total + 1) * sizeof(*all));
+
+    for (i = 0; i < conn_count; i++) {
+        struct replay_conn *rc = conns[i];
+        sent       += rc->bytes_sent;
+        received   += rc->bytes_received;
+        unexpected += rc->unexpected_bytes;
+        responses  += rc->responses;
+        short_responses += rc->short_responses;
+        incomplete += rc->incomplete;
+        failed     += rc->failed;
+        if (rc->last_send_ns > last_ns)
+            last_ns = rc->last_send_ns;
+        if (rc->last_recv_ns > last_ns)
+            last_ns = rc->last_recv_ns;
+        if (all && rc->latency_count) {
+            memcpy(all + n, rc->latencies_ns, rc->latency_count * sizeof(*all));
+            n += rc->latency_count;
+        }
+    }
+    for (i = 0; i < n; i++)
+        sum_us += (double)all[i] / 1000.0;
+    if (all)
+        qsort(all, n, sizeof(*all), compare_u64);
+    elapsed_s = (double)(last_ns - start_ns) / 1e9;
+
+    if (speed == 0)
+        printf("speed:       max\n");
+    else
+        printf("speed:       %gx\n", speed);
+    printf("connections: %zu (%zu failed)\n", conn_count, failed);
+    printf("elapsed:     %.3f s\n", elapsed_s);
+    printf("packets:     %" PRIu64 " answered, %" PRIu64 " short, %" PRIu64 " incomplete\n",
+           responses, short_responses, incomplete);
+    printf("throughput:  %.1f packets/s, sent %.3f MB/s, received %.3f MB/s\n",
+           elapsed_s > 0 ? (double)responses / elapsed_s : 0,
+           elapsed_s > 0 ? (double)sent / 1e6 / elapsed_s : 0,
+           elapsed_s > 0 ? (double)received / 1e6 / elapsed_s : 0);
+    printf("bytes:       sent %" PRIu64 ", received %" PRIu64 " (%" PRIu64 " unexpected)\n",
+           sent, received, unexpected);
+    if (n > 0 && all)
+        printf("latency us:  mean %.1f  p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+               sum_us / (double)n, percentile_us(all, n, 50), percentile_us(all, n, 90),
+               percentile_us(all, n, 99), percentile_us(all, n, 99.9),
+               (double)all[n - 1] / 1000.0);
+    free(all);
+}
+
+static void print_usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-h host] [-p port] [-s speed] capture-file\n", prog);
+    fprintf(stderr, "  -h host   Server address (default %s)\n", target_host);
+    fprintf(stderr, "  -p port   Server port (default %s)\n", target_port);
+    fprintf(stderr, "  -s speed  1 = recorded pace (default), N = N times faster,\n"
+                    "            max = next packet as soon as the previous was answered\n");
+}
+
+int main(int argc, char *argv[])
+{
+    struct addrinfo hints;
+    pthread_attr_t attr;
+    const char *path = NULL;
+    size_t i, joined = 0;
+    uint64_t start_ns;
+    bool failed = false;
+    int rc, argi;
+
+    for (argi = 1; argi < argc; argi++) {
+        if (strcmp(argv[argi], "-h") == 0 && argi + 1 < argc) {
+            target_host = argv[++argi];
+        } else if (strcmp(argv[argi], "-p") == 0 && argi + 1 < argc) {
+            target_port = argv[++argi];
+        } else if (strcmp(argv[argi], "-s") == 0 && argi + 1 < argc) {
+            char *endptr;
+            argi++;
+            if (strcmp(argv[argi], "max") == 0) {
+                speed = 0;
+            } else {
+                speed = strtod(argv[argi], &endptr);
+                if (*endptr != '\0' || !(speed > 0)) {
+                    print_usage(argv[0]);
+                    return EXIT_FAILURE;
+                }
+            }
+        } else if (argv[argi][0] != '-' && !path) {
+            path = argv[argi];
+        } else {
+            print_usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    if (!path) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    rc = getaddrinfo(target_host, target_port, &hints, &target_addr);
+    if (rc != 0) {
+        fprintf(stderr, "aesdreplay: %s:%s: %s\n", target_host, target_port, gai_strerror(rc));
+        return EXIT_FAILURE;
+    }
+
+    if (load_capture(path) == -1)
+        return EXIT_FAILURE;
+    if (conn_count == 0) {
+        fprintf(stderr, "aesdreplay: %s holds no connections\n", path);
+        return EXIT_FAILURE;
+    }
+
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, REPLAY_THREAD_STACK);
+
+    /*
+     * Connections are launched at their first event, in capture order, and
+     * joined as they finish, so a long capture never holds a thread per
+     * connection it ever saw.
+     */
+    start_ns = monotonic_ns();
+    replay_base_ns = start_ns + REPLAY_START_DELAY_NS;
+    for (i = 0; i < conn_count; i++) {
+        struct replay_conn *c = conns[i];
+
+        if (speed != 0)
+            sleep_until(scheduled_ns(c->events[0].time_ns));
+        rc = pthread_create(&c->thread, &attr, conn_thread, c);
+        if (rc != 0) {
+            /* pthread_create returns its error and leaves errno alone */
+            fprintf(stderr, "aesdreplay: pthread_create: %s\n", strerror(rc));
+            c->failed = true;
+            __atomic_store_n(&c->done, 1, __ATOMIC_RELEASE);
+        } else {
+            c->started = true;
+        }
+        while (joined < i && __atomic_load_n(&conns[joined]->done, __ATOMIC_ACQUIRE)) {
+            if (conns[joined]->started)
+                pthread_join(conns[joined]->thread, NULL);
+            joined++;
+        }
+    }
+    for (; joined < conn_count; joined++) {
+        if (conns[joined]->started)
+            pthread_join(conns[joined]->thread, NULL);
+    }
+    pthread_attr_destroy(&attr);
+
+    report(speed != 0 ? replay_base_ns : start_ns);
+
+    for (i = 0; i < conn_count; i++)
+        failed |= conns[i]->failed;
+    freeaddrinfo(target_addr);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -3,8 +3,9 @@
  * Enhanced with thread management and timestamps (optional)
  *
  * Features:
- * - Listens on port 9000 for TCP connections
+ * - Listens on port 9000 (-p) for TCP connections
  * - Receives data until newline, appends to either /var/tmp/aesdsocketdata or /dev/aesdchar
+ *   (-o selects another file or device)
  * - Returns entire file content after each complete packet
  * - Supports daemon mode with -d flag
  * - Supports multiple simultaneous socket connections with threads
@@ -12,6 +13,24 @@
  * - Includes timestamps written to output file every 10 seconds (disabled when using /dev/aesdchar)
  * - Build switch USE_AESD_CHAR_DEVICE (default 1) redirects I/O to the AESD character driver
  * - Supports AESDCHAR_IOCSEEKTO:X,Y socket command to seek via ioctl before reading
+ * - AESD_TAIL:n, AESD_RANGE:a,b and AESD_GREP:pattern return only the selected
+ *   lines (both backends)
+ * - Large responses are sent with MSG_ZEROCOPY (threshold set with -z)
+ * - Listening socket optionally uses TCP_DEFER_ACCEPT (-a) and TCP Fast Open (-f)
+ * - Optional server-wide memory budget (-m) with per-connection accounting;
+ *   SIGUSR1 logs current usage
+ * - Seek results are cached until the next write to the device
+ * - Leader/follower replication: a primary (-P) streams its writes to
+ *   followers (-R), which apply them locally and serve reads (replication.c)
+ * - Optional sharding across several files/devices (repeated -o), routed by a
+ *   "key|" packet prefix or the client address, each with its own lock
+ * - AESD_COMPRESS:lz4 switches a connection to LZ4-framed responses; the
+ *   compressed full readback is cached per shard until the next write
+ * - Optional capture of the inbound traffic (-c) for replay with aesdreplay
+ * - Optional coroutine mode (-C n): connections run as coroutines on n epoll
+ *   scheduler threads instead of a thread each (coroutine.c)
+ * - Idle connections are parked without a thread or buffer (idlepark.c) and
+ *   time out after an idle period adapted to each client, capped by -i
  *
  *  Version 1 Code: https://chat.deepseek.com/share/92ytxo7wnlhuiigbbf
  *  Version 2 Code (this): https://chat.deepseek.com/share/qtyyz0zhqx67gk3lir
@@ -58,7 +77,9 @@
 #include <sys/sendfile.h>
 #include <sys/ioctl.h>
 #include <syslog.h>
+#include <poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>  /* TCP_DEFER_ACCEPT, TCP_FASTOPEN */
 #include <arpa/inet.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -67,6 +88,16 @@
 #include <stdint.h>
 #include <time.h>
 #include <limits.h>  /* UINT32_MAX */
+#include <regex.h>   /* AESD_GREP */
+#include <sys/epoll.h>     /* EPOLLIN/EPOLLOUT for coro_wait_fd */
+#include <sys/mman.h>      /* staged packets (chardev_stream_end) */
+#include <linux/errqueue.h>  /* struct sock_extended_err, SO_EE_ORIGIN_ZEROCOPY */
+
+#include "replication.h"
+#include "lz4frame.h"
+#include "capture.h"
+#include "coroutine.h"
+#include "idlepark.h"
 
 /* ==================== Build Configuration ==================== */
 #ifndef USE_AESD_CHAR_DEVICE
@@ -135,6 +166,29 @@
  * maintenance hazard where the count could silently diverge from the string.
  */
 #define SEEKTO_CMD_PREFIX "AESDCHAR_IOCSEEKTO:"
+
+/*
+ * Query command prefixes, available with both backends.  Lines are numbered
+ * from 0 in the current backend content, matching write_cmd in seekto.
+ *   AESD_TAIL:n        the last n lines
+ *   AESD_RANGE:a,b     lines a..b inclusive
+ *   AESD_GREP:pattern  lines matching a POSIX extended regular expression
+ * A query that selects nothing (AESD_TAIL:0, a range past the end, no match,
+ * an empty backend) is answered with QUERY_EMPTY_RESPONSE, a single empty
+ * line, so the client does not wait for a response that never comes.
+ */
+#define TAIL_CMD_PREFIX  "AESD_TAIL:"
+#define RANGE_CMD_PREFIX "AESD_RANGE:"
+#define GREP_CMD_PREFIX  "AESD_GREP:"
+#define QUERY_FLUSH_SIZE (64 * 1024)  /* grep sends matches in chunks of this size */
+#define QUERY_EMPTY_RESPONSE "\n"
+
+/*
+ * AESD_COMPRESS:lz4 / AESD_COMPRESS:none - per-connection response encoding.
+ * The "OK <codec>\n" reply is sent uncompressed; every response after it uses
+ * the new encoding.
+ */
+#define COMPRESS_CMD_PREFIX "AESD_COMPRESS:"
 /* ============================================================= */
 
 /* Configuration constants */
@@ -143,6 +197,131 @@
 #define MAX_PACKET_SIZE (10 * 1024 * 1024)
 #define TIMESTAMP_INTERVAL 10 /* seconds (only used when !USE_AESD_CHAR_DEVICE) */
 #define ACCEPT_RETRY_DELAY_MS 100  /* delay after accept() errors like EMFILE */
+#define CLIENT_TIMEOUT_SEC 5       /* SO_RCVTIMEO / SO_SNDTIMEO on client sockets */
+/*
+ * Char-device packets that grow past this many bytes without a newline are
+ * staged in a per-connection file under STREAM_STAGING_DIR chunk by chunk
+ * instead of being assembled in packet_buffer, and written to the driver once
+ * complete.  It must be at least as long as the longest command prefix so a
+ * command is always recognised before streaming could start.
+ */
+#define STREAM_WINDOW_SIZE (4 * RECV_BUFFER_SIZE)
+#define STREAM_STAGING_DIR "/var/tmp"
+/* A staged packet reaches the driver in writes of at most this many bytes */
+#define STREAM_COMMIT_CHUNK (64 * 1024)
+/* packet_buffer grown beyond this by one packet is shrunk again afterwards */
+#define PACKET_BUFFER_RETAIN_SIZE (64 * 1024)
+
+/*
+ * ==================== Idle connections ====================
+ * Between packets a connection first waits up to IDLE_PARK_GRACE_MS for the
+ * next one, keeping its thread (or coroutine) and packet_buffer.  If the
+ * client stays quiet, the buffer goes back to the packet pool and the
+ * connection is parked (idlepark.c): the thread or coroutine ends, and the
+ * parker resumes the connection on a new one when the client sends again.
+ *
+ * Each connection's idle timeout follows its own pace: IDLE_TIMEOUT_GAP_FACTOR
+ * times the smoothed pause between its packets, at least CLIENT_TIMEOUT_SEC
+ * and at most idle_timeout_sec (-i).  Until a first pause has been seen the
+ * maximum applies, so a subscriber that polls once a minute is not cut off
+ * before its first poll.  Partly received packets and sends keep the fixed
+ * CLIENT_TIMEOUT_SEC.
+ */
+#define IDLE_PARK_GRACE_MS 200
+#define IDLE_TIMEOUT_GAP_FACTOR 4
+#ifndef IDLE_TIMEOUT_SEC_DEFAULT
+#define IDLE_TIMEOUT_SEC_DEFAULT 300
+#endif
+#define PACKET_POOL_MAX 256  /* idle RECV_BUFFER_SIZE buffers kept for reuse */
+/* ========================================================== */
+
+/*
+ * ==================== Zero-copy send configuration ====================
+ * Responses of at least zerocopy_threshold bytes are sent with MSG_ZEROCOPY
+ * so the kernel pins the user pages instead of copying them into socket
+ * buffers.  The default can be overridden at build time or with -z on the
+ * command line; a threshold of 0 disables zero-copy entirely.
+ *
+ * Older C libraries do not define the flags; the copy path is used then.
+ */
+#ifndef ZEROCOPY_THRESHOLD_DEFAULT
+#define ZEROCOPY_THRESHOLD_DEFAULT (64 * 1024)  /* below this, copying is cheaper */
+#endif
+/* How long parking or closing waits for outstanding completions */
+#define ZEROCOPY_REAP_TIMEOUT_MS (CLIENT_TIMEOUT_SEC * 1000)
+
+#if defined(SO_ZEROCOPY) && defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define HAVE_MSG_ZEROCOPY 1
+#else
+#define HAVE_MSG_ZEROCOPY 0
+#endif
+/* ====================================================================== */
+
+/*
+ * ==================== Listening socket options ====================
+ * Every client speaks first (a line, then waits for the dump), so nothing is
+ * lost by letting the kernel hold a connection until data arrives:
+ *
+ * TCP_DEFER_ACCEPT: accept4() only returns once the first data segment has
+ *   arrived (or the timeout expires), so a connection thread is never created
+ *   just to block in recv().  Default off, because a connection that never
+ *   sends is then invisible to the server (not logged, not counted) for the
+ *   whole timeout; enable with -a secs.
+ * TCP_FASTOPEN: a client with a cached TFO cookie may carry its first packet
+ *   in the SYN, saving a round trip for short request/response clients.  The
+ *   value is the queue length for pending TFO requests.  Default off; enable
+ *   with -f qlen (also requires bit 2 of net.ipv4.tcp_fastopen).
+ */
+#ifndef DEFER_ACCEPT_SEC_DEFAULT
+#define DEFER_ACCEPT_SEC_DEFAULT 0
+#endif
+#ifndef FASTOPEN_QLEN_DEFAULT
+#define FASTOPEN_QLEN_DEFAULT 0
+#endif
+/* ================================================================== */
+
+/*
+ * ==================== Memory budget ====================
+ * Receive buffers (packet_buffer) and readback buffers (read_entire_file) are
+ * charged to a per-connection mem_account and to a server-wide total.  When a
+ * charge would push the total past mem_budget:
+ *   - the largest consumer is rejected outright (its connection is closed);
+ *   - any other connection pauses, i.e. stops reading so TCP backpressure
+ *     holds the peer, for up to MEM_PAUSE_TIMEOUT_MS waiting for memory to be
+ *     released, and is rejected if none becomes available.
+ * A budget of 0 (the default) disables enforcement; usage is still tracked
+ * and reported on SIGUSR1.
+ */
+#ifndef MEM_BUDGET_DEFAULT
+#define MEM_BUDGET_DEFAULT 0  /* bytes; 0 = unlimited */
+#endif
+#define MEM_PAUSE_TIMEOUT_MS 2000
+#define MEM_PAUSE_POLL_MS 10  /* coroutines re-check the budget this often */
+/* ======================================================== */
+
+/*
+ * Number of distinct (write_cmd, write_cmd_offset) seek results kept between
+ * writes.  Clients tend to poll a handful of positions, so a small table is
+ * enough; 0 disables the cache.
+ */
+#ifndef SEEK_CACHE_SLOTS
+#define SEEK_CACHE_SLOTS 16
+#endif
+
+/*
+ * Packets are routed to one of up to MAX_SHARDS backends (one per -o).  A
+ * packet that starts with "key|" goes to the shard its key hashes to; any
+ * other packet (including socket commands) goes to the connection's current
+ * shard: the shard of its last keyed packet, initially chosen by hashing the
+ * client address.  Only the first SHARD_KEY_MAX bytes are searched for the
+ * delimiter.  The "key|" prefix only routes: it is not written to the
+ * backend, so a readback never contains it.
+ */
+#ifndef MAX_SHARDS
+#define MAX_SHARDS 16
+#endif
+#define SHARD_KEY_DELIM '|'
+#define SHARD_KEY_MAX 64
 
 /* Thread node for linked list */
 struct thread_node {
@@ -157,12 +336,103 @@ struct thread_node {
 struct thread_args {
     int client_fd;
     struct sockaddr_in client_addr;
+    struct connection_ctx *resume;  /* parked connection to continue, or NULL */
+};
+
+/*
+ * Memory charged on behalf of one connection.  Accounts are linked into
+ * mem_accounts while registered so the largest consumer can be found and
+ * reported.  All fields are protected by mem_mutex.
+ */
+struct mem_account {
+    size_t used;
+    const char *owner;          /* client address, for the usage report */
+    struct mem_account *next;
+};
+
+/*
+ * Per-connection state owned by connection_handler and passed down to the
+ * packet handlers and send_to_client().
+ *
+ * zc_issued / zc_completed count MSG_ZEROCOPY send() calls.  The kernel
+ * numbers them per socket starting at 0 and reports completions as
+ * inclusive [lo, hi] ranges on the socket error queue.  zc_pending holds a
+ * reference to every buffer a zero-copy send still uses, oldest first; each
+ * is released once zc_completed has passed its last send (zerocopy_collect).
+ */
+struct zc_pending {
+    struct zc_pending *next;
+    struct shared_buf *sb;
+    uint32_t last_send;      /* zc number of the buffer's last MSG_ZEROCOPY send */
+};
+
+struct connection_ctx {
+    int client_fd;
+    char client_ip[INET_ADDRSTRLEN];
+    struct mem_account mem;  /* receive + readback buffers of this connection */
+    bool zerocopy;           /* SO_ZEROCOPY accepted and still worthwhile */
+    uint32_t zc_issued;
+    uint32_t zc_completed;
+    struct zc_pending *zc_pending;  /* buffers the kernel may still read, or NULL */
+    struct shard *shard;     /* backend of the current packet (see route_packet) */
+    bool compress;           /* AESD_COMPRESS:lz4 negotiated: responses are LZ4 frames */
+    uint32_t capture_id;     /* -c connection id, 0 when not capturing */
+    size_t bytes_sent;       /* response bytes since the last capture_response */
+    uint64_t idle_since_ms;  /* monotonic time the last packet completed, 0 before */
+    uint32_t gap_ewma_ms;    /* smoothed pause between packets (idle_timeout_ms) */
+    bool gap_seen;           /* gap_ewma_ms holds at least one sample */
+#if USE_AESD_CHAR_DEVICE
+    int stream_fd;           /* staging file while a large packet streams, else -1 */
+    size_t stream_size;      /* bytes of the current packet already staged */
+#endif
+};
+
+/* Reference-counted cached response (seek results, compressed snapshots) */
+struct shared_buf {
+    unsigned int refs;   /* __atomic; the buffer is freed when it drops to 0 */
+    size_t size;
+    char *data;
+    struct mem_account *acct;
+};
+
+#if USE_AESD_CHAR_DEVICE
+struct seek_cache_entry {
+    struct shared_buf *buf;  /* NULL when the slot is empty */
+    uint64_t generation;
+    uint32_t write_cmd;
+    uint32_t write_cmd_offset;
+};
+#endif
+
+/*
+ * One backend file or device node.  file_mutex serialises every open/write/
+ * read/ioctl sequence on data_file, exactly as the single global lock did
+ * before sharding; separate shards therefore never contend with each other
+ * (nor, for separate device nodes, on the driver's per-device mutex).
+ */
+struct shard {
+    const char *data_file;
+    pthread_mutex_t file_mutex;
+    uint64_t generation;       /* bumped by every write; protected by file_mutex */
+    struct shared_buf *lz4_snapshot;  /* compressed full readback, or NULL */
+    uint64_t lz4_generation;          /* generation lz4_snapshot was taken at */
+    unsigned long lz4_hits;
+    unsigned long lz4_misses;
+#if USE_AESD_CHAR_DEVICE
+#if SEEK_CACHE_SLOTS > 0
+    struct seek_cache_entry seek_cache[SEEK_CACHE_SLOTS];  /* protected by file_mutex */
+    unsigned int seek_cache_next;  /* round-robin replacement cursor */
+    unsigned long seek_cache_hits;
+    unsigned long seek_cache_misses;
+#endif
+#endif
 };
 
 /* Global variables */
 static volatile sig_atomic_t shutdown_requested = 0;
 static int server_fd = -1;
-static pthread_mutex_t file_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct shard shards[MAX_SHARDS];
+static unsigned int shard_count = 0;  /* set from -o in main(); at least 1 */
 static pthread_mutex_t thread_list_mutex = PTHREAD_MUTEX_INITIALIZER;
 static struct thread_node *thread_list_head = NULL;
 
@@ -174,7 +444,29 @@ static pthread_mutex_t timestamp_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t timestamp_cond = PTHREAD_COND_INITIALIZER;
 #endif
 
+static volatile sig_atomic_t stats_requested = 0;
 static bool daemon_mode = false;
+static size_t listen_port = PORT;
+static size_t zerocopy_threshold = ZEROCOPY_THRESHOLD_DEFAULT;
+static size_t defer_accept_sec = DEFER_ACCEPT_SEC_DEFAULT;
+static size_t fastopen_qlen = FASTOPEN_QLEN_DEFAULT;
+static size_t repl_listen_port = 0;        /* -P: serve followers; 0 = off */
+static char repl_upstream_host[256];       /* -R host:port: follow a primary */
+static size_t repl_upstream_port = 0;
+static const char *capture_path = NULL;    /* -c: record inbound traffic */
+static size_t coroutine_schedulers = 0;    /* -C: 0 = a thread per connection */
+static size_t idle_timeout_sec = IDLE_TIMEOUT_SEC_DEFAULT;  /* -i: idle timeout cap */
+static pthread_attr_t connection_thread_attr;
+
+/* Memory budget state (see mem_charge) */
+static pthread_mutex_t mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t mem_cond = PTHREAD_COND_INITIALIZER;
+static struct mem_account *mem_accounts = NULL;
+static size_t mem_budget = MEM_BUDGET_DEFAULT;
+static size_t mem_used = 0;
+static size_t mem_peak = 0;
+static unsigned long mem_pauses = 0;
+static unsigned long mem_rejects = 0;
 
 /* ---- Forward declarations ---- */
 static void signal_handler(int signal);
@@ -182,10 +474,11 @@ static int setup_signal_handlers(void);
 static int setup_server_socket(void);
 static void cleanup_resources(void);
 static void *connection_handler(void *arg);
+static void serve_connection(void *arg);
 static int run_as_daemon(void);
 static void add_thread_to_list(pthread_t thread_id, int client_fd,
                                struct sockaddr_in *client_addr);
-static void remove_thread_from_list(pthread_t thread_id);
+static bool remove_thread_from_list(pthread_t thread_id);
 static void wait_for_all_threads(void);
 
 /*
@@ -196,13 +489,14 @@ static void wait_for_all_threads(void);
  * timestamp_thread_func is similarly file-path only.
  */
 #if !USE_AESD_CHAR_DEVICE
-static int write_data_to_file(const char *data, size_t length);
-static int read_and_send_file(int client_fd);
+static int write_data_to_file(struct shard *shard, const char *data, size_t length);
+static int read_and_send_file(struct connection_ctx *conn);
 static void *timestamp_thread_func(void *arg);
 #endif /* !USE_AESD_CHAR_DEVICE */
 
 /*
- * signal_handler - Handle SIGINT and SIGTERM signals.
+ * signal_handler - Handle SIGINT and SIGTERM signals, and SIGUSR1 (usage
+ * report request).
  *
  * Async-signal-safe: only sets a volatile flag and shuts down the server
  * socket.  All other cleanup is performed in main() / cleanup_resources()
@@ -210,7 +504,10 @@ static void *timestamp_thread_func(void *arg);
  */
 static void signal_handler(int signal)
 {
-    (void)signal; /* parameter unused; the flag conveys the needed information */
+    if (signal == SIGUSR1) {
+        stats_requested = 1;  /* reported by the main loop */
+        return;
+    }
     shutdown_requested = 1;
 
     /* Shutdown server socket to unblock accept() */
@@ -246,6 +543,11 @@ static int setup_signal_handlers(void)
         return -1;
     }
 
+    if (sigaction(SIGUSR1, &sa, NULL) == -1) {
+        syslog(LOG_ERR, "Failed to set SIGUSR1 handler: %s", strerror(errno));
+        return -1;
+    }
+
     signal(SIGPIPE, SIG_IGN);
     return 0;
 }
@@ -257,6 +559,11 @@ static int setup_signal_handlers(void)
  * created by run_as_daemon()'s double-fork do not inherit the listening socket.
  * Without this flag there is a race window between socket() and a hypothetical
  * fcntl(F_SETFD) call.
+ *
+ * TCP_DEFER_ACCEPT and TCP_FASTOPEN are applied before listen() (TFO must be
+ * enabled before the socket starts listening).  Both are optimisations only:
+ * a kernel that rejects them leaves a working socket, so failures are logged
+ * as warnings like SO_REUSEADDR.
  */
 static int setup_server_socket(void)
 {
@@ -280,14 +587,30 @@ static int setup_server_socket(void)
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_addr.s_addr = INADDR_ANY;
-    server_addr.sin_port = htons(PORT);
+    server_addr.sin_port = htons((uint16_t)listen_port);
 
     if (bind(sock_fd, (struct sockaddr *)&server_addr, sizeof(server_addr)) == -1) {
-        syslog(LOG_ERR, "Failed to bind to port %d: %s", PORT, strerror(errno));
+        syslog(LOG_ERR, "Failed to bind to port %zu: %s", listen_port, strerror(errno));
         close(sock_fd);
         return -1;
     }
 
+#ifdef TCP_DEFER_ACCEPT
+    if (defer_accept_sec > 0) {
+        int secs = defer_accept_sec > INT_MAX ? INT_MAX : (int)defer_accept_sec;
+        if (setsockopt(sock_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &secs, sizeof(secs)) == -1)
+            syslog(LOG_WARNING, "Failed to set TCP_DEFER_ACCEPT: %s", strerror(errno));
+    }
+#endif
+
+#ifdef TCP_FASTOPEN
+    if (fastopen_qlen > 0) {
+        int qlen = fastopen_qlen > INT_MAX ? INT_MAX : (int)fastopen_qlen;
+        if (setsockopt(sock_fd, IPPROTO_TCP, TCP_FASTOPEN, &qlen, sizeof(qlen)) == -1)
+            syslog(LOG_WARNING, "Failed to set TCP_FASTOPEN: %s", strerror(errno));
+    }
+#endif
+
     if (listen(sock_fd, SOMAXCONN) == -1) {
         syslog(LOG_ERR, "Failed to listen on socket: %s", strerror(errno));
         close(sock_fd);
@@ -297,18 +620,348 @@ static int setup_server_socket(void)
     return sock_fd;
 }
 
+/*
+ * mem_account_register - Start tracking a connection's memory usage.
+ */
+static void mem_account_register(struct mem_account *acct, const char *owner)
+{
+    acct->used  = 0;
+    acct->owner = owner;
+
+    pthread_mutex_lock(&mem_mutex);
+    acct->next   = mem_accounts;
+    mem_accounts = acct;
+    pthread_mutex_unlock(&mem_mutex);
+}
+
+/*
+ * mem_account_unregister - Stop tracking an account, returning anything it
+ * still holds to the pool and waking paused connections.
+ */
+static void mem_account_unregister(struct mem_account *acct)
+{
+    pthread_mutex_lock(&mem_mutex);
+
+    struct mem_account **indirect = &mem_accounts;
+    while (*indirect) {
+        if (*indirect == acct) {
+            *indirect = acct->next;
+            break;
+        }
+        indirect = &(*indirect)->next;
+    }
+    mem_used  -= acct->used;
+    acct->used = 0;
+
+    pthread_cond_broadcast(&mem_cond);
+    pthread_mutex_unlock(&mem_mutex);
+}
+
+/*
+ * mem_is_largest_locked - True if no other account holds more than acct.
+ * Must be called with mem_mutex held.
+ */
+static bool mem_is_largest_locked(const struct mem_account *acct)
+{
+    const struct mem_account *a;
+
+    for (a = mem_accounts; a; a = a->next) {
+        if (a->used > acct->used)
+            return false;
+    }
+    return true;
+}
+
+/*
+ * mem_charge - Charge bytes to acct before allocating them.
+ *
+ * Returns 0 when the bytes fit in the budget (or no budget is set), -1 when
+ * the allocation must be refused.  A NULL account is never limited; it is
+ * used for internal allocations that have no owning connection.
+ *
+ * Policy when the budget is exhausted (see MEM_BUDGET_DEFAULT): the largest
+ * consumer, or a request that could never fit, is rejected immediately.
+ * Other callers wait on mem_cond, which mem_uncharge() signals, for up to
+ * MEM_PAUSE_TIMEOUT_MS.  Because the caller is the connection's own thread,
+ * waiting here is what pauses reads on that connection.  A coroutine shares
+ * its thread with other connections, so it sleeps in the scheduler and polls
+ * the budget every MEM_PAUSE_POLL_MS instead of waiting on mem_cond.
+ *
+ * may_pause must be false while file_mutex is held (readback buffers): a
+ * reader sleeping on the budget there would stall every writer, and the
+ * writers' buffers are exactly what it is waiting for.
+ */
+static int mem_charge(struct mem_account *acct, size_t bytes, bool may_pause)
+{
+    bool paused = false, timed_out;
+    struct timespec deadline;
+
+    if (!acct || bytes == 0)
+        return 0;
+
+    pthread_mutex_lock(&mem_mutex);
+
+    while (mem_budget > 0 && mem_used + bytes > mem_budget) {
+        if (!may_pause || shutdown_requested || bytes > mem_budget ||
+            mem_is_largest_locked(acct)) {
+            mem_rejects++;
+            pthread_mutex_unlock(&mem_mutex);
+            syslog(LOG_WARNING, "Memory budget exhausted: rejecting %zu bytes for %s "
+                   "(holds %zu, total %zu of %zu)", bytes, acct->owner, acct->used,
+                   mem_used, mem_budget);
+            return -1;
+        }
+
+        if (!paused) {
+            paused = true;
+            mem_pauses++;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_sec  += MEM_PAUSE_TIMEOUT_MS / 1000;
+            deadline.tv_nsec += (long)(MEM_PAUSE_TIMEOUT_MS % 1000) * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L) {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            syslog(LOG_DEBUG, "Memory budget exhausted: pausing reads from %s", acct->owner);
+        }
+
+        if (coro_active()) {
+            struct timespec now;
+
+            pthread_mutex_unlock(&mem_mutex);
+            coro_wait_fd(-1, 0, MEM_PAUSE_POLL_MS);
+            pthread_mutex_lock(&mem_mutex);
+            clock_gettime(CLOCK_REALTIME, &now);
+            timed_out = now.tv_sec > deadline.tv_sec ||
+                        (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec);
+        } else {
+            timed_out = pthread_cond_timedwait(&mem_cond, &mem_mutex, &deadline) == ETIMEDOUT;
+        }
+        if (timed_out && mem_used + bytes > mem_budget) {
+            mem_rejects++;
+            pthread_mutex_unlock(&mem_mutex);
+            syslog(LOG_WARNING, "Memory budget exhausted: %s paused for %d ms, rejecting",
+                   acct->owner, MEM_PAUSE_TIMEOUT_MS);
+            return -1;
+        }
+    }
+
+    acct->used += bytes;
+    mem_used   += bytes;
+    if (mem_used > mem_peak)
+        mem_peak = mem_used;
+
+    pthread_mutex_unlock(&mem_mutex);
+    return 0;
+}
+
+/*
+ * mem_uncharge - Return bytes previously charged with mem_charge().
+ */
+static void mem_uncharge(struct mem_account *acct, size_t bytes)
+{
+    if (!acct || bytes == 0)
+        return;
+
+    pthread_mutex_lock(&mem_mutex);
+    acct->used -= bytes;
+    mem_used   -= bytes;
+    pthread_cond_broadcast(&mem_cond);
+    pthread_mutex_unlock(&mem_mutex);
+}
+
+/*
+ * log_memory_usage - Report budget state to syslog (triggered by SIGUSR1).
+ */
+static void log_memory_usage(void)
+{
+    const struct mem_account *a;
+    const struct mem_account *largest = NULL;
+    unsigned int accounts = 0;
+
+    pthread_mutex_lock(&mem_mutex);
+    for (a = mem_accounts; a; a = a->next) {
+        accounts++;
+        if (!largest || a->used > largest->used)
+            largest = a;
+    }
+    syslog(LOG_INFO, "Memory: used=%zu peak=%zu budget=%zu%s connections=%u "
+           "largest=%s (%zu) pauses=%lu rejects=%lu",
+           mem_used, mem_peak, mem_budget, mem_budget ? "" : " (unlimited)",
+           accounts, largest ? largest->owner : "-", largest ? largest->used : 0,
+           mem_pauses, mem_rejects);
+    pthread_mutex_unlock(&mem_mutex);
+}
+
+/*
+ * ==================== Packet buffer pool ====================
+ * Parked connections hold no packet_buffer.  The RECV_BUFFER_SIZE buffers
+ * they give back are kept here, up to PACKET_POOL_MAX and charged to
+ * packet_pool_mem, and handed to the next connection that needs one.  Many
+ * mostly idle clients thus share a small working set of buffers, and
+ * resuming a connection does not go through malloc.
+ */
+static pthread_mutex_t packet_pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *packet_pool[PACKET_POOL_MAX];
+static unsigned int packet_pool_count = 0;
+static struct mem_account packet_pool_mem = { 0, "packet-pool", NULL };
+
+/*
+ * packet_buffer_get - A RECV_BUFFER_SIZE (+1 NUL slot) packet_buffer charged
+ * to conn, from the pool when one is free.  Returns NULL when the budget
+ * refuses it or malloc fails.
+ */
+static char *packet_buffer_get(struct connection_ctx *conn)
+{
+    char *buf = NULL;
+
+    pthread_mutex_lock(&packet_pool_mutex);
+    if (packet_pool_count > 0)
+        buf = packet_pool[--packet_pool_count];
+    pthread_mutex_unlock(&packet_pool_mutex);
+    if (buf)
+        mem_uncharge(&packet_pool_mem, RECV_BUFFER_SIZE + 1);
+
+    if (mem_charge(&conn->mem, RECV_BUFFER_SIZE + 1, true) == -1) {
+        free(buf);
+        return NULL;
+    }
+    if (!buf) {
+        buf = malloc(RECV_BUFFER_SIZE + 1);
+        if (!buf)
+            mem_uncharge(&conn->mem, RECV_BUFFER_SIZE + 1);
+    }
+    return buf;
+}
+
+/*
+ * packet_buffer_put - Give back a packet_buffer with 'capacity' usable
+ * bytes.  Only RECV_BUFFER_SIZE buffers are pooled; grown ones, and any the
+ * pool has no room (or budget) for, are freed.
+ */
+static void packet_buffer_put(struct connection_ctx *conn, char *buf, size_t capacity)
+{
+    if (!buf)
+        return;
+    mem_uncharge(&conn->mem, capacity + 1);
+
+    if (capacity == RECV_BUFFER_SIZE &&
+        mem_charge(&packet_pool_mem, RECV_BUFFER_SIZE + 1, false) == 0) {
+        pthread_mutex_lock(&packet_pool_mutex);
+        if (packet_pool_count < PACKET_POOL_MAX) {
+            packet_pool[packet_pool_count++] = buf;
+            buf = NULL;
+        }
+        pthread_mutex_unlock(&packet_pool_mutex);
+        if (buf)
+            mem_uncharge(&packet_pool_mem, RECV_BUFFER_SIZE + 1);
+    }
+    free(buf);
+}
+
+/*
+ * packet_buffer_append - Append one received chunk to the packet being
+ * assembled in *buffer (*size bytes used of *capacity), doubling the
+ * capacity up to MAX_PACKET_SIZE when the chunk does not fit.  The +1
+ * NUL-terminator slot is kept on every reallocation and each growth step is
+ * charged to conn first; waiting here (budget exhausted) pauses reads from
+ * this client.
+ *
+ * Returns 0, or -1 when the packet would exceed MAX_PACKET_SIZE or the buffer
+ * could not grow; the caller then drops the connection.
+ */
+static int packet_buffer_append(struct connection_ctx *conn, char **buffer,
+                                size_t *capacity, size_t *size,
+                                const char *chunk, size_t chunk_size)
+{
+    /* Reject packets exceeding the configured size limit */
+    if (*size + chunk_size > MAX_PACKET_SIZE) {
+        syslog(LOG_ERR, "Packet from %s exceeds maximum size", conn->client_ip);
+        return -1;
+    }
+
+    /* Expand the packet buffer if the new chunk would overflow it */
+    if (*size + chunk_size > *capacity) {
+        size_t new_capacity = *capacity * 2;
+        char *new_buffer;
+
+        while (new_capacity < *size + chunk_size)
+            new_capacity *= 2;
+        if (new_capacity > MAX_PACKET_SIZE)
+            new_capacity = MAX_PACKET_SIZE;
+
+        /* The charge is returned by mem_account_unregister() on every exit path */
+        if (mem_charge(&conn->mem, new_capacity - *capacity, true) == -1)
+            return -1;
+
+        new_buffer = realloc(*buffer, new_capacity + 1);
+        if (!new_buffer) {
+            syslog(LOG_ERR, "Failed to expand packet buffer for %s", conn->client_ip);
+            mem_uncharge(&conn->mem, new_capacity - *capacity);
+            return -1;
+        }
+        *buffer   = new_buffer;
+        *capacity = new_capacity;
+    }
+
+    memcpy(*buffer + *size, chunk, chunk_size);
+    *size += chunk_size;
+    return 0;
+}
+
+/*
+ * packet_buffer_trim - After a complete packet, give a buffer grown by one
+ * large packet back to the budget instead of holding it for the rest of the
+ * connection.
+ */
+static void packet_buffer_trim(struct connection_ctx *conn, char **buffer, size_t *capacity)
+{
+    if (*capacity > PACKET_BUFFER_RETAIN_SIZE) {
+        char *shrunk = realloc(*buffer, RECV_BUFFER_SIZE + 1);
+        if (shrunk) {
+            mem_uncharge(&conn->mem, *capacity - RECV_BUFFER_SIZE);
+            *buffer   = shrunk;
+            *capacity = RECV_BUFFER_SIZE;
+        }
+    }
+}
+
+/* packet_pool_drain - Free the pooled buffers (shutdown) */
+static void packet_pool_drain(void)
+{
+    pthread_mutex_lock(&packet_pool_mutex);
+    while (packet_pool_count > 0) {
+        free(packet_pool[--packet_pool_count]);
+        mem_uncharge(&packet_pool_mem, RECV_BUFFER_SIZE + 1);
+    }
+    pthread_mutex_unlock(&packet_pool_mutex);
+}
+
+static void log_packet_pool_stats(void)
+{
+    pthread_mutex_lock(&packet_pool_mutex);
+    syslog(LOG_INFO, "Packet pool: buffers=%u bytes=%zu", packet_pool_count,
+           (size_t)packet_pool_count * (RECV_BUFFER_SIZE + 1));
+    pthread_mutex_unlock(&packet_pool_mutex);
+}
+
 /*
  * read_entire_file - Read an already-open fd from its current position to EOF
  * into a dynamically allocated heap buffer.
  *
  * Returns the buffer pointer (caller must free) and sets *out_size to the
- * number of bytes read.  Returns NULL on allocation or read error.
+ * number of bytes read.  Returns NULL on allocation or read error, or when
+ * the memory budget refuses the buffer.
+ *
+ * Every growth step is charged to acct.  Before returning, the buffer is
+ * trimmed to *out_size so the charge matches the data exactly; the caller
+ * returns it with mem_uncharge(acct, *out_size) after freeing the buffer.
  *
  * This helper is shared between both the regular-file and char-device paths.
  * It is the caller's responsibility to hold file_mutex if the read must be
  * atomic with respect to concurrent writes.
  */
-static char *read_entire_file(int fd, size_t *out_size)
+static char *read_entire_file(int fd, size_t *out_size, struct mem_account *acct)
 {
     char *buffer = NULL;
     size_t capacity = 0;
@@ -318,9 +971,17 @@ static char *read_entire_file(int fd, size_t *out_size)
     while (1) {
         if (total == capacity) {
             size_t new_cap = (capacity == 0) ? RECV_BUFFER_SIZE : capacity * 2;
-            char *new_buf = realloc(buffer, new_cap);
+            char *new_buf;
+
+            if (mem_charge(acct, new_cap - capacity, false) == -1) {
+                free(buffer);
+                mem_uncharge(acct, capacity);
+                return NULL;
+            }
+            new_buf = realloc(buffer, new_cap);
             if (!new_buf) {
                 free(buffer);
+                mem_uncharge(acct, new_cap);
                 return NULL;
             }
             buffer = new_buf;
@@ -332,6 +993,7 @@ static char *read_entire_file(int fd, size_t *out_size)
             if (errno == EINTR)
                 continue;
             free(buffer);
+            mem_uncharge(acct, capacity);
             return NULL;
         }
         if (n == 0)
@@ -340,112 +1002,673 @@ static char *read_entire_file(int fd, size_t *out_size)
         total += (size_t)n;
     }
 
+    /* Trim the doubling slack; glibc shrinks large (mmap) chunks with mremap */
+    if (total > 0 && total < capacity) {
+        char *trimmed = realloc(buffer, total);
+        if (trimmed)
+            buffer = trimmed;
+    }
+    mem_uncharge(acct, capacity - total);
+
     *out_size = total;
     return buffer;
 }
 
-/* ==================================================================
- * Fix 6 / Fix 7: Regular-file I/O helpers – compiled only when
- * !USE_AESD_CHAR_DEVICE.
- *
- * The #if block also contains timestamp_thread_func because timestamps
- * are only written to the regular file; the char-device path does not
- * use them.
- * ================================================================== */
-#if !USE_AESD_CHAR_DEVICE
-
 /*
- * write_data_to_file - Append data to /var/tmp/aesdsocketdata under mutex.
- *
- * O_CREAT: create the file if it does not exist.
- * O_APPEND: every write goes atomically to the end of the file regardless of
- *   f_pos, which is important for concurrent access even with our mutex.
- * O_CLOEXEC: fd does not survive a fork (see run_as_daemon).
+ * conn_recv / conn_send - recv() and send() on the client socket.
  *
- * Handles partial writes by looping until all bytes are committed.
+ * On a connection thread the socket is blocking and SO_RCVTIMEO/SO_SNDTIMEO
+ * bound each call (set_socket_timeout).  In a coroutine (-C) the socket is
+ * non-blocking: EAGAIN parks the coroutine in its scheduler until the socket
+ * is ready, for up to CLIENT_TIMEOUT_SEC, and a timeout is reported as
+ * EAGAIN exactly as SO_RCVTIMEO would.  The runtime stopping is reported as
+ * ECANCELED.
  */
-static int write_data_to_file(const char *data, size_t length)
+static ssize_t conn_recv(struct connection_ctx *conn, void *buf, size_t len)
 {
-    int fd;
-    size_t total_written = 0;
-
-    pthread_mutex_lock(&file_mutex);
-
-    fd = open(DATA_FILE, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
-    if (fd == -1) {
-        syslog(LOG_ERR, "Failed to open %s: %s", DATA_FILE, strerror(errno));
-        pthread_mutex_unlock(&file_mutex);
-        return -1;
+    for (;;) {
+        ssize_t n = recv(conn->client_fd, buf, len, 0);
+        if (n >= 0 || errno != EAGAIN || !coro_active())
+            return n;
+        if (coro_wait_fd(conn->client_fd, EPOLLIN, CLIENT_TIMEOUT_SEC * 1000) == -1) {
+            if (errno == ETIMEDOUT)
+                errno = EAGAIN;
+            return -1;
+        }
     }
+}
 
-    while (total_written < length) {
-        ssize_t bytes_written = write(fd, data + total_written,
-                                      length - total_written);
-        if (bytes_written == -1) {
-            if (errno == EINTR)
-                continue;
-            syslog(LOG_ERR, "Failed to write to %s: %s", DATA_FILE, strerror(errno));
-            close(fd);
-            pthread_mutex_unlock(&file_mutex);
+static ssize_t conn_send(struct connection_ctx *conn, const void *buf, size_t len,
+                         int flags)
+{
+    for (;;) {
+        ssize_t n = send(conn->client_fd, buf, len, flags);
+        if (n >= 0 || errno != EAGAIN || !coro_active())
+            return n;
+        if (coro_wait_fd(conn->client_fd, EPOLLOUT, CLIENT_TIMEOUT_SEC * 1000) == -1) {
+            if (errno == ETIMEDOUT)
+                errno = EAGAIN;
             return -1;
         }
-        total_written += (size_t)bytes_written;
     }
+}
 
-    close(fd);
-    pthread_mutex_unlock(&file_mutex);
-    return 0;
+static uint64_t monotonic_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000u + (uint64_t)ts.tv_nsec / 1000000u;
 }
 
 /*
- * read_and_send_file - Read the entire regular data file and send to client.
- *
- * Holds file_mutex only while reading into a heap buffer; releases the lock
- * before the (potentially slow) network send.  This prevents a blocked client
- * from stalling concurrent writers.
+ * idle_timeout_ms - How long this connection may stay idle between packets
+ * (see IDLE_TIMEOUT_GAP_FACTOR).
  */
-static int read_and_send_file(int client_fd)
+static int idle_timeout_ms(const struct connection_ctx *conn)
 {
-    int fd;
-    char *file_buffer = NULL;
-    size_t file_size = 0;
-    int result = 0;
+    uint64_t max_ms = (uint64_t)idle_timeout_sec * 1000u;
+    uint64_t timeout;
+
+    if (!conn->gap_seen)
+        return (int)max_ms;
+    timeout = (uint64_t)conn->gap_ewma_ms * IDLE_TIMEOUT_GAP_FACTOR;
+    if (timeout < CLIENT_TIMEOUT_SEC * 1000u)
+        timeout = CLIENT_TIMEOUT_SEC * 1000u;
+    if (timeout > max_ms)
+        timeout = max_ms;
+    return (int)timeout;
+}
 
-    pthread_mutex_lock(&file_mutex);
+/*
+ * conn_idle_ended - The first bytes of a new packet arrived: fold the pause
+ * since the previous packet into gap_ewma_ms (weight 1/8).
+ */
+static void conn_idle_ended(struct connection_ctx *conn)
+{
+    uint64_t gap;
+
+    if (conn->idle_since_ms == 0)
+        return;  /* first packet: the time since accept is not a pause */
+    gap = monotonic_ms() - conn->idle_since_ms;
+    if (gap > (uint64_t)idle_timeout_sec * 1000u)
+        gap = (uint64_t)idle_timeout_sec * 1000u;
+    conn->gap_ewma_ms = conn->gap_seen
+        ? (uint32_t)(((uint64_t)conn->gap_ewma_ms * 7 + gap) / 8)
+        : (uint32_t)gap;
+    conn->gap_seen = true;
+    conn->idle_since_ms = 0;
+}
 
-    fd = open(DATA_FILE, O_RDONLY | O_CLOEXEC);
-    if (fd == -1) {
-        pthread_mutex_unlock(&file_mutex);
-        return 0; /* File does not exist yet – nothing to send */
+/*
+ * shared_buf_put - Drop one reference; frees the buffer on the last one.
+ */
+static void shared_buf_put(struct shared_buf *sb)
+{
+    if (__atomic_sub_fetch(&sb->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+        mem_uncharge(sb->acct, sb->size);
+        free(sb->data);
+        free(sb);
     }
+}
 
-    file_buffer = read_entire_file(fd, &file_size);
-    close(fd);
+#if HAVE_MSG_ZEROCOPY
+/*
+ * zerocopy_collect - Drain the MSG_ZEROCOPY completion notifications queued
+ * on the socket error queue, without blocking, and release every pending
+ * buffer whose sends have all completed.
+ *
+ * Until a send completes the kernel still references the user pages, so a
+ * buffer sent with MSG_ZEROCOPY is only freed (its shared_buf reference
+ * dropped) here.  Completions are collected lazily: before the next send,
+ * while waiting for the next packet, and before the connection is parked or
+ * closed, so a response costs no extra round trip.
+ *
+ * SO_EE_CODE_ZEROCOPY_COPIED means the kernel fell back to copying (e.g. on
+ * loopback or a device without scatter-gather).  Zero-copy is then pure
+ * overhead for this socket, so it is switched off for the rest of the
+ * connection as recommended by Documentation/networking/msg_zerocopy.rst.
+ */
+static void zerocopy_collect(struct connection_ctx *conn)
+{
+    for (;;) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+        struct msghdr msg;
+        struct cmsghdr *cm;
 
-    pthread_mutex_unlock(&file_mutex);
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof(control);
 
-    if (!file_buffer) {
-        syslog(LOG_ERR, "Failed to read %s into buffer", DATA_FILE);
-        return -1;
+        if (recvmsg(conn->client_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                syslog(LOG_ERR, "zerocopy_collect: recvmsg(MSG_ERRQUEUE) failed: %s",
+                       strerror(errno));
+            break;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err serr;
+
+            if (!((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                  (cm->cmsg_level == SOL_IPV6 && cm->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            memcpy(&serr, CMSG_DATA(cm), sizeof(serr));
+            if (serr.ee_errno != 0 || serr.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+
+            /* ee_info..ee_data is an inclusive range of completed sends */
+            conn->zc_completed += serr.ee_data - serr.ee_info + 1;
+
+            if (serr.ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                if (conn->zerocopy)
+                    syslog(LOG_DEBUG, "Kernel copied zero-copy send to %s; disabling zero-copy",
+                           conn->client_ip);
+                conn->zerocopy = false;
+            }
+        }
     }
 
+    /* Completed: zc_completed is past last_send (modulo 2^32) */
+    while (conn->zc_pending &&
+           (int32_t)(conn->zc_completed - conn->zc_pending->last_send) > 0) {
+        struct zc_pending *done = conn->zc_pending;
+
+        conn->zc_pending = done->next;
+        shared_buf_put(done->sb);
+        free(done);
+    }
+}
+
+/*
+ * zerocopy_wait - Collect completions until no buffer is pending.  Returns
+ * -1 if they do not arrive within timeout_ms (peer stopped ACKing).
+ * recvmsg() with MSG_ERRQUEUE never blocks; poll() reports POLLERR (always
+ * polled, no events bit needed) once a notification is queued.
+ */
+static int zerocopy_wait(struct connection_ctx *conn, int timeout_ms)
+{
+    uint64_t deadline = monotonic_ms() + (uint64_t)timeout_ms;
+
+    for (;;) {
+        struct pollfd pfd = { .fd = conn->client_fd, .events = 0 };
+        uint64_t now;
+
+        zerocopy_collect(conn);
+        if (!conn->zc_pending)
+            return 0;
+        now = monotonic_ms();
+        if (now >= deadline)
+            break;
+        if (poll(&pfd, 1, (int)(deadline - now)) == 0)
+            break;
+    }
+    syslog(LOG_ERR, "zerocopy_wait: timed out waiting for %u completion(s) from %s",
+           conn->zc_issued - conn->zc_completed, conn->client_ip);
+    return -1;
+}
+
+/*
+ * zerocopy_abandon - Forget the buffers still pending on a connection that
+ * is being closed without their completions.  The kernel may still read
+ * them, and a freed heap buffer could be reused for another client's data
+ * before they go out, so their references are deliberately never dropped:
+ * the memory is leaked, which is logged.
+ */
+static void zerocopy_abandon(struct connection_ctx *conn)
+{
+    size_t leaked = 0;
+
+    while (conn->zc_pending) {
+        struct zc_pending *held = conn->zc_pending;
+
+        conn->zc_pending = held->next;
+        leaked += held->sb->size;
+        free(held);
+    }
+    if (leaked > 0)
+        syslog(LOG_WARNING, "Leaking %zu bytes still referenced by zero-copy sends to %s",
+               leaked, conn->client_ip);
+}
+#endif /* HAVE_MSG_ZEROCOPY */
+
+/*
+ * conn_wait_readable - Wait up to timeout_ms for the client to send, with
+ * poll() on a thread or in the scheduler in a coroutine.  Returns 1 when
+ * readable (including EOF and errors, which the next recv reports), 0 on
+ * timeout, -1 when the coroutine runtime is stopping.
+ */
+static int conn_wait_readable(struct connection_ctx *conn, int timeout_ms)
+{
+    if (coro_active()) {
+        if (coro_wait_fd(conn->client_fd, EPOLLIN, timeout_ms) == 0)
+            return 1;
+        return errno == ETIMEDOUT ? 0 : -1;
+    }
+
+    for (;;) {
+        struct pollfd pfd = { .fd = conn->client_fd, .events = POLLIN };
+        uint64_t start = monotonic_ms();
+        int ret = poll(&pfd, 1, timeout_ms);
+#if HAVE_MSG_ZEROCOPY
+        /* POLLERR alone may just be zero-copy completions: reap, keep waiting */
+        if (ret == 1 && !(pfd.revents & POLLIN) && conn->zc_pending) {
+            uint32_t completed = conn->zc_completed;
+            uint64_t waited = monotonic_ms() - start;
+
+            zerocopy_collect(conn);
+            if (conn->zc_completed == completed)
+                return 1;  /* a real socket error */
+            timeout_ms = waited >= (uint64_t)timeout_ms ? 0 : timeout_ms - (int)waited;
+            continue;
+        }
+#endif
+        if (ret >= 0)
+            return ret;
+        if (errno != EINTR)
+            return 1;  /* let recv() report it */
+    }
+}
+
+/*
+ * send_to_client - Send an entire response buffer, looping over partial
+ * sends.  'who' names the caller for the error log.
+ *
+ * When buf lies in a shared_buf the caller passes it as owner, and
+ * responses of at least zerocopy_threshold bytes then go out with
+ * MSG_ZEROCOPY when the socket supports it.  The connection takes its own
+ * reference to owner until the kernel reports completion (zerocopy_collect),
+ * so the caller drops its reference as usual when this returns.  Buffers
+ * without an owner may be reused or freed right away and are always copied.
+ * ENOBUFS from a zero-copy send (optmem limit reached) falls back to a plain
+ * copying send for the remainder of the buffer.
+ */
+static int send_to_client(struct connection_ctx *conn, const char *buf,
+                          size_t len, struct shared_buf *owner, const char *who)
+{
     size_t sent = 0;
-    while (sent < file_size) {
-        ssize_t n = send(client_fd, file_buffer + sent, file_size - sent, 0);
+    int result = 0;
+    int flags = 0;
+
+#if HAVE_MSG_ZEROCOPY
+    struct zc_pending *hold = NULL;
+    uint32_t first_send = conn->zc_issued;
+
+    if (conn->zc_pending)
+        zerocopy_collect(conn);
+    if (owner && conn->zerocopy && zerocopy_threshold > 0 && len >= zerocopy_threshold) {
+        hold = malloc(sizeof(*hold));
+        if (hold)
+            flags = MSG_ZEROCOPY;
+    }
+#else
+    (void)owner;
+#endif
+
+    while (sent < len) {
+        ssize_t n = conn_send(conn, buf + sent, len - sent, flags);
         if (n == -1) {
             if (errno == EINTR)
                 continue;
-            syslog(LOG_ERR, "Failed to send data to client: %s", strerror(errno));
+            if (flags && errno == ENOBUFS) {
+                flags = 0;
+                continue;
+            }
+            syslog(LOG_ERR, "%s: send failed: %s", who, strerror(errno));
             result = -1;
             break;
         }
+        if (flags)
+            conn->zc_issued++;
         sent += (size_t)n;
     }
+    conn->bytes_sent += sent;
+
+#if HAVE_MSG_ZEROCOPY
+    if (hold && conn->zc_issued != first_send) {
+        struct zc_pending **tail = &conn->zc_pending;
+
+        __atomic_add_fetch(&owner->refs, 1, __ATOMIC_RELAXED);
+        hold->sb = owner;
+        hold->last_send = conn->zc_issued - 1;
+        hold->next = NULL;
+        while (*tail)
+            tail = &(*tail)->next;
+        *tail = hold;
+    } else {
+        free(hold);
+    }
+#endif
+
+    return result;
+}
+
+/*
+ * send_owned - send_to_client() for a heap buffer charged to acct, taking
+ * ownership of it.  The buffer is wrapped in a shared_buf so that a
+ * zero-copy send can keep it until its completion arrives; it is freed and
+ * uncharged once nothing uses it.
+ */
+static int send_owned(struct connection_ctx *conn, char *data, size_t len,
+                      struct mem_account *acct, const char *who)
+{
+    struct shared_buf *sb = malloc(sizeof(*sb));
+    int result;
+
+    if (!sb) {
+        result = send_to_client(conn, data, len, NULL, who);
+        free(data);
+        mem_uncharge(acct, len);
+        return result;
+    }
+    sb->data = data;
+    sb->size = len;
+    sb->acct = acct;
+    sb->refs = 1;
+    result = send_to_client(conn, data, len, sb, who);
+    shared_buf_put(sb);
+    return result;
+}
+
+/*
+ * shard_lock - Take a shard's file_mutex.  Nothing that holds it waits on a
+ * client (responses are sent after the unlock, streamed packets are staged
+ * outside it), so in a coroutine (-C) the holder is never a parked coroutine
+ * of the same scheduler thread and blocking here is short.
+ */
+static void shard_lock(struct shard *shard)
+{
+    pthread_mutex_lock(&shard->file_mutex);
+}
+
+/*
+ * shard_invalidate_locked - Start a new generation for one shard and drop
+ * every cached response derived from the old content.  Called with its
+ * file_mutex held before every write to the backend.
+ */
+static void shard_invalidate_locked(struct shard *shard)
+{
+    shard->generation++;
+
+    if (shard->lz4_snapshot) {
+        shared_buf_put(shard->lz4_snapshot);
+        shard->lz4_snapshot = NULL;
+    }
+
+#if USE_AESD_CHAR_DEVICE && SEEK_CACHE_SLOTS > 0
+    unsigned int i;
+    for (i = 0; i < SEEK_CACHE_SLOTS; i++) {
+        if (shard->seek_cache[i].buf) {
+            shared_buf_put(shard->seek_cache[i].buf);
+            shard->seek_cache[i].buf = NULL;
+        }
+    }
+#endif
+}
+
+/* ==================================================================
+ * Compressed responses (AESD_COMPRESS:lz4).
+ *
+ * After a client negotiates compression every response on its connection
+ * is one LZ4 frame (lz4frame.c), so the client can always decode with a
+ * stock LZ4 frame decoder; the frame header carries the original size.
+ *
+ * Full readbacks are what gets large, and every client that reads the same
+ * shard between two writes receives the same bytes, so the compressed form
+ * of the full readback is cached per shard, keyed by the shard generation
+ * like the seek cache.  A hit skips the backend read as well as the
+ * compression.  Compression runs outside file_mutex; the result is cached
+ * only if no write bumped the generation in the meantime.  Cached frames are
+ * charged to compress_cache_mem; if the budget refuses, the frame is sent
+ * but not cached.
+ * ================================================================== */
+static struct mem_account compress_cache_mem = { 0, "lz4-cache", NULL };
+
+/*
+ * lz4_cache_lookup_locked - Return a referenced compressed readback of the
+ * shard's current generation, or NULL.  file_mutex must be held.
+ */
+static struct shared_buf *lz4_cache_lookup_locked(struct shard *shard)
+{
+    struct shared_buf *sb = shard->lz4_snapshot;
+
+    if (sb && shard->lz4_generation == shard->generation) {
+        __atomic_add_fetch(&sb->refs, 1, __ATOMIC_RELAXED);
+        shard->lz4_hits++;
+        return sb;
+    }
+    shard->lz4_misses++;
+    return NULL;
+}
 
-    free(file_buffer);
+/*
+ * compress_for_client - Compress a response into an LZ4 frame charged to
+ * conn->mem.  Returns the frame or NULL (allocation or budget refusal).
+ */
+static char *compress_for_client(struct connection_ctx *conn, const char *buf,
+                                 size_t len, size_t *out_len, const char *who)
+{
+    char *frame = lz4_frame_compress(buf, len, out_len);
+
+    if (!frame) {
+        syslog(LOG_ERR, "%s: compression failed", who);
+        return NULL;
+    }
+    if (mem_charge(&conn->mem, *out_len, false) == -1) {
+        free(frame);
+        return NULL;
+    }
+    return frame;
+}
+
+/*
+ * send_response - send_to_client() for command results: compressed into a
+ * frame when the connection negotiated it, otherwise sent as is.
+ */
+static int send_response(struct connection_ctx *conn, const char *buf,
+                         size_t len, const char *who)
+{
+    char *frame;
+    size_t frame_len;
+
+    if (!conn->compress)
+        return send_to_client(conn, buf, len, NULL, who);
+
+    frame = compress_for_client(conn, buf, len, &frame_len, who);
+    if (!frame)
+        return -1;
+    return send_owned(conn, frame, frame_len, &conn->mem, who);
+}
+
+/*
+ * send_readback - Send a full readback of conn->shard read at 'generation',
+ * taking ownership of 'content' (charged to conn->mem).  With compression on,
+ * the frame is also offered to the shard's snapshot cache.
+ */
+static int send_readback(struct connection_ctx *conn, char *content, size_t size,
+                         uint64_t generation, const char *who)
+{
+    struct shard *shard = conn->shard;
+    struct shared_buf *sb;
+    char *frame;
+    size_t frame_len;
+    int result;
+
+    if (!conn->compress)
+        return send_owned(conn, content, size, &conn->mem, who);
+
+    frame = compress_for_client(conn, content, size, &frame_len, who);
+    free(content);
+    mem_uncharge(&conn->mem, size);
+    if (!frame)
+        return -1;
+
+    sb = malloc(sizeof(*sb));
+    if (sb && mem_charge(&compress_cache_mem, frame_len, false) == 0) {
+        /* Move the charge to the cache, as seek_cache_insert_locked does */
+        mem_uncharge(&conn->mem, frame_len);
+        sb->data = frame;
+        sb->size = frame_len;
+        sb->acct = &compress_cache_mem;
+        sb->refs = 1;  /* ours */
+
+        shard_lock(shard);
+        if (shard->generation == generation) {
+            if (shard->lz4_snapshot)
+                shared_buf_put(shard->lz4_snapshot);
+            sb->refs++;  /* the cache's */
+            shard->lz4_snapshot = sb;
+            shard->lz4_generation = generation;
+        }
+        pthread_mutex_unlock(&shard->file_mutex);
+
+        result = send_to_client(conn, sb->data, sb->size, sb, who);
+        shared_buf_put(sb);
+        return result;
+    }
+
+    free(sb);
+    return send_owned(conn, frame, frame_len, &conn->mem, who);
+}
+
+/*
+ * send_cached_readback - Send a referenced compressed snapshot and drop the
+ * reference.  Called after file_mutex has been released.
+ */
+static int send_cached_readback(struct connection_ctx *conn, struct shared_buf *sb,
+                                const char *who)
+{
+    int result = send_to_client(conn, sb->data, sb->size, sb, who);
+
+    shared_buf_put(sb);
     return result;
 }
 
+/*
+ * log_compress_stats - Report compressed snapshot cache use (SIGUSR1).
+ */
+static void log_compress_stats(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < shard_count; i++) {
+        struct shard *shard = &shards[i];
+        shard_lock(shard);
+        if (shard->lz4_hits || shard->lz4_misses)
+            syslog(LOG_INFO, "Compressed readbacks %s: hits=%lu misses=%lu cached=%zu",
+                   shard->data_file, shard->lz4_hits, shard->lz4_misses,
+                   shard->lz4_snapshot ? shard->lz4_snapshot->size : 0);
+        pthread_mutex_unlock(&shard->file_mutex);
+    }
+}
+
+/* ==================================================================
+ * Fix 6 / Fix 7: Regular-file I/O helpers – compiled only when
+ * !USE_AESD_CHAR_DEVICE.
+ *
+ * The #if block also contains timestamp_thread_func because timestamps
+ * are only written to the regular file; the char-device path does not
+ * use them.
+ * ================================================================== */
+#if !USE_AESD_CHAR_DEVICE
+
+/*
+ * write_data_to_file - Append data to /var/tmp/aesdsocketdata under mutex.
+ *
+ * O_CREAT: create the file if it does not exist.
+ * O_APPEND: every write goes atomically to the end of the file regardless of
+ *   f_pos, which is important for concurrent access even with our mutex.
+ * O_CLOEXEC: fd does not survive a fork (see run_as_daemon).
+ *
+ * Handles partial writes by looping until all bytes are committed.
+ */
+static int write_data_to_file(struct shard *shard, const char *data, size_t length)
+{
+    int fd;
+    size_t total_written = 0;
+
+    shard_lock(shard);
+
+    fd = open(shard->data_file, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Failed to open %s: %s", shard->data_file, strerror(errno));
+        pthread_mutex_unlock(&shard->file_mutex);
+        return -1;
+    }
+
+    shard_invalidate_locked(shard);
+
+    while (total_written < length) {
+        ssize_t bytes_written = write(fd, data + total_written,
+                                      length - total_written);
+        if (bytes_written == -1) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Failed to write to %s: %s", shard->data_file, strerror(errno));
+            repl_publish(data, total_written);
+            close(fd);
+            pthread_mutex_unlock(&shard->file_mutex);
+            return -1;
+        }
+        total_written += (size_t)bytes_written;
+    }
+
+    /* Replicate under the same lock so followers see writes in file order */
+    repl_publish(data, length);
+
+    close(fd);
+    pthread_mutex_unlock(&shard->file_mutex);
+    return 0;
+}
+
+/*
+ * read_and_send_file - Read the entire regular data file and send to client.
+ *
+ * Holds file_mutex only while reading into a heap buffer; releases the lock
+ * before the (potentially slow) network send.  This prevents a blocked client
+ * from stalling concurrent writers.
+ */
+static int read_and_send_file(struct connection_ctx *conn)
+{
+    struct shard *shard = conn->shard;
+    int fd;
+    char *file_buffer = NULL;
+    size_t file_size = 0;
+    struct shared_buf *cached = NULL;
+    uint64_t generation;
+
+    shard_lock(shard);
+
+    if (conn->compress)
+        cached = lz4_cache_lookup_locked(shard);
+    if (cached) {
+        pthread_mutex_unlock(&shard->file_mutex);
+        return send_cached_readback(conn, cached, "read_and_send_file");
+    }
+
+    fd = open(shard->data_file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        pthread_mutex_unlock(&shard->file_mutex);
+        return 0; /* File does not exist yet – nothing to send */
+    }
+
+    file_buffer = read_entire_file(fd, &file_size, &conn->mem);
+    close(fd);
+    generation = shard->generation;
+
+    pthread_mutex_unlock(&shard->file_mutex);
+
+    if (!file_buffer) {
+        syslog(LOG_ERR, "Failed to read %s into buffer", shard->data_file);
+        return -1;
+    }
+
+    return send_readback(conn, file_buffer, file_size, generation, "read_and_send_file");
+}
+
 /*
  * timestamp_thread_func - Write a formatted RFC-2822 timestamp to the data
  * file every TIMESTAMP_INTERVAL seconds.
@@ -479,27 +1702,224 @@ static void *timestamp_thread_func(void *arg)
             strftime(timestamp, sizeof(timestamp),
                      "timestamp:%a, %d %b %Y %H:%M:%S %z\n", tm_info);
 
-            write_data_to_file(timestamp, strlen(timestamp));
-            syslog(LOG_DEBUG, "Wrote timestamp: %s", timestamp);
-        }
+            for (unsigned int i = 0; i < shard_count; i++)
+                write_data_to_file(&shards[i], timestamp, strlen(timestamp));
+            syslog(LOG_DEBUG, "Wrote timestamp: %s", timestamp);
+        }
+    }
+
+    return NULL;
+}
+
+#endif /* !USE_AESD_CHAR_DEVICE */
+
+
+/* ==================================================================
+ * Fix 6 / Fix 7: Character-device I/O helpers – compiled only when
+ * USE_AESD_CHAR_DEVICE=1.
+ *
+ * These replace write_data_to_file + read_and_send_file for the device
+ * path and add the AESDCHAR_IOCSEEKTO seek path.  Separating them into
+ * their own #if block eliminates the dead O_WRONLY-vs-O_APPEND branch
+ * that existed inside write_data_to_file in earlier revisions.
+ * ================================================================== */
+#if USE_AESD_CHAR_DEVICE
+
+/*
+ * ---- Seek result cache ----
+ *
+ * handle_seekto_command costs open + ioctl + full read + close under
+ * file_mutex.  Between writes the device contents cannot change, so the
+ * bytes returned for a given (write_cmd, write_cmd_offset) are the same every
+ * time.  Results are therefore cached, keyed by the seek arguments and by
+ * the shard's generation, a counter bumped under file_mutex by every write
+ * this process makes to the device (shard_invalidate_locked, called from
+ * write_all_chardev).  Bumping the generation also drops all entries so
+ * stale snapshots do not hold memory.
+ *
+ * Cached buffers are reference counted: a hit takes a reference under
+ * file_mutex and sends outside it, so an invalidation racing with a slow
+ * send only drops the cache's reference.  The cache assumes this process is
+ * the only writer; data written to the device by another process is not
+ * seen until aesdsocket itself next writes.
+ *
+ * Cached memory is charged to seek_cache_mem with may_pause == false; when
+ * the budget refuses it the result is simply not cached.
+ *
+ * Each shard has its own generation and table (struct shard); a write to
+ * one shard leaves the others' cached results valid.
+ */
+#if SEEK_CACHE_SLOTS > 0
+static struct mem_account seek_cache_mem = { 0, "seek-cache", NULL };  /* all shards */
+#endif
+
+#if SEEK_CACHE_SLOTS > 0
+/*
+ * seek_cache_lookup_locked - Return a referenced buffer for a cached seek
+ * result of the current generation, or NULL.  file_mutex must be held.
+ */
+static struct shared_buf *seek_cache_lookup_locked(struct shard *shard,
+                                                   const struct aesd_seekto *seekto)
+{
+    unsigned int i;
+
+    for (i = 0; i < SEEK_CACHE_SLOTS; i++) {
+        struct seek_cache_entry *e = &shard->seek_cache[i];
+        if (e->buf && e->generation == shard->generation &&
+            e->write_cmd == seekto->write_cmd &&
+            e->write_cmd_offset == seekto->write_cmd_offset) {
+            __atomic_add_fetch(&e->buf->refs, 1, __ATOMIC_RELAXED);
+            shard->seek_cache_hits++;
+            return e->buf;
+        }
+    }
+    shard->seek_cache_misses++;
+    return NULL;
+}
+
+/*
+ * seek_cache_insert_locked - Take ownership of a freshly read seek result
+ * (charged to 'from') and store it in the cache.  Returns a referenced
+ * shared_buf for the caller to send, or NULL on allocation failure, in which
+ * case data is left untouched and still owned and charged to the caller.
+ * file_mutex must be held.
+ */
+static struct shared_buf *seek_cache_insert_locked(struct shard *shard,
+                                                   const struct aesd_seekto *seekto,
+                                                   char *data, size_t size,
+                                                   struct mem_account *from)
+{
+    struct seek_cache_entry *e;
+    struct shared_buf *sb = malloc(sizeof(*sb));
+
+    if (!sb)
+        return NULL;
+
+    sb->data = data;
+    sb->size = size;
+    sb->acct = from;
+    sb->refs = 1;  /* the caller's reference */
+
+    /* Move the charge to the cache; if the budget refuses, do not cache */
+    if (mem_charge(&seek_cache_mem, size, false) == -1)
+        return sb;
+    mem_uncharge(from, size);
+    sb->acct = &seek_cache_mem;
+
+    e = &shard->seek_cache[shard->seek_cache_next];
+    shard->seek_cache_next = (shard->seek_cache_next + 1) % SEEK_CACHE_SLOTS;
+    if (e->buf)
+        shared_buf_put(e->buf);
+
+    e->buf = sb;
+    e->generation = shard->generation;
+    e->write_cmd = seekto->write_cmd;
+    e->write_cmd_offset = seekto->write_cmd_offset;
+    sb->refs++;  /* the cache's reference; not yet visible to other threads */
+
+    return sb;
+}
+#endif /* SEEK_CACHE_SLOTS > 0 */
+
+/*
+ * log_seek_cache_stats - Report cache effectiveness (triggered by SIGUSR1).
+ */
+static void log_seek_cache_stats(void)
+{
+#if SEEK_CACHE_SLOTS > 0
+    unsigned int i;
+
+    for (i = 0; i < shard_count; i++) {
+        struct shard *shard = &shards[i];
+        shard_lock(shard);
+        syslog(LOG_INFO, "Seek cache %s: generation=%llu hits=%lu misses=%lu",
+               shard->data_file, (unsigned long long)shard->generation,
+               shard->seek_cache_hits, shard->seek_cache_misses);
+        pthread_mutex_unlock(&shard->file_mutex);
+    }
+    syslog(LOG_INFO, "Seek cache: bytes=%zu", seek_cache_mem.used);
+#endif
+}
+
+/*
+ * write_all_chardev - Write length bytes to an open device fd, looping over
+ * partial writes and EINTR.  'who' names the caller for the error log.
+ * Must be called with the shard's file_mutex held.  The bytes that reached
+ * the device are handed to repl_publish(), including each chunk of a
+ * streamed packet.
+ */
+static int write_all_chardev(struct shard *shard, int fd, const char *data,
+                             size_t length, const char *who)
+{
+    size_t total_written = 0;
+
+    /* Any write, even one that fails part-way, may change what a seek returns */
+    shard_invalidate_locked(shard);
+
+    while (total_written < length) {
+        ssize_t n = write(fd, data + total_written, length - total_written);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "%s: write failed: %s", who, strerror(errno));
+            repl_publish(data, total_written);
+            return -1;
+        }
+        total_written += (size_t)n;
+    }
+
+    /* Replicate under file_mutex so followers see writes in device order */
+    repl_publish(data, length);
+    return 0;
+}
+
+/*
+ * readback_unlock_and_send_chardev - Phases 2 and 3 of a normal packet.
+ *
+ * Must be called with file_mutex held; always releases it.  The read happens
+ * under the lock so no write interleaves between the caller's write and the
+ * readback; the send happens after the unlock so a slow client never blocks
+ * other writers.
+ */
+static int readback_unlock_and_send_chardev(struct connection_ctx *conn, const char *who)
+{
+    struct shard *shard = conn->shard;
+    int rfd;
+    char *file_buffer = NULL;
+    size_t file_size = 0;
+    struct shared_buf *cached = NULL;
+    uint64_t generation;
+
+    /* A compressed snapshot of this generation makes the read unnecessary */
+    if (conn->compress)
+        cached = lz4_cache_lookup_locked(shard);
+    if (cached) {
+        pthread_mutex_unlock(&shard->file_mutex);
+        return send_cached_readback(conn, cached, who);
     }
 
-    return NULL;
-}
+    /* ---- Phase 2: Read into buffer (still under mutex so no write interleaves) ---- */
+    rfd = open(shard->data_file, O_RDONLY | O_CLOEXEC);
+    if (rfd == -1) {
+        syslog(LOG_ERR, "%s: open for read failed: %s", who, strerror(errno));
+        pthread_mutex_unlock(&shard->file_mutex);
+        return -1;
+    }
 
-#endif /* !USE_AESD_CHAR_DEVICE */
+    file_buffer = read_entire_file(rfd, &file_size, &conn->mem);
+    close(rfd);
+    generation = shard->generation;
 
+    pthread_mutex_unlock(&shard->file_mutex);
 
-/* ==================================================================
- * Fix 6 / Fix 7: Character-device I/O helpers – compiled only when
- * USE_AESD_CHAR_DEVICE=1.
- *
- * These replace write_data_to_file + read_and_send_file for the device
- * path and add the AESDCHAR_IOCSEEKTO seek path.  Separating them into
- * their own #if block eliminates the dead O_WRONLY-vs-O_APPEND branch
- * that existed inside write_data_to_file in earlier revisions.
- * ================================================================== */
-#if USE_AESD_CHAR_DEVICE
+    if (!file_buffer) {
+        syslog(LOG_ERR, "%s: read_entire_file failed", who);
+        return -1;
+    }
+
+    /* ---- Phase 3: Send (outside lock) ---- */
+    return send_readback(conn, file_buffer, file_size, generation, who);
+}
 
 /*
  * write_and_readback_chardev - Handle a normal (non-seek) packet for the
@@ -523,77 +1943,179 @@ static void *timestamp_thread_func(void *arg)
  * The mutex is released before the send so a slow or stalled client does not
  * hold the lock and block concurrent writers.
  */
-static int write_and_readback_chardev(int client_fd, const char *data, size_t length)
+static int write_and_readback_chardev(struct connection_ctx *conn,
+                                      const char *data, size_t length)
 {
+    struct shard *shard = conn->shard;
     int wfd;
-    size_t total_written = 0;
-    int rfd;
-    char *file_buffer = NULL;
-    size_t file_size = 0;
-    int result = 0;
 
-    pthread_mutex_lock(&file_mutex);
+    shard_lock(shard);
 
     /* ---- Phase 1: Write ---- */
-    wfd = open(DATA_FILE, O_WRONLY | O_CLOEXEC);
+    wfd = open(shard->data_file, O_WRONLY | O_CLOEXEC);
     if (wfd == -1) {
         syslog(LOG_ERR, "write_and_readback_chardev: open for write failed: %s",
                strerror(errno));
-        pthread_mutex_unlock(&file_mutex);
+        pthread_mutex_unlock(&shard->file_mutex);
+        return -1;
+    }
+
+    if (write_all_chardev(shard, wfd, data, length, "write_and_readback_chardev") == -1) {
+        close(wfd);
+        pthread_mutex_unlock(&shard->file_mutex);
         return -1;
     }
+    close(wfd);
+
+    return readback_unlock_and_send_chardev(conn, "write_and_readback_chardev");
+}
+
+/*
+ * chardev_stream_stage - Append data to the connection's staging file.
+ */
+static int chardev_stream_stage(struct connection_ctx *conn,
+                                const char *data, size_t length)
+{
+    size_t total_written = 0;
 
     while (total_written < length) {
-        ssize_t n = write(wfd, data + total_written, length - total_written);
+        ssize_t n = write(conn->stream_fd, data + total_written, length - total_written);
         if (n == -1) {
             if (errno == EINTR)
                 continue;
-            syslog(LOG_ERR, "write_and_readback_chardev: write failed: %s",
-                   strerror(errno));
-            close(wfd);
-            pthread_mutex_unlock(&file_mutex);
+            syslog(LOG_ERR, "Staging packet from %s failed: %s",
+                   conn->client_ip, strerror(errno));
             return -1;
         }
         total_written += (size_t)n;
     }
-    close(wfd);
+    conn->stream_size += length;
+    return 0;
+}
 
-    /* ---- Phase 2: Read into buffer (still under mutex so no write interleaves) ---- */
-    rfd = open(DATA_FILE, O_RDONLY | O_CLOEXEC);
-    if (rfd == -1) {
-        syslog(LOG_ERR, "write_and_readback_chardev: open for read failed: %s",
-               strerror(errno));
-        pthread_mutex_unlock(&file_mutex);
+/*
+ * chardev_stream_begin - Start staging a large packet for the device.
+ *
+ * Called by connection_handler once a packet has grown past
+ * STREAM_WINDOW_SIZE without a newline and cannot be a socket command.  The
+ * bytes buffered so far and every later chunk (chardev_stream_write) go to
+ * an unlinked file in STREAM_STAGING_DIR, so the connection holds O(chunk)
+ * memory instead of O(packet).
+ *
+ * No lock is held while the packet arrives: however slowly the client sends,
+ * other writers, readers and seeks on the shard go on.  chardev_stream_end()
+ * takes file_mutex only to copy the complete packet into the device.
+ */
+static int chardev_stream_begin(struct connection_ctx *conn,
+                                const char *data, size_t length)
+{
+    char path[] = STREAM_STAGING_DIR "/aesdsocket-stream.XXXXXX";
+    int fd = -1;
+
+#ifdef O_TMPFILE
+    fd = open(STREAM_STAGING_DIR, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+#endif
+    if (fd == -1) {
+        /* No O_TMPFILE support in this kernel or filesystem: unlink at once */
+        fd = mkostemp(path, O_CLOEXEC);
+        if (fd != -1)
+            unlink(path);
+    }
+    if (fd == -1) {
+        syslog(LOG_ERR, "chardev_stream_begin: no staging file in %s: %s",
+               STREAM_STAGING_DIR, strerror(errno));
         return -1;
     }
 
-    file_buffer = read_entire_file(rfd, &file_size);
-    close(rfd);
+    conn->stream_fd = fd;
+    conn->stream_size = 0;
+    if (chardev_stream_stage(conn, data, length) == -1) {
+        close(fd);
+        conn->stream_fd = -1;
+        return -1;
+    }
+    syslog(LOG_DEBUG, "Staging large packet from %s for %s", conn->client_ip,
+           conn->shard->data_file);
+    return 0;
+}
 
-    pthread_mutex_unlock(&file_mutex);
+/*
+ * chardev_stream_write - Append one received chunk to the staged packet.
+ */
+static int chardev_stream_write(struct connection_ctx *conn,
+                                const char *data, size_t length)
+{
+    return chardev_stream_stage(conn, data, length);
+}
 
-    if (!file_buffer) {
-        syslog(LOG_ERR, "write_and_readback_chardev: read_entire_file failed");
+/*
+ * chardev_stream_end - Commit (complete == true) or drop a staged packet.
+ *
+ * On completion the staged packet, whose last chunk holds the newline, is
+ * mapped and written to the device in STREAM_COMMIT_CHUNK pieces under
+ * file_mutex.  The driver's partial_buf is shared by all openers, so the
+ * lock is held from the first piece to the newline; that now takes as long
+ * as a local copy, not as long as the client.  The readback and send then
+ * follow exactly as for a buffered packet.  A write that fails part-way
+ * leaves a partial line in the driver, which is terminated with a newline so
+ * it cannot be prepended to the next writer's packet.
+ *
+ * An abandoned packet (disconnect, timeout, oversized packet, shutdown)
+ * never reached the device and is simply dropped with its staging file.
+ */
+static int chardev_stream_end(struct connection_ctx *conn, bool complete)
+{
+    struct shard *shard = conn->shard;
+    int staging = conn->stream_fd;
+    size_t size = conn->stream_size;
+    size_t offset;
+    char *map;
+    int wfd;
+
+    conn->stream_fd = -1;
+
+    if (!complete) {
+        syslog(LOG_WARNING, "Dropping incomplete packet from %s after %zu bytes",
+               conn->client_ip, size);
+        close(staging);
         return -1;
     }
 
-    /* ---- Phase 3: Send (outside lock) ---- */
-    size_t sent = 0;
-    while (sent < file_size) {
-        ssize_t n = send(client_fd, file_buffer + sent, file_size - sent, 0);
-        if (n == -1) {
-            if (errno == EINTR)
-                continue;
-            syslog(LOG_ERR, "write_and_readback_chardev: send failed: %s",
-                   strerror(errno));
-            result = -1;
-            break;
+    map = mmap(NULL, size, PROT_READ, MAP_SHARED, staging, 0);
+    close(staging);
+    if (map == MAP_FAILED) {
+        syslog(LOG_ERR, "chardev_stream_end: mmap of staged packet failed: %s",
+               strerror(errno));
+        return -1;
+    }
+
+    shard_lock(shard);
+
+    wfd = open(shard->data_file, O_WRONLY | O_CLOEXEC);
+    if (wfd == -1) {
+        syslog(LOG_ERR, "chardev_stream_end: open for write failed: %s",
+               strerror(errno));
+        pthread_mutex_unlock(&shard->file_mutex);
+        munmap(map, size);
+        return -1;
+    }
+
+    for (offset = 0; offset < size; offset += STREAM_COMMIT_CHUNK) {
+        size_t length = size - offset < STREAM_COMMIT_CHUNK ? size - offset : STREAM_COMMIT_CHUNK;
+
+        if (write_all_chardev(shard, wfd, map + offset, length, "chardev_stream_end") == -1) {
+            if (offset > 0)
+                write_all_chardev(shard, wfd, "\n", 1, "chardev_stream_end");
+            close(wfd);
+            pthread_mutex_unlock(&shard->file_mutex);
+            munmap(map, size);
+            return -1;
         }
-        sent += (size_t)n;
     }
+    close(wfd);
+    munmap(map, size);
 
-    free(file_buffer);
-    return result;
+    return readback_unlock_and_send_chardev(conn, "chardev_stream_end");
 }
 
 /*
@@ -621,8 +2143,9 @@ static int write_and_readback_chardev(int client_fd, const char *data, size_t le
  * Fix 12: Trailing garbage after Y is rejected.
  * Fix 13: O_CLOEXEC is used on the open() call.
  */
-static int handle_seekto_command(int client_fd, const char *packet)
+static int handle_seekto_command(struct connection_ctx *conn, const char *packet)
 {
+    struct shard *shard = conn->shard;
     struct aesd_seekto seekto;
     unsigned long x, y;
     const char *args;
@@ -631,6 +2154,9 @@ static int handle_seekto_command(int client_fd, const char *packet)
     char *content = NULL;
     size_t content_size = 0;
     int result = 0;
+#if SEEK_CACHE_SLOTS > 0
+    struct shared_buf *cached = NULL;
+#endif
 
     /* Skip past "AESDCHAR_IOCSEEKTO:" to reach the "X,Y\n" portion */
     args = packet + strlen(SEEKTO_CMD_PREFIX);
@@ -716,13 +2242,24 @@ static int handle_seekto_command(int client_fd, const char *packet)
      *
      * Fix 13: O_CLOEXEC prevents the fd from leaking across fork().
      */
-    pthread_mutex_lock(&file_mutex);
+    shard_lock(shard);
+
+#if SEEK_CACHE_SLOTS > 0
+    /* Same position, no write since it was read: answer from memory */
+    cached = seek_cache_lookup_locked(shard, &seekto);
+    if (cached) {
+        pthread_mutex_unlock(&shard->file_mutex);
+        result = send_response(conn, cached->data, cached->size, "handle_seekto_command");
+        shared_buf_put(cached);
+        return result;
+    }
+#endif
 
-    data_fd = open(DATA_FILE, O_RDWR | O_CLOEXEC);
+    data_fd = open(shard->data_file, O_RDWR | O_CLOEXEC);
     if (data_fd == -1) {
         syslog(LOG_ERR, "handle_seekto_command: failed to open %s: %s",
-               DATA_FILE, strerror(errno));
-        pthread_mutex_unlock(&file_mutex);
+               shard->data_file, strerror(errno));
+        pthread_mutex_unlock(&shard->file_mutex);
         return -1;
     }
 
@@ -736,7 +2273,7 @@ static int handle_seekto_command(int client_fd, const char *packet)
         syslog(LOG_ERR, "handle_seekto_command: AESDCHAR_IOCSEEKTO ioctl failed: %s",
                strerror(errno));
         close(data_fd);
-        pthread_mutex_unlock(&file_mutex);
+        pthread_mutex_unlock(&shard->file_mutex);
         return -1;
     }
 
@@ -744,10 +2281,15 @@ static int handle_seekto_command(int client_fd, const char *packet)
      * Read from the SAME fd (f_pos is now at the seeked offset).  Closing
      * data_fd and opening a new fd would reset f_pos to 0.
      */
-    content = read_entire_file(data_fd, &content_size);
+    content = read_entire_file(data_fd, &content_size, &conn->mem);
     close(data_fd);
 
-    pthread_mutex_unlock(&file_mutex);
+#if SEEK_CACHE_SLOTS > 0
+    if (content)
+        cached = seek_cache_insert_locked(shard, &seekto, content, content_size, &conn->mem);
+#endif
+
+    pthread_mutex_unlock(&shard->file_mutex);
 
     /* Fix 4: Send buffer to client outside the lock */
     if (!content) {
@@ -755,85 +2297,569 @@ static int handle_seekto_command(int client_fd, const char *packet)
         return -1;
     }
 
-    size_t sent = 0;
-    while (sent < content_size) {
-        ssize_t n = send(client_fd, content + sent, content_size - sent, 0);
+#if SEEK_CACHE_SLOTS > 0
+    if (cached) {
+        result = send_response(conn, cached->data, cached->size, "handle_seekto_command");
+        shared_buf_put(cached);
+        return result;
+    }
+#endif
+
+    result = send_response(conn, content, content_size, "handle_seekto_command");
+
+    free(content);
+    mem_uncharge(&conn->mem, content_size);
+    return result;
+}
+
+#endif /* USE_AESD_CHAR_DEVICE */
+
+
+/* ==================================================================
+ * Query commands (AESD_TAIL / AESD_RANGE / AESD_GREP) – both backends.
+ *
+ * Each command takes one consistent copy of the connection's shard under
+ * file_mutex (the same read as a normal readback), releases the lock, and
+ * sends only the selected lines.  TAIL and RANGE select a contiguous slice
+ * of that copy, so nothing else is allocated.  GREP compacts matching lines
+ * towards the front of the copy in place and flushes every
+ * QUERY_FLUSH_SIZE bytes, so results start flowing before the scan ends.
+ * ================================================================== */
+
+/*
+ * query_read_backend - Read the connection's shard into a buffer charged to
+ * conn->mem.  A regular file that does not exist yet reads as empty.
+ * Returns 0 and sets *out and *out_size (*out is NULL when empty), or -1.
+ */
+static int query_read_backend(struct connection_ctx *conn, char **out, size_t *out_size)
+{
+    struct shard *shard = conn->shard;
+    int fd;
+
+    *out = NULL;
+    *out_size = 0;
+
+    shard_lock(shard);
+    fd = open(shard->data_file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        int err = errno;
+        pthread_mutex_unlock(&shard->file_mutex);
+        if (err == ENOENT)
+            return 0;
+        syslog(LOG_ERR, "query: failed to open %s: %s", shard->data_file, strerror(err));
+        return -1;
+    }
+    *out = read_entire_file(fd, out_size, &conn->mem);
+    close(fd);
+    pthread_mutex_unlock(&shard->file_mutex);
+
+    if (!*out) {
+        syslog(LOG_ERR, "query: read_entire_file failed");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * parse_query_number - strtoul with the seekto parser's checks (no sign, no
+ * empty field, ERANGE).  *endptr is left after the digits.
+ */
+static int parse_query_number(const char *str, char **endptr, size_t *out)
+{
+    unsigned long long value;
+
+    if (*str < '0' || *str > '9')
+        return -1;
+    errno = 0;
+    value = strtoull(str, endptr, 10);
+    if (errno == ERANGE || value > SIZE_MAX)
+        return -1;
+    *out = (size_t)value;
+    return 0;
+}
+
+/* True if the command argument ends at the packet newline or NUL (Fix 12) */
+static bool query_args_end(const char *p)
+{
+    return *p == '\n' || *p == '\0';
+}
+
+/*
+ * send_query_result - Send [start, end) of a query buffer, or
+ * QUERY_EMPTY_RESPONSE when it is empty, then release the buffer.
+ */
+static int send_query_result(struct connection_ctx *conn, char *content, size_t size,
+                             size_t start, size_t end, const char *who)
+{
+    int result;
+
+    if (end > start)
+        result = send_response(conn, content + start, end - start, who);
+    else
+        result = send_response(conn, QUERY_EMPTY_RESPONSE,
+                               strlen(QUERY_EMPTY_RESPONSE), who);
+    free(content);
+    mem_uncharge(&conn->mem, size);
+    return result;
+}
+
+/*
+ * handle_tail_command - AESD_TAIL:n, the last n lines.
+ */
+static int handle_tail_command(struct connection_ctx *conn, const char *packet)
+{
+    char *content, *endptr;
+    size_t n, size, start;
+
+    if (parse_query_number(packet + strlen(TAIL_CMD_PREFIX), &endptr, &n) == -1 ||
+        !query_args_end(endptr)) {
+        syslog(LOG_ERR, "handle_tail_command: invalid argument from %s", conn->client_ip);
+        return -1;
+    }
+    if (query_read_backend(conn, &content, &size) == -1)
+        return -1;
+
+    /*
+     * Walk back over n line terminators; the trailing newline ends the last
+     * line rather than starting an empty one.  Fewer than n lines: everything.
+     */
+    start = size;
+    if (n > 0) {
+        size_t scan = (size > 0 && content[size - 1] == '\n') ? size - 1 : size;
+        char *nl = NULL;
+
+        while (n > 0 && (nl = memrchr(content, '\n', scan)) != NULL) {
+            scan = (size_t)(nl - content);
+            n--;
+        }
+        start = nl ? scan + 1 : 0;
+    }
+
+    return send_query_result(conn, content, size, start, size, "handle_tail_command");
+}
+
+/*
+ * handle_range_command - AESD_RANGE:a,b, lines a..b inclusive (0-based).
+ * A range past the end returns what exists; a > b is rejected.
+ */
+static int handle_range_command(struct connection_ctx *conn, const char *packet)
+{
+    char *content, *endptr;
+    size_t first, last, size, pos = 0, line = 0, start = SIZE_MAX;
+
+    if (parse_query_number(packet + strlen(RANGE_CMD_PREFIX), &endptr, &first) == -1 ||
+        *endptr != ',' ||
+        parse_query_number(endptr + 1, &endptr, &last) == -1 ||
+        !query_args_end(endptr) || first > last) {
+        syslog(LOG_ERR, "handle_range_command: invalid arguments from %s", conn->client_ip);
+        return -1;
+    }
+    if (query_read_backend(conn, &content, &size) == -1)
+        return -1;
+
+    while (pos < size) {
+        char *nl = memchr(content + pos, '\n', size - pos);
+        size_t next = nl ? (size_t)(nl - content) + 1 : size;
+
+        if (line == first)
+            start = pos;
+        if (line == last) {
+            pos = next;
+            break;
+        }
+        line++;
+        pos = next;
+    }
+    if (start == SIZE_MAX)
+        start = pos;  /* line first never reached: empty result */
+
+    return send_query_result(conn, content, size, start, pos, "handle_range_command");
+}
+
+/*
+ * handle_grep_command - AESD_GREP:pattern, matching lines in order.
+ *
+ * REG_STARTEND matches each line in place without NUL-terminating it.
+ * Matches are moved towards the front of the buffer (the write cursor never
+ * passes the read cursor) and sent every QUERY_FLUSH_SIZE bytes, or all at
+ * once as a single frame when the connection negotiated compression.
+ */
+static int handle_grep_command(struct connection_ctx *conn, const char *packet)
+{
+    const char *pattern = packet + strlen(GREP_CMD_PREFIX);
+    size_t pattern_len = strcspn(pattern, "\n");
+    char pattern_buf[256];
+    char *content;
+    size_t size, pos = 0, out = 0;
+    bool flushed = false;
+    regex_t re;
+    int rc, result = 0;
+
+    /* The length bound also bounds regcomp()'s stack depth (CORO_STACK_SIZE) */
+    if (pattern_len == 0 || pattern_len >= sizeof(pattern_buf)) {
+        syslog(LOG_ERR, "handle_grep_command: invalid pattern length from %s",
+               conn->client_ip);
+        return -1;
+    }
+    memcpy(pattern_buf, pattern, pattern_len);
+    pattern_buf[pattern_len] = '\0';
+
+    rc = regcomp(&re, pattern_buf, REG_EXTENDED | REG_NOSUB);
+    if (rc != 0) {
+        char msg[128];
+        regerror(rc, &re, msg, sizeof(msg));
+        syslog(LOG_ERR, "handle_grep_command: bad pattern from %s: %s", conn->client_ip, msg);
+        return -1;
+    }
+
+    if (query_read_backend(conn, &content, &size) == -1) {
+        regfree(&re);
+        return -1;
+    }
+
+    while (pos < size && result == 0) {
+        char *nl = memchr(content + pos, '\n', size - pos);
+        size_t next = nl ? (size_t)(nl - content) + 1 : size;
+        regmatch_t m;
+
+        m.rm_so = 0;
+        m.rm_eo = (regoff_t)(next - pos - (nl ? 1 : 0));
+        if (regexec(&re, content + pos, 1, &m, REG_STARTEND) == 0) {
+            memmove(content + out, content + pos, next - pos);
+            out += next - pos;
+            if (out >= QUERY_FLUSH_SIZE && !conn->compress) {
+                result = send_to_client(conn, content, out, NULL, "handle_grep_command");
+                out = 0;
+                flushed = true;
+            }
+        }
+        pos = next;
+    }
+    regfree(&re);
+
+    /* Matches already sent: only what is left, if anything, follows them */
+    if (result == -1 || (flushed && out == 0)) {
+        free(content);
+        mem_uncharge(&conn->mem, size);
+        return result;
+    }
+    return send_query_result(conn, content, size, 0, out, "handle_grep_command");
+}
+
+/* ==================================================================
+ * Replication callbacks (see replication.h).
+ *
+ * The replication threads call these without holding any lock; each one
+ * takes file_mutex itself, keeping the file_mutex -> repl_mutex order.
+ * Replication carries no shard information, so main() only enables it with
+ * a single shard and these always use shards[0].
+ * Applied writes go through the normal backend write path, so an instance
+ * that is both a follower and a primary re-publishes them downstream.
+ * ================================================================== */
+
+/*
+ * repl_snapshot_backend - Copy the whole backend for a follower that cannot
+ * resume from the backlog.  For the char device this is the driver's ring
+ * (the last AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED lines).
+ */
+static char *repl_snapshot_backend(size_t *out_size, uint64_t *out_epoch,
+                                   uint64_t *out_seq)
+{
+    struct shard *shard = &shards[0];
+    char *content = NULL;
+    int fd;
+
+    shard_lock(shard);
+    fd = open(shard->data_file, O_RDONLY | O_CLOEXEC);
+    if (fd != -1) {
+        content = read_entire_file(fd, out_size, NULL);
+        close(fd);
+    } else if (errno == ENOENT) {
+        content = malloc(1);  /* no data file yet: empty snapshot */
+        *out_size = 0;
+    }
+    repl_position(out_epoch, out_seq);
+    pthread_mutex_unlock(&shard->file_mutex);
+
+    if (!content)
+        syslog(LOG_ERR, "Failed to snapshot %s for replication", shard->data_file);
+    return content;
+}
+
+/*
+ * repl_apply_write - Append one replicated write to the local backend.
+ */
+static int repl_apply_write(const char *data, size_t length)
+{
+    struct shard *shard = &shards[0];
+#if USE_AESD_CHAR_DEVICE
+    int fd, ret;
+
+    shard_lock(shard);
+    fd = open(shard->data_file, O_WRONLY | O_CLOEXEC);
+    if (fd == -1) {
+        syslog(LOG_ERR, "repl_apply_write: open for write failed: %s", strerror(errno));
+        pthread_mutex_unlock(&shard->file_mutex);
+        return -1;
+    }
+    ret = write_all_chardev(shard, fd, data, length, "repl_apply_write");
+    close(fd);
+    pthread_mutex_unlock(&shard->file_mutex);
+    return ret;
+#else
+    return write_data_to_file(shard, data, length);
+#endif
+}
+
+/*
+ * repl_apply_snapshot - Replace the local backend content with a snapshot.
+ *
+ * The regular file is truncated and rewritten, and any downstream followers
+ * are moved to a new epoch.  The char device cannot be truncated: the
+ * snapshot lines are appended instead, which leaves the ring identical to
+ * the primary's once it holds a full ring's worth of lines.
+ */
+static int repl_apply_snapshot(const char *data, size_t length)
+{
+    struct shard *shard = &shards[0];
+#if USE_AESD_CHAR_DEVICE
+    (void)shard;
+    return repl_apply_write(data, length);
+#else
+    size_t total_written = 0;
+    int fd;
+
+    shard_lock(shard);
+
+    fd = open(shard->data_file, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        syslog(LOG_ERR, "Failed to open %s: %s", shard->data_file, strerror(errno));
+        pthread_mutex_unlock(&shard->file_mutex);
+        return -1;
+    }
+
+    shard_invalidate_locked(shard);
+
+    while (total_written < length) {
+        ssize_t n = write(fd, data + total_written, length - total_written);
         if (n == -1) {
             if (errno == EINTR)
                 continue;
-            syslog(LOG_ERR, "handle_seekto_command: send failed: %s", strerror(errno));
-            result = -1;
+            syslog(LOG_ERR, "Failed to write to %s: %s", shard->data_file, strerror(errno));
             break;
         }
-        sent += (size_t)n;
+        total_written += (size_t)n;
     }
+    close(fd);
 
-    free(content);
-    return result;
+    repl_publish_reset();
+    pthread_mutex_unlock(&shard->file_mutex);
+    return total_written == length ? 0 : -1;
+#endif
 }
 
-#endif /* USE_AESD_CHAR_DEVICE */
+/*
+ * handle_compress_command - AESD_COMPRESS:lz4 or AESD_COMPRESS:none.
+ */
+static int handle_compress_command(struct connection_ctx *conn, const char *packet)
+{
+    const char *codec = packet + strlen(COMPRESS_CMD_PREFIX);
+    size_t codec_len = strcspn(codec, "\n");
+    bool enable;
+
+    if (codec_len == 3 && strncmp(codec, "lz4", 3) == 0) {
+        enable = true;
+    } else if (codec_len == 4 && strncmp(codec, "none", 4) == 0) {
+        enable = false;
+    } else {
+        syslog(LOG_ERR, "handle_compress_command: unsupported codec \"%.*s\" from %s",
+               (int)(codec_len < 32 ? codec_len : 32), codec, conn->client_ip);
+        return -1;
+    }
+
+    conn->compress = false;  /* the acknowledgement itself is plain text */
+    if (send_to_client(conn, enable ? "OK lz4\n" : "OK none\n", enable ? 7 : 8, NULL,
+                       "handle_compress_command") == -1)
+        return -1;
+    conn->compress = enable;
+    syslog(LOG_DEBUG, "Compression %s for %s", enable ? "lz4" : "off", conn->client_ip);
+    return 0;
+}
+
+/*
+ * Socket commands.  A packet starting with one of these prefixes is parsed
+ * and answered by its handler instead of being written to the backend.
+ * Handlers receive the NUL-terminated packet (prefix included) and send
+ * their own response; they return -1 on a malformed command, in which case
+ * nothing is sent, as for a bad seekto.
+ */
+struct socket_command {
+    const char *prefix;
+    int (*handler)(struct connection_ctx *conn, const char *packet);
+};
 
+static const struct socket_command socket_commands[] = {
+#if USE_AESD_CHAR_DEVICE
+    { SEEKTO_CMD_PREFIX, handle_seekto_command },
+#endif
+    { TAIL_CMD_PREFIX,   handle_tail_command },
+    { RANGE_CMD_PREFIX,  handle_range_command },
+    { GREP_CMD_PREFIX,   handle_grep_command },
+    { COMPRESS_CMD_PREFIX, handle_compress_command },
+};
 
 /*
- * is_seekto_command - Return true if the NUL-terminated packet begins with
- * the AESDCHAR_IOCSEEKTO: prefix.
+ * find_socket_command - Return the command whose prefix starts the
+ * NUL-terminated packet, or NULL for a normal data packet.
  *
- * Fix 2: The packet_size parameter has been removed.  In the previous
- * revision it was silently discarded with (void)packet_size, making the
- * signature misleading and producing a -Wunused-parameter warning.  The
- * comparison needs only a NUL-terminated string, which process_complete_packet
- * guarantees before calling this function.  Removing the parameter eliminates
- * both the warning and the false implication that a length is used.
+ * Replaces is_seekto_command.  As before only a NUL-terminated string is
+ * needed (process_complete_packet guarantees one), and strncmp is limited to
+ * the prefix length so the arguments after the prefix are not compared.
+ */
+static const struct socket_command *find_socket_command(const char *packet)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(socket_commands) / sizeof(socket_commands[0]); i++) {
+        const char *prefix = socket_commands[i].prefix;
+        if (strncmp(packet, prefix, strlen(prefix)) == 0)
+            return &socket_commands[i];
+    }
+    return NULL;
+}
+
+#if USE_AESD_CHAR_DEVICE
+/*
+ * packet_may_be_command - Return true if the first length bytes of a
+ * (possibly incomplete, not NUL-terminated) packet match the start of a
+ * command prefix.  Such packets must be buffered whole, because commands are
+ * parsed rather than written to the backend.
+ */
+static bool packet_may_be_command(const char *packet, size_t length)
+{
+    size_t i;
+
+    for (i = 0; i < sizeof(socket_commands) / sizeof(socket_commands[0]); i++) {
+        const char *prefix = socket_commands[i].prefix;
+        size_t prefix_len = strlen(prefix);
+
+        if (memcmp(packet, prefix, length < prefix_len ? length : prefix_len) == 0)
+            return true;
+    }
+    return false;
+}
+#endif /* USE_AESD_CHAR_DEVICE */
+
+/*
+ * shard_for_key - Map a routing key to a shard with 32-bit FNV-1a.  The
+ * mapping is stable for a given -o list, so a key always lands on the same
+ * backend across connections and restarts.
+ */
+static struct shard *shard_for_key(const char *key, size_t length)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= 16777619u;
+    }
+    return &shards[hash % shard_count];
+}
+
+/*
+ * route_packet - Select conn->shard for the packet starting at 'packet' (the
+ * first 'length' bytes received so far).  A "key|" prefix moves the
+ * connection to the key's shard; anything else stays on the current one.
+ * See SHARD_KEY_DELIM.
  *
- * strncmp is length-limited to strlen(SEEKTO_CMD_PREFIX) to perform a prefix
- * match only; the packet also contains "X,Y\n" after the prefix.
+ * Returns the offset of the text after the key (0 when there is none), where
+ * the packet to write or the command starts, so "key|hello\n" writes
+ * "hello\n" and "key|AESD_TAIL:5" queries the key's shard.
  */
-static bool is_seekto_command(const char *packet)
+static size_t route_packet(struct connection_ctx *conn, const char *packet, size_t length)
 {
-    return strncmp(packet, SEEKTO_CMD_PREFIX, strlen(SEEKTO_CMD_PREFIX)) == 0;
+    size_t limit = length < SHARD_KEY_MAX ? length : SHARD_KEY_MAX;
+    size_t i;
+
+    if (shard_count == 1)
+        return 0;
+
+    for (i = 0; i < limit && packet[i] != '\n'; i++) {
+        if (packet[i] == SHARD_KEY_DELIM) {
+            if (i == 0)
+                return 0;
+            conn->shard = shard_for_key(packet, i);
+            return i + 1;
+        }
+    }
+    return 0;
 }
 
 /*
  * process_complete_packet - Dispatch a fully received newline-terminated packet.
  *
  * NUL-terminates packet_buffer (using the +1 byte reserved at allocation time)
- * so that is_seekto_command() can call strncmp safely.
+ * so that find_socket_command() can call strncmp safely.
  *
- * Fix 3: client_ip is conditionally compiled.  It is only referenced on the
- * USE_AESD_CHAR_DEVICE=1 path (as context for the seekto log message).  When
- * the regular-file backend is active the parameter would be unused and would
- * cause a -Wunused-parameter warning.  Conditional compilation is cleaner than
- * a silent (void) cast because it accurately reflects that the parameter does
- * not exist in the regular-file variant rather than pretending it does.
+ * The connection context carries the client fd (for the response) and the
+ * client address (as context for the seekto log message).  It replaced the
+ * separate client_fd / client_ip parameters, which also removes the need to
+ * conditionally compile client_ip out of the regular-file variant (Fix 3).
  */
-static int process_complete_packet(int client_fd,
-#if USE_AESD_CHAR_DEVICE
-                                   const char *client_ip,
-#endif
+static int process_complete_packet(struct connection_ctx *conn,
                                    char *packet_buffer, size_t packet_size)
 {
-    /* NUL-terminate for is_seekto_command; buffer has capacity+1 bytes */
+    const struct socket_command *command;
+    size_t body;
+
+    /* NUL-terminate for find_socket_command; buffer has capacity+1 bytes */
     packet_buffer[packet_size] = '\0';
 
-#if USE_AESD_CHAR_DEVICE
-    if (is_seekto_command(packet_buffer)) {
-        syslog(LOG_DEBUG, "Received seekto command from %s: %.*s",
-               client_ip,
+    body = route_packet(conn, packet_buffer, packet_size);
+
+    command = find_socket_command(packet_buffer + body);
+    if (command) {
+        syslog(LOG_DEBUG, "Received command from %s: %.*s",
+               conn->client_ip,
                (int)(packet_size > 0 ? packet_size - 1 : 0),
                packet_buffer);
-        return handle_seekto_command(client_fd, packet_buffer);
+        return command->handler(conn, packet_buffer + body);
+    }
+
+#if USE_AESD_CHAR_DEVICE
+    /* Followers are read-only: the packet is dropped, the readback still sent */
+    if (repl_is_follower()) {
+        syslog(LOG_WARNING, "Follower: ignoring write from %s", conn->client_ip);
+        shard_lock(conn->shard);
+        return readback_unlock_and_send_chardev(conn, "process_complete_packet");
     }
     /* Normal (non-seek) packet: write to device then echo full content back */
-    return write_and_readback_chardev(client_fd, packet_buffer, packet_size);
+    return write_and_readback_chardev(conn, packet_buffer + body, packet_size - body);
 #else
+    if (repl_is_follower()) {
+        syslog(LOG_WARNING, "Follower: ignoring write from %s", conn->client_ip);
+        return read_and_send_file(conn);
+    }
     /* Regular-file path: append to file then echo full file content back */
-    if (write_data_to_file(packet_buffer, packet_size) == 0)
-        return read_and_send_file(client_fd);
+    if (write_data_to_file(conn->shard, packet_buffer + body, packet_size - body) == 0)
+        return read_and_send_file(conn);
     return -1;
 #endif
 }
 
+/*
+ * packet_done - Bookkeeping after each packet: record the size of its
+ * response (-c), so aesdreplay knows where each response ends, and start
+ * timing the pause before the next one.
+ */
+static void packet_done(struct connection_ctx *conn)
+{
+    capture_response(conn->capture_id, conn->bytes_sent);
+    conn->bytes_sent = 0;
+    conn->idle_since_ms = monotonic_ms();
+}
+
 /*
  * add_thread_to_list - Prepend a new thread node to the management list.
  */
@@ -869,9 +2895,14 @@ static void add_thread_to_list(pthread_t thread_id, int client_fd,
  * pthread_equal() is used instead of == because pthread_t is an opaque type
  * that may be a struct on some platforms; direct == comparison would be
  * undefined in that case.
+ *
+ * Returns true if the node was found.  When it was not, wait_for_all_threads
+ * has already taken it and will join the thread.
  */
-static void remove_thread_from_list(pthread_t thread_id)
+static bool remove_thread_from_list(pthread_t thread_id)
 {
+    bool found = false;
+
     pthread_mutex_lock(&thread_list_mutex);
 
     struct thread_node **indirect = &thread_list_head;
@@ -880,12 +2911,14 @@ static void remove_thread_from_list(pthread_t thread_id)
             struct thread_node *to_free = *indirect;
             *indirect = to_free->next;
             free(to_free);
+            found = true;
             break;
         }
         indirect = &(*indirect)->next;
     }
 
     pthread_mutex_unlock(&thread_list_mutex);
+    return found;
 }
 
 /*
@@ -934,7 +2967,52 @@ static void set_socket_timeout(int fd, int timeout_sec)
 }
 
 /*
- * connection_handler - Handle one client connection in its own thread.
+ * park_connection - Hand an idle connection to the parker (idlepark.c) for
+ * up to timeout_ms.  Its packet_buffer must already be back in the pool.
+ * Returns 0 when the parker owns the connection: it may already be running
+ * again elsewhere, so the caller must return without touching it.  Returns
+ * -1 when it could not be parked; the caller then closes it.
+ */
+static int park_connection(struct connection_ctx *conn,
+                           const struct sockaddr_in *client_addr, int timeout_ms)
+{
+    struct thread_args *args;
+    struct connection_ctx *saved;
+
+#if HAVE_MSG_ZEROCOPY
+    /* The copy must not hold buffers charged to this thread's conn->mem */
+    if (conn->zc_pending && zerocopy_wait(conn, ZEROCOPY_REAP_TIMEOUT_MS) == -1) {
+        zerocopy_abandon(conn);
+        return -1;
+    }
+#endif
+    args = malloc(sizeof(*args));
+    saved = malloc(sizeof(*saved));
+    if (!args || !saved) {
+        free(args);
+        free(saved);
+        return -1;
+    }
+
+    /* The copy is registered again by whichever thread resumes it */
+    mem_account_unregister(&conn->mem);
+    /* An armed registration would wake this (finished) coroutine */
+    coro_forget_fd(conn->client_fd);
+    *saved = *conn;
+    args->client_fd   = conn->client_fd;
+    args->client_addr = *client_addr;
+    args->resume      = saved;
+
+    if (idle_park(conn->client_fd, timeout_ms, args) == 0)
+        return 0;
+    free(saved);
+    free(args);
+    return -1;
+}
+
+/*
+ * serve_connection - Handle one client connection, on its own thread
+ * (connection_handler) or in a coroutine (-C).
  *
  * Accumulates received bytes into packet_buffer until a '\n' is found, then
  * calls process_complete_packet.  Multiple packets may arrive within a single
@@ -954,20 +3032,63 @@ static void set_socket_timeout(int fd, int timeout_sec)
  * Fix 14: close(client_fd) is guarded with (client_fd != -1).
  * cleanup_resources() now calls shutdown() only (not close()) on client fds
  * to unblock recv() without closing the fd, leaving the close to this thread.
+ *
+ * Char-device builds stage packets longer than STREAM_WINDOW_SIZE in a file
+ * and commit them to the driver once complete, so packet_buffer stays at
+ * window size however large the packet.  Every exit path goes through
+ * close_connection so an interrupted stream's staging file is always dropped.
+ *
+ * Between packets the connection may be parked (see IDLE_PARK_GRACE_MS), in
+ * which case this returns with the connection still open, and the parker
+ * later calls it again with thread_args->resume set to the saved state.
  */
-static void *connection_handler(void *arg)
+static void serve_connection(void *arg)
 {
     struct thread_args *thread_args = (struct thread_args *)arg;
     int client_fd = thread_args->client_fd;
     struct sockaddr_in client_addr = thread_args->client_addr;
+    struct connection_ctx *resume = thread_args->resume;
     free(thread_args);
 
-    char client_ip[INET_ADDRSTRLEN];
-    inet_ntop(AF_INET, &client_addr.sin_addr, client_ip, sizeof(client_ip));
+    struct connection_ctx conn;
+    if (resume) {
+        /* Back from the parker: the client sent more, or hung up */
+        conn = *resume;
+        free(resume);
+        conn_idle_ended(&conn);
+    } else {
+        memset(&conn, 0, sizeof(conn));
+        conn.client_fd = client_fd;
+#if USE_AESD_CHAR_DEVICE
+        conn.stream_fd = -1;
+#endif
+        inet_ntop(AF_INET, &client_addr.sin_addr, conn.client_ip, sizeof(conn.client_ip));
+        /* Unkeyed packets from this client go to the shard of its address */
+        conn.shard = shard_for_key(conn.client_ip, strlen(conn.client_ip));
+    }
+    const char *client_ip = conn.client_ip;
+    mem_account_register(&conn.mem, client_ip);
+
+    if (!resume) {
+        syslog(LOG_INFO, "Accepted connection from %s", client_ip);
+        conn.capture_id = capture_open();
 
-    syslog(LOG_INFO, "Accepted connection from %s", client_ip);
+        set_socket_timeout(client_fd, CLIENT_TIMEOUT_SEC);
 
-    set_socket_timeout(client_fd, 5); /* 5-second timeout on receive and send */
+#if HAVE_MSG_ZEROCOPY
+        /*
+         * SO_ZEROCOPY must be set before MSG_ZEROCOPY is honoured.  Kernels
+         * older than 4.14 reject it with ENOPROTOOPT; such connections use
+         * the copy path.  Coroutines also use the copy path: zerocopy_wait()
+         * blocks in poll().
+         */
+        if (zerocopy_threshold > 0 && !coro_active()) {
+            int one = 1;
+            conn.zerocopy = setsockopt(client_fd, SOL_SOCKET, SO_ZEROCOPY,
+                                       &one, sizeof(one)) == 0;
+        }
+#endif
+    }
 
     char *packet_buffer = NULL;
     char recv_buffer[RECV_BUFFER_SIZE];
@@ -976,23 +3097,47 @@ static void *connection_handler(void *arg)
     ssize_t bytes_received;
 
     /*
-     * Allocate +1 byte beyond buffer_capacity so process_complete_packet
+     * The buffer has +1 byte beyond buffer_capacity so process_complete_packet
      * can NUL-terminate without a buffer overrun.  buffer_capacity
      * intentionally excludes this byte so all size comparisons against
      * MAX_PACKET_SIZE and the growth-doubling logic remain correct.
      */
-    packet_buffer = malloc(buffer_capacity + 1);
+    packet_buffer = packet_buffer_get(&conn);
     if (!packet_buffer) {
         syslog(LOG_ERR, "Failed to allocate packet buffer for %s", client_ip);
-        close(client_fd);
-        remove_thread_from_list(pthread_self());
-        return NULL;
+        goto close_connection;
     }
 
     /* Main receive loop */
     while (!shutdown_requested) {
+#if USE_AESD_CHAR_DEVICE
+        bool between_packets = packet_size == 0 && conn.stream_fd == -1;
+#else
+        bool between_packets = packet_size == 0;
+#endif
+        /*
+         * After a packet, give the client IDLE_PARK_GRACE_MS to go on before
+         * parking the connection; its remaining idle time is spent parked.
+         */
+        if (between_packets && conn.idle_since_ms != 0) {
+            int idle_ms = idle_timeout_ms(&conn);
+            int ready = conn_wait_readable(&conn, IDLE_PARK_GRACE_MS);
+
+            if (ready == -1)
+                break;
+            if (ready == 0) {
+                packet_buffer_put(&conn, packet_buffer, buffer_capacity);
+                packet_buffer = NULL;
+                if (park_connection(&conn, &client_addr, idle_ms - IDLE_PARK_GRACE_MS) == 0)
+                    return;
+                if (!shutdown_requested)
+                    syslog(LOG_ERR, "Failed to park idle connection from %s", client_ip);
+                goto close_connection;
+            }
+        }
+
         /* Fix 10: use full recv_buffer; it is a raw byte staging area only */
-        bytes_received = recv(client_fd, recv_buffer, sizeof(recv_buffer), 0);
+        bytes_received = conn_recv(&conn, recv_buffer, sizeof(recv_buffer));
 
         if (bytes_received <= 0) {
             if (bytes_received == 0) {
@@ -1005,6 +3150,8 @@ static void *connection_handler(void *arg)
             }
             break;
         }
+        capture_data(conn.capture_id, recv_buffer, (size_t)bytes_received);
+        conn_idle_ended(&conn);
 
         /* Scan the received chunk for newlines, dispatching each complete packet */
         char *current_pos = recv_buffer;
@@ -1016,54 +3163,65 @@ static void *connection_handler(void *arg)
                 ? (size_t)(newline_pos - current_pos) + 1
                 : remaining;
 
-            /* Reject packets exceeding the configured size limit */
-            if (packet_size + chunk_size > MAX_PACKET_SIZE) {
-                syslog(LOG_ERR, "Packet from %s exceeds maximum size", client_ip);
-                free(packet_buffer);
-                close(client_fd);
-                remove_thread_from_list(pthread_self());
-                return NULL;
+#if USE_AESD_CHAR_DEVICE
+            /*
+             * A packet that is streaming bypasses packet_buffer: each chunk is
+             * staged as it arrives and the newline commits it to the device
+             * (see chardev_stream_begin).
+             */
+            if (conn.stream_fd != -1) {
+                if (conn.stream_size + chunk_size > MAX_PACKET_SIZE) {
+                    syslog(LOG_ERR, "Packet from %s exceeds maximum size", client_ip);
+                    goto close_connection;
+                }
+                if (chardev_stream_write(&conn, current_pos, chunk_size) == -1)
+                    goto close_connection;
+                current_pos += chunk_size;
+                remaining   -= chunk_size;
+                if (newline_pos) {
+                    chardev_stream_end(&conn, true);
+                    packet_done(&conn);
+                }
+                continue;
             }
 
-            /* Expand the packet buffer if the new chunk would overflow it */
-            if (packet_size + chunk_size > buffer_capacity) {
-                size_t new_capacity = buffer_capacity * 2;
-                while (new_capacity < packet_size + chunk_size)
-                    new_capacity *= 2;
-                if (new_capacity > MAX_PACKET_SIZE)
-                    new_capacity = MAX_PACKET_SIZE;
-
-                /* +1 preserves the NUL-terminator slot on every reallocation */
-                char *new_buffer = realloc(packet_buffer, new_capacity + 1);
-                if (!new_buffer) {
-                    syslog(LOG_ERR, "Failed to expand packet buffer for %s", client_ip);
-                    free(packet_buffer);
-                    close(client_fd);
-                    remove_thread_from_list(pthread_self());
-                    return NULL;
-                }
-                packet_buffer  = new_buffer;
-                buffer_capacity = new_capacity;
+            /* Start streaming once an incomplete, non-command packet outgrows the window */
+            if (!newline_pos && packet_size + chunk_size > STREAM_WINDOW_SIZE &&
+                !packet_may_be_command(packet_buffer, packet_size) &&
+                !repl_is_follower()) {
+                size_t body = route_packet(&conn, packet_buffer, packet_size);
+
+                if (chardev_stream_begin(&conn, packet_buffer + body, packet_size - body) == -1)
+                    goto close_connection;
+                packet_size = 0;
+                continue; /* re-dispatch this chunk through the streaming branch */
             }
+#endif
 
-            memcpy(packet_buffer + packet_size, current_pos, chunk_size);
-            packet_size += chunk_size;
+            if (packet_buffer_append(&conn, &packet_buffer, &buffer_capacity,
+                                     &packet_size, current_pos, chunk_size) == -1)
+                goto close_connection;
             current_pos += chunk_size;
             remaining   -= chunk_size;
 
             /* A complete newline-terminated packet has been assembled */
             if (newline_pos) {
-                process_complete_packet(client_fd,
-#if USE_AESD_CHAR_DEVICE
-                                        client_ip,
-#endif
-                                        packet_buffer, packet_size);
+                process_complete_packet(&conn, packet_buffer, packet_size);
+                packet_done(&conn);
                 packet_size = 0; /* Reset for the next packet in this connection */
+                packet_buffer_trim(&conn, &packet_buffer, &buffer_capacity);
             }
         }
     }
 
-    free(packet_buffer);
+close_connection:
+#if USE_AESD_CHAR_DEVICE
+    /* Disconnected or failed mid-stream: drop the staged packet */
+    if (conn.stream_fd != -1)
+        chardev_stream_end(&conn, false);
+#endif
+
+    packet_buffer_put(&conn, packet_buffer, buffer_capacity);
 
     /*
      * Fix 14: Guard the close.  cleanup_resources() calls shutdown() (not
@@ -1072,12 +3230,32 @@ static void *connection_handler(void *arg)
      * safety net in case client_fd somehow became -1, which is not a valid
      * fd to close().
      */
+#if HAVE_MSG_ZEROCOPY
+    /* Closing the socket does not stop the kernel reading unacked buffers */
+    if (conn.zc_pending &&
+        (shutdown_requested || zerocopy_wait(&conn, ZEROCOPY_REAP_TIMEOUT_MS) == -1))
+        zerocopy_abandon(&conn);
+#endif
+
     if (client_fd != -1)
         close(client_fd);
 
+    capture_close(conn.capture_id);
+    mem_account_unregister(&conn.mem);
     syslog(LOG_INFO, "Closed connection from %s", client_ip);
-    remove_thread_from_list(pthread_self());
+}
 
+/*
+ * connection_handler - Thread entry point: serve the connection, then take
+ * this thread off the management list.  A thread that removed its own node
+ * is never joined, so it detaches; with parking, connections come and go on
+ * short-lived threads and each would otherwise keep its stack.
+ */
+static void *connection_handler(void *arg)
+{
+    serve_connection(arg);
+    if (remove_thread_from_list(pthread_self()))
+        pthread_detach(pthread_self());
     return NULL;
 }
 
@@ -1135,14 +3313,19 @@ static int run_as_daemon(void)
 static int verify_device_exists(void)
 {
 #if USE_AESD_CHAR_DEVICE
-    struct stat st;
-    if (stat(DATA_FILE, &st) == -1) {
-        syslog(LOG_ERR, "Device %s does not exist. Is the driver loaded?", DATA_FILE);
-        return -1;
-    }
-    if (!S_ISCHR(st.st_mode)) {
-        syslog(LOG_ERR, "%s is not a character device", DATA_FILE);
-        return -1;
+    unsigned int i;
+
+    for (i = 0; i < shard_count; i++) {
+        struct stat st;
+        if (stat(shards[i].data_file, &st) == -1) {
+            syslog(LOG_ERR, "Device %s does not exist. Is the driver loaded?",
+                   shards[i].data_file);
+            return -1;
+        }
+        if (!S_ISCHR(st.st_mode)) {
+            syslog(LOG_ERR, "%s is not a character device", shards[i].data_file);
+            return -1;
+        }
     }
 #endif
     return 0;
@@ -1160,6 +3343,8 @@ static int verify_device_exists(void)
  */
 static void cleanup_resources(void)
 {
+    unsigned int i;
+
     shutdown_requested = true;
 #if !USE_AESD_CHAR_DEVICE
     pthread_cond_signal(&timestamp_cond);
@@ -1171,6 +3356,12 @@ static void cleanup_resources(void)
         server_fd = -1;
     }
 
+    /*
+     * Close the parked connections before the thread list is walked: any
+     * connection the parker resumes up to here is already on the list.
+     */
+    idle_park_stop();
+
     /*
      * Use shutdown() – not close() – on each client fd.  See Fix 14 note.
      * active is set to false so a subsequent call does not repeat the shutdown.
@@ -1193,14 +3384,31 @@ static void cleanup_resources(void)
 #endif
 
     wait_for_all_threads();
-
+    /* Coroutines see ECANCELED from their next wait and exit the same way */
+    coro_runtime_stop();
+    pthread_attr_destroy(&connection_thread_attr);
+    packet_pool_drain();
+
+    /* After the connection threads: nothing publishes once this returns */
+    repl_stop();
+    capture_stop();
+
+    for (i = 0; i < shard_count; i++) {
+        struct shard *shard = &shards[i];
+        /* Release cached responses (all connection threads have exited) */
+        shard_lock(shard);
+        shard_invalidate_locked(shard);
+        pthread_mutex_unlock(&shard->file_mutex);
 #if !USE_AESD_CHAR_DEVICE
-    if (unlink(DATA_FILE) == -1 && errno != ENOENT)
-        syslog(LOG_WARNING, "Failed to remove data file: %s", strerror(errno));
+        if (unlink(shard->data_file) == -1 && errno != ENOENT)
+            syslog(LOG_WARNING, "Failed to remove %s: %s", shard->data_file,
+                   strerror(errno));
 #endif
-
-    pthread_mutex_destroy(&file_mutex);
+        pthread_mutex_destroy(&shard->file_mutex);
+    }
     pthread_mutex_destroy(&thread_list_mutex);
+    pthread_mutex_destroy(&mem_mutex);
+    pthread_cond_destroy(&mem_cond);
 #if !USE_AESD_CHAR_DEVICE
     pthread_mutex_destroy(&timestamp_mutex);
     pthread_cond_destroy(&timestamp_cond);
@@ -1209,6 +3417,81 @@ static void cleanup_resources(void)
     closelog();
 }
 
+/*
+ * create_worker_thread - pthread_create() with SIGUSR1 blocked in the new
+ * thread.  The mask is inherited from the creating thread, so it is blocked
+ * just around the call.  This steers the usage-report signal to the main
+ * thread, where it interrupts accept() and is handled promptly, instead of
+ * a connection thread whose recv() would merely restart.
+ */
+static int create_worker_thread(pthread_t *thread, const pthread_attr_t *attr,
+                                void *(*start_routine)(void *), void *arg)
+{
+    sigset_t block, saved;
+    int ret;
+
+    sigemptyset(&block);
+    sigaddset(&block, SIGUSR1);
+    pthread_sigmask(SIG_BLOCK, &block, &saved);
+    ret = pthread_create(thread, attr, start_routine, arg);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    return ret;
+}
+
+/*
+ * start_connection - Serve args' connection on a new thread, or in a new
+ * coroutine with -C.  Returns 0 on success; on failure (logged) args and the
+ * client fd stay with the caller.
+ */
+static int start_connection(struct thread_args *args)
+{
+    int client_fd = args->client_fd;
+    struct sockaddr_in client_addr = args->client_addr;
+    pthread_t thread_id;
+    int ret;
+
+    if (coroutine_schedulers > 0) {
+        if (coro_spawn(serve_connection, args) == -1) {
+            syslog(LOG_ERR, "Failed to start connection coroutine");
+            return -1;
+        }
+        return 0;
+    }
+
+    /* args belongs to the new thread from here on: client_fd was copied */
+    ret = create_worker_thread(&thread_id, &connection_thread_attr, connection_handler, args);
+    if (ret != 0) {
+        syslog(LOG_ERR, "Failed to create connection thread: %s", strerror(ret));
+        return -1;
+    }
+    add_thread_to_list(thread_id, client_fd, &client_addr);
+    return 0;
+}
+
+/*
+ * parked_connection_event - idle_park callback, on the parker thread.  A
+ * connection whose client sent again continues on a new thread or
+ * coroutine; one that timed out, or is still parked at shutdown, is closed.
+ */
+static void parked_connection_event(void *ctx, enum idle_park_event event)
+{
+    struct thread_args *args = ctx;
+    struct connection_ctx *conn = args->resume;
+
+    if (event == IDLE_PARK_READY && start_connection(args) == 0)
+        return;
+
+    if (event == IDLE_PARK_TIMEOUT)
+        syslog(LOG_INFO, "Closing idle connection from %s after %d ms",
+               conn->client_ip, idle_timeout_ms(conn));
+    close(conn->client_fd);
+    capture_close(conn->capture_id);
+    syslog(LOG_INFO, "Closed connection from %s", conn->client_ip);
+    free(conn);
+    free(args);
+}
+
 /*
  * handle_accept_error - Decide whether an accept() failure is transient.
  *
@@ -1233,6 +3516,96 @@ static bool handle_accept_error(int err)
     }
 }
 
+/*
+ * parse_size_arg - Parse a non-negative decimal byte count from the command
+ * line.  Uses the same strtoul + endptr + ERANGE checks as the seekto parser
+ * so "12abc", "" and overflowing values are rejected rather than truncated.
+ */
+static int parse_size_arg(const char *str, size_t *out)
+{
+    unsigned long long value;
+    char *endptr;
+
+    if (*str == '-')
+        return -1;
+
+    errno = 0;
+    value = strtoull(str, &endptr, 10);
+    if (endptr == str || *endptr != '\0' || errno == ERANGE || value > SIZE_MAX)
+        return -1;
+
+    *out = (size_t)value;
+    return 0;
+}
+
+/*
+ * parse_port_arg - parse_size_arg() restricted to a usable TCP port.
+ */
+static int parse_port_arg(const char *str, size_t *out)
+{
+    size_t port;
+
+    if (parse_size_arg(str, &port) == -1 || port == 0 || port > UINT16_MAX)
+        return -1;
+    *out = port;
+    return 0;
+}
+
+/*
+ * parse_upstream_arg - Split -R host:port.  The last ':' separates the port so
+ * an unbracketed IPv6 literal still parses.
+ */
+static int parse_upstream_arg(const char *str)
+{
+    const char *colon = strrchr(str, ':');
+    size_t host_len;
+
+    if (!colon || colon == str)
+        return -1;
+    host_len = (size_t)(colon - str);
+    if (host_len >= sizeof(repl_upstream_host))
+        return -1;
+    if (parse_port_arg(colon + 1, &repl_upstream_port) == -1)
+        return -1;
+
+    memcpy(repl_upstream_host, str, host_len);
+    repl_upstream_host[host_len] = '\0';
+    return 0;
+}
+
+/*
+ * print_usage - Describe the command line options on stderr.
+ */
+static void print_usage(const char *prog)
+{
+    fprintf(stderr, "Usage: %s [-d] [-p port] [-o path]... [-z bytes] [-a secs] [-f qlen]\n"
+                    "          [-m bytes] [-P port] [-R host:port] [-c file] [-C n] [-i secs]\n",
+            prog);
+    fprintf(stderr, "  -d        Run as daemon\n");
+    fprintf(stderr, "  -p port   Listen port (default %d)\n", PORT);
+    fprintf(stderr, "  -o path   Data file or device (default %s); repeat for up to %d\n"
+                    "            shards, selected by a \"key%c\" packet prefix or the\n"
+                    "            client address\n", DATA_FILE, MAX_SHARDS, SHARD_KEY_DELIM);
+    fprintf(stderr, "  -z bytes  Send responses of at least this size with MSG_ZEROCOPY\n"
+                    "            (default %d, 0 disables)\n", ZEROCOPY_THRESHOLD_DEFAULT);
+    fprintf(stderr, "  -a secs   Enable TCP_DEFER_ACCEPT with this timeout (default %d)\n",
+            DEFER_ACCEPT_SEC_DEFAULT);
+    fprintf(stderr, "  -f qlen   Enable TCP Fast Open with this queue length (default %d)\n",
+            FASTOPEN_QLEN_DEFAULT);
+    fprintf(stderr, "  -m bytes  Server-wide memory budget for connection buffers\n"
+                    "            (default %d, 0 = unlimited; SIGUSR1 logs usage)\n",
+            MEM_BUDGET_DEFAULT);
+    fprintf(stderr, "  -P port   Serve the replication stream to followers on this port\n");
+    fprintf(stderr, "  -R host:port  Follow the primary at host:port (client writes are\n"
+                    "            ignored; reads are served locally)\n");
+    fprintf(stderr, "  -c file   Record inbound traffic to file for aesdreplay\n");
+    fprintf(stderr, "  -C n      Serve connections as coroutines on n scheduler threads\n"
+                    "            instead of one thread per connection\n");
+    fprintf(stderr, "  -i secs   Longest idle timeout between packets (default %d); each\n"
+                    "            connection's timeout adapts to its pace, at least %d\n",
+            IDLE_TIMEOUT_SEC_DEFAULT, CLIENT_TIMEOUT_SEC);
+}
+
 /*
  * main - Program entry point
  */
@@ -1240,19 +3613,59 @@ int main(int argc, char *argv[])
 {
     struct sockaddr_in client_addr;
     socklen_t client_len;
-    pthread_attr_t thread_attr;
     int i;
 
     for (i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-d") == 0) {
             daemon_mode = true;
+        } else if (strcmp(argv[i], "-z") == 0 && i + 1 < argc &&
+                   parse_size_arg(argv[i + 1], &zerocopy_threshold) == 0) {
+            i++;
+        } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc &&
+                   parse_size_arg(argv[i + 1], &defer_accept_sec) == 0) {
+            i++;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc &&
+                   parse_size_arg(argv[i + 1], &fastopen_qlen) == 0) {
+            i++;
+        } else if (strcmp(argv[i], "-m") == 0 && i + 1 < argc &&
+                   parse_size_arg(argv[i + 1], &mem_budget) == 0) {
+            i++;
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc &&
+                   parse_port_arg(argv[i + 1], &listen_port) == 0) {
+            i++;
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc && argv[i + 1][0] != '\0' &&
+                   shard_count < MAX_SHARDS) {
+            shards[shard_count++].data_file = argv[++i];
+        } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc &&
+                   parse_port_arg(argv[i + 1], &repl_listen_port) == 0) {
+            i++;
+        } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc &&
+                   parse_upstream_arg(argv[i + 1]) == 0) {
+            i++;
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc && argv[i + 1][0] != '\0') {
+            capture_path = argv[++i];
+        } else if (strcmp(argv[i], "-C") == 0 && i + 1 < argc &&
+                   parse_size_arg(argv[i + 1], &coroutine_schedulers) == 0) {
+            i++;
+        } else if (strcmp(argv[i], "-i") == 0 && i + 1 < argc &&
+                   parse_size_arg(argv[i + 1], &idle_timeout_sec) == 0 &&
+                   idle_timeout_sec >= 1 && idle_timeout_sec <= INT_MAX / 1000) {
+            i++;
         } else {
-            fprintf(stderr, "Usage: %s [-d]\n", argv[0]);
-            fprintf(stderr, "  -d    Run as daemon\n");
+            print_usage(argv[0]);
             return EXIT_FAILURE;
         }
     }
 
+    if (shard_count == 0)
+        shards[shard_count++].data_file = DATA_FILE;
+
+    /* The replication stream has no shard field; see repl_snapshot_backend */
+    if (shard_count > 1 && (repl_listen_port > 0 || repl_upstream_port > 0)) {
+        fprintf(stderr, "%s: -P/-R need a single -o endpoint\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
     /*
      * LOG_PID: prepend the process ID to each message – useful when multiple
      *   instances run simultaneously.
@@ -1261,15 +3674,29 @@ int main(int argc, char *argv[])
      */
     openlog("aesdsocket", LOG_PID | LOG_CONS, LOG_USER);
     syslog(LOG_INFO, "Starting aesdsocket%s using endpoint: %s",
-           daemon_mode ? " in daemon mode" : "", DATA_FILE);
+           daemon_mode ? " in daemon mode" : "", shards[0].data_file);
+    if (shard_count > 1)
+        syslog(LOG_INFO, "Sharding packets across %u endpoints", shard_count);
 
     if (verify_device_exists() == -1) {
         closelog();
         return EXIT_FAILURE;
     }
 
-    pthread_mutex_init(&file_mutex, NULL);
+    for (i = 0; i < (int)shard_count; i++)
+        pthread_mutex_init(&shards[i].file_mutex, NULL);
     pthread_mutex_init(&thread_list_mutex, NULL);
+    pthread_mutex_init(&mem_mutex, NULL);
+    pthread_cond_init(&mem_cond, NULL);
+
+    /*
+     * PTHREAD_CREATE_JOINABLE is the default on Linux but is set explicitly
+     * for portability and clarity: we must be able to join threads in
+     * wait_for_all_threads(), which requires joinable state.  The attribute
+     * lives until cleanup_resources(): the parker starts threads too.
+     */
+    pthread_attr_init(&connection_thread_attr);
+    pthread_attr_setdetachstate(&connection_thread_attr, PTHREAD_CREATE_JOINABLE);
 #if !USE_AESD_CHAR_DEVICE
     pthread_mutex_init(&timestamp_mutex, NULL);
     pthread_cond_init(&timestamp_cond, NULL);
@@ -1286,6 +3713,12 @@ int main(int argc, char *argv[])
         return EXIT_FAILURE;
     }
 
+    /* Before run_as_daemon(): a relative path is resolved from the start directory */
+    if (capture_path && capture_start(capture_path) == -1) {
+        cleanup_resources();
+        return EXIT_FAILURE;
+    }
+
     if (daemon_mode) {
         if (run_as_daemon() == -1) {
             cleanup_resources();
@@ -1293,30 +3726,65 @@ int main(int argc, char *argv[])
         }
     }
 
-#if !USE_AESD_CHAR_DEVICE
-    if (pthread_create(&timestamp_thread, NULL, timestamp_thread_func, NULL) != 0) {
-        syslog(LOG_ERR, "Failed to create timestamp thread: %s", strerror(errno));
+    /*
+     * Replication threads are started after run_as_daemon(): threads do not
+     * survive fork().
+     */
+    if (repl_listen_port > 0 &&
+        repl_primary_start((uint16_t)repl_listen_port, repl_snapshot_backend) == -1) {
+        cleanup_resources();
+        return EXIT_FAILURE;
+    }
+    if (repl_upstream_port > 0 &&
+        repl_follower_start(repl_upstream_host, (uint16_t)repl_upstream_port,
+                            repl_apply_write, repl_apply_snapshot) == -1) {
         cleanup_resources();
         return EXIT_FAILURE;
     }
-    timestamp_thread_running = true;
-#endif
 
-    /*
-     * PTHREAD_CREATE_JOINABLE is the default on Linux but is set explicitly
-     * for portability and clarity: we must be able to join threads in
-     * wait_for_all_threads(), which requires joinable state.
-     */
-    pthread_attr_init(&thread_attr);
-    pthread_attr_setdetachstate(&thread_attr, PTHREAD_CREATE_JOINABLE);
+    /* Like the replication threads, schedulers must start after the fork */
+    if (coroutine_schedulers > 0 &&
+        coro_runtime_start((unsigned int)coroutine_schedulers) == -1) {
+        cleanup_resources();
+        return EXIT_FAILURE;
+    }
+    if (idle_park_start(parked_connection_event) == -1) {
+        cleanup_resources();
+        return EXIT_FAILURE;
+    }
+
+#if !USE_AESD_CHAR_DEVICE
+    /* A follower's timestamps arrive from the primary */
+    if (!repl_is_follower()) {
+        if (create_worker_thread(&timestamp_thread, NULL, timestamp_thread_func, NULL) != 0) {
+            syslog(LOG_ERR, "Failed to create timestamp thread: %s", strerror(errno));
+            cleanup_resources();
+            return EXIT_FAILURE;
+        }
+        timestamp_thread_running = true;
+    }
+#endif
 
-    syslog(LOG_INFO, "Server listening on port %d", PORT);
+    syslog(LOG_INFO, "Server listening on port %zu", listen_port);
 
     /* Main accept loop */
     while (!shutdown_requested) {
         client_len = sizeof(client_addr);
         int client_fd;
 
+        if (stats_requested) {
+            stats_requested = 0;
+            log_memory_usage();
+#if USE_AESD_CHAR_DEVICE
+            log_seek_cache_stats();
+#endif
+            log_compress_stats();
+            coro_log_stats();
+            idle_park_log_stats();
+            log_packet_pool_stats();
+            repl_log_stats();
+        }
+
         /*
          * accept4() with SOCK_CLOEXEC atomically sets close-on-exec on the
          * new fd, closing the race window that exists between accept() and a
@@ -1332,6 +3800,8 @@ int main(int argc, char *argv[])
         if (client_fd == -1) {
             if (errno == EINTR && shutdown_requested)
                 break;
+            if (errno == EINTR && stats_requested)
+                continue;  /* SIGUSR1: report at the top of the loop */
             if (handle_accept_error(errno))
                 continue;
             syslog(LOG_ERR, "Failed to accept connection: %s", strerror(errno));
@@ -1346,26 +3816,28 @@ int main(int argc, char *argv[])
         }
         args->client_fd   = client_fd;
         args->client_addr = client_addr;
+        args->resume      = NULL;
 
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, &thread_attr, connection_handler, args) != 0) {
-            syslog(LOG_ERR, "Failed to create connection thread: %s", strerror(errno));
+        /* In a coroutine, conn_recv/conn_send park the coroutine on EAGAIN */
+        if (coroutine_schedulers > 0 &&
+            fcntl(client_fd, F_SETFL, fcntl(client_fd, F_GETFL) | O_NONBLOCK) == -1) {
+            syslog(LOG_ERR, "Failed to make client socket non-blocking: %s", strerror(errno));
             free(args);
             close(client_fd);
             continue;
         }
 
-        add_thread_to_list(thread_id, client_fd, &client_addr);
+        if (start_connection(args) == -1) {
+            free(args);
+            close(client_fd);
+        }
     }
 
     /*
      * Fix 8: pthread_attr_destroy releases resources allocated by
-     * pthread_attr_init.  It is called after the loop exits (no further
-     * pthread_create calls will be made) and before cleanup_resources() so
-     * the attribute object's lifetime is correctly bounded.
+     * pthread_attr_init.  cleanup_resources() calls it once the parker,
+     * which also starts connection threads, has stopped.
      */
-    pthread_attr_destroy(&thread_attr);
-
     cleanup_resources();
     syslog(LOG_INFO, "Server shutdown complete");
 
@@ -0,0 +1,169 @@
+/*
+ * capture.c - Inbound traffic capture for aesdsocket (see capture.h).
+ *
+ * Records are appended under one mutex to a stdio stream with a large
+ * buffer, so a capture costs a memcpy per received chunk on the connection
+ * threads; the stream is flushed when a connection closes and at shutdown.
+ * The first write error is logged and ends the capture rather than failing
+ * the connections that produced the traffic.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "capture.h"
+
+#define CAPTURE_STREAM_BUFFER (1024 * 1024)
+
+static pthread_mutex_t capture_mutex = PTHREAD_MUTEX_INITIALIZER;
+static FILE *capture_fp = NULL;
+static char *capture_buffer = NULL;
+static uint64_t capture_epoch_ns;   /* CLOCK_MONOTONIC at capture_start */
+static uint32_t capture_next_id = 1;
+static int capture_on = 0;          /* read without the lock by capture_enabled */
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static void put_be64(unsigned char *p, uint64_t v)
+{
+    put_be32(p, (uint32_t)(v >> 32));
+    put_be32(p + 4, (uint32_t)v);
+}
+
+static uint64_t monotonic_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * capture_fail_locked - Log the write error and stop capturing.  What was
+ * written so far stays readable; aesdreplay ignores a truncated last record.
+ */
+static void capture_fail_locked(void)
+{
+    syslog(LOG_ERR, "Capture write failed, capture stopped: %s", strerror(errno));
+    fclose(capture_fp);
+    capture_fp = NULL;
+    __atomic_store_n(&capture_on, 0, __ATOMIC_RELAXED);
+}
+
+static void capture_record(uint32_t conn_id, uint8_t type, const char *payload,
+                           size_t length)
+{
+    unsigned char hdr[CAPTURE_REC_HDR_SIZE];
+
+    pthread_mutex_lock(&capture_mutex);
+    if (!capture_fp) {
+        pthread_mutex_unlock(&capture_mutex);
+        return;
+    }
+
+    memset(hdr, 0, sizeof(hdr));
+    put_be64(hdr, monotonic_ns() - capture_epoch_ns);
+    put_be32(hdr + 8, conn_id);
+    hdr[12] = type;
+    put_be32(hdr + 16, (uint32_t)length);
+
+    if (fwrite(hdr, sizeof(hdr), 1, capture_fp) != 1 ||
+        (payload && length > 0 && fwrite(payload, length, 1, capture_fp) != 1) ||
+        (type == CAPTURE_REC_CLOSE && fflush(capture_fp) != 0))
+        capture_fail_locked();
+
+    pthread_mutex_unlock(&capture_mutex);
+}
+
+int capture_start(const char *path)
+{
+    unsigned char hdr[CAPTURE_FILE_HDR_SIZE];
+
+    capture_fp = fopen(path, "we");  /* "e": O_CLOEXEC */
+    if (!capture_fp) {
+        syslog(LOG_ERR, "Failed to create capture file %s: %s", path, strerror(errno));
+        return -1;
+    }
+    capture_buffer = malloc(CAPTURE_STREAM_BUFFER);
+    if (capture_buffer)
+        setvbuf(capture_fp, capture_buffer, _IOFBF, CAPTURE_STREAM_BUFFER);
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, CAPTURE_MAGIC, 8);
+    put_be32(hdr + 8, CAPTURE_VERSION);
+    if (fwrite(hdr, sizeof(hdr), 1, capture_fp) != 1) {
+        syslog(LOG_ERR, "Failed to write capture file %s: %s", path, strerror(errno));
+        fclose(capture_fp);
+        capture_fp = NULL;
+        free(capture_buffer);
+        capture_buffer = NULL;
+        return -1;
+    }
+
+    capture_epoch_ns = monotonic_ns();
+    capture_on = 1;
+    syslog(LOG_INFO, "Capturing inbound traffic to %s", path);
+    return 0;
+}
+
+int capture_enabled(void)
+{
+    return __atomic_load_n(&capture_on, __ATOMIC_RELAXED);
+}
+
+uint32_t capture_open(void)
+{
+    uint32_t id;
+
+    if (!capture_enabled())
+        return 0;
+    pthread_mutex_lock(&capture_mutex);
+    id = capture_next_id++;
+    pthread_mutex_unlock(&capture_mutex);
+    capture_record(id, CAPTURE_REC_OPEN, NULL, 0);
+    return id;
+}
+
+void capture_data(uint32_t conn_id, const char *data, size_t length)
+{
+    if (conn_id != 0 && capture_enabled())
+        capture_record(conn_id, CAPTURE_REC_DATA, data, length);
+}
+
+void capture_response(uint32_t conn_id, size_t bytes)
+{
+    if (conn_id != 0 && capture_enabled())
+        capture_record(conn_id, CAPTURE_REC_RESPONSE, NULL, bytes);
+}
+
+void capture_close(uint32_t conn_id)
+{
+    if (conn_id != 0 && capture_enabled())
+        capture_record(conn_id, CAPTURE_REC_CLOSE, NULL, 0);
+}
+
+void capture_stop(void)
+{
+    pthread_mutex_lock(&capture_mutex);
+    if (capture_fp) {
+        if (fclose(capture_fp) != 0)
+            syslog(LOG_ERR, "Failed to close capture file: %s", strerror(errno));
+        capture_fp = NULL;
+        __atomic_store_n(&capture_on, 0, __ATOMIC_RELAXED);
+    }
+    free(capture_buffer);
+    capture_buffer = NULL;
+    pthread_mutex_unlock(&capture_mutex);
+}
@@ -0,0 +1,66 @@
+/*
+ * capture.h - Recording of the inbound packet stream for later replay.
+ *
+ * With -c path, aesdsocket appends every chunk it receives from a client to
+ * a capture file, together with connection open/close events and the size of
+ * the response to each packet.  aesdreplay reads the file back and drives a
+ * server with the same connections and bytes at the recorded pace (or
+ * faster), so a change can be measured against real traffic.
+ *
+ * File format (all integers big-endian):
+ *
+ *   header, once:
+ *       8 bytes CAPTURE_MAGIC | uint32 CAPTURE_VERSION | uint32 zero
+ *
+ *   record, repeated:
+ *       uint64 time_ns | uint32 conn_id | uint8 type | 3 bytes zero |
+ *       uint32 length | payload
+ *
+ *     time_ns is CLOCK_MONOTONIC nanoseconds since the capture started;
+ *     conn_id numbers connections from 1 in accept order.
+ *     CAPTURE_REC_OPEN:     a client connected; length 0.
+ *     CAPTURE_REC_DATA:     length bytes received from the client, as one
+ *                           recv() returned them; the payload follows.
+ *     CAPTURE_REC_RESPONSE: a packet was handled and length bytes were sent
+ *                           in response (0 for a rejected command); no
+ *                           payload.
+ *     CAPTURE_REC_CLOSE:    the connection ended; length 0.
+ *
+ * Only DATA records carry a payload.
+ */
+
+#ifndef AESD_CAPTURE_H
+#define AESD_CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CAPTURE_MAGIC "AESDCAP\0"
+#define CAPTURE_VERSION 1
+#define CAPTURE_FILE_HDR_SIZE 16
+#define CAPTURE_REC_HDR_SIZE 20
+
+#define CAPTURE_REC_OPEN 1
+#define CAPTURE_REC_DATA 2
+#define CAPTURE_REC_RESPONSE 3
+#define CAPTURE_REC_CLOSE 4
+
+/*
+ * capture_start - Create (truncate) the capture file and write its header.
+ * Returns 0 on success, -1 on failure (logged).
+ */
+int capture_start(const char *path);
+
+/* True once capture_start() succeeded; the record calls are no-ops otherwise */
+int capture_enabled(void);
+
+/* capture_open returns the new connection id (0 when capture is off) */
+uint32_t capture_open(void);
+void capture_data(uint32_t conn_id, const char *data, size_t length);
+void capture_response(uint32_t conn_id, size_t bytes);
+void capture_close(uint32_t conn_id);
+
+/* Flush and close the file; call after every connection thread has exited */
+void capture_stop(void);
+
+#endif /* AESD_CAPTURE_H */
@@ -0,0 +1,617 @@
+/*
+ * coroutine.c - Stackful coroutine runtime for aesdsocket (see coroutine.h).
+ *
+ * Each scheduler thread owns:
+ *   - an epoll set.  A waiting coroutine arms its fd with EPOLLONESHOT and
+ *     itself as the event data, so one readiness event resumes exactly one
+ *     coroutine and nothing is delivered for it again until it re-arms;
+ *   - a run queue of coroutines ready to continue;
+ *   - a hashed timer wheel (CORO_WHEEL_SLOTS slots of CORO_TICK_MS) holding
+ *     the deadlines of timed waits.  Insertion and removal are O(1); the
+ *     scheduler visits only the slots of the ticks that have passed;
+ *   - a spawn inbox, filled by coro_spawn() from the accept thread and
+ *     signalled through an eventfd in the same epoll set.
+ *
+ * Context switches use swapcontext().  It is not the fastest switch (it
+ * saves and restores the signal mask with a system call) but it is portable
+ * glibc and keeps this file free of assembly.
+ *
+ * Stacks are CORO_STACK_SIZE bytes of anonymous memory with a PROT_NONE
+ * guard page below, so an overflow faults instead of silently corrupting the
+ * neighbouring stack.  Only the pages a coroutine touches become resident,
+ * typically a few KiB for a connection.  Freed stacks are kept in a small
+ * cache to avoid an mmap/munmap pair per connection.
+ *
+ * The size is set by the deepest handler, not the typical one.  Measured
+ * high-water marks (x86_64, glibc 2.36, stack painted at allocation):
+ * packets, readbacks, seeks, AESD_TAIL / AESD_RANGE and lz4 responses stay
+ * under 6 KiB; AESD_GREP needs 22 KiB for any pattern, because regcomp()
+ * is deep; and the worst accepted pattern, 255 bytes of nested parentheses,
+ * needs 88 KiB (about 670 bytes per nesting level).  64 KiB overflowed on
+ * it, so the default is 128 KiB.  Address space is reserved with
+ * MAP_NORESERVE, so the unused part costs no memory.
+ *
+ * A coroutine must close its fd, or give it up with coro_forget_fd(), before
+ * it returns: that is what removes the fd from the epoll set, and the
+ * runtime never touches an fd the coroutine may already have closed.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <ucontext.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+#include "coroutine.h"
+
+#ifndef CORO_STACK_SIZE
+#define CORO_STACK_SIZE (128 * 1024)  /* deepest handler + margin, see above */
+#endif
+#define CORO_STACK_CACHE 256       /* freed stacks kept for reuse, all schedulers */
+#define CORO_TICK_MS 10
+#define CORO_WHEEL_SLOTS 1024      /* one revolution = 10.24 s */
+#define CORO_MAX_EVENTS 256
+#define CORO_MAX_SCHEDULERS 64
+
+struct coro_sched;
+
+struct coro {
+    ucontext_t ctx;
+    struct coro_sched *sched;
+    void *stack;                   /* mapping base; the guard page is first */
+    void (*fn)(void *arg);
+    void *arg;
+    struct coro *next;             /* inbox or run queue link */
+    struct coro *all_prev;         /* list of the scheduler's live coroutines */
+    struct coro *all_next;
+    bool waiting;
+    bool finished;
+    int wait_fd;                   /* fd of the current wait, -1 for a sleep */
+    int wait_result;               /* 0, ETIMEDOUT or ECANCELED */
+    int registered_fd;             /* fd this coroutine added to the epoll set */
+    struct coro *timer_prev;       /* timer wheel slot links */
+    struct coro *timer_next;
+    uint64_t expires;              /* tick, 0 when not in the wheel */
+};
+
+struct coro_sched {
+    pthread_t thread;
+    bool thread_started;
+    int epfd;
+    int wakefd;
+    pthread_mutex_t inbox_mutex;
+    struct coro *inbox_head;
+    struct coro *inbox_tail;
+    struct coro *run_head;
+    struct coro *run_tail;
+    struct coro *all;
+    struct coro *current;
+    ucontext_t main_ctx;
+    struct coro *wheel[CORO_WHEEL_SLOTS];
+    uint64_t tick;                 /* last tick whose slot has been processed */
+    unsigned long timers;          /* coroutines in the wheel */
+    /* Statistics: written by the scheduler, read by coro_log_stats */
+    unsigned long live;
+    unsigned long spawned;
+    unsigned long switches;
+    unsigned long timeouts;
+};
+
+static struct coro_sched *scheds;
+static unsigned int sched_count;
+static unsigned int next_sched;    /* __atomic; round-robin cursor */
+static int stopping;               /* __atomic */
+static size_t page_size;
+static __thread struct coro_sched *tls_sched;
+
+static pthread_mutex_t stack_mutex = PTHREAD_MUTEX_INITIALIZER;
+static void *stack_cache[CORO_STACK_CACHE];
+static unsigned int stack_cached;
+
+/* ------------------------------------------------------------------ */
+/* Stacks                                                              */
+/* ------------------------------------------------------------------ */
+
+static void *stack_alloc(void)
+{
+    void *base = NULL;
+
+    pthread_mutex_lock(&stack_mutex);
+    if (stack_cached > 0)
+        base = stack_cache[--stack_cached];
+    pthread_mutex_unlock(&stack_mutex);
+    if (base)
+        return base;
+
+    base = mmap(NULL, page_size + CORO_STACK_SIZE, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (base == MAP_FAILED)
+        return NULL;
+    if (mprotect(base, page_size, PROT_NONE) == -1) {
+        munmap(base, page_size + CORO_STACK_SIZE);
+        return NULL;
+    }
+    return base;
+}
+
+static void stack_free(void *base)
+{
+    pthread_mutex_lock(&stack_mutex);
+    if (stack_cached < CORO_STACK_CACHE) {
+        stack_cache[stack_cached++] = base;
+        base = NULL;
+    }
+    pthread_mutex_unlock(&stack_mutex);
+    if (base)
+        munmap(base, page_size + CORO_STACK_SIZE);
+}
+
+/* ------------------------------------------------------------------ */
+/* Timer wheel and run queue (scheduler thread only)                   */
+/* ------------------------------------------------------------------ */
+
+static uint64_t now_tick(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * (1000 / CORO_TICK_MS) +
+           (uint64_t)ts.tv_nsec / (CORO_TICK_MS * 1000000u);
+}
+
+static void timer_add(struct coro_sched *s, struct coro *c, int timeout_ms)
+{
+    uint64_t ticks = ((uint64_t)timeout_ms + CORO_TICK_MS - 1) / CORO_TICK_MS;
+    struct coro **slot;
+
+    c->expires = now_tick() + (ticks ? ticks : 1);
+    slot = &s->wheel[c->expires % CORO_WHEEL_SLOTS];
+    c->timer_prev = NULL;
+    c->timer_next = *slot;
+    if (*slot)
+        (*slot)->timer_prev = c;
+    *slot = c;
+    s->timers++;
+}
+
+static void timer_remove(struct coro_sched *s, struct coro *c)
+{
+    if (c->expires == 0)
+        return;
+    if (c->timer_prev)
+        c->timer_prev->timer_next = c->timer_next;
+    else
+        s->wheel[c->expires % CORO_WHEEL_SLOTS] = c->timer_next;
+    if (c->timer_next)
+        c->timer_next->timer_prev = c->timer_prev;
+    c->expires = 0;
+    s->timers--;
+}
+
+static void run_enqueue(struct coro_sched *s, struct coro *c)
+{
+    c->next = NULL;
+    if (s->run_tail)
+        s->run_tail->next = c;
+    else
+        s->run_head = c;
+    s->run_tail = c;
+}
+
+/* make_ready - End a coroutine's wait with 'result' and queue it to run */
+static void make_ready(struct coro_sched *s, struct coro *c, int result)
+{
+    if (!c->waiting)
+        return;
+    c->waiting = false;
+    c->wait_result = result;
+    timer_remove(s, c);
+    run_enqueue(s, c);
+}
+
+/*
+ * timers_advance - Expire the waits whose deadline has passed.  However long
+ * the scheduler was busy, at most one revolution of slots is visited: each
+ * slot is scanned for every entry that is due, not only those of one tick.
+ */
+static void timers_advance(struct coro_sched *s)
+{
+    uint64_t now = now_tick();
+    uint64_t steps = now - s->tick;
+    uint64_t i;
+
+    if (steps > CORO_WHEEL_SLOTS)
+        steps = CORO_WHEEL_SLOTS;
+    for (i = 1; i <= steps; i++) {
+        struct coro *c = s->wheel[(s->tick + i) % CORO_WHEEL_SLOTS];
+        while (c) {
+            struct coro *next = c->timer_next;
+            if (c->expires <= now) {
+                make_ready(s, c, ETIMEDOUT);
+                __atomic_add_fetch(&s->timeouts, 1, __ATOMIC_RELAXED);
+            }
+            c = next;
+        }
+    }
+    s->tick = now;
+}
+
+/* ------------------------------------------------------------------ */
+/* Coroutines                                                          */
+/* ------------------------------------------------------------------ */
+
+static void coro_entry(void)
+{
+    struct coro *c = tls_sched->current;
+
+    c->fn(c->arg);
+    c->finished = true;
+    /* returning resumes uc_link, the scheduler */
+}
+
+static void coro_destroy(struct coro_sched *s, struct coro *c)
+{
+    if (c->all_prev)
+        c->all_prev->all_next = c->all_next;
+    else
+        s->all = c->all_next;
+    if (c->all_next)
+        c->all_next->all_prev = c->all_prev;
+    stack_free(c->stack);
+    free(c);
+    __atomic_sub_fetch(&s->live, 1, __ATOMIC_RELAXED);
+}
+
+static int coro_prepare(struct coro_sched *s, struct coro *c)
+{
+    if (getcontext(&c->ctx) == -1)
+        return -1;
+    c->ctx.uc_stack.ss_sp   = (char *)c->stack + page_size;
+    c->ctx.uc_stack.ss_size = CORO_STACK_SIZE;
+    c->ctx.uc_link = &s->main_ctx;
+    makecontext(&c->ctx, coro_entry, 0);
+
+    c->sched = s;
+    c->all_prev = NULL;
+    c->all_next = s->all;
+    if (s->all)
+        s->all->all_prev = c;
+    s->all = c;
+    __atomic_add_fetch(&s->live, 1, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&s->spawned, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void coro_run(struct coro_sched *s, struct coro *c)
+{
+    s->current = c;
+    __atomic_add_fetch(&s->switches, 1, __ATOMIC_RELAXED);
+    swapcontext(&s->main_ctx, &c->ctx);
+    s->current = NULL;
+    if (c->finished)
+        coro_destroy(s, c);
+}
+
+bool coro_active(void)
+{
+    return tls_sched && tls_sched->current;
+}
+
+int coro_wait_fd(int fd, uint32_t events, int timeout_ms)
+{
+    struct coro_sched *s = tls_sched;
+    struct coro *c = s->current;
+
+    if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        errno = ECANCELED;
+        return -1;
+    }
+
+    if (fd >= 0) {
+        struct epoll_event ev;
+
+        memset(&ev, 0, sizeof(ev));
+        ev.events = events | EPOLLONESHOT;
+        ev.data.ptr = c;
+        if (epoll_ctl(s->epfd, c->registered_fd == fd ? EPOLL_CTL_MOD : EPOLL_CTL_ADD,
+                      fd, &ev) == -1 &&
+            (errno != EEXIST || epoll_ctl(s->epfd, EPOLL_CTL_MOD, fd, &ev) == -1))
+            return -1;
+        c->registered_fd = fd;
+    }
+    c->wait_fd = fd;
+    if (timeout_ms >= 0)
+        timer_add(s, c, timeout_ms);
+    c->waiting = true;
+
+    swapcontext(&c->ctx, &s->main_ctx);
+
+    if (c->wait_result != 0) {
+        errno = c->wait_result;
+        return -1;
+    }
+    return 0;
+}
+
+void coro_forget_fd(int fd)
+{
+    struct coro *c;
+
+    if (!coro_active())
+        return;
+    c = tls_sched->current;
+    if (fd < 0 || c->registered_fd != fd)
+        return;
+    epoll_ctl(tls_sched->epfd, EPOLL_CTL_DEL, fd, NULL);
+    c->registered_fd = -1;
+}
+
+void coro_yield(void)
+{
+    struct coro_sched *s = tls_sched;
+    struct coro *c = s->current;
+
+    run_enqueue(s, c);
+    swapcontext(&c->ctx, &s->main_ctx);
+}
+
+/* ------------------------------------------------------------------ */
+/* Scheduler threads                                                   */
+/* ------------------------------------------------------------------ */
+
+/* take_inbox - Start the coroutines handed over by coro_spawn() */
+static void take_inbox(struct coro_sched *s)
+{
+    struct coro *c;
+
+    pthread_mutex_lock(&s->inbox_mutex);
+    c = s->inbox_head;
+    s->inbox_head = s->inbox_tail = NULL;
+    pthread_mutex_unlock(&s->inbox_mutex);
+
+    while (c) {
+        struct coro *next = c->next;
+        if (coro_prepare(s, c) == 0) {
+            run_enqueue(s, c);
+        } else {
+            /* Cannot happen with a valid stack; the argument is lost */
+            syslog(LOG_ERR, "Failed to prepare coroutine context: %s", strerror(errno));
+            stack_free(c->stack);
+            free(c);
+        }
+        c = next;
+    }
+}
+
+static bool sched_finished(struct coro_sched *s)
+{
+    bool done;
+
+    if (!__atomic_load_n(&stopping, __ATOMIC_ACQUIRE) || s->all)
+        return false;
+    pthread_mutex_lock(&s->inbox_mutex);
+    done = s->inbox_head == NULL;
+    pthread_mutex_unlock(&s->inbox_mutex);
+    return done;
+}
+
+static void *sched_thread(void *arg)
+{
+    struct coro_sched *s = arg;
+    struct epoll_event events[CORO_MAX_EVENTS];
+
+    tls_sched = s;
+    s->tick = now_tick();
+
+    for (;;) {
+        struct coro *c;
+        int n, i, timeout;
+
+        take_inbox(s);
+
+        /* Run what is ready now; coroutines that yield wait for the next round */
+        c = s->run_head;
+        s->run_head = s->run_tail = NULL;
+        while (c) {
+            struct coro *next = c->next;
+            coro_run(s, c);
+            c = next;
+        }
+
+        if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+            for (c = s->all; c; c = c->all_next)
+                make_ready(s, c, ECANCELED);
+            if (sched_finished(s))
+                break;
+        }
+
+        if (s->run_head)
+            timeout = 0;
+        else if (s->timers > 0)
+            timeout = CORO_TICK_MS;
+        else
+            timeout = -1;
+
+        n = epoll_wait(s->epfd, events, CORO_MAX_EVENTS, timeout);
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL) {
+                uint64_t count;
+                if (read(s->wakefd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+                    syslog(LOG_ERR, "Coroutine scheduler wake read failed: %s",
+                           strerror(errno));
+                continue;
+            }
+            c = events[i].data.ptr;
+            if (c->wait_fd >= 0)
+                make_ready(s, c, 0);
+        }
+        timers_advance(s);
+    }
+    return NULL;
+}
+
+static void sched_wake(struct coro_sched *s)
+{
+    uint64_t one = 1;
+
+    if (write(s->wakefd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+        syslog(LOG_ERR, "Coroutine scheduler wake failed: %s", strerror(errno));
+}
+
+int coro_spawn(void (*fn)(void *arg), void *arg)
+{
+    struct coro_sched *s;
+    struct coro *c;
+
+    if (sched_count == 0 || __atomic_load_n(&stopping, __ATOMIC_ACQUIRE))
+        return -1;
+
+    c = calloc(1, sizeof(*c));
+    if (!c)
+        return -1;
+    c->stack = stack_alloc();
+    if (!c->stack) {
+        syslog(LOG_ERR, "Failed to allocate coroutine stack: %s", strerror(errno));
+        free(c);
+        return -1;
+    }
+    c->fn = fn;
+    c->arg = arg;
+    c->wait_fd = -1;
+    c->registered_fd = -1;
+
+    s = &scheds[__atomic_fetch_add(&next_sched, 1, __ATOMIC_RELAXED) % sched_count];
+
+    /* stopping is re-checked under the inbox lock; see sched_finished */
+    pthread_mutex_lock(&s->inbox_mutex);
+    if (__atomic_load_n(&stopping, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_unlock(&s->inbox_mutex);
+        stack_free(c->stack);
+        free(c);
+        return -1;
+    }
+    if (s->inbox_tail)
+        s->inbox_tail->next = c;
+    else
+        s->inbox_head = c;
+    s->inbox_tail = c;
+    pthread_mutex_unlock(&s->inbox_mutex);
+
+    sched_wake(s);
+    return 0;
+}
+
+int coro_runtime_start(unsigned int schedulers)
+{
+    struct epoll_event ev;
+    sigset_t all, saved;
+    unsigned int i;
+
+    if (schedulers == 0 || schedulers > CORO_MAX_SCHEDULERS) {
+        syslog(LOG_ERR, "Coroutine schedulers must be 1..%d", CORO_MAX_SCHEDULERS);
+        return -1;
+    }
+    page_size = (size_t)sysconf(_SC_PAGESIZE);
+    scheds = calloc(schedulers, sizeof(*scheds));
+    if (!scheds)
+        return -1;
+
+    for (i = 0; i < schedulers; i++) {
+        pthread_mutex_init(&scheds[i].inbox_mutex, NULL);
+        scheds[i].epfd = scheds[i].wakefd = -1;
+    }
+    sched_count = schedulers;
+
+    for (i = 0; i < schedulers; i++) {
+        struct coro_sched *s = &scheds[i];
+
+        s->epfd = epoll_create1(EPOLL_CLOEXEC);
+        s->wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        memset(&ev, 0, sizeof(ev));
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (s->epfd == -1 || s->wakefd == -1 ||
+            epoll_ctl(s->epfd, EPOLL_CTL_ADD, s->wakefd, &ev) == -1) {
+            syslog(LOG_ERR, "Failed to set up coroutine scheduler: %s", strerror(errno));
+            coro_runtime_stop();
+            return -1;
+        }
+    }
+
+    /* Schedulers never handle signals; they stay with the server's threads */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    for (i = 0; i < schedulers; i++) {
+        if (pthread_create(&scheds[i].thread, NULL, sched_thread, &scheds[i]) != 0) {
+            pthread_sigmask(SIG_SETMASK, &saved, NULL);
+            syslog(LOG_ERR, "Failed to create coroutine scheduler thread");
+            coro_runtime_stop();
+            return -1;
+        }
+        scheds[i].thread_started = true;
+    }
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+
+    syslog(LOG_INFO, "Coroutine runtime: %u schedulers, %d KiB stacks",
+           schedulers, CORO_STACK_SIZE / 1024);
+    return 0;
+}
+
+void coro_runtime_stop(void)
+{
+    unsigned int i;
+
+    if (!scheds)
+        return;
+
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    for (i = 0; i < sched_count; i++) {
+        if (scheds[i].thread_started) {
+            sched_wake(&scheds[i]);
+            pthread_join(scheds[i].thread, NULL);
+        }
+    }
+    for (i = 0; i < sched_count; i++) {
+        if (scheds[i].epfd != -1)
+            close(scheds[i].epfd);
+        if (scheds[i].wakefd != -1)
+            close(scheds[i].wakefd);
+        pthread_mutex_destroy(&scheds[i].inbox_mutex);
+    }
+    free(scheds);
+    scheds = NULL;
+    sched_count = 0;
+
+    pthread_mutex_lock(&stack_mutex);
+    while (stack_cached > 0)
+        munmap(stack_cache[--stack_cached], page_size + CORO_STACK_SIZE);
+    pthread_mutex_unlock(&stack_mutex);
+}
+
+void coro_log_stats(void)
+{
+    unsigned int i;
+
+    for (i = 0; i < sched_count; i++) {
+        const struct coro_sched *s = &scheds[i];
+        syslog(LOG_INFO, "Coroutine scheduler %u: live=%lu spawned=%lu switches=%lu "
+               "timeouts=%lu", i,
+               __atomic_load_n(&s->live, __ATOMIC_RELAXED),
+               __atomic_load_n(&s->spawned, __ATOMIC_RELAXED),
+               __atomic_load_n(&s->switches, __ATOMIC_RELAXED),
+               __atomic_load_n(&s->timeouts, __ATOMIC_RELAXED));
+    }
+}
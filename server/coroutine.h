@@ -0,0 +1,66 @@
+/*
+ * coroutine.h - Stackful coroutines on a small pool of epoll scheduler
+ * threads, used by aesdsocket -C to serve connections without a thread each.
+ *
+ * A coroutine runs ordinary blocking-style code on its own small stack.
+ * Where that code would block on a socket it calls coro_wait_fd(), which
+ * parks the coroutine in its scheduler's epoll set (and timer wheel, when a
+ * timeout is given) and switches back to the scheduler; the scheduler
+ * resumes it when the fd is ready or the timeout expires.  A coroutine stays
+ * on the scheduler thread it was started on, so thread-owned state such as a
+ * locked pthread mutex remains valid across a wait.
+ *
+ * Code that can run both in a coroutine and on a plain thread checks
+ * coro_active() and uses the blocking call when it returns false.
+ */
+
+#ifndef AESD_COROUTINE_H
+#define AESD_COROUTINE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * coro_runtime_start - Start 'schedulers' scheduler threads.  Returns 0 on
+ * success, -1 on failure (logged; nothing is left running).
+ */
+int coro_runtime_start(unsigned int schedulers);
+
+/*
+ * coro_spawn - Run fn(arg) in a new coroutine on the next scheduler, round
+ * robin.  Returns 0 on success, -1 when the runtime is stopping or out of
+ * memory; fn is then never called and arg stays with the caller.
+ */
+int coro_spawn(void (*fn)(void *arg), void *arg);
+
+/* True when called from a coroutine */
+bool coro_active(void);
+
+/*
+ * coro_wait_fd - Suspend the calling coroutine until fd reports one of
+ * 'events' (EPOLLIN / EPOLLOUT) or timeout_ms passes (-1: no timeout).
+ * fd -1 waits for the timeout only.  Returns 0 when ready, or -1 with errno
+ * ETIMEDOUT (timeout) or ECANCELED (runtime stopping).
+ */
+int coro_wait_fd(int fd, uint32_t events, int timeout_ms);
+
+/*
+ * coro_forget_fd - Take fd out of the scheduler's epoll set without closing
+ * it, before the fd is handed to another thread or coroutine.  No-op outside
+ * a coroutine or for an fd the coroutine never waited on.
+ */
+void coro_forget_fd(int fd);
+
+/* Let the other runnable coroutines of this scheduler run first */
+void coro_yield(void);
+
+/*
+ * coro_runtime_stop - Wake every waiting coroutine with ECANCELED, refuse new
+ * ones, and return once all coroutines have finished and the scheduler
+ * threads have exited.
+ */
+void coro_runtime_stop(void);
+
+void coro_log_stats(void);
+
+#endif /* AESD_COROUTINE_H */
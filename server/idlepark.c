@@ -0,0 +1,312 @@
+/*
+ * idlepark.c - Idle connection parker for aesdsocket (see idlepark.h).
+ *
+ * One thread owns:
+ *   - an epoll set in which every parked fd is armed with EPOLLONESHOT and
+ *     its park_entry as the event data, so readiness is reported once and
+ *     the fd is removed again before the callback hands it back;
+ *   - a hashed timer wheel (PARK_WHEEL_SLOTS slots of PARK_TICK_MS) holding
+ *     the idle deadlines.  Insertion and removal are O(1); the thread wakes
+ *     once a tick and visits only the slots of the ticks that have passed.
+ *     Deadlines beyond one revolution simply stay in their slot until their
+ *     round comes up;
+ *   - an eventfd in the same epoll set, written by idle_park_stop().
+ *
+ * Connection threads add entries under park_mutex; only the parker thread
+ * removes and frees them, so an event never refers to a freed entry.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <syslog.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#include "idlepark.h"
+
+#define PARK_TICK_MS 100
+#define PARK_WHEEL_SLOTS 1024      /* one revolution = 102.4 s */
+#define PARK_MAX_EVENTS 256
+
+struct park_entry {
+    int fd;
+    void *ctx;
+    uint64_t expires;              /* tick */
+    struct park_entry *prev;       /* wheel slot links; next also links */
+    struct park_entry *next;       /* the due list in park_expire */
+};
+
+static pthread_mutex_t park_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct park_entry *wheel[PARK_WHEEL_SLOTS];  /* protected by park_mutex */
+static uint64_t park_tick;         /* last tick whose slot has been processed */
+static bool park_running;          /* accepting entries; protected by park_mutex */
+static bool park_thread_started;
+static pthread_t park_thread;
+static int park_epfd = -1;
+static int park_wakefd = -1;
+static void (*park_fn)(void *ctx, enum idle_park_event event);
+
+/* Statistics, protected by park_mutex */
+static unsigned long parked_now;
+static unsigned long parked_total;
+static unsigned long resumed_total;
+static unsigned long expired_total;
+
+static uint64_t now_tick(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * (1000 / PARK_TICK_MS) +
+           (uint64_t)ts.tv_nsec / (PARK_TICK_MS * 1000000u);
+}
+
+/* wheel_add / wheel_remove - Must be called with park_mutex held */
+static void wheel_add(struct park_entry *e, int timeout_ms)
+{
+    uint64_t ticks = ((uint64_t)timeout_ms + PARK_TICK_MS - 1) / PARK_TICK_MS;
+    struct park_entry **slot;
+
+    e->expires = now_tick() + (ticks ? ticks : 1);
+    slot = &wheel[e->expires % PARK_WHEEL_SLOTS];
+    e->prev = NULL;
+    e->next = *slot;
+    if (*slot)
+        (*slot)->prev = e;
+    *slot = e;
+    parked_now++;
+}
+
+static void wheel_remove(struct park_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        wheel[e->expires % PARK_WHEEL_SLOTS] = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    parked_now--;
+}
+
+/* hand_back - Take e's fd out of the epoll set and pass its context on */
+static void hand_back(struct park_entry *e, enum idle_park_event event)
+{
+    epoll_ctl(park_epfd, EPOLL_CTL_DEL, e->fd, NULL);
+    park_fn(e->ctx, event);
+    free(e);
+}
+
+/*
+ * park_expire - Hand back the entries whose deadline has passed.  However
+ * long the thread was busy, at most one revolution of slots is visited: each
+ * slot is scanned for every entry that is due, not only those of one tick.
+ */
+static void park_expire(void)
+{
+    struct park_entry *due = NULL;
+    uint64_t now = now_tick();
+    uint64_t steps, i;
+
+    pthread_mutex_lock(&park_mutex);
+    steps = now - park_tick;
+    if (steps > PARK_WHEEL_SLOTS)
+        steps = PARK_WHEEL_SLOTS;
+    for (i = 1; i <= steps; i++) {
+        struct park_entry *e = wheel[(park_tick + i) % PARK_WHEEL_SLOTS];
+        while (e) {
+            struct park_entry *next = e->next;
+            if (e->expires <= now) {
+                wheel_remove(e);
+                e->next = due;
+                due = e;
+                expired_total++;
+            }
+            e = next;
+        }
+    }
+    park_tick = now;
+    pthread_mutex_unlock(&park_mutex);
+
+    while (due) {
+        struct park_entry *next = due->next;
+        hand_back(due, IDLE_PARK_TIMEOUT);
+        due = next;
+    }
+}
+
+static void *park_thread_func(void *arg)
+{
+    struct epoll_event events[PARK_MAX_EVENTS];
+    bool stop = false;
+    unsigned int i;
+    int n;
+
+    (void)arg;
+    while (!stop) {
+        n = epoll_wait(park_epfd, events, PARK_MAX_EVENTS, PARK_TICK_MS);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            syslog(LOG_ERR, "Idle park epoll_wait failed: %s", strerror(errno));
+            n = 0;
+        }
+
+        for (i = 0; i < (unsigned int)n; i++) {
+            struct park_entry *e = events[i].data.ptr;
+
+            if (!e) {
+                uint64_t value;
+                if (read(park_wakefd, &value, sizeof(value)) == -1 && errno != EAGAIN)
+                    syslog(LOG_ERR, "Idle park wakeup read failed: %s", strerror(errno));
+                stop = true;
+                continue;
+            }
+            pthread_mutex_lock(&park_mutex);
+            wheel_remove(e);
+            resumed_total++;
+            pthread_mutex_unlock(&park_mutex);
+            hand_back(e, IDLE_PARK_READY);
+        }
+
+        park_expire();
+    }
+
+    /* park_running is false: no entry is added from here on */
+    for (i = 0; i < PARK_WHEEL_SLOTS; i++) {
+        for (;;) {
+            struct park_entry *e;
+
+            pthread_mutex_lock(&park_mutex);
+            e = wheel[i];
+            if (e)
+                wheel_remove(e);
+            pthread_mutex_unlock(&park_mutex);
+            if (!e)
+                break;
+            hand_back(e, IDLE_PARK_STOPPED);
+        }
+    }
+    return NULL;
+}
+
+int idle_park_start(void (*fn)(void *ctx, enum idle_park_event event))
+{
+    struct epoll_event ev;
+    sigset_t all, saved;
+    int ret;
+
+    park_fn = fn;
+    park_epfd = epoll_create1(EPOLL_CLOEXEC);
+    park_wakefd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (park_epfd == -1 || park_wakefd == -1) {
+        syslog(LOG_ERR, "Failed to create idle park descriptors: %s", strerror(errno));
+        goto fail;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;  /* the wakeup; entries are never NULL */
+    if (epoll_ctl(park_epfd, EPOLL_CTL_ADD, park_wakefd, &ev) == -1) {
+        syslog(LOG_ERR, "Failed to register idle park wakeup: %s", strerror(errno));
+        goto fail;
+    }
+
+    park_tick = now_tick();
+    park_running = true;
+
+    /* Signals belong to the main thread */
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    ret = pthread_create(&park_thread, NULL, park_thread_func, NULL);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    if (ret != 0) {
+        syslog(LOG_ERR, "Failed to create idle park thread: %s", strerror(ret));
+        park_running = false;
+        goto fail;
+    }
+    park_thread_started = true;
+    return 0;
+
+fail:
+    if (park_epfd != -1)
+        close(park_epfd);
+    if (park_wakefd != -1)
+        close(park_wakefd);
+    park_epfd = park_wakefd = -1;
+    return -1;
+}
+
+int idle_park(int fd, int timeout_ms, void *ctx)
+{
+    struct park_entry *e = malloc(sizeof(*e));
+    struct epoll_event ev;
+
+    if (!e)
+        return -1;
+    e->fd = fd;
+    e->ctx = ctx;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    ev.data.ptr = e;
+
+    /*
+     * Added to the wheel before the fd is armed: the parker thread may see
+     * the event at once, and then waits for park_mutex to unlink it.
+     */
+    pthread_mutex_lock(&park_mutex);
+    if (!park_running) {
+        pthread_mutex_unlock(&park_mutex);
+        free(e);
+        return -1;
+    }
+    wheel_add(e, timeout_ms);
+    if (epoll_ctl(park_epfd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        syslog(LOG_ERR, "Failed to park fd %d: %s", fd, strerror(errno));
+        wheel_remove(e);
+        pthread_mutex_unlock(&park_mutex);
+        free(e);
+        return -1;
+    }
+    parked_total++;
+    pthread_mutex_unlock(&park_mutex);
+    return 0;
+}
+
+void idle_park_stop(void)
+{
+    uint64_t one = 1;
+
+    pthread_mutex_lock(&park_mutex);
+    park_running = false;
+    pthread_mutex_unlock(&park_mutex);
+
+    if (!park_thread_started)
+        return;
+    if (write(park_wakefd, &one, sizeof(one)) == -1)
+        syslog(LOG_ERR, "Failed to wake idle park thread: %s", strerror(errno));
+    pthread_join(park_thread, NULL);
+    park_thread_started = false;
+
+    close(park_epfd);
+    close(park_wakefd);
+    park_epfd = park_wakefd = -1;
+}
+
+void idle_park_log_stats(void)
+{
+    pthread_mutex_lock(&park_mutex);
+    syslog(LOG_INFO, "Idle park: parked=%lu total=%lu resumed=%lu expired=%lu",
+           parked_now, parked_total, resumed_total, expired_total);
+    pthread_mutex_unlock(&park_mutex);
+}
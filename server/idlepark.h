@@ -0,0 +1,44 @@
+/*
+ * idlepark.h - Parking of idle client connections between packets.
+ *
+ * A connection that has gone quiet between packets is handed to the parker
+ * together with its own idle timeout.  From then on it costs an fd and a
+ * small heap record: no connection thread or coroutine waits on it and it
+ * holds no receive buffer.  One parker thread watches every parked fd in an
+ * epoll set and keeps their deadlines in a hashed timer wheel, and calls back
+ * when the client sends again (so the connection can be resumed on a thread
+ * or coroutine) or when its timeout expires.
+ */
+
+#ifndef AESD_IDLEPARK_H
+#define AESD_IDLEPARK_H
+
+enum idle_park_event {
+    IDLE_PARK_READY,     /* the fd is readable (data, EOF or error) */
+    IDLE_PARK_TIMEOUT,   /* the connection's idle timeout expired */
+    IDLE_PARK_STOPPED,   /* idle_park_stop() was called */
+};
+
+/*
+ * idle_park_start - Start the parker thread.  'fn' is called on that thread
+ * exactly once for every parked context; it then owns the context and its
+ * fd.  Returns 0 on success, -1 on failure (logged).
+ */
+int idle_park_start(void (*fn)(void *ctx, enum idle_park_event event));
+
+/*
+ * idle_park - Park fd until it is readable or timeout_ms passes.  Returns 0
+ * when the parker took ctx, -1 when it is not running or out of memory; ctx
+ * then stays with the caller.
+ */
+int idle_park(int fd, int timeout_ms, void *ctx);
+
+/*
+ * idle_park_stop - Refuse new connections, call back every parked one with
+ * IDLE_PARK_STOPPED and join the parker thread.  Safe when never started.
+ */
+void idle_park_stop(void);
+
+void idle_park_log_stats(void);
+
+#endif /* AESD_IDLEPARK_H */
@@ -0,0 +1,258 @@
+/*
+ * lz4frame.c - Minimal LZ4 frame encoder (see lz4frame.h).
+ *
+ * The block compressor is the classic single-pass greedy LZ4 scheme: a hash
+ * table of the last position seen for each 4-byte sequence, one probe per
+ * position, matches extended forwards and backwards.  It trades some ratio
+ * against the reference lz4 for being small enough to read in one sitting;
+ * on line-oriented text it still gets most of the way there.
+ *
+ * Format references: LZ4 Block Format and LZ4 Frame Format descriptions
+ * (lz4 project, doc/lz4_Block_format.md and doc/lz4_Frame_format.md).
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "lz4frame.h"
+
+#define LZ4_MAGIC        0x184D2204u
+#define LZ4_BLOCK_MAX    (4 * 1024 * 1024)  /* BD block max size id 7 */
+#define LZ4_FLG          0x68  /* version 01, block independent, content size */
+#define LZ4_BD           0x70  /* block max size 4 MiB */
+#define LZ4_HASH_LOG     14
+#define LZ4_MINMATCH     4
+#define LZ4_LASTLITERALS 5     /* the last 5 bytes are always literals */
+#define LZ4_MFLIMIT      12    /* no match may start in the last 12 bytes */
+#define LZ4_MAX_DISTANCE 65535
+
+static uint32_t read32(const unsigned char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static void write_le32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+static uint32_t hash4(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - LZ4_HASH_LOG);
+}
+
+/*
+ * emit_length - Write the 255-run continuation of a literal or match length
+ * whose 4-bit token field saturated at 15.
+ */
+static unsigned char *emit_length(unsigned char *op, size_t len)
+{
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (unsigned char)len;
+    return op;
+}
+
+/*
+ * compress_block - Compress one block.  Returns the compressed size, or 0 if
+ * it would not fit in dst_cap bytes (the caller then stores it raw).
+ * table must hold 1 << LZ4_HASH_LOG entries; it is reset here.
+ */
+static size_t compress_block(const unsigned char *src, size_t len,
+                             unsigned char *dst, size_t dst_cap, uint32_t *table)
+{
+    const unsigned char *ip = src;
+    const unsigned char *anchor = src;
+    const unsigned char *end = src + len;
+    unsigned char *op = dst;
+    unsigned char *oend = dst + dst_cap;
+    size_t lit;
+
+    memset(table, 0, sizeof(uint32_t) << LZ4_HASH_LOG);
+
+    if (len > LZ4_MFLIMIT) {
+        const unsigned char *mflimit = end - LZ4_MFLIMIT;
+        const unsigned char *matchlimit = end - LZ4_LASTLITERALS;
+
+        ip++;
+        while (ip < mflimit) {
+            uint32_t sequence = read32(ip);
+            uint32_t h = hash4(sequence);
+            const unsigned char *ref = src + table[h];
+            const unsigned char *mp, *rp;
+            unsigned char *token;
+            size_t mlen;
+
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || ip - ref > LZ4_MAX_DISTANCE || read32(ref) != sequence) {
+                ip++;
+                continue;
+            }
+
+            /* Extend backwards into pending literals, then forwards */
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            mp = ip + LZ4_MINMATCH;
+            rp = ref + LZ4_MINMATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            lit  = (size_t)(ip - anchor);
+            mlen = (size_t)(mp - ip) - LZ4_MINMATCH;
+
+            /* token + literal run + literals + offset + match run + final token */
+            if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1 +
+                                      1 + LZ4_LASTLITERALS)
+                return 0;
+
+            token = op++;
+            if (lit >= 15) {
+                *token = 15 << 4;
+                op = emit_length(op, lit - 15);
+            } else {
+                *token = (unsigned char)(lit << 4);
+            }
+            memcpy(op, anchor, lit);
+            op += lit;
+
+            op[0] = (unsigned char)(ip - ref);
+            op[1] = (unsigned char)((ip - ref) >> 8);
+            op += 2;
+
+            if (mlen >= 15) {
+                *token |= 15;
+                op = emit_length(op, mlen - 15);
+            } else {
+                *token |= (unsigned char)mlen;
+            }
+
+            ip = anchor = mp;
+            /* Index a position inside the match so runs chain cheaply */
+            table[hash4(read32(ip - 2))] = (uint32_t)(ip - 2 - src);
+        }
+    }
+
+    /* Final sequence: literals only */
+    lit = (size_t)(end - anchor);
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit)
+        return 0;
+    if (lit >= 15) {
+        *op++ = 15 << 4;
+        op = emit_length(op, lit - 15);
+    } else {
+        *op++ = (unsigned char)(lit << 4);
+    }
+    memcpy(op, anchor, lit);
+    op += lit;
+
+    return (size_t)(op - dst);
+}
+
+/* ---- xxHash32, needed only for the frame descriptor checksum byte ---- */
+
+#define XXH_PRIME1 2654435761u
+#define XXH_PRIME2 2246822519u
+#define XXH_PRIME3 3266489917u
+#define XXH_PRIME4 668265263u
+#define XXH_PRIME5 374761393u
+
+static uint32_t rotl32(uint32_t x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+/*
+ * xxh32_short - xxHash32 with seed 0 for inputs shorter than 16 bytes (the
+ * frame descriptor is at most 15).
+ */
+static uint32_t xxh32_short(const unsigned char *p, size_t len)
+{
+    uint32_t h = XXH_PRIME5 + (uint32_t)len;
+
+    while (len >= 4) {
+        uint32_t k;
+        k  = (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+             ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+        h += k * XXH_PRIME3;
+        h  = rotl32(h, 17) * XXH_PRIME4;
+        p += 4;
+        len -= 4;
+    }
+    while (len > 0) {
+        h += (*p++) * XXH_PRIME5;
+        h  = rotl32(h, 11) * XXH_PRIME1;
+        len--;
+    }
+
+    h ^= h >> 15;
+    h *= XXH_PRIME2;
+    h ^= h >> 13;
+    h *= XXH_PRIME3;
+    h ^= h >> 16;
+    return h;
+}
+
+char *lz4_frame_compress(const char *src, size_t len, size_t *out_len)
+{
+    size_t blocks = len / LZ4_BLOCK_MAX + 1;
+    /* header 15 + per block (size word + raw worst case) + end mark 4 */
+    size_t cap = 15 + len + blocks * 4 + 4;
+    unsigned char *frame, *op;
+    uint32_t *table;
+    size_t pos = 0;
+    int i;
+
+    frame = malloc(cap);
+    table = malloc(sizeof(uint32_t) << LZ4_HASH_LOG);
+    if (!frame || !table) {
+        free(frame);
+        free(table);
+        return NULL;
+    }
+
+    /* Frame header: magic, FLG, BD, content size (LE64), header checksum */
+    write_le32(frame, LZ4_MAGIC);
+    frame[4] = LZ4_FLG;
+    frame[5] = LZ4_BD;
+    for (i = 0; i < 8; i++)
+        frame[6 + i] = (unsigned char)((uint64_t)len >> (8 * i));
+    frame[14] = (unsigned char)(xxh32_short(frame + 4, 10) >> 8);
+    op = frame + 15;
+
+    while (pos < len) {
+        size_t chunk = len - pos < LZ4_BLOCK_MAX ? len - pos : LZ4_BLOCK_MAX;
+        /* Compressed output must beat raw, or the block is stored raw */
+        size_t csize = compress_block((const unsigned char *)src + pos, chunk,
+                                      op + 4, chunk - 1, table);
+        if (csize > 0) {
+            write_le32(op, (uint32_t)csize);
+            op += 4 + csize;
+        } else {
+            write_le32(op, (uint32_t)chunk | 0x80000000u);  /* uncompressed */
+            memcpy(op + 4, src + pos, chunk);
+            op += 4 + chunk;
+        }
+        pos += chunk;
+    }
+
+    write_le32(op, 0);  /* EndMark */
+    op += 4;
+    free(table);
+
+    /* Give back the worst-case slack; the frame may be cached for a while */
+    *out_len = (size_t)(op - frame);
+    op = realloc(frame, *out_len);
+    return (char *)(op ? op : frame);
+}
@@ -0,0 +1,23 @@
+/*
+ * lz4frame.h - Minimal LZ4 frame encoder used for compressed responses.
+ *
+ * Produces standard LZ4 frames (magic 0x184D2204, independent 4 MiB blocks,
+ * content size in the header, no checksums) that any LZ4 decoder accepts,
+ * e.g. "lz4 -d" or Python's lz4.frame.decompress().  Only compression is
+ * implemented; the server never needs to decode.
+ */
+
+#ifndef AESD_LZ4FRAME_H
+#define AESD_LZ4FRAME_H
+
+#include <stddef.h>
+
+/*
+ * lz4_frame_compress - Compress len bytes of src into a newly allocated
+ * frame.  Returns the frame (caller frees) and sets *out_len, or returns
+ * NULL on allocation failure.  Incompressible blocks are stored raw, so the
+ * frame is never more than a few bytes per 4 MiB larger than the input.
+ */
+char *lz4_frame_compress(const char *src, size_t len, size_t *out_len);
+
+#endif /* AESD_LZ4FRAME_H */
@@ -0,0 +1,952 @@
+/*
+ * replication.c - Leader/follower replication for aesdsocket.
+ *
+ * See replication.h for the wire format.  This file holds both roles; a
+ * process may run either, or both at once (a follower that also serves -P
+ * re-publishes what it applies, so followers can be chained).
+ *
+ * Primary:
+ *   - repl_publish() is called by the server with its backend lock held, in
+ *     the same order the bytes reach the backend.  Each call becomes one
+ *     record with the next sequence number and is copied into a bounded
+ *     backlog (REPL_BACKLOG_RECORDS / REPL_BACKLOG_BYTES).
+ *   - A listener thread accepts follower links; each link gets a sender
+ *     thread that waits on repl_cond for new records.  Records are copied
+ *     out of the backlog under repl_mutex and sent outside it, so a slow
+ *     follower never blocks repl_publish() (and therefore never blocks the
+ *     server's writers).
+ *   - A follower that falls out of the backlog is resynchronised with a
+ *     snapshot rather than holding records for it.  One that stops reading
+ *     altogether is dropped when a send exceeds REPL_SEND_TIMEOUT_SEC.
+ *
+ * Follower:
+ *   - One thread keeps a link to the primary, reconnecting every
+ *     REPL_RETRY_MS.  The hello carries the last (epoch, seq) applied, so a
+ *     reconnect within the backlog resumes without a snapshot.
+ *   - Records are applied strictly in sequence: duplicates are skipped, a gap
+ *     drops the link and forces a snapshot on the next connect.
+ *
+ * Lock order: the server's backend lock (file_mutex) -> repl_mutex.
+ * repl_publish() and repl_position() are called under the backend lock;
+ * the snapshot callback takes the backend lock itself and is never called
+ * with repl_mutex held.
+ */
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <syslog.h>
+#include <poll.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "replication.h"
+
+#ifndef REPL_BACKLOG_RECORDS
+#define REPL_BACKLOG_RECORDS 1024
+#endif
+#ifndef REPL_BACKLOG_BYTES
+#define REPL_BACKLOG_BYTES (4 * 1024 * 1024)
+#endif
+#define REPL_MAX_RECORD (64 * 1024 * 1024)  /* larger lengths are a corrupt stream */
+#define REPL_HELLO_MAX 64
+#define REPL_HELLO_TIMEOUT_SEC 5
+#define REPL_SEND_TIMEOUT_SEC 10
+#define REPL_IDLE_CHECK_MS 1000            /* how often an idle sender checks its link */
+#define REPL_RETRY_MS 1000
+
+struct repl_record {
+    uint64_t seq;
+    size_t length;
+    char *data;
+};
+
+struct repl_peer {
+    int fd;
+    pthread_t thread;
+    bool done;                    /* set by the sender thread as it exits */
+    char addr[INET6_ADDRSTRLEN];
+    struct repl_peer *next;
+};
+
+static pthread_mutex_t repl_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t repl_cond = PTHREAD_COND_INITIALIZER;
+static bool repl_stopping = false;
+
+/* ---- Primary state (protected by repl_mutex) ---- */
+static bool primary_running = false;
+static int primary_fd = -1;
+static pthread_t primary_thread;
+static repl_snapshot_fn primary_snapshot = NULL;
+static uint64_t primary_epoch = 0;
+static uint64_t primary_seq = 0;          /* last published sequence number */
+static struct repl_record backlog[REPL_BACKLOG_RECORDS];  /* indexed by seq % N */
+static size_t backlog_count = 0;          /* records primary_seq-count+1 .. primary_seq */
+static size_t backlog_bytes = 0;
+static struct repl_peer *peers = NULL;
+static unsigned long stat_published = 0;
+static unsigned long stat_snapshots_sent = 0;
+static unsigned long stat_peers_dropped = 0;
+
+/* ---- Follower state (protected by repl_mutex) ---- */
+static bool follower_running = false;
+static int follower_fd = -1;
+static pthread_t follower_thread;
+static char *follower_host = NULL;
+static uint16_t follower_port = 0;
+static repl_apply_fn follower_apply = NULL;
+static repl_reset_fn follower_reset = NULL;
+static uint64_t upstream_epoch = 0;       /* position of the last applied record */
+static uint64_t upstream_seq = 0;
+static bool follower_connected = false;
+static unsigned long stat_applied = 0;
+static unsigned long stat_duplicates = 0;
+static unsigned long stat_gaps = 0;
+static unsigned long stat_snapshots_applied = 0;
+static unsigned long stat_reconnects = 0;
+
+/* ==================== Helpers ==================== */
+
+static void put_be32(unsigned char *p, uint32_t v)
+{
+    p[0] = (unsigned char)(v >> 24);
+    p[1] = (unsigned char)(v >> 16);
+    p[2] = (unsigned char)(v >> 8);
+    p[3] = (unsigned char)v;
+}
+
+static void put_be64(unsigned char *p, uint64_t v)
+{
+    put_be32(p, (uint32_t)(v >> 32));
+    put_be32(p + 4, (uint32_t)v);
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static uint64_t get_be64(const unsigned char *p)
+{
+    return ((uint64_t)get_be32(p) << 32) | get_be32(p + 4);
+}
+
+/*
+ * send_all / recv_all - Loop over partial transfers and EINTR.  MSG_NOSIGNAL
+ * keeps a dropped link from raising SIGPIPE (the server ignores it anyway,
+ * but this file should not depend on that).
+ */
+static int send_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p   += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int recv_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+
+    while (len > 0) {
+        ssize_t n = recv(fd, p, len, 0);
+        if (n == 0)
+            return -1;
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p   += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+static int send_record(int fd, uint8_t type, uint64_t seq, uint64_t epoch,
+                       const char *data, size_t length)
+{
+    unsigned char hdr[REPL_HDR_SIZE];
+
+    memset(hdr, 0, sizeof(hdr));
+    put_be32(hdr, REPL_MAGIC);
+    hdr[4] = type;
+    put_be32(hdr + 8, (uint32_t)length);
+    put_be64(hdr + 12, seq);
+    put_be64(hdr + 20, epoch);
+
+    if (send_all(fd, hdr, sizeof(hdr)) == -1)
+        return -1;
+    return length > 0 ? send_all(fd, data, length) : 0;
+}
+
+static void set_timeout(int fd, int optname, int seconds)
+{
+    struct timeval tv = { .tv_sec = seconds, .tv_usec = 0 };
+
+    if (setsockopt(fd, SOL_SOCKET, optname, &tv, sizeof(tv)) == -1)
+        syslog(LOG_WARNING, "replication: failed to set socket timeout: %s",
+               strerror(errno));
+}
+
+/*
+ * deadline_after_ms - Absolute CLOCK_REALTIME deadline for pthread_cond_timedwait.
+ */
+static struct timespec deadline_after_ms(long ms)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec  += ms / 1000;
+    ts.tv_nsec += (ms % 1000) * 1000000L;
+    if (ts.tv_nsec >= 1000000000L) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000L;
+    }
+    return ts;
+}
+
+/*
+ * start_thread - pthread_create() with every signal blocked in the new
+ * thread, so SIGINT/SIGTERM/SIGUSR1 keep being delivered to the server's
+ * main thread where they interrupt accept().
+ */
+static int start_thread(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+    sigset_t all, saved;
+    int ret;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &saved);
+    ret = pthread_create(thread, NULL, fn, arg);
+    pthread_sigmask(SIG_SETMASK, &saved, NULL);
+    return ret;
+}
+
+/* ==================== Primary ==================== */
+
+/*
+ * backlog_drop_oldest_locked - Evict the oldest backlog record.
+ */
+static void backlog_drop_oldest_locked(void)
+{
+    struct repl_record *r = &backlog[(primary_seq - backlog_count + 1) % REPL_BACKLOG_RECORDS];
+
+    backlog_bytes -= r->length;
+    free(r->data);
+    r->data = NULL;
+    r->length = 0;
+    backlog_count--;
+}
+
+static void backlog_clear_locked(void)
+{
+    while (backlog_count > 0)
+        backlog_drop_oldest_locked();
+}
+
+/*
+ * repl_publish - Record one backend write for the followers.
+ *
+ * Called with the server's backend lock held, so sequence numbers follow the
+ * order in which bytes reached the backend.  A no-op unless -P is active.
+ * If the copy cannot be allocated the backlog is emptied: every follower then
+ * resynchronises with a snapshot instead of silently missing the record.
+ */
+void repl_publish(const char *data, size_t length)
+{
+    char *copy;
+
+    if (length == 0)
+        return;
+
+    pthread_mutex_lock(&repl_mutex);
+    if (!primary_running) {
+        pthread_mutex_unlock(&repl_mutex);
+        return;
+    }
+
+    copy = malloc(length);
+    if (!copy) {
+        primary_seq++;
+        stat_published++;
+        syslog(LOG_ERR, "replication: out of memory for record %" PRIu64
+               ", followers will resync", primary_seq);
+        backlog_clear_locked();
+        pthread_cond_broadcast(&repl_cond);
+        pthread_mutex_unlock(&repl_mutex);
+        return;
+    }
+    memcpy(copy, data, length);
+
+    while (backlog_count > 0 &&
+           (backlog_count >= REPL_BACKLOG_RECORDS ||
+            backlog_bytes + length > REPL_BACKLOG_BYTES))
+        backlog_drop_oldest_locked();
+
+    primary_seq++;
+    stat_published++;
+    backlog[primary_seq % REPL_BACKLOG_RECORDS].seq    = primary_seq;
+    backlog[primary_seq % REPL_BACKLOG_RECORDS].length = length;
+    backlog[primary_seq % REPL_BACKLOG_RECORDS].data   = copy;
+    backlog_count++;
+    backlog_bytes += length;
+
+    pthread_cond_broadcast(&repl_cond);
+    pthread_mutex_unlock(&repl_mutex);
+}
+
+/*
+ * repl_publish_reset - The backend was replaced wholesale (a follower applied
+ * a snapshot).  Start a new epoch so downstream followers resync too.
+ * Called with the backend lock held.
+ */
+void repl_publish_reset(void)
+{
+    pthread_mutex_lock(&repl_mutex);
+    if (primary_running) {
+        backlog_clear_locked();
+        primary_epoch++;
+        primary_seq = 0;
+        pthread_cond_broadcast(&repl_cond);
+    }
+    pthread_mutex_unlock(&repl_mutex);
+}
+
+/*
+ * repl_position - Current (epoch, seq) of the published stream.  Called under
+ * the backend lock by the snapshot callback so the pair matches the content.
+ */
+void repl_position(uint64_t *epoch, uint64_t *seq)
+{
+    pthread_mutex_lock(&repl_mutex);
+    *epoch = primary_epoch;
+    *seq   = primary_seq;
+    pthread_mutex_unlock(&repl_mutex);
+}
+
+/*
+ * peer_link_closed - True if the follower closed its end.  Followers never
+ * send after the hello, so any readable data means EOF or a broken link.
+ */
+static bool peer_link_closed(int fd)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN, .revents = 0 };
+
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * peer_send_snapshot - Send the full backend content and move the peer to the
+ * position it represents.
+ */
+static int peer_send_snapshot(struct repl_peer *peer, uint64_t *epoch, uint64_t *next)
+{
+    size_t size = 0;
+    uint64_t snap_epoch = 0, snap_seq = 0;
+    char *data;
+    int ret;
+
+    data = primary_snapshot(&size, &snap_epoch, &snap_seq);
+    if (!data) {
+        syslog(LOG_ERR, "replication: snapshot for %s failed", peer->addr);
+        return -1;
+    }
+    if (size > REPL_MAX_RECORD) {
+        syslog(LOG_ERR, "replication: snapshot of %zu bytes exceeds record limit", size);
+        free(data);
+        return -1;
+    }
+
+    ret = send_record(peer->fd, REPL_REC_SNAPSHOT, snap_seq, snap_epoch, data, size);
+    free(data);
+    if (ret == 0) {
+        syslog(LOG_INFO, "replication: sent %zu byte snapshot at %" PRIu64 ":%" PRIu64
+               " to %s", size, snap_epoch, snap_seq, peer->addr);
+        pthread_mutex_lock(&repl_mutex);
+        stat_snapshots_sent++;
+        pthread_mutex_unlock(&repl_mutex);
+        *epoch = snap_epoch;
+        *next  = snap_seq + 1;
+    }
+    return ret;
+}
+
+/*
+ * peer_read_hello - Read "AESDREPL <epoch> <last_seq>\n" from a new follower.
+ */
+static int peer_read_hello(struct repl_peer *peer, uint64_t *epoch, uint64_t *last_seq)
+{
+    char line[REPL_HELLO_MAX];
+    size_t len = 0;
+    unsigned long long e, s;
+
+    set_timeout(peer->fd, SO_RCVTIMEO, REPL_HELLO_TIMEOUT_SEC);
+    while (len < sizeof(line) - 1) {
+        ssize_t n = recv(peer->fd, line + len, 1, 0);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        if (line[len] == '\n')
+            break;
+        len++;
+    }
+    line[len] = '\0';
+
+    if (sscanf(line, "AESDREPL %llu %llu", &e, &s) != 2) {
+        syslog(LOG_WARNING, "replication: bad hello from %s", peer->addr);
+        return -1;
+    }
+    *epoch = e;
+    *last_seq = s;
+    return 0;
+}
+
+/*
+ * peer_thread - Stream records to one follower until it disconnects, a send
+ * fails or times out, or replication stops.
+ */
+static void *peer_thread(void *arg)
+{
+    struct repl_peer *peer = arg;
+    uint64_t epoch, next, last_seq;
+    bool need_snapshot;
+
+    if (peer_read_hello(peer, &epoch, &last_seq) == -1)
+        goto out;
+    set_timeout(peer->fd, SO_SNDTIMEO, REPL_SEND_TIMEOUT_SEC);
+    next = last_seq + 1;
+
+    /* Resume only if the follower's position is in this epoch's backlog */
+    pthread_mutex_lock(&repl_mutex);
+    need_snapshot = epoch != primary_epoch || last_seq > primary_seq ||
+                    next + backlog_count <= primary_seq;
+    pthread_mutex_unlock(&repl_mutex);
+
+    syslog(LOG_INFO, "replication: follower %s connected at %" PRIu64 ":%" PRIu64 "%s",
+           peer->addr, epoch, last_seq, need_snapshot ? ", sending snapshot" : "");
+
+    while (1) {
+        struct repl_record rec;
+
+        if (need_snapshot) {
+            if (peer_send_snapshot(peer, &epoch, &next) == -1)
+                break;
+            need_snapshot = false;
+        }
+
+        pthread_mutex_lock(&repl_mutex);
+        if (repl_stopping) {
+            pthread_mutex_unlock(&repl_mutex);
+            break;
+        }
+        if (epoch != primary_epoch || next + backlog_count <= primary_seq) {
+            /* Epoch changed, or the follower fell out of the backlog */
+            pthread_mutex_unlock(&repl_mutex);
+            syslog(LOG_INFO, "replication: follower %s lagged at %" PRIu64
+                   ", resyncing", peer->addr, next - 1);
+            need_snapshot = true;
+            continue;
+        }
+        if (next > primary_seq) {
+            struct timespec ts = deadline_after_ms(REPL_IDLE_CHECK_MS);
+            pthread_cond_timedwait(&repl_cond, &repl_mutex, &ts);
+            pthread_mutex_unlock(&repl_mutex);
+            if (peer_link_closed(peer->fd))
+                break;
+            continue;
+        }
+
+        rec = backlog[next % REPL_BACKLOG_RECORDS];
+        rec.data = malloc(rec.length);
+        if (rec.data)
+            memcpy(rec.data, backlog[next % REPL_BACKLOG_RECORDS].data, rec.length);
+        pthread_mutex_unlock(&repl_mutex);
+
+        if (!rec.data) {
+            syslog(LOG_ERR, "replication: out of memory sending to %s", peer->addr);
+            break;
+        }
+        if (send_record(peer->fd, REPL_REC_DATA, rec.seq, epoch, rec.data, rec.length) == -1) {
+            free(rec.data);
+            pthread_mutex_lock(&repl_mutex);
+            stat_peers_dropped++;
+            pthread_mutex_unlock(&repl_mutex);
+            syslog(LOG_WARNING, "replication: dropping follower %s: %s", peer->addr,
+                   strerror(errno));
+            break;
+        }
+        free(rec.data);
+        next++;
+    }
+
+out:
+    syslog(LOG_INFO, "replication: follower %s disconnected", peer->addr);
+    pthread_mutex_lock(&repl_mutex);
+    peer->done = true;
+    pthread_mutex_unlock(&repl_mutex);
+    return NULL;
+}
+
+/*
+ * reap_peers_locked - Join and free sender threads that have exited.
+ * Joining under repl_mutex is safe: a done peer no longer takes the lock.
+ */
+static void reap_peers_locked(void)
+{
+    struct repl_peer **pp = &peers;
+
+    while (*pp) {
+        struct repl_peer *peer = *pp;
+        if (peer->done) {
+            *pp = peer->next;
+            pthread_join(peer->thread, NULL);
+            close(peer->fd);
+            free(peer);
+        } else {
+            pp = &peer->next;
+        }
+    }
+}
+
+/*
+ * primary_listener - Accept follower links until replication stops.
+ */
+static void *primary_listener(void *arg)
+{
+    (void)arg;
+
+    while (1) {
+        struct sockaddr_storage addr;
+        socklen_t addr_len = sizeof(addr);
+        struct repl_peer *peer;
+        int fd;
+
+        fd = accept4(primary_fd, (struct sockaddr *)&addr, &addr_len, SOCK_CLOEXEC);
+
+        pthread_mutex_lock(&repl_mutex);
+        reap_peers_locked();
+        if (repl_stopping) {
+            pthread_mutex_unlock(&repl_mutex);
+            if (fd != -1)
+                close(fd);
+            break;
+        }
+        pthread_mutex_unlock(&repl_mutex);
+
+        if (fd == -1) {
+            if (errno != EINTR && errno != ECONNABORTED) {
+                syslog(LOG_ERR, "replication: accept failed: %s", strerror(errno));
+                usleep(REPL_RETRY_MS * 1000);
+            }
+            continue;
+        }
+
+        peer = calloc(1, sizeof(*peer));
+        if (!peer) {
+            close(fd);
+            continue;
+        }
+        peer->fd = fd;
+        if (addr.ss_family == AF_INET)
+            inet_ntop(AF_INET, &((struct sockaddr_in *)&addr)->sin_addr,
+                      peer->addr, sizeof(peer->addr));
+        else
+            inet_ntop(AF_INET6, &((struct sockaddr_in6 *)&addr)->sin6_addr,
+                      peer->addr, sizeof(peer->addr));
+
+        pthread_mutex_lock(&repl_mutex);
+        if (start_thread(&peer->thread, peer_thread, peer) != 0) {
+            pthread_mutex_unlock(&repl_mutex);
+            syslog(LOG_ERR, "replication: failed to create sender thread");
+            close(fd);
+            free(peer);
+            continue;
+        }
+        peer->next = peers;
+        peers = peer;
+        pthread_mutex_unlock(&repl_mutex);
+    }
+    return NULL;
+}
+
+/*
+ * repl_primary_start - Serve the replication stream on port (-P).
+ *
+ * The epoch is derived from the start time and pid, so a restarted primary
+ * never resumes a follower against sequence numbers from a previous run.
+ */
+int repl_primary_start(uint16_t port, repl_snapshot_fn snapshot)
+{
+    struct sockaddr_in addr;
+    int opt = 1;
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+        syslog(LOG_ERR, "replication: socket failed: %s", strerror(errno));
+        return -1;
+    }
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) == -1)
+        syslog(LOG_WARNING, "replication: failed to set SO_REUSEADDR: %s", strerror(errno));
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1 ||
+        listen(fd, SOMAXCONN) == -1) {
+        syslog(LOG_ERR, "replication: failed to listen on port %u: %s",
+               (unsigned)port, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    pthread_mutex_lock(&repl_mutex);
+    primary_fd = fd;
+    primary_snapshot = snapshot;
+    primary_epoch = ((uint64_t)time(NULL) << 20) ^ (uint64_t)getpid();
+    primary_seq = 0;
+    primary_running = true;
+    if (start_thread(&primary_thread, primary_listener, NULL) != 0) {
+        primary_running = false;
+        primary_fd = -1;
+        pthread_mutex_unlock(&repl_mutex);
+        syslog(LOG_ERR, "replication: failed to create listener thread");
+        close(fd);
+        return -1;
+    }
+    pthread_mutex_unlock(&repl_mutex);
+
+    syslog(LOG_INFO, "replication: serving followers on port %u (epoch %" PRIu64 ")",
+           (unsigned)port, primary_epoch);
+    return 0;
+}
+
+/* ==================== Follower ==================== */
+
+static int follower_connect(void)
+{
+    struct addrinfo hints, *res, *ai;
+    char port_str[8];
+    int fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    snprintf(port_str, sizeof(port_str), "%u", (unsigned)follower_port);
+
+    if (getaddrinfo(follower_host, port_str, &hints, &res) != 0)
+        return -1;
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+        if (fd == -1)
+            continue;
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0)
+            break;
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    return fd;
+}
+
+/*
+ * follower_session - Run one link to the primary until it fails.
+ *
+ * upstream_epoch/upstream_seq are only written by this thread; repl_mutex is
+ * taken for the writes so repl_log_stats() reads a consistent pair.
+ */
+static void follower_session(int fd)
+{
+    char hello[REPL_HELLO_MAX];
+    uint64_t epoch = upstream_epoch, seq = upstream_seq;
+
+    snprintf(hello, sizeof(hello), "AESDREPL %" PRIu64 " %" PRIu64 "\n", epoch, seq);
+    if (send_all(fd, hello, strlen(hello)) == -1)
+        return;
+
+    while (1) {
+        unsigned char hdr[REPL_HDR_SIZE];
+        uint32_t length;
+        uint64_t rec_seq, rec_epoch;
+        uint8_t type;
+        char *data;
+        int ret;
+
+        if (recv_all(fd, hdr, sizeof(hdr)) == -1)
+            return;
+
+        type      = hdr[4];
+        length    = get_be32(hdr + 8);
+        rec_seq   = get_be64(hdr + 12);
+        rec_epoch = get_be64(hdr + 20);
+        if (get_be32(hdr) != REPL_MAGIC || length > REPL_MAX_RECORD ||
+            (type != REPL_REC_DATA && type != REPL_REC_SNAPSHOT)) {
+            syslog(LOG_ERR, "replication: corrupt record header from primary");
+            return;
+        }
+
+        data = malloc(length > 0 ? length : 1);
+        if (!data) {
+            syslog(LOG_ERR, "replication: out of memory for %" PRIu32 " byte record", length);
+            return;
+        }
+        if (recv_all(fd, data, length) == -1) {
+            free(data);
+            return;
+        }
+
+        if (type == REPL_REC_SNAPSHOT) {
+            ret = follower_reset(data, length);
+            free(data);
+            pthread_mutex_lock(&repl_mutex);
+            if (ret == 0) {
+                stat_snapshots_applied++;
+                upstream_epoch = rec_epoch;
+                upstream_seq   = rec_seq;
+            } else {
+                upstream_epoch = 0;  /* force another snapshot */
+            }
+            pthread_mutex_unlock(&repl_mutex);
+            if (ret == -1)
+                return;
+            syslog(LOG_INFO, "replication: applied %" PRIu32 " byte snapshot at %"
+                   PRIu64 ":%" PRIu64, length, rec_epoch, rec_seq);
+            epoch = rec_epoch;
+            seq   = rec_seq;
+            continue;
+        }
+
+        if (rec_epoch != epoch) {
+            syslog(LOG_ERR, "replication: record from epoch %" PRIu64 " while at %" PRIu64,
+                   rec_epoch, epoch);
+            free(data);
+            return;
+        }
+        if (rec_seq <= seq) {
+            free(data);
+            pthread_mutex_lock(&repl_mutex);
+            stat_duplicates++;
+            pthread_mutex_unlock(&repl_mutex);
+            continue;
+        }
+        if (rec_seq != seq + 1) {
+            syslog(LOG_WARNING, "replication: gap %" PRIu64 "..%" PRIu64
+                   ", requesting snapshot", seq + 1, rec_seq - 1);
+            free(data);
+            pthread_mutex_lock(&repl_mutex);
+            stat_gaps++;
+            upstream_epoch = 0;
+            pthread_mutex_unlock(&repl_mutex);
+            return;
+        }
+
+        ret = follower_apply(data, length);
+        free(data);
+        pthread_mutex_lock(&repl_mutex);
+        if (ret == 0) {
+            stat_applied++;
+            upstream_seq = rec_seq;
+        } else {
+            upstream_epoch = 0;  /* local backend diverged; resync */
+        }
+        pthread_mutex_unlock(&repl_mutex);
+        if (ret == -1)
+            return;
+        seq = rec_seq;
+    }
+}
+
+static void *follower_loop(void *arg)
+{
+    (void)arg;
+
+    while (1) {
+        struct timespec ts;
+        int fd;
+
+        pthread_mutex_lock(&repl_mutex);
+        if (repl_stopping) {
+            pthread_mutex_unlock(&repl_mutex);
+            break;
+        }
+        pthread_mutex_unlock(&repl_mutex);
+
+        fd = follower_connect();
+        if (fd != -1) {
+            pthread_mutex_lock(&repl_mutex);
+            follower_fd = fd;
+            follower_connected = true;
+            pthread_mutex_unlock(&repl_mutex);
+
+            syslog(LOG_INFO, "replication: connected to primary %s:%u",
+                   follower_host, (unsigned)follower_port);
+            follower_session(fd);
+            syslog(LOG_INFO, "replication: link to primary %s:%u closed",
+                   follower_host, (unsigned)follower_port);
+
+            pthread_mutex_lock(&repl_mutex);
+            follower_fd = -1;
+            follower_connected = false;
+            stat_reconnects++;
+            pthread_mutex_unlock(&repl_mutex);
+            close(fd);
+        }
+
+        pthread_mutex_lock(&repl_mutex);
+        ts = deadline_after_ms(REPL_RETRY_MS);
+        if (!repl_stopping)
+            pthread_cond_timedwait(&repl_cond, &repl_mutex, &ts);
+        pthread_mutex_unlock(&repl_mutex);
+    }
+    return NULL;
+}
+
+/*
+ * repl_follower_start - Follow the primary at host:port (-R).
+ */
+int repl_follower_start(const char *host, uint16_t port,
+                        repl_apply_fn apply, repl_reset_fn reset)
+{
+    pthread_mutex_lock(&repl_mutex);
+    follower_host = strdup(host);
+    if (!follower_host) {
+        pthread_mutex_unlock(&repl_mutex);
+        return -1;
+    }
+    follower_port  = port;
+    follower_apply = apply;
+    follower_reset = reset;
+    follower_running = true;
+    if (start_thread(&follower_thread, follower_loop, NULL) != 0) {
+        follower_running = false;
+        free(follower_host);
+        follower_host = NULL;
+        pthread_mutex_unlock(&repl_mutex);
+        syslog(LOG_ERR, "replication: failed to create follower thread");
+        return -1;
+    }
+    pthread_mutex_unlock(&repl_mutex);
+
+    syslog(LOG_INFO, "replication: following primary %s:%u", host, (unsigned)port);
+    return 0;
+}
+
+/*
+ * repl_is_follower - True when -R is active.  Set once before the server
+ * accepts clients, so it is read without the lock.
+ */
+int repl_is_follower(void)
+{
+    return follower_running;
+}
+
+/* ==================== Both ==================== */
+
+/*
+ * repl_stop - Stop all replication threads and release the backlog.
+ *
+ * Blocked accept()/recv()/send() calls are woken with shutdown(); idle
+ * senders and the follower's retry wait are woken through repl_cond.
+ * Must be called without the backend lock held: the follower thread may be
+ * waiting for it inside an apply callback.
+ */
+void repl_stop(void)
+{
+    struct repl_peer *peer;
+    bool primary, follower;
+
+    pthread_mutex_lock(&repl_mutex);
+    repl_stopping = true;
+    primary  = primary_running;
+    follower = follower_running;
+    primary_running = false;  /* later repl_publish() calls are no-ops */
+    if (primary_fd != -1)
+        shutdown(primary_fd, SHUT_RDWR);
+    for (peer = peers; peer; peer = peer->next)
+        shutdown(peer->fd, SHUT_RDWR);
+    if (follower_fd != -1)
+        shutdown(follower_fd, SHUT_RDWR);
+    pthread_cond_broadcast(&repl_cond);
+    pthread_mutex_unlock(&repl_mutex);
+
+    if (follower)
+        pthread_join(follower_thread, NULL);
+
+    if (primary) {
+        pthread_join(primary_thread, NULL);
+        close(primary_fd);
+
+        /* Senders exit on repl_stopping; join the rest without the lock */
+        while (peers) {
+            peer = peers;
+            peers = peer->next;
+            pthread_join(peer->thread, NULL);
+            close(peer->fd);
+            free(peer);
+        }
+    }
+
+    pthread_mutex_lock(&repl_mutex);
+    primary_fd = -1;
+    backlog_clear_locked();
+    free(follower_host);
+    follower_host = NULL;
+    pthread_mutex_unlock(&repl_mutex);
+}
+
+/*
+ * repl_log_stats - Report replication state to syslog (SIGUSR1).
+ */
+void repl_log_stats(void)
+{
+    struct repl_peer *peer;
+    unsigned int npeers = 0;
+
+    pthread_mutex_lock(&repl_mutex);
+    if (primary_running) {
+        for (peer = peers; peer; peer = peer->next)
+            if (!peer->done)
+                npeers++;
+        syslog(LOG_INFO, "Replication primary: epoch=%" PRIu64 " seq=%" PRIu64
+               " followers=%u backlog=%zu records/%zu bytes published=%lu "
+               "snapshots=%lu dropped=%lu", primary_epoch, primary_seq, npeers,
+               backlog_count, backlog_bytes, stat_published, stat_snapshots_sent,
+               stat_peers_dropped);
+    }
+    if (follower_running) {
+        syslog(LOG_INFO, "Replication follower: primary=%s:%u %s at %" PRIu64 ":%" PRIu64
+               " applied=%lu duplicates=%lu gaps=%lu snapshots=%lu reconnects=%lu",
+               follower_host, (unsigned)follower_port,
+               follower_connected ? "connected" : "disconnected",
+               upstream_epoch, upstream_seq, stat_applied, stat_duplicates,
+               stat_gaps, stat_snapshots_applied, stat_reconnects);
+    }
+    pthread_mutex_unlock(&repl_mutex);
+}
@@ -0,0 +1,72 @@
+/*
+ * replication.h - Leader/follower replication of backend writes between
+ * aesdsocket instances.
+ *
+ * A primary (-P port) assigns every write it makes to its backend a sequence
+ * number, keeps the most recent ones in an in-memory backlog, and streams
+ * them over a persistent TCP link to each connected follower.  A follower
+ * (-R host:port) applies the records to its own backend in order and serves
+ * readbacks and seeks locally, so read fan-out can be spread across hosts.
+ *
+ * Wire format (all integers big-endian):
+ *
+ *   follower -> primary, once per connection:
+ *       "AESDREPL <epoch> <last_seq>\n"
+ *     epoch/last_seq identify the last record the follower applied (0 0 when
+ *     it has applied nothing).
+ *
+ *   primary -> follower, repeated:
+ *       uint32 magic (REPL_MAGIC) | uint8 type | 3 bytes zero |
+ *       uint32 length | uint64 seq | uint64 epoch | length payload bytes
+ *
+ *     REPL_REC_DATA:     payload is one write, seq is its sequence number.
+ *     REPL_REC_SNAPSHOT: payload is the primary's full backend content; seq is
+ *                        the last write it includes.  Sent when the follower
+ *                        is new, belongs to a previous primary epoch, or has
+ *                        fallen behind the backlog.
+ */
+
+#ifndef AESD_REPLICATION_H
+#define AESD_REPLICATION_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define REPL_MAGIC 0x41455352u  /* "AESR" */
+#define REPL_REC_DATA 1
+#define REPL_REC_SNAPSHOT 2
+#define REPL_HDR_SIZE 28
+
+/*
+ * Callbacks supplied by the server.  All of them take the server's backend
+ * lock themselves; replication never calls them with its own lock held.
+ *
+ * repl_snapshot_fn: return a malloc'd copy of the backend content and the
+ *   position (epoch, sequence number of the last write) it corresponds to,
+ *   read with repl_position() under the same lock as the content, or NULL on
+ *   failure.
+ * repl_apply_fn: append one replicated write to the local backend.
+ * repl_reset_fn: replace the local backend content with a snapshot.
+ * Both apply callbacks return 0 on success, -1 on failure.
+ */
+typedef char *(*repl_snapshot_fn)(size_t *out_size, uint64_t *out_epoch,
+                                  uint64_t *out_seq);
+typedef int (*repl_apply_fn)(const char *data, size_t length);
+typedef int (*repl_reset_fn)(const char *data, size_t length);
+
+/* Primary side */
+int repl_primary_start(uint16_t port, repl_snapshot_fn snapshot);
+void repl_publish(const char *data, size_t length);
+void repl_publish_reset(void);
+void repl_position(uint64_t *epoch, uint64_t *seq);
+
+/* Follower side */
+int repl_follower_start(const char *host, uint16_t port,
+                        repl_apply_fn apply, repl_reset_fn reset);
+int repl_is_follower(void);
+
+/* Both */
+void repl_stop(void);
+void repl_log_stats(void);
+
+#endif /* AESD_REPLICATION_H */
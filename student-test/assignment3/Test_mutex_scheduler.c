@@ -0,0 +1,105 @@
+#include "unity.h"
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "../../examples/threading/threading.h"
+
+/**
+* Firing times of the timer-wheel mutex_scheduler in examples/threading.  Delays of 64 ms or
+* more are held in level 1 and above of the wheel and reach level 0 only when the slot they
+* are in is cascaded, on a wrap of the level 0 index.  A task must still obtain its mutex
+* within a few ticks of its deadline, wherever its delay puts it in the wheel.
+*/
+
+#define SCHED_TASKS 300                 /* one per ms: every tick across several wraps */
+#define SCHED_MAX_LATENCY_MS 30         /* a missed cascade makes tasks up to 63 ms late */
+
+/**
+* A task due on every tick for SCHED_TASKS ms: whichever tick the timer thread last woke
+* for, the cascade on the following wrap must not be skipped.
+*/
+void test_mutex_scheduler_cascade_latency()
+{
+    static struct mutex_task *tasks[SCHED_TASKS];
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct mutex_scheduler *sched = mutex_scheduler_create(1);
+    int64_t worst_ns = 0;
+    int worst_delay = 0;
+    char message[128];
+    int i;
+
+    TEST_ASSERT_NOT_NULL_MESSAGE(sched, "mutex_scheduler_create failed");
+    for (i = 0; i < SCHED_TASKS; i++) {
+        TEST_ASSERT_TRUE_MESSAGE(mutex_scheduler_submit(sched, &tasks[i], &mutex, i, 0, 0),
+                "mutex_scheduler_submit failed");
+    }
+    for (i = 0; i < SCHED_TASKS; i++) {
+        struct thread_data *data = mutex_task_join(tasks[i]);
+        TEST_ASSERT_TRUE_MESSAGE(data->thread_complete_success, "task failed");
+        if (data->acquire_latency_ns > worst_ns) {
+            worst_ns = data->acquire_latency_ns;
+            worst_delay = i;
+        }
+        free(data);
+    }
+    mutex_scheduler_destroy(sched);
+
+    snprintf(message, sizeof(message), "task with a %d ms delay obtained the mutex %lld ms late",
+             worst_delay, (long long)(worst_ns / 1000000));
+    TEST_ASSERT_TRUE_MESSAGE(worst_ns < (int64_t)SCHED_MAX_LATENCY_MS * 1000000, message);
+}
+
+/**
+* Single delays that start in level 1 and level 2 of the wheel.
+*/
+void test_mutex_scheduler_long_delays()
+{
+    static const int delays_ms[] = { 64, 100, 1000, 4100 };
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct mutex_scheduler *sched = mutex_scheduler_create(1);
+    char message[128];
+    unsigned int i;
+
+    TEST_ASSERT_NOT_NULL_MESSAGE(sched, "mutex_scheduler_create failed");
+    for (i = 0; i < sizeof(delays_ms) / sizeof(delays_ms[0]); i++) {
+        struct mutex_task *task;
+        struct thread_data *data;
+
+        TEST_ASSERT_TRUE_MESSAGE(mutex_scheduler_submit(sched, &task, &mutex, delays_ms[i], 0, 0),
+                "mutex_scheduler_submit failed");
+        data = mutex_task_join(task);
+        snprintf(message, sizeof(message), "task with a %d ms delay obtained the mutex %lld ms late",
+                 delays_ms[i], (long long)(data->acquire_latency_ns / 1000000));
+        TEST_ASSERT_TRUE_MESSAGE(data->thread_complete_success, "task failed");
+        TEST_ASSERT_TRUE_MESSAGE(data->acquire_latency_ns >= 0, "task obtained the mutex early");
+        TEST_ASSERT_TRUE_MESSAGE(data->acquire_latency_ns < (int64_t)SCHED_MAX_LATENCY_MS * 1000000,
+                message);
+        free(data);
+    }
+    mutex_scheduler_destroy(sched);
+}
+
+/**
+* A task whose mutex stays locked gives up once its lock timeout has passed.
+*/
+void test_mutex_scheduler_lock_timeout()
+{
+    pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
+    struct mutex_scheduler *sched = mutex_scheduler_create(1);
+    struct mutex_task *task;
+    struct thread_data *data;
+
+    TEST_ASSERT_NOT_NULL_MESSAGE(sched, "mutex_scheduler_create failed");
+    pthread_mutex_lock(&mutex);
+    TEST_ASSERT_TRUE_MESSAGE(mutex_scheduler_submit(sched, &task, &mutex, 10, 0, 20),
+            "mutex_scheduler_submit failed");
+    data = mutex_task_join(task);
+    pthread_mutex_unlock(&mutex);
+    TEST_ASSERT_FALSE_MESSAGE(data->thread_complete_success, "task obtained a locked mutex");
+    TEST_ASSERT_TRUE_MESSAGE(data->acquire_latency_ns >= 20 * 1000000,
+            "task gave up before its lock timeout");
+    free(data);
+    mutex_scheduler_destroy(sched);
+}
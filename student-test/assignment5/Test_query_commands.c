@@ -0,0 +1,100 @@
+/**
+* Responses of the aesdsocket query commands (AESD_TAIL, AESD_RANGE, AESD_GREP).  The server
+* keeps its handlers static, so this file includes aesdsocket.c itself (with its main
+* renamed), as bench/bench_aesdsocket.c does, and calls them on one end of a socketpair.
+* A query that selects nothing must still answer, with an empty line: otherwise the client
+* waits for data until its timeout.
+*/
+
+#define main aesdsocket_main
+#include "../../server/aesdsocket.c"
+#undef main
+
+#include "unity.h"
+
+struct query_run
+{
+    struct connection_ctx conn;
+    int peer_fd;
+    char path[64];
+};
+
+static void query_setup(struct query_run *run, const char *content)
+{
+    int sv[2];
+    int fd;
+
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, socketpair(AF_UNIX, SOCK_STREAM, 0, sv), "socketpair failed");
+    strcpy(run->path, "/tmp/test_query.XXXXXX");
+    fd = mkstemp(run->path);
+    TEST_ASSERT_TRUE_MESSAGE(fd != -1, "mkstemp failed");
+    if (content != NULL) {
+        TEST_ASSERT_TRUE_MESSAGE(write(fd, content, strlen(content)) == (ssize_t)strlen(content),
+                "write failed");
+    } else {
+        unlink(run->path);  /* a backend that does not exist yet reads as empty */
+    }
+    close(fd);
+
+    shard_count = 1;
+    shards[0].data_file = run->path;
+    pthread_mutex_init(&shards[0].file_mutex, NULL);
+
+    memset(&run->conn, 0, sizeof(run->conn));
+    strcpy(run->conn.client_ip, "test");
+    run->conn.client_fd = sv[0];
+    run->conn.shard = &shards[0];
+    mem_account_register(&run->conn.mem, run->conn.client_ip);
+    run->peer_fd = sv[1];
+}
+
+static void query_teardown(struct query_run *run)
+{
+    mem_account_unregister(&run->conn.mem);
+    pthread_mutex_destroy(&shards[0].file_mutex);
+    close(run->conn.client_fd);
+    close(run->peer_fd);
+    unlink(run->path);
+}
+
+/**
+* Run @param packet through the command table and check that exactly @param expected
+* was sent back.
+*/
+static void query_expect(const char *content, const char *packet, const char *expected)
+{
+    struct query_run run;
+    const struct socket_command *command;
+    char response[256];
+    char message[256];
+    ssize_t n;
+
+    query_setup(&run, content);
+    command = find_socket_command(packet);
+    TEST_ASSERT_NOT_NULL_MESSAGE(command, "not a socket command");
+    TEST_ASSERT_EQUAL_INT_MESSAGE(0, command->handler(&run.conn, packet), "handler failed");
+
+    n = recv(run.peer_fd, response, sizeof(response) - 1, MSG_DONTWAIT);
+    response[n > 0 ? n : 0] = '\0';
+    snprintf(message, sizeof(message), "%s on \"%s\"", packet, content ? content : "(none)");
+    TEST_ASSERT_EQUAL_STRING_MESSAGE(expected, response, message);
+    query_teardown(&run);
+}
+
+void test_query_empty_results()
+{
+    query_expect("one\ntwo\n", "AESD_TAIL:0\n", QUERY_EMPTY_RESPONSE);
+    query_expect("one\ntwo\n", "AESD_RANGE:5,9\n", QUERY_EMPTY_RESPONSE);
+    query_expect("one\ntwo\n", "AESD_RANGE:2,5\n", QUERY_EMPTY_RESPONSE);
+    query_expect("one\ntwo", "AESD_RANGE:2,5\n", QUERY_EMPTY_RESPONSE);
+    query_expect("one\ntwo\n", "AESD_GREP:three\n", QUERY_EMPTY_RESPONSE);
+    query_expect("", "AESD_TAIL:3\n", QUERY_EMPTY_RESPONSE);
+    query_expect(NULL, "AESD_GREP:one\n", QUERY_EMPTY_RESPONSE);
+}
+
+void test_query_results()
+{
+    query_expect("one\ntwo\nthree\n", "AESD_TAIL:2\n", "two\nthree\n");
+    query_expect("one\ntwo\nthree\n", "AESD_RANGE:0,1\n", "one\ntwo\n");
+    query_expect("one\ntwo\nthree\n", "AESD_GREP:^t\n", "two\nthree\n");
+}
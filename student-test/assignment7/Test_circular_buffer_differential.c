@@ -0,0 +1,319 @@
+#include "unity.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include "../../aesd-char-driver/aesd-circular-buffer.h"
+
+/**
+* Differential test of the circular buffer in aesd-char-driver (the candidate, built from
+* TESTED_SOURCE) against a reference model: a copy of the implementation whose semantics
+* the driver was written against.  Random sequences of add and lookup operations run on
+* both, and after every step each lookup result and the stored sequence of entries must
+* match.  An optimized buffer can replace aesd-circular-buffer.c (or be pointed to by
+* TESTED_SOURCE in CMakeLists.txt) and land once these tests pass.
+*
+* The semantics checked are the ones aesd-char-driver/main.c relies on:
+*   - find_entry_offset_for_fpos returns the entry holding char_offset of the entries
+*     concatenated oldest first, with the byte within it, or NULL past the end.  Zero-size
+*     entries never hold an offset.  The byte offset is only compared when an entry is found,
+*     as documented in the header.
+*   - add_entry appends, and on a full buffer replaces the oldest entry.
+*   - in_offs, out_offs and full describe the stored entries oldest first, and when full
+*     entry[in_offs] is the oldest, which the next add replaces.
+*/
+
+#define REF_CAPACITY AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED
+#define DIFF_SEQUENCES 300
+#define DIFF_STEPS 200
+#define DIFF_RANDOM_LOOKUPS 8
+#define DIFF_MAX_SMALL_ENTRY 16
+#define DIFF_MAX_LARGE_ENTRY 4096
+
+/* Entries point into this pool; distinct buffptr values tell entries apart */
+static char diff_pool[DIFF_STEPS * 4];
+
+/* ---------- Reference model: the current implementation, renamed ---------- */
+
+struct ref_circular_buffer
+{
+    struct aesd_buffer_entry entry[REF_CAPACITY];
+    unsigned int in_offs;
+    unsigned int out_offs;
+    bool full;
+};
+
+static void ref_init(struct ref_circular_buffer *buffer)
+{
+    memset(buffer, 0, sizeof(*buffer));
+}
+
+static unsigned int ref_count(const struct ref_circular_buffer *buffer)
+{
+    if (buffer->full) {
+        return REF_CAPACITY;
+    }
+    return (buffer->in_offs + REF_CAPACITY - buffer->out_offs) % REF_CAPACITY;
+}
+
+static const struct aesd_buffer_entry *ref_find_entry_offset_for_fpos(const struct ref_circular_buffer *buffer,
+            size_t char_offset, size_t *entry_offset_byte_rtn)
+{
+    unsigned int num_entries = ref_count(buffer);
+    unsigned int index = buffer->out_offs;
+    size_t cumulative = 0;
+    unsigned int i;
+
+    for (i = 0; i < num_entries; i++) {
+        const struct aesd_buffer_entry *entry = &buffer->entry[index];
+        if (char_offset < cumulative + entry->size) {
+            *entry_offset_byte_rtn = char_offset - cumulative;
+            return entry;
+        }
+        cumulative += entry->size;
+        index = (index + 1) % REF_CAPACITY;
+    }
+    *entry_offset_byte_rtn = 0;
+    return NULL;
+}
+
+static void ref_add_entry(struct ref_circular_buffer *buffer, const struct aesd_buffer_entry *add_entry)
+{
+    buffer->entry[buffer->in_offs] = *add_entry;
+    if (buffer->full) {
+        buffer->out_offs = (buffer->out_offs + 1) % REF_CAPACITY;
+    }
+    buffer->in_offs = (buffer->in_offs + 1) % REF_CAPACITY;
+    buffer->full = (buffer->in_offs == buffer->out_offs);
+}
+
+/* The i-th stored entry, oldest first */
+static const struct aesd_buffer_entry *ref_entry(const struct ref_circular_buffer *buffer, unsigned int i)
+{
+    return &buffer->entry[(buffer->out_offs + i) % REF_CAPACITY];
+}
+
+/*
+ * ---------- Candidate adapters ----------
+ * The only code here that knows the layout of struct aesd_circular_buffer.  It reads the
+ * fields the way main.c does; a redesign that changes them changes main.c and these.
+ */
+
+static unsigned int candidate_count(const struct aesd_circular_buffer *buffer)
+{
+    if (buffer->full) {
+        return AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+    }
+    return (buffer->in_offs + AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED - buffer->out_offs) %
+           AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED;
+}
+
+static const struct aesd_buffer_entry *candidate_entry(const struct aesd_circular_buffer *buffer, unsigned int i)
+{
+    return &buffer->entry[(buffer->out_offs + i) % AESDCHAR_MAX_WRITE_OPERATIONS_SUPPORTED];
+}
+
+/* The entry the next add replaces when the buffer is full (see aesd_add_entry_locked) */
+static const struct aesd_buffer_entry *candidate_next_replaced(const struct aesd_circular_buffer *buffer)
+{
+    return &buffer->entry[buffer->in_offs];
+}
+
+/* ---------- Harness ---------- */
+
+struct diff_run
+{
+    struct ref_circular_buffer ref;
+    struct aesd_circular_buffer candidate;
+    uint32_t seed;
+    uint32_t rand_state;
+    unsigned int step;
+    char message[256];
+};
+
+static uint32_t diff_rand(struct diff_run *run)
+{
+    /* xorshift32: the same sequence for a seed on every platform */
+    uint32_t x = run->rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    run->rand_state = x;
+    return x;
+}
+
+static void diff_fail(struct diff_run *run, const char *what, size_t offset)
+{
+    snprintf(run->message, sizeof(run->message), "seed %u step %u offset %zu: %s",
+             (unsigned int)run->seed, run->step, offset, what);
+    TEST_FAIL_MESSAGE(run->message);
+}
+
+static void diff_init(struct diff_run *run)
+{
+    ref_init(&run->ref);
+    aesd_circular_buffer_init(&run->candidate);
+}
+
+static void diff_add(struct diff_run *run, const char *buffptr, size_t size)
+{
+    struct aesd_buffer_entry entry;
+    entry.buffptr = buffptr;
+    entry.size = size;
+    ref_add_entry(&run->ref, &entry);
+    aesd_circular_buffer_add_entry(&run->candidate, &entry);
+}
+
+/**
+* Look up @param offset in both buffers and fail unless they return the same entry (by
+* content) and, when one is found, the same byte offset within it.
+*/
+static void diff_lookup(struct diff_run *run, size_t offset)
+{
+    size_t ref_byte = 0;
+    size_t candidate_byte = 0;
+    const struct aesd_buffer_entry *expected =
+        ref_find_entry_offset_for_fpos(&run->ref, offset, &ref_byte);
+    const struct aesd_buffer_entry *actual =
+        aesd_circular_buffer_find_entry_offset_for_fpos(&run->candidate, offset, &candidate_byte);
+
+    if (expected == NULL || actual == NULL) {
+        if (expected != actual) {
+            diff_fail(run, expected ? "candidate found no entry" : "candidate found an entry past the end", offset);
+        }
+        return;
+    }
+    if (actual->buffptr != expected->buffptr || actual->size != expected->size) {
+        diff_fail(run, "candidate returned a different entry", offset);
+    }
+    if (candidate_byte != ref_byte) {
+        diff_fail(run, "candidate returned a different byte offset", offset);
+    }
+}
+
+/**
+* Compare the stored entries, then look up every entry boundary, the end of the data,
+* random offsets and SIZE_MAX.
+*/
+static void diff_check(struct diff_run *run)
+{
+    unsigned int count = ref_count(&run->ref);
+    size_t total = 0;
+    unsigned int i;
+
+    if (candidate_count(&run->candidate) != count) {
+        diff_fail(run, "candidate holds a different number of entries", 0);
+    }
+    for (i = 0; i < count; i++) {
+        const struct aesd_buffer_entry *expected = ref_entry(&run->ref, i);
+        const struct aesd_buffer_entry *actual = candidate_entry(&run->candidate, i);
+        if (actual->buffptr != expected->buffptr || actual->size != expected->size) {
+            diff_fail(run, "candidate stores a different entry sequence", total);
+        }
+        if (total > 0) {
+            diff_lookup(run, total - 1);
+        }
+        diff_lookup(run, total);
+        if (expected->size > 1) {
+            diff_lookup(run, total + expected->size - 1);
+        }
+        total += expected->size;
+    }
+    if (count == REF_CAPACITY) {
+        const struct aesd_buffer_entry *next = candidate_next_replaced(&run->candidate);
+        if (next->buffptr != ref_entry(&run->ref, 0)->buffptr) {
+            diff_fail(run, "entry[in_offs] of the full candidate is not its oldest entry", 0);
+        }
+    }
+
+    diff_lookup(run, total);
+    diff_lookup(run, total + 1);
+    diff_lookup(run, SIZE_MAX);
+    for (i = 0; i < DIFF_RANDOM_LOOKUPS; i++) {
+        diff_lookup(run, diff_rand(run) % (total + DIFF_MAX_SMALL_ENTRY));
+    }
+}
+
+/* Mostly small entries, some empty ones and some large ones */
+static size_t diff_entry_size(struct diff_run *run)
+{
+    uint32_t r = diff_rand(run);
+    switch (r % 8) {
+    case 0:
+        return 0;
+    case 1:
+        return 1 + (r >> 3) % DIFF_MAX_LARGE_ENTRY;
+    default:
+        return 1 + (r >> 3) % DIFF_MAX_SMALL_ENTRY;
+    }
+}
+
+static void diff_sequence(struct diff_run *run, uint32_t seed)
+{
+    run->seed = seed;
+    run->rand_state = seed * 2654435761u + 1;  /* never 0, which xorshift keeps */
+    run->step = 0;
+    diff_init(run);
+    diff_check(run);
+
+    for (run->step = 1; run->step <= DIFF_STEPS; run->step++) {
+        uint32_t op = diff_rand(run) % 100;
+        if (op < 3) {
+            diff_init(run);
+        } else if (op < 90) {
+            diff_add(run, &diff_pool[(run->step * 4 + diff_rand(run) % 4) % sizeof(diff_pool)],
+                     diff_entry_size(run));
+        } /* otherwise a lookup-only step */
+        diff_check(run);
+    }
+}
+
+/**
+* Random add / lookup / reinit sequences, each reproducible from the seed in its failure
+* message.
+*/
+void test_circular_buffer_differential_random()
+{
+    static struct diff_run run;
+    uint32_t seed;
+
+    for (seed = 1; seed <= DIFF_SEQUENCES; seed++) {
+        diff_sequence(&run, seed);
+    }
+}
+
+/**
+* Runs of empty entries around non-empty ones, across several wraps of a full buffer.
+*/
+void test_circular_buffer_differential_empty_entries()
+{
+    static struct diff_run run;
+    unsigned int i;
+
+    run.seed = 0;
+    run.rand_state = 1;
+    run.step = 0;
+    diff_init(&run);
+    for (i = 0; i < 4 * REF_CAPACITY; i++) {
+        run.step = i + 1;
+        diff_add(&run, &diff_pool[i], (i % 3 == 1) ? i % 7 + 1 : 0);
+        diff_check(&run);
+    }
+}
+
+/**
+* Missing arguments find no entry, as in the current implementation.
+*/
+void test_circular_buffer_differential_null_arguments()
+{
+    struct aesd_circular_buffer candidate;
+    struct aesd_buffer_entry entry = { diff_pool, 4 };
+    size_t byte = 0;
+
+    aesd_circular_buffer_init(&candidate);
+    aesd_circular_buffer_add_entry(&candidate, &entry);
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(NULL, 0, &byte),
+            "NULL buffer must not find an entry");
+    TEST_ASSERT_NULL_MESSAGE(aesd_circular_buffer_find_entry_offset_for_fpos(&candidate, 0, NULL),
+            "NULL entry_offset_byte_rtn must not find an entry");
+}